@@ -0,0 +1,176 @@
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "allocator.h"
+
+#define ALLOCATOR_BLOCK 256 // bitset words of free clusters classified at once
+
+/**
+ * @brief Inserts a run into a list at position index
+ * @return 0 on success, -1 if out of memory
+ */
+static int allocatorInsert(ExtentList* list, unsigned int index, unsigned int start, unsigned int length) {
+    if(list->count == list->capacity) {
+        unsigned int capacity = list->capacity ? list->capacity * 2 : 64;
+        Extent* extents = (Extent*)realloc(list->extents, sizeof(Extent) * capacity);
+        if(!extents) {
+            return -1;
+        }
+        list->extents = extents;
+        list->capacity = capacity;
+    }
+    memmove(&list->extents[index + 1], &list->extents[index], sizeof(Extent) * (list->count - index));
+    list->extents[index].start = start;
+    list->extents[index].length = length;
+    list->count++;
+    return 0;
+}
+
+/**
+ * @brief Takes length clusters from the start of free extent index and appends them to runs
+ * @return 0 on success, -1 if out of memory
+ */
+static int allocatorSplit(ClusterAllocator* allocator, unsigned int index, unsigned int length, ExtentList* runs) {
+    Extent* extent = &allocator->free.extents[index];
+    unsigned int start = extent->start;
+
+    // continuing the last run keeps the chain in one piece
+    Extent* last = runs->count ? &runs->extents[runs->count - 1] : 0;
+    if(last && last->start + last->length == start) {
+        last->length += length;
+    }else if(allocatorInsert(runs, runs->count, start, length) != 0) {
+        return -1;
+    }
+
+    extent->start += length;
+    extent->length -= length;
+    if(extent->length == 0) {
+        memmove(extent, extent + 1, sizeof(Extent) * (allocator->free.count - index - 1));
+        allocator->free.count--;
+    }
+    allocator->freeCount -= length;
+    allocator->next = start + length;
+    return 0;
+}
+
+int allocatorInit(ClusterAllocator* allocator, const FatTable* fat) {
+    memset(allocator, 0, sizeof(ClusterAllocator));
+    unsigned long long freeBits[ALLOCATOR_BLOCK];
+    FatClasses classes = {freeBits, 0, 0, 0};
+    unsigned int words = fat->count / 64 + 1;
+    unsigned int block;
+    for(block = 0; block < words; block += ALLOCATOR_BLOCK) {
+        unsigned int count = words - block < ALLOCATOR_BLOCK ? words - block : ALLOCATOR_BLOCK;
+        fatClassify(fat, block, block + count, &classes);
+        unsigned int i;
+        for(i = 0; i < count; i++) {
+            unsigned long long bits = freeBits[i];
+            while(bits) {
+                if(extentListAdd(&allocator->free, (block + i) * 64 + __builtin_ctzll(bits)) != 0) {
+                    allocatorFree(allocator);
+                    return -1;
+                }
+                allocator->freeCount++;
+                bits &= bits - 1;
+            }
+        }
+    }
+    allocator->next = 2;
+    return 0;
+}
+
+int allocatorTake(ClusterAllocator* allocator, unsigned int count, unsigned int goal, ExtentList* runs) {
+    if(count > allocator->freeCount) {
+        errno = ENOSPC;
+        return -1;
+    }
+
+    ExtentList* extents = &allocator->free;
+    while(count > 0) {
+        // the extent right behind the chain, as far as it goes
+        unsigned int i;
+        if(goal) {
+            unsigned int low = 0, high = extents->count;
+            while(low < high) {
+                unsigned int middle = low + (high - low) / 2;
+                if(extents->extents[middle].start < goal) {
+                    low = middle + 1;
+                }else{
+                    high = middle;
+                }
+            }
+            if(low < extents->count && extents->extents[low].start == goal) {
+                unsigned int length = extents->extents[low].length < count ? extents->extents[low].length : count;
+                if(allocatorSplit(allocator, low, length, runs) != 0) {
+                    errno = ENOMEM;
+                    return -1;
+                }
+                count -= length;
+            }
+            goal = 0;
+            continue;
+        }
+
+        // the smallest extent the rest fits in, the largest one if it fits nowhere
+        unsigned int best = extents->count;
+        unsigned int largest = 0;
+        for(i = 0; i < extents->count; i++) {
+            unsigned int length = extents->extents[i].length;
+            if(length >= count && (best == extents->count || length < extents->extents[best].length)) {
+                best = i;
+                if(length == count) {
+                    break;
+                }
+            }
+            if(length > extents->extents[largest].length) {
+                largest = i;
+            }
+        }
+        unsigned int index = best < extents->count ? best : largest;
+        unsigned int length = extents->extents[index].length < count ? extents->extents[index].length : count;
+        if(allocatorSplit(allocator, index, length, runs) != 0) {
+            errno = ENOMEM;
+            return -1;
+        }
+        count -= length;
+    }
+    return 0;
+}
+
+int allocatorRelease(ClusterAllocator* allocator, const Extent* run) {
+    ExtentList* extents = &allocator->free;
+    unsigned int low = 0, high = extents->count;
+    while(low < high) {
+        unsigned int middle = low + (high - low) / 2;
+        if(extents->extents[middle].start < run->start) {
+            low = middle + 1;
+        }else{
+            high = middle;
+        }
+    }
+    allocator->freeCount += run->length;
+
+    // low is the first extent behind the run, merge with it and the one in front
+    int front = low > 0 && extents->extents[low - 1].start + extents->extents[low - 1].length == run->start;
+    int behind = low < extents->count && run->start + run->length == extents->extents[low].start;
+    if(front && behind) {
+        extents->extents[low - 1].length += run->length + extents->extents[low].length;
+        memmove(&extents->extents[low], &extents->extents[low + 1], sizeof(Extent) * (extents->count - low - 1));
+        extents->count--;
+    }else if(front) {
+        extents->extents[low - 1].length += run->length;
+    }else if(behind) {
+        extents->extents[low].start = run->start;
+        extents->extents[low].length += run->length;
+    }else if(allocatorInsert(extents, low, run->start, run->length) != 0) {
+        allocator->freeCount -= run->length;
+        return -1;
+    }
+    return 0;
+}
+
+void allocatorFree(ClusterAllocator* allocator) {
+    extentListFree(&allocator->free);
+    allocator->freeCount = 0;
+}
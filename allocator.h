@@ -0,0 +1,46 @@
+/*
+ * allocator.h
+ *
+ * Cluster allocation for writing to a volume. The free clusters are kept as
+ * a sorted list of free extents, so a request is served from one extent
+ * where possible: the extent right behind the chain being extended, else
+ * the smallest one that holds the whole request. Only when no extent is
+ * large enough is the request split, over the largest extents, so new files
+ * get as few fragments as the free space allows.
+ */
+
+#ifndef __ALLOCATOR_H
+#define __ALLOCATOR_H
+
+#include "extent.h"
+#include "fat.h"
+
+typedef struct ClusterAllocator_t {
+    ExtentList free;            // free extents, ascending and never touching each other
+    unsigned int freeCount;     // clusters
+    unsigned int next;          // behind the last cluster handed out, for FSInfo
+} ClusterAllocator;
+
+/**
+ * @brief Collects the free extents of a FAT
+ * @return 0 on success, -1 if out of memory
+ */
+int allocatorInit(ClusterAllocator* allocator, const FatTable* fat);
+
+/**
+ * @brief Takes count clusters off the free extents, the FAT is not touched
+ * @param goal cluster to continue at (behind the last one of a chain), 0 for none
+ * @param runs the clusters are appended, in the order they are to be chained
+ * @return 0 on success, -1 otherwise (errno is ENOSPC if there are too few free clusters, ENOMEM)
+ */
+int allocatorTake(ClusterAllocator* allocator, unsigned int count, unsigned int goal, ExtentList* runs);
+
+/**
+ * @brief Gives clusters back, they are merged with the free extents around them
+ * @return 0 on success, -1 if out of memory
+ */
+int allocatorRelease(ClusterAllocator* allocator, const Extent* run);
+
+void allocatorFree(ClusterAllocator* allocator);
+
+#endif
@@ -0,0 +1,63 @@
+#include <stdlib.h>
+
+#include "arena.h"
+#include "counters.h"
+
+#define ARENA_ALIGN 16
+#define ARENA_HEADER ((sizeof(ArenaBlock) + ARENA_ALIGN - 1) & ~(size_t)(ARENA_ALIGN - 1))
+
+void* arenaAlloc(Arena* arena, size_t size) {
+    size = (size + ARENA_ALIGN - 1) & ~(size_t)(ARENA_ALIGN - 1);
+    COUNT(COUNTER_ALLOCATIONS, 1);
+
+    ArenaBlock* block = arena->blocks;
+    if(!block || block->size - block->used < size) {
+        int oversized = size > ARENA_BLOCK_SIZE - ARENA_HEADER;
+        size_t blockSize = oversized ? size + ARENA_HEADER : ARENA_BLOCK_SIZE;
+        block = (ArenaBlock*)malloc(blockSize);
+        if(!block) {
+            return 0;
+        }
+        COUNT(COUNTER_ARENA_BLOCKS, 1);
+        block->size = blockSize;
+        block->used = ARENA_HEADER;
+
+        if(oversized && arena->blocks) {
+            // oversized requests get a block of their own behind the current one
+            block->used = blockSize;
+            block->next = arena->blocks->next;
+            arena->blocks->next = block;
+            return (char*)block + ARENA_HEADER;
+        }
+        block->next = arena->blocks;
+        arena->blocks = block;
+    }
+
+    void* ret = (char*)block + block->used;
+    block->used += size;
+    return ret;
+}
+
+void arenaReset(Arena* arena) {
+    if(!arena->blocks) {
+        return;
+    }
+
+    // the oldest block is the last one in the list
+    ArenaBlock* block = arena->blocks;
+    while(block->next) {
+        ArenaBlock* next = block->next;
+        free(block);
+        block = next;
+    }
+    block->used = ARENA_HEADER;
+    arena->blocks = block;
+}
+
+void arenaFree(Arena* arena) {
+    while(arena->blocks) {
+        ArenaBlock* next = arena->blocks->next;
+        free(arena->blocks);
+        arena->blocks = next;
+    }
+}
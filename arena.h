@@ -0,0 +1,41 @@
+/*
+ * arena.h
+ *
+ * Bump allocator: allocations are carved from large blocks and released
+ * all at once, e.g. at the end of a traversal.
+ */
+
+#ifndef __ARENA_H
+#define __ARENA_H
+
+#include <stddef.h>
+
+#define ARENA_BLOCK_SIZE (256 * 1024)
+
+typedef struct ArenaBlock_t {
+    struct ArenaBlock_t* next;
+    size_t size;
+    size_t used;
+} ArenaBlock;
+
+typedef struct Arena_t {
+    ArenaBlock* blocks;     // current block first
+} Arena;
+
+/**
+ * @brief Allocates size bytes, aligned for any type
+ * @return pointer into the arena, 0 if out of memory
+ */
+void* arenaAlloc(Arena* arena, size_t size);
+
+/**
+ * @brief Releases all allocations but keeps the first block for reuse
+ */
+void arenaReset(Arena* arena);
+
+/**
+ * @brief Releases all allocations and blocks
+ */
+void arenaFree(Arena* arena);
+
+#endif
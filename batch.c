@@ -0,0 +1,526 @@
+#include <dirent.h>
+#include <errno.h>
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+
+#include "arena.h"
+#include "batch.h"
+#include "format.h"
+#include "partition.h"
+#include "path.h"
+#include "volume.h"
+
+#define BATCH_TAG_MAX 1100      // image path and '#' partition number
+
+typedef struct BatchJob_t {
+    char* image;                // path as given
+    unsigned int partition;     // number of the partition listed, 0 for the image (all of its FAT partitions if it has a table)
+    unsigned long long offset;  // of the partition
+    unsigned long long length;
+    Output output;              // listing, in memory until it is written
+    int done;
+    int failed;
+    char message[256];          // why it failed
+} BatchJob;
+
+typedef struct Batch_t {
+    BatchJob* jobs;
+    unsigned int count;
+    unsigned int capacity;
+    unsigned int next;          // next job to be taken by a worker
+    unsigned int written;       // jobs written to the stream so far
+    unsigned int window;        // jobs listed ahead of the written ones at most
+    int format;
+    pthread_mutex_t mutex;
+    pthread_cond_t changed;     // a job is done or has been written
+} Batch;
+
+/**
+ * @brief Adds an image to the batch
+ * @param length of the path
+ * @return 0 on success, -1 if out of memory
+ */
+static int batchAdd(Batch* batch, const char* image, size_t length) {
+    if(batch->count == batch->capacity) {
+        unsigned int capacity = batch->capacity ? batch->capacity * 2 : 64;
+        BatchJob* jobs = (BatchJob*)realloc(batch->jobs, sizeof(BatchJob) * capacity);
+        if(!jobs) {
+            return -1;
+        }
+        batch->jobs = jobs;
+        batch->capacity = capacity;
+    }
+    BatchJob* job = &batch->jobs[batch->count];
+    memset(job, 0, sizeof(BatchJob));
+    job->image = (char*)malloc(length + 1);
+    if(!job->image) {
+        return -1;
+    }
+    memcpy(job->image, image, length);
+    job->image[length] = '\0';
+    batch->count++;
+    return 0;
+}
+
+/**
+ * @brief Adds one image per line, empty lines are skipped
+ * @return 0 on success, -1 on a read error or if out of memory
+ */
+static int batchReadManifest(Batch* batch, FILE* manifest) {
+    char* line = 0;
+    size_t size = 0;
+    ssize_t length;
+    int ret = 0;
+    while(ret == 0 && (length = getline(&line, &size, manifest)) >= 0) {
+        while(length > 0 && (line[length - 1] == '\n' || line[length - 1] == '\r')) {
+            length--;
+        }
+        if(length > 0) {
+            ret = batchAdd(batch, line, length);
+        }
+    }
+    if(ferror(manifest)) {
+        ret = -1;
+    }
+    free(line);
+    return ret;
+}
+
+/**
+ * @brief Adds the regular files of a directory, sorted by name
+ * @return 0 on success, -1 on error
+ */
+static int batchReadDirectory(Batch* batch, const char* directory) {
+    struct dirent** names;
+    int count = scandir(directory, &names, 0, alphasort);
+    if(count < 0) {
+        return -1;
+    }
+    int ret = 0;
+    size_t directoryLength = strlen(directory);
+    int i;
+    for(i = 0; i < count; i++) {
+        size_t nameLength = strlen(names[i]->d_name);
+        char* path = (char*)malloc(directoryLength + nameLength + 2);
+        if(!path) {
+            ret = -1;
+        }else{
+            memcpy(path, directory, directoryLength);
+            path[directoryLength] = '/';
+            memcpy(&path[directoryLength + 1], names[i]->d_name, nameLength + 1);
+
+            // the directory's own entries, subdirectories and whatever else is not a file are left out
+            struct stat info;
+            if(ret == 0 && stat(path, &info) == 0 && S_ISREG(info.st_mode)) {
+                ret = batchAdd(batch, path, directoryLength + nameLength + 1);
+            }
+            free(path);
+        }
+        free(names[i]);
+    }
+    free(names);
+    return ret;
+}
+
+/**
+ * @brief Records why an image failed, the first reason counts
+ */
+static void batchFail(BatchJob* job, const char* message, int error) {
+    if(job->failed) {
+        return;
+    }
+    job->failed = 1;
+    if(error) {
+        snprintf(job->message, sizeof(job->message), "%s (%s)", message, strerror(error));
+    }else{
+        snprintf(job->message, sizeof(job->message), "%s", message);
+    }
+}
+
+/**
+ * @brief Formats what the records of a partition are tagged with, 'image#number'
+ */
+static void batchTag(const BatchJob* job, unsigned int partition, char* tag) {
+    if(partition) {
+        snprintf(tag, BATCH_TAG_MAX, "%.1024s#%u", job->image, partition);
+    }else{
+        snprintf(tag, BATCH_TAG_MAX, "%.1024s", job->image);
+    }
+}
+
+/**
+ * @brief Lists all directories of an opened volume depth-first, in the order of 'list'
+ * @param tag of the records, the image or partition
+ */
+static void batchWalk(BatchJob* job, Volume* volume, const char* tag, int format) {
+    Output* out = &job->output;
+    Arena arena = {0};
+    VolumeDir dir;
+    memset(&dir, 0, sizeof(dir));
+
+    // directories already listed, a chain looping back to one of them would go on forever
+    unsigned char* visited = (unsigned char*)calloc(volume->fat.count / 8 + 1, 1);
+    PathNode** stack = (PathNode**)malloc(sizeof(PathNode*) * 64);
+    unsigned int stackCount = 0;
+    unsigned int stackCapacity = 64;
+    char* path = 0;
+    unsigned int pathSize = 0;
+    int outOfMemory = 0;
+
+    PathNode* root = pathNodeCreate(&arena, 0, "", volume->geometry.rootCluster, 0);
+    if(!visited || !stack || !root) {
+        outOfMemory = 1;
+    }else{
+        stack[stackCount++] = root;
+    }
+
+    // a directory that can't be read is reported, the others are still listed
+    while(stackCount > 0 && !outOfMemory) {
+        PathNode* node = stack[--stackCount];
+        if(node->length + 1 > pathSize) {
+            pathSize = (node->length + 1) * 2;
+            free(path);
+            path = (char*)malloc(pathSize);
+            if(!path) {
+                outOfMemory = 1;
+                break;
+            }
+        }
+        pathFormat(node, path);
+        if(format == FORMAT_DIR) {
+            outputString(out, "Directory of ");
+            outputWrite(out, path, node->length);
+            outputChar(out, '\n');
+        }
+
+        unsigned int stackMark = stackCount;
+        volumeDirOpen(volume, &dir, node->parent ? node->firstCluster : 0);
+        const DIRENTRY* directoryEntry;
+        while((directoryEntry = volumeDirRead(&dir))) {
+            int dots = directoryEntry->name[0] == '.' && (memcmp(directoryEntry->name, ".       ", 8) == 0 ||
+                                                          memcmp(directoryEntry->name, "..      ", 8) == 0);
+            if(format == FORMAT_DIR) {
+                char shortName[14];
+                volumeShortName(directoryEntry, shortName);
+                formatDirLine(out, directoryEntry, shortName, dir.name, dir.longNameLength);
+            }else if(!(directoryEntry->attr & DIRENTRY_ATTR_VOLUME) && directoryEntry->name[0] != 0xE5 && !dots) {
+                formatRecord(out, format, tag, path, node->length, dir.name, directoryEntry, fatFirstCluster(directoryEntry, volume->geometry.fatType));
+            }
+
+            // a deleted directory's clusters may be reused, its records would have no parent
+            if(!IS_DIR(directoryEntry->attr) || dots || directoryEntry->name[0] == 0xE5) {
+                continue;
+            }
+            unsigned int firstCluster = fatFirstCluster(directoryEntry, volume->geometry.fatType);
+            // a subdirectory without clusters would be the root directory again
+            if(firstCluster < 2 || firstCluster >= volume->fat.count || (visited[firstCluster / 8] & (1 << (firstCluster % 8)))) {
+                continue;
+            }
+            visited[firstCluster / 8] |= 1 << (firstCluster % 8);
+
+            if(stackCount == stackCapacity) {
+                PathNode** grown = (PathNode**)realloc(stack, sizeof(PathNode*) * stackCapacity * 2);
+                if(!grown) {
+                    outOfMemory = 1;
+                    break;
+                }
+                stack = grown;
+                stackCapacity *= 2;
+            }
+            stack[stackCount] = pathNodeCreate(&arena, node, dir.name, firstCluster, dir.entryIndex);
+            if(!stack[stackCount]) {
+                outOfMemory = 1;
+                break;
+            }
+            stackCount++;
+        }
+        if(dir.error) {
+            // what could be read stays in the listing
+            char message[128];
+            snprintf(message, sizeof(message), "could not read directory '%.80s'", path);
+            batchFail(job, message, errno);
+        }
+        if(format == FORMAT_DIR) {
+            outputChar(out, '\n');
+        }
+
+        // subdirectories go on top in listing order so that we get depth-first search
+        unsigned int low = stackMark;
+        unsigned int high = stackCount;
+        while(low + 1 < high) {
+            PathNode* swap = stack[low];
+            stack[low++] = stack[--high];
+            stack[high] = swap;
+        }
+    }
+
+    if(outOfMemory) {
+        batchFail(job, "out of memory", 0);
+    }
+    volumeDirClose(&dir);
+    free(path);
+    free(stack);
+    free(visited);
+    arenaFree(&arena);
+}
+
+/**
+ * @brief Opens and lists the volume in a range of a job's image
+ * @param partition number of the partition, 0 for the image itself
+ * @param length of the partition, 0 for the image itself
+ * @return VOLUME_ERROR_FORMAT if there is no FAT volume (nothing is reported then), 0 otherwise
+ */
+static int batchListVolume(BatchJob* job, unsigned int partition, unsigned long long offset, unsigned long long length, int format) {
+    char tag[BATCH_TAG_MAX];
+    batchTag(job, partition, tag);
+    Volume volume;
+    int ret = volumeOpenPartition(&volume, job->image, offset, length, 0);
+    if(ret == VOLUME_ERROR_FORMAT && partition == 0) {
+        return ret;
+    }
+    if(format == FORMAT_DIR) {
+        outputString(&job->output, "Image ");
+        outputString(&job->output, tag);
+        outputString(&job->output, "\n\n");
+    }
+    if(ret == VOLUME_ERROR_OPEN) {
+        batchFail(job, "can't open image", errno);
+        return 0;
+    }
+    if(ret == VOLUME_ERROR_READ) {
+        batchFail(job, "could not read the boot sector", errno);
+        return 0;
+    }
+    if(ret != 0) {
+        batchFail(job, "not a FAT volume", 0);
+        return 0;
+    }
+
+    ret = volumeLoad(&volume);
+    if(ret == VOLUME_ERROR_READ) {
+        batchFail(job, "could not load the FAT", errno);
+    }else if(ret != 0) {
+        batchFail(job, "could not build the extent index", 0);
+    }else{
+        batchWalk(job, &volume, tag, format);
+    }
+    volumeClose(&volume);
+    return 0;
+}
+
+/**
+ * @brief Opens and lists one image or partition into its job's output. An image
+ * without a FAT volume at its start is a disk, its FAT partitions are listed one after another.
+ */
+static void batchList(BatchJob* job, int format) {
+    outputInit(&job->output, 0);
+    if(job->partition) {
+        batchListVolume(job, job->partition, job->offset, job->length, format);
+        return;
+    }
+    if(batchListVolume(job, 0, 0, 0, format) != VOLUME_ERROR_FORMAT) {
+        return;
+    }
+
+    Image image;
+    PartitionTable table;
+    int ret = imageOpen(&image, job->image);
+    if(ret == 0) {
+        ret = partitionRead(&image, &table);
+        imageClose(&image);
+    }
+    if(ret != 0) {
+        batchFail(job, "could not read the partition table", errno);
+        return;
+    }
+    if(partitionFatCount(&table) == 0) {
+        if(format == FORMAT_DIR) {
+            outputString(&job->output, "Image ");
+            outputString(&job->output, job->image);
+            outputString(&job->output, "\n\n");
+        }
+        batchFail(job, table.scheme == PARTITION_NONE ? "not a FAT volume" : "no FAT partition", 0);
+    }
+    unsigned int i;
+    for(i = 0; i < table.count; i++) {
+        const Partition* partition = &table.partitions[i];
+        if(partition->fatType) {
+            batchListVolume(job, partition->number, partition->offset, partition->length, format);
+        }
+    }
+    partitionFree(&table);
+}
+
+/**
+ * @brief Takes jobs until there are none left, never more than the window ahead of the writer
+ */
+static void* batchWorker(void* arg) {
+    Batch* batch = (Batch*)arg;
+    pthread_mutex_lock(&batch->mutex);
+    for(;;) {
+        while(batch->next < batch->count && batch->next >= batch->written + batch->window) {
+            pthread_cond_wait(&batch->changed, &batch->mutex);
+        }
+        if(batch->next >= batch->count) {
+            break;
+        }
+        BatchJob* job = &batch->jobs[batch->next++];
+        pthread_mutex_unlock(&batch->mutex);
+
+        batchList(job, batch->format);
+
+        pthread_mutex_lock(&batch->mutex);
+        job->done = 1;
+        pthread_cond_broadcast(&batch->changed);
+    }
+    pthread_mutex_unlock(&batch->mutex);
+    return 0;
+}
+
+/**
+ * @brief Lists the jobs of a batch by a pool of workers and writes their outputs in order
+ * @param what the jobs are, for the summary of failures
+ * @return number of jobs that failed
+ */
+static unsigned int batchExecute(Batch* batch, unsigned int threads, FILE* stream, FILE* errors, const char* what) {
+    unsigned int failed = 0;
+    unsigned int i;
+    if(threads < 1) {
+        threads = 1;
+    }
+    batch->window = threads * BATCH_WINDOW;
+    pthread_t* workers = (pthread_t*)malloc(sizeof(pthread_t) * threads);
+    unsigned int started = 0;
+    while(workers && started < threads && pthread_create(&workers[started], 0, batchWorker, batch) == 0) {
+        started++;
+    }
+    if(started == 0) {
+        // no threads at all, list everything here before writing
+        batch->window = batch->count;
+        batchWorker(batch);
+    }
+
+    Output out;
+    outputInit(&out, stream);
+    formatBegin(&out, batch->format, 1);
+    for(i = 0; i < batch->count; i++) {
+        BatchJob* job = &batch->jobs[i];
+        pthread_mutex_lock(&batch->mutex);
+        while(!job->done) {
+            pthread_cond_wait(&batch->changed, &batch->mutex);
+        }
+        pthread_mutex_unlock(&batch->mutex);
+
+        if(job->output.used) {
+            outputWrite(&out, job->output.data, job->output.used);
+        }
+        outputFree(&job->output);
+        if(job->failed) {
+            // the listing so far goes out first, so the report comes after it
+            outputFlush(&out);
+            fflush(stream);
+            char tag[BATCH_TAG_MAX];
+            batchTag(job, job->partition, tag);
+            fprintf(errors, "%s: %s\n", tag, job->message);
+            failed++;
+        }
+
+        pthread_mutex_lock(&batch->mutex);
+        batch->written = i + 1;
+        pthread_cond_broadcast(&batch->changed);
+        pthread_mutex_unlock(&batch->mutex);
+    }
+    outputFree(&out);
+
+    for(i = 0; i < started; i++) {
+        pthread_join(workers[i], 0);
+    }
+    free(workers);
+    if(failed) {
+        fprintf(errors, "%u of %u %s failed\n", failed, batch->count, what);
+    }
+    return failed;
+}
+
+/**
+ * @brief Releases the jobs of a batch
+ */
+static void batchFree(Batch* batch) {
+    unsigned int i;
+    for(i = 0; i < batch->count; i++) {
+        free(batch->jobs[i].image);
+    }
+    free(batch->jobs);
+    pthread_cond_destroy(&batch->changed);
+    pthread_mutex_destroy(&batch->mutex);
+}
+
+int batchRun(const char* source, int format, unsigned int threads, FILE* stream, FILE* errors) {
+    Batch batch;
+    memset(&batch, 0, sizeof(batch));
+    batch.format = format;
+    pthread_mutex_init(&batch.mutex, 0);
+    pthread_cond_init(&batch.changed, 0);
+
+    int ret;
+    struct stat info;
+    if(strcmp(source, "-") == 0) {
+        ret = batchReadManifest(&batch, stdin);
+    }else if(stat(source, &info) == 0 && S_ISDIR(info.st_mode)) {
+        ret = batchReadDirectory(&batch, source);
+    }else{
+        FILE* manifest = fopen(source, "r");
+        ret = manifest ? batchReadManifest(&batch, manifest) : -1;
+        if(manifest) {
+            fclose(manifest);
+        }
+    }
+
+    unsigned int failed = 0;
+    if(ret == 0) {
+        failed = batchExecute(&batch, threads, stream, errors, "images");
+    }
+
+    int error = errno;
+    batchFree(&batch);
+    errno = error;
+    return ret == 0 ? (int)failed : -1;
+}
+
+int batchRunPartitions(const char* image, const PartitionTable* table, int format, unsigned int threads, FILE* stream, FILE* errors) {
+    Batch batch;
+    memset(&batch, 0, sizeof(batch));
+    batch.format = format;
+    pthread_mutex_init(&batch.mutex, 0);
+    pthread_cond_init(&batch.changed, 0);
+
+    int ret = 0;
+    unsigned int i;
+    for(i = 0; i < table->count && ret == 0; i++) {
+        const Partition* partition = &table->partitions[i];
+        if(!partition->fatType) {
+            continue;
+        }
+        ret = batchAdd(&batch, image, strlen(image));
+        if(ret == 0) {
+            BatchJob* job = &batch.jobs[batch.count - 1];
+            job->partition = partition->number;
+            job->offset = partition->offset;
+            job->length = partition->length;
+        }
+    }
+
+    unsigned int failed = 0;
+    if(ret == 0) {
+        failed = batchExecute(&batch, threads, stream, errors, "partitions");
+    }else{
+        errno = ENOMEM;
+    }
+
+    int error = errno;
+    batchFree(&batch);
+    errno = error;
+    return ret == 0 ? (int)failed : -1;
+}
@@ -0,0 +1,41 @@
+/*
+ * batch.h
+ *
+ * Lists many images in one run. The images come from a manifest (one path
+ * per line) or a directory, a fixed number of workers open and list them,
+ * each into its own in-memory output, and the outputs are written to one
+ * stream in manifest order with every record tagged by its image. An image
+ * that can't be opened or read is reported and skipped, the others go on.
+ * An image that is a disk has the FAT volumes of its partitions listed one
+ * after another, tagged 'image#number'.
+ */
+
+#ifndef __BATCH_H
+#define __BATCH_H
+
+#include <stdio.h>
+
+#include "partition.h"
+
+#define BATCH_WINDOW 4  // images listed ahead of the one being written, per worker
+
+/**
+ * @brief Lists every image of a manifest or directory
+ * @param source manifest file ('-' for stdin) or directory whose regular files are the images (sorted by name)
+ * @param format FORMAT_*
+ * @param threads number of workers, at least 1
+ * @param stream the listings are written to
+ * @param errors failures are reported to, one line per image
+ * @return number of images that failed, -1 if the source could not be read (errno is set)
+ */
+int batchRun(const char* source, int format, unsigned int threads, FILE* stream, FILE* errors);
+
+/**
+ * @brief Lists the FAT partitions of a disk image at once, each one by a worker
+ * with its own volume, and writes them in table order tagged 'image#number'
+ * @param table of the image, see partitionRead
+ * @return number of partitions that failed, -1 if out of memory
+ */
+int batchRunPartitions(const char* image, const PartitionTable* table, int format, unsigned int threads, FILE* stream, FILE* errors);
+
+#endif
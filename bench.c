@@ -0,0 +1,59 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "bench.h"
+
+unsigned long long benchClock(void) {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (unsigned long long)now.tv_sec * 1000000000ull + now.tv_nsec;
+}
+
+void benchInit(BenchResult* result, const char* name, unsigned long long operations) {
+    result->name = name;
+    result->operations = operations;
+    result->runs = 0;
+}
+
+void benchRecord(BenchResult* result, unsigned long long start) {
+    unsigned long long end = benchClock();
+    if(result->runs < BENCH_RUNS_MAX) {
+        result->nanoseconds[result->runs++] = end - start;
+    }
+}
+
+static int compareTimes(const void* a, const void* b) {
+    unsigned long long x = *(const unsigned long long*)a;
+    unsigned long long y = *(const unsigned long long*)b;
+    return (x > y) - (x < y);
+}
+
+void benchWrite(Output* out, const char* context, const BenchResult* results, unsigned int count) {
+    unsigned int i;
+    for(i = 0; i < count; i++) {
+        const BenchResult* result = &results[i];
+        if(!result->runs) {
+            continue;
+        }
+        unsigned long long times[BENCH_RUNS_MAX];
+        memcpy(times, result->nanoseconds, result->runs * sizeof(times[0]));
+        qsort(times, result->runs, sizeof(times[0]), compareTimes);
+
+        // the median of an even number of runs is the lower one of the middle two
+        unsigned long long median = times[(result->runs - 1) / 2];
+        char line[256];
+        outputChar(out, '{');
+        if(context) {
+            outputString(out, context);
+            outputChar(out, ',');
+        }
+        outputString(out, "\"name\":");
+        outputJsonString(out, result->name, strlen(result->name));
+        snprintf(line, sizeof(line), ",\"runs\":%u,\"operations\":%llu,\"min_ns\":%llu,\"median_ns\":%llu,\"max_ns\":%llu,\"ns_per_operation\":%.2f}\n",
+                 result->runs, result->operations, times[0], median, times[result->runs - 1],
+                 result->operations ? (double)median / result->operations : 0.0);
+        outputString(out, line);
+    }
+}
@@ -0,0 +1,46 @@
+/*
+ * bench.h
+ *
+ * Timing of the decoder's hot paths. Every benchmark runs a fixed amount of
+ * work several times; the times of all runs are kept and summed up as
+ * minimum and median, which are less noisy than the mean.
+ */
+
+#ifndef __BENCH_H
+#define __BENCH_H
+
+#include "format.h"
+
+#define BENCH_RUNS_MAX 100
+
+typedef struct BenchResult_t {
+    const char* name;
+    unsigned long long operations;                  // done in every run
+    unsigned int runs;
+    unsigned long long nanoseconds[BENCH_RUNS_MAX]; // of each run
+} BenchResult;
+
+/**
+ * @return monotonic time in nanoseconds
+ */
+unsigned long long benchClock(void);
+
+/**
+ * @brief Prepares a result, the runs are added with benchRecord
+ * @param operations units of work of one run, e.g. clusters or paths
+ */
+void benchInit(BenchResult* result, const char* name, unsigned long long operations);
+
+/**
+ * @brief Adds a run that began at start (see benchClock), runs beyond BENCH_RUNS_MAX are dropped
+ */
+void benchRecord(BenchResult* result, unsigned long long start);
+
+/**
+ * @brief Writes one JSON Lines record per result: runs, operations, minimum,
+ * median and maximum time of a run and the median time per operation
+ * @param context members put in front of every record, e.g. "\"image\":\"a.img\"", 0 for none
+ */
+void benchWrite(Output* out, const char* context, const BenchResult* results, unsigned int count);
+
+#endif
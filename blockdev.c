@@ -0,0 +1,564 @@
+#define _FILE_OFFSET_BITS 64
+
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#ifdef WTF_HAVE_ZLIB
+#include <zlib.h>
+#endif
+#ifdef WTF_HAVE_ZSTD
+#include <zstd.h>
+#endif
+
+#include "blockdev.h"
+#include "counters.h"
+
+#define BLOCK_WINDOW    32768       // history a deflate stream refers back to
+#define BLOCK_INPUT     (64u << 10) // compressed bytes read at once
+
+#define BLOCK_ZSTD_SEEKABLE     0x8F92EAB1u // magic at the very end of a seekable zstd file
+#define BLOCK_ZSTD_SKIPPABLE    0x184D2A5Eu // frame holding the seek table
+
+#if defined(WTF_HAVE_ZLIB) || defined(WTF_HAVE_ZSTD)
+
+/**
+ * @brief Reads up to length bytes, less only at the end of the file
+ * @return bytes read, -1 on error
+ */
+static long long blockPread(int handle, void* buf, size_t length, unsigned long long offset) {
+    size_t done = 0;
+    while(done < length) {
+        ssize_t bytesRead = pread(handle, (char*)buf + done, length - done, (off_t)(offset + done));
+        COUNT(COUNTER_READ_CALLS, 1);
+        if(bytesRead < 0 && errno == EINTR) {
+            continue;
+        }
+        if(bytesRead < 0) {
+            return -1;
+        }
+        if(bytesRead == 0) {
+            break;
+        }
+        COUNT(COUNTER_READ_BYTES, bytesRead);
+        done += bytesRead;
+    }
+    return (long long)done;
+}
+
+/**
+ * @brief Appends a block starting at start (uncompressed) and source (compressed)
+ * @param capacity of starts and sources, grows with them
+ * @return 0 on success, -1 if out of memory
+ */
+static int blockAdd(BlockDevice* device, unsigned int* capacity, unsigned long long start, unsigned long long source) {
+    // one more for the end of the last block
+    if(device->blockCount + 1 >= *capacity) {
+        unsigned int larger = *capacity ? *capacity * 2 : 64;
+        unsigned long long* starts = (unsigned long long*)realloc(device->starts, sizeof(unsigned long long) * larger);
+        if(!starts) {
+            return -1;
+        }
+        device->starts = starts;
+        unsigned long long* sources = (unsigned long long*)realloc(device->sources, sizeof(unsigned long long) * larger);
+        if(!sources) {
+            return -1;
+        }
+        device->sources = sources;
+        *capacity = larger;
+    }
+    device->starts[device->blockCount] = start;
+    device->sources[device->blockCount] = source;
+    device->blockCount++;
+    return 0;
+}
+
+#endif
+
+#ifdef WTF_HAVE_ZLIB
+
+/**
+ * @brief Where inflating a block starts
+ */
+typedef struct GzipPoint_t {
+    int bits;                               // bits of the byte before the source that belong to the block, -1 at the start of a member
+    unsigned char window[BLOCK_WINDOW];     // output before the block, unused at the start of a member
+} GzipPoint;
+
+/**
+ * @brief Adds an access point, with the last BLOCK_WINDOW bytes of output from the ring
+ * @param left bytes of the ring not written in its current round
+ */
+static int gzipAddPoint(BlockDevice* device, unsigned int* capacity, unsigned long long start, unsigned long long source, int bits, const unsigned char* ring, unsigned int left) {
+    unsigned int pointCapacity = *capacity;
+    if(blockAdd(device, capacity, start, source) != 0) {
+        return -1;
+    }
+    if(*capacity != pointCapacity) {
+        GzipPoint* points = (GzipPoint*)realloc(device->extra, sizeof(GzipPoint) * *capacity);
+        if(!points) {
+            return -1;
+        }
+        device->extra = points;
+    }
+    GzipPoint* point = &((GzipPoint*)device->extra)[device->blockCount - 1];
+    point->bits = bits;
+    if(bits >= 0) {
+        // oldest bytes first
+        memcpy(point->window, ring + BLOCK_WINDOW - left, left);
+        memcpy(point->window + left, ring, BLOCK_WINDOW - left);
+    }
+    return 0;
+}
+
+/**
+ * @brief Inflates the whole file once and sets an access point about every BLOCK_GZIP_SPAN bytes of output.
+ * Points are at the start of a member or of a deflate block.
+ */
+static int gzipIndex(BlockDevice* device) {
+    z_stream stream;
+    memset(&stream, 0, sizeof(stream));
+    unsigned char* input = (unsigned char*)malloc(BLOCK_INPUT);
+    unsigned char* ring = (unsigned char*)malloc(BLOCK_WINDOW);
+    if(!input || !ring || inflateInit2(&stream, 47) != Z_OK) {
+        free(input);
+        free(ring);
+        errno = ENOMEM;
+        return -1;
+    }
+
+    unsigned int capacity = 0;
+    unsigned long long totalIn = 0, totalOut = 0, readOffset = 0;
+    int ret = gzipAddPoint(device, &capacity, 0, 0, -1, ring, 0) == 0 ? Z_OK : Z_MEM_ERROR;
+    while(ret == Z_OK) {
+        if(stream.avail_in == 0) {
+            long long bytesRead = blockPread(device->handle, input, BLOCK_INPUT, readOffset);
+            if(bytesRead <= 0) {
+                ret = bytesRead < 0 ? Z_ERRNO : Z_BUF_ERROR;     // the member is cut off
+                break;
+            }
+            readOffset += bytesRead;
+            stream.next_in = input;
+            stream.avail_in = (unsigned int)bytesRead;
+        }
+        if(stream.avail_out == 0) {
+            stream.next_out = ring;
+            stream.avail_out = BLOCK_WINDOW;
+        }
+
+        unsigned int availIn = stream.avail_in, availOut = stream.avail_out;
+        ret = inflate(&stream, Z_BLOCK);
+        totalIn += availIn - stream.avail_in;
+        totalOut += availOut - stream.avail_out;
+        if(ret == Z_NEED_DICT) {
+            ret = Z_DATA_ERROR;
+        }
+
+        if(ret == Z_STREAM_END) {
+            // another member may follow; anything else after the last one is ignored
+            if(stream.avail_in == 0) {
+                long long bytesRead = blockPread(device->handle, input, BLOCK_INPUT, readOffset);
+                if(bytesRead < 0) {
+                    ret = Z_ERRNO;
+                    break;
+                }
+                readOffset += bytesRead;
+                stream.next_in = input;
+                stream.avail_in = (unsigned int)bytesRead;
+            }
+            if(stream.avail_in < 2 || stream.next_in[0] != 0x1F || stream.next_in[1] != 0x8B) {
+                break;
+            }
+            inflateReset(&stream);
+            ret = Z_OK;
+            if(totalOut - device->starts[device->blockCount - 1] >= BLOCK_GZIP_SPAN &&
+               gzipAddPoint(device, &capacity, totalOut, totalIn, -1, ring, 0) != 0) {
+                ret = Z_MEM_ERROR;
+            }
+        }else if(ret == Z_OK && (stream.data_type & 128) && !(stream.data_type & 64) &&
+                 totalOut - device->starts[device->blockCount - 1] >= BLOCK_GZIP_SPAN) {
+            // between two deflate blocks, and not after the last one
+            if(gzipAddPoint(device, &capacity, totalOut, totalIn, stream.data_type & 7, ring, stream.avail_out) != 0) {
+                ret = Z_MEM_ERROR;
+            }
+        }
+    }
+    inflateEnd(&stream);
+    free(input);
+    free(ring);
+
+    if(ret != Z_STREAM_END) {
+        errno = ret == Z_MEM_ERROR ? ENOMEM : ret == Z_ERRNO ? errno : EIO;
+        return -1;
+    }
+    device->size = totalOut;
+    device->starts[device->blockCount] = totalOut;
+    device->sources[device->blockCount] = totalIn;
+    return 0;
+}
+
+static int gzipDecode(BlockDevice* device, unsigned int block, char* buf, size_t length) {
+    const GzipPoint* point = &((const GzipPoint*)device->extra)[block];
+    unsigned long long source = device->sources[block];
+    z_stream stream;
+    memset(&stream, 0, sizeof(stream));
+    unsigned char* input = (unsigned char*)malloc(BLOCK_INPUT);
+    if(!input || inflateInit2(&stream, point->bits < 0 ? 47 : -15) != Z_OK) {
+        free(input);
+        errno = ENOMEM;
+        return -1;
+    }
+
+    // a block that starts inside a member continues its deflate stream
+    int raw = point->bits >= 0;
+    int ret = Z_OK;
+    if(point->bits > 0) {
+        unsigned char before;
+        if(blockPread(device->handle, &before, 1, source - 1) != 1) {
+            ret = Z_ERRNO;
+        }else{
+            inflatePrime(&stream, point->bits, before >> (8 - point->bits));
+        }
+    }
+    if(raw && ret == Z_OK) {
+        inflateSetDictionary(&stream, point->window, BLOCK_WINDOW);
+    }
+
+    stream.next_out = (unsigned char*)buf;
+    stream.avail_out = (unsigned int)length;
+    while(ret == Z_OK && stream.avail_out > 0) {
+        if(stream.avail_in == 0) {
+            long long bytesRead = blockPread(device->handle, input, BLOCK_INPUT, source);
+            if(bytesRead <= 0) {
+                ret = bytesRead < 0 ? Z_ERRNO : Z_BUF_ERROR;
+                break;
+            }
+            source += bytesRead;
+            stream.next_in = input;
+            stream.avail_in = (unsigned int)bytesRead;
+        }
+        ret = inflate(&stream, Z_NO_FLUSH);
+        if(ret == Z_STREAM_END && stream.avail_out > 0) {
+            // on into the next member; a raw stream leaves the member's trailer to us
+            if(raw) {
+                source -= stream.avail_in;
+                source += 8;
+                stream.avail_in = 0;
+                inflateReset2(&stream, 47);
+                raw = 0;
+            }else{
+                inflateReset(&stream);
+            }
+            ret = Z_OK;
+        }
+    }
+    inflateEnd(&stream);
+    free(input);
+
+    if(stream.avail_out > 0) {
+        errno = ret == Z_ERRNO ? errno : EIO;
+        return -1;
+    }
+    return 0;
+}
+
+#endif
+
+#ifdef WTF_HAVE_ZSTD
+
+static unsigned int blockLittle32(const unsigned char* bytes) {
+    return bytes[0] | (bytes[1] << 8) | (bytes[2] << 16) | ((unsigned int)bytes[3] << 24);
+}
+
+/**
+ * @brief Reads the seek table at the end of a seekable zstd file: one block per frame
+ */
+static int zstdIndex(BlockDevice* device) {
+    struct stat st;
+    unsigned char footer[9];
+    if(fstat(device->handle, &st) != 0) {
+        return -1;
+    }
+    unsigned long long fileSize = st.st_size;
+    if(fileSize < sizeof(footer) + 8 || blockPread(device->handle, footer, sizeof(footer), fileSize - sizeof(footer)) != sizeof(footer) ||
+       blockLittle32(&footer[5]) != BLOCK_ZSTD_SEEKABLE) {
+        errno = ENOTSUP;
+        return -1;
+    }
+
+    // frame sizes, with a checksum after them if the descriptor says so
+    unsigned int frames = blockLittle32(footer);
+    unsigned int entrySize = (footer[4] & 0x80) ? 12 : 8;
+    unsigned long long tableSize = (unsigned long long)frames * entrySize;
+    if(tableSize + sizeof(footer) + 8 > fileSize) {
+        errno = EIO;
+        return -1;
+    }
+    unsigned long long tableOffset = fileSize - sizeof(footer) - tableSize;
+    unsigned char header[8];
+    unsigned char* table = (unsigned char*)malloc(tableSize + 1);
+    if(!table) {
+        errno = ENOMEM;
+        return -1;
+    }
+    if(blockPread(device->handle, header, sizeof(header), tableOffset - sizeof(header)) != sizeof(header) ||
+       blockLittle32(header) != BLOCK_ZSTD_SKIPPABLE || blockLittle32(&header[4]) != tableSize + sizeof(footer) ||
+       blockPread(device->handle, table, tableSize, tableOffset) != (long long)tableSize) {
+        free(table);
+        errno = EIO;
+        return -1;
+    }
+
+    unsigned int capacity = 0;
+    unsigned long long start = 0, source = 0;
+    unsigned int frame;
+    for(frame = 0; frame < frames; frame++) {
+        if(blockAdd(device, &capacity, start, source) != 0) {
+            free(table);
+            errno = ENOMEM;
+            return -1;
+        }
+        source += blockLittle32(&table[frame * entrySize]);
+        start += blockLittle32(&table[frame * entrySize + 4]);
+    }
+    free(table);
+    if(source != tableOffset - sizeof(header) || blockAdd(device, &capacity, start, source) != 0) {
+        errno = source != tableOffset - sizeof(header) ? EIO : ENOMEM;
+        return -1;
+    }
+    // the end was added as a block of its own
+    device->blockCount--;
+    device->size = start;
+    return 0;
+}
+
+static int zstdDecode(BlockDevice* device, unsigned int block, char* buf, size_t length) {
+    size_t sourceLength = (size_t)(device->sources[block + 1] - device->sources[block]);
+    char* source = (char*)malloc(sourceLength ? sourceLength : 1);
+    if(!source) {
+        errno = ENOMEM;
+        return -1;
+    }
+    if(blockPread(device->handle, source, sourceLength, device->sources[block]) != (long long)sourceLength) {
+        free(source);
+        errno = EIO;
+        return -1;
+    }
+    size_t decoded = ZSTD_decompress(buf, length, source, sourceLength);
+    free(source);
+    if(ZSTD_isError(decoded) || decoded != length) {
+        errno = EIO;
+        return -1;
+    }
+    return 0;
+}
+
+#endif
+
+/**
+ * @brief Decompresses a whole block into buf
+ */
+static int blockDecode(BlockDevice* device, unsigned int block, char* buf, size_t length) {
+    COUNT(COUNTER_BLOCKS_DECODED, 1);
+#ifdef WTF_HAVE_ZLIB
+    if(device->format == BLOCK_FORMAT_GZIP) {
+        return gzipDecode(device, block, buf, length);
+    }
+#endif
+#ifdef WTF_HAVE_ZSTD
+    if(device->format == BLOCK_FORMAT_ZSTD) {
+        return zstdDecode(device, block, buf, length);
+    }
+#endif
+    (void)device;
+    (void)block;
+    (void)buf;
+    (void)length;
+    errno = ENOTSUP;
+    return -1;
+}
+
+int blockFormat(const unsigned char* magic, size_t length) {
+    if(length >= 2 && magic[0] == 0x1F && magic[1] == 0x8B) {
+        return BLOCK_FORMAT_GZIP;
+    }
+    if(length >= 4 && magic[0] == 0x28 && magic[1] == 0xB5 && magic[2] == 0x2F && magic[3] == 0xFD) {
+        return BLOCK_FORMAT_ZSTD;
+    }
+    return 0;
+}
+
+int blockDeviceOpen(BlockDevice* device, int handle, int format) {
+    memset(device, 0, sizeof(BlockDevice));
+    device->handle = handle;
+    device->format = format;
+    device->capacity = BLOCK_CACHE_DEFAULT;
+
+    int ret = -1;
+    errno = ENOTSUP;
+#ifdef WTF_HAVE_ZLIB
+    if(format == BLOCK_FORMAT_GZIP) {
+        ret = gzipIndex(device);
+    }
+#endif
+#ifdef WTF_HAVE_ZSTD
+    if(format == BLOCK_FORMAT_ZSTD) {
+        ret = zstdIndex(device);
+    }
+#endif
+    if(ret == 0 && device->blockCount > 0) {
+        device->entries = (BlockCacheEntry**)calloc(device->blockCount, sizeof(BlockCacheEntry*));
+        if(!device->entries) {
+            errno = ENOMEM;
+            ret = -1;
+        }
+    }
+    if(ret != 0) {
+        int error = errno;
+        free(device->starts);
+        free(device->sources);
+        free(device->extra);
+        errno = error;
+        return -1;
+    }
+    pthread_mutex_init(&device->lock, 0);
+    return 0;
+}
+
+/**
+ * @return block holding offset, which is < size
+ */
+static unsigned int blockFind(const BlockDevice* device, unsigned long long offset) {
+    // last block starting at or before offset, empty blocks are passed over that way
+    unsigned int low = 0, high = device->blockCount - 1;
+    while(low < high) {
+        unsigned int middle = low + (high - low + 1) / 2;
+        if(device->starts[middle] <= offset) {
+            low = middle;
+        }else{
+            high = middle - 1;
+        }
+    }
+    return low;
+}
+
+static void blockUnlink(BlockDevice* device, BlockCacheEntry* entry) {
+    if(entry->newer) {
+        entry->newer->older = entry->older;
+    }else{
+        device->newest = entry->older;
+    }
+    if(entry->older) {
+        entry->older->newer = entry->newer;
+    }else{
+        device->oldest = entry->newer;
+    }
+}
+
+static void blockMakeNewest(BlockDevice* device, BlockCacheEntry* entry) {
+    entry->older = device->newest;
+    entry->newer = 0;
+    if(device->newest) {
+        device->newest->newer = entry;
+    }
+    device->newest = entry;
+    if(!device->oldest) {
+        device->oldest = entry;
+    }
+}
+
+/**
+ * @brief Drops the least recently used blocks until the cache fits its capacity, the newest one stays
+ */
+static void blockEvict(BlockDevice* device) {
+    while(device->cached > device->capacity && device->oldest != device->newest) {
+        BlockCacheEntry* victim = device->oldest;
+        blockUnlink(device, victim);
+        device->entries[victim->block] = 0;
+        device->cached -= victim->length;
+        free(victim->data);
+        free(victim);
+    }
+}
+
+int blockDeviceRead(BlockDevice* device, void* buf, size_t length, unsigned long long offset) {
+    if(offset > device->size || length > device->size - offset) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    char* dst = (char*)buf;
+    while(length > 0) {
+        unsigned int block = blockFind(device, offset);
+        size_t blockLength = (size_t)(device->starts[block + 1] - device->starts[block]);
+        size_t within = (size_t)(offset - device->starts[block]);
+        size_t chunk = length < blockLength - within ? length : blockLength - within;
+
+        pthread_mutex_lock(&device->lock);
+        BlockCacheEntry* entry = device->entries[block];
+        if(entry) {
+            COUNT(COUNTER_BLOCK_HITS, 1);
+            blockUnlink(device, entry);
+        }else{
+            // decompressed without the lock, other threads go on reading cached blocks meanwhile
+            pthread_mutex_unlock(&device->lock);
+            entry = (BlockCacheEntry*)malloc(sizeof(BlockCacheEntry));
+            char* data = entry ? (char*)malloc(blockLength) : 0;
+            if(!data || blockDecode(device, block, data, blockLength) != 0) {
+                int error = data ? errno : ENOMEM;
+                free(data);
+                free(entry);
+                errno = error;
+                return -1;
+            }
+            entry->block = block;
+            entry->data = data;
+            entry->length = blockLength;
+
+            pthread_mutex_lock(&device->lock);
+            if(device->entries[block]) {
+                // another thread was faster
+                free(data);
+                free(entry);
+                entry = device->entries[block];
+                blockUnlink(device, entry);
+            }else{
+                device->entries[block] = entry;
+                device->cached += blockLength;
+            }
+        }
+        blockMakeNewest(device, entry);
+        memcpy(dst, entry->data + within, chunk);
+        blockEvict(device);
+        pthread_mutex_unlock(&device->lock);
+
+        dst += chunk;
+        offset += chunk;
+        length -= chunk;
+    }
+    return 0;
+}
+
+void blockDeviceCacheSize(BlockDevice* device, size_t capacity) {
+    pthread_mutex_lock(&device->lock);
+    device->capacity = capacity;
+    blockEvict(device);
+    pthread_mutex_unlock(&device->lock);
+}
+
+void blockDeviceClose(BlockDevice* device) {
+    while(device->oldest) {
+        BlockCacheEntry* entry = device->oldest;
+        blockUnlink(device, entry);
+        free(entry->data);
+        free(entry);
+    }
+    pthread_mutex_destroy(&device->lock);
+    free(device->entries);
+    free(device->starts);
+    free(device->sources);
+    free(device->extra);
+    memset(device, 0, sizeof(BlockDevice));
+}
@@ -0,0 +1,87 @@
+/*
+ * blockdev.h
+ *
+ * Compressed images as block devices. The uncompressed image is cut into
+ * blocks that can be decompressed on their own: the frames of a seekable
+ * zstd file, or the spans between the access points of a gzip index. Reads
+ * go through an LRU cache of decompressed blocks, so only the blocks that
+ * are touched are ever decompressed, and the FAT and directories that are
+ * read again come from memory. The cache can be used from several threads.
+ *
+ * gzip needs zlib (build with -DWTF_HAVE_ZLIB -lz), zstd needs libzstd
+ * (-DWTF_HAVE_ZSTD -lzstd). gzip has no random access of its own: the file
+ * is inflated once when it is opened to find the access points, each with
+ * the 32 KiB of output before it that the next block refers back to.
+ */
+
+#ifndef __BLOCKDEV_H
+#define __BLOCKDEV_H
+
+#include <pthread.h>
+#include <stddef.h>
+
+#define BLOCK_CACHE_DEFAULT (64u << 20) // bytes of decompressed blocks kept
+#define BLOCK_GZIP_SPAN     (4u << 20)  // uncompressed bytes between gzip access points
+
+#define BLOCK_FORMAT_GZIP   1
+#define BLOCK_FORMAT_ZSTD   2
+
+/**
+ * @brief A decompressed block in the cache
+ */
+typedef struct BlockCacheEntry_t {
+    unsigned int block;
+    char* data;
+    size_t length;
+    struct BlockCacheEntry_t* newer;    // towards the most recently used one
+    struct BlockCacheEntry_t* older;
+} BlockCacheEntry;
+
+typedef struct BlockDevice_t {
+    int handle;                         // the compressed file, owned by the caller
+    int format;                         // BLOCK_FORMAT_*
+    unsigned long long size;            // uncompressed
+    unsigned long long* starts;         // uncompressed offset of each block, blockCount + 1 of them
+    unsigned long long* sources;        // compressed offset of each block
+    unsigned int blockCount;
+    void* extra;                        // gzip: windows and bit offsets of the access points
+
+    pthread_mutex_t lock;               // of the cache
+    BlockCacheEntry** entries;          // by block, 0 if not cached
+    BlockCacheEntry* newest;
+    BlockCacheEntry* oldest;
+    size_t cached;                      // bytes
+    size_t capacity;
+} BlockDevice;
+
+/**
+ * @brief Tells a compressed file by its first bytes
+ * @return BLOCK_FORMAT_*, 0 for anything else
+ */
+int blockFormat(const unsigned char* magic, size_t length);
+
+/**
+ * @brief Opens a compressed file as a block device; a gzip file is indexed on the way
+ * @param format BLOCK_FORMAT_* of the file
+ * @return 0 on success, -1 otherwise (errno is set; ENOTSUP if the format is not compiled in
+ * or the zstd file has no seek table)
+ */
+int blockDeviceOpen(BlockDevice* device, int handle, int format);
+
+/**
+ * @brief Copies length uncompressed bytes at offset into buf
+ * @return 0 on success, -1 otherwise (errno is set)
+ */
+int blockDeviceRead(BlockDevice* device, void* buf, size_t length, unsigned long long offset);
+
+/**
+ * @brief Sets how many bytes of decompressed blocks are kept; at least one block always is
+ */
+void blockDeviceCacheSize(BlockDevice* device, size_t capacity);
+
+/**
+ * @brief Releases the index and the cache, the file stays open
+ */
+void blockDeviceClose(BlockDevice* device);
+
+#endif
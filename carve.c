@@ -0,0 +1,406 @@
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "carve.h"
+
+#define CARVE_STATES        128 // of the automaton, enough for all signatures
+#define CARVE_BLOCK         256 // bitset words of free clusters classified at once
+#define CARVE_READ_AHEAD    2   // chunks read while one is scanned
+
+typedef struct CarveType_t {
+    const char* extension;
+    unsigned int footerExtra;   // bytes that still belong to the file after its footer
+    unsigned long long maxSize; // a file is cut here if there is no footer by then
+} CarveType;
+
+typedef struct CarveSignature_t {
+    int type;
+    int footer;                 // 0 for a header
+    const char* bytes;
+    unsigned int length;
+} CarveSignature;
+
+static const CarveType carveTypes[CARVE_TYPES] = {
+    {"jpg", 0, 64ull << 20},
+    {"png", 0, 64ull << 20},
+    {"gif", 0, 16ull << 20},
+    {"pdf", 0, 256ull << 20},
+    {"zip", 18, 1ull << 30},    // rest of the end of central directory record, the comment is not counted
+};
+
+static const CarveSignature carveSignatures[] = {
+    {CARVE_JPG, 0, "\xFF\xD8\xFF", 3},
+    {CARVE_JPG, 1, "\xFF\xD9", 2},
+    {CARVE_PNG, 0, "\x89PNG\r\n\x1A\n", 8},
+    {CARVE_PNG, 1, "IEND\xAE\x42\x60\x82", 8},
+    {CARVE_GIF, 0, "GIF87a", 6},
+    {CARVE_GIF, 0, "GIF89a", 6},
+    {CARVE_GIF, 1, "\x00\x3B", 2},
+    {CARVE_PDF, 0, "%PDF-", 5},
+    {CARVE_PDF, 1, "%%EOF", 5},
+    {CARVE_ZIP, 0, "PK\x03\x04", 4},
+    {CARVE_ZIP, 1, "PK\x05\x06", 4},
+};
+
+#define CARVE_SIGNATURES (sizeof(carveSignatures) / sizeof(carveSignatures[0]))
+
+/**
+ * @brief Aho-Corasick automaton over all signatures, as a complete transition table
+ */
+typedef struct CarveAutomaton_t {
+    unsigned char next[CARVE_STATES][256];
+    unsigned int matches[CARVE_STATES];     // signatures ending in a state, one bit each
+    unsigned int headers;                   // bits of the headers
+    unsigned int footers[CARVE_TYPES];      // bits of the footers of each type
+    unsigned int headerMax;                 // length of the longest header
+} CarveAutomaton;
+
+typedef struct CarveScan_t {
+    Volume* volume;
+    const CarveAutomaton* automaton;
+    void (*found)(const CarvedFile* file, void* arg);
+    void* arg;
+    const Extent* run;          // free extent being scanned
+    unsigned long long runOffset;
+    CarvedFile file;            // open file, type -1 if none
+} CarveScan;
+
+static void carveBuild(CarveAutomaton* automaton) {
+    memset(automaton, 0, sizeof(CarveAutomaton));
+
+    // trie of the signatures, state 0 is the root and no edge leads back to it
+    unsigned int states = 1;
+    unsigned int i;
+    for(i = 0; i < CARVE_SIGNATURES; i++) {
+        const CarveSignature* signature = &carveSignatures[i];
+        unsigned int state = 0;
+        unsigned int j;
+        for(j = 0; j < signature->length; j++) {
+            unsigned char c = (unsigned char)signature->bytes[j];
+            if(!automaton->next[state][c]) {
+                automaton->next[state][c] = (unsigned char)states++;
+            }
+            state = automaton->next[state][c];
+        }
+        automaton->matches[state] |= 1u << i;
+        if(signature->footer) {
+            automaton->footers[signature->type] |= 1u << i;
+        }else{
+            automaton->headers |= 1u << i;
+            if(signature->length > automaton->headerMax) {
+                automaton->headerMax = signature->length;
+            }
+        }
+    }
+
+    // breadth first: fill the missing edges with those of the failure state, which is shallower and done
+    unsigned char fail[CARVE_STATES];
+    unsigned char queue[CARVE_STATES];
+    unsigned int head = 0, tail = 0;
+    unsigned int c;
+    for(c = 0; c < 256; c++) {
+        unsigned char child = automaton->next[0][c];
+        if(child) {
+            fail[child] = 0;
+            queue[tail++] = child;
+        }
+    }
+    while(head < tail) {
+        unsigned char state = queue[head++];
+        for(c = 0; c < 256; c++) {
+            unsigned char child = automaton->next[state][c];
+            if(child) {
+                fail[child] = automaton->next[fail[state]][c];
+                automaton->matches[child] |= automaton->matches[fail[child]];
+                queue[tail++] = child;
+            }else{
+                automaton->next[state][c] = automaton->next[fail[state]][c];
+            }
+        }
+    }
+}
+
+/**
+ * @return type of the header at the start of data, -1 if there is none; *state receives the state after it
+ */
+static int carveHeader(const CarveAutomaton* automaton, const unsigned char* data, unsigned int* length, unsigned int* state) {
+    unsigned int current = 0;
+    unsigned int i;
+    for(i = 0; i < automaton->headerMax; i++) {
+        current = automaton->next[current][data[i]];
+        unsigned int bits = automaton->matches[current] & automaton->headers;
+        while(bits) {
+            unsigned int signature = __builtin_ctz(bits);
+            bits &= bits - 1;
+            if(carveSignatures[signature].length == i + 1) {
+                *length = i + 1;
+                *state = current;
+                return carveSignatures[signature].type;
+            }
+        }
+    }
+    return -1;
+}
+
+/**
+ * @brief Reports the open file, ending at end (relative to the extent)
+ */
+static void carveClose(CarveScan* scan, unsigned long long end, int complete) {
+    scan->file.length = scan->runOffset + end - scan->file.offset;
+    scan->file.complete = complete;
+    scan->found(&scan->file, scan->arg);
+    scan->file.type = -1;
+}
+
+/**
+ * @brief Opens a file at start (relative to the extent, at a cluster start)
+ */
+static void carveOpen(CarveScan* scan, int type, unsigned long long start) {
+    scan->file.type = type;
+    scan->file.offset = scan->runOffset + start;
+    scan->file.cluster = scan->run->start + (unsigned int)(start / scan->volume->geometry.clusterSize);
+}
+
+/**
+ * @brief Collects the free extents of the FAT
+ */
+static int carveFreeRuns(const FatTable* fat, ExtentList* runs) {
+    unsigned long long freeBits[CARVE_BLOCK];
+    FatClasses classes = {freeBits, 0, 0, 0};
+    unsigned int words = fat->count / 64 + 1;
+    unsigned int block;
+    for(block = 0; block < words; block += CARVE_BLOCK) {
+        unsigned int count = words - block < CARVE_BLOCK ? words - block : CARVE_BLOCK;
+        fatClassify(fat, block, block + count, &classes);
+        unsigned int i;
+        for(i = 0; i < count; i++) {
+            unsigned long long bits = freeBits[i];
+            while(bits) {
+                if(extentListAdd(runs, (block + i) * 64 + __builtin_ctzll(bits)) != 0) {
+                    return -1;
+                }
+                bits &= bits - 1;
+            }
+        }
+    }
+    return 0;
+}
+
+/**
+ * @brief Starts reading the chunk at (run, position) of the free extents, unless it only covers holes
+ */
+static void carvePrefetch(Volume* volume, ReadAhead* readAhead, const Extent* run, unsigned long long position, unsigned long long chunkSize) {
+    unsigned long long runBytes = (unsigned long long)run->length * volume->geometry.clusterSize;
+    unsigned long long offset = volumeClusterOffset(volume, run->start) + position;
+    size_t length = (size_t)(runBytes - position < chunkSize ? runBytes - position : chunkSize);
+    unsigned long long dataEnd;
+    if(imageNextData(&volume->image, offset, &dataEnd) < offset + length) {
+        readAheadStart(readAhead, offset, length);
+    }
+}
+
+/**
+ * @brief Steps to the chunk after (run, position)
+ * @return 0 if there is none
+ */
+static int carveNextChunk(const ExtentList* runs, unsigned long long chunkSize, unsigned int clusterSize, unsigned int* run, unsigned long long* position) {
+    if(*run >= runs->count) {
+        return 0;
+    }
+    *position += chunkSize;
+    if(*position >= (unsigned long long)runs->extents[*run].length * clusterSize) {
+        *position = 0;
+        (*run)++;
+    }
+    return *run < runs->count;
+}
+
+int carveScan(Volume* volume, ReadAhead* readAhead, void (*found)(const CarvedFile* file, void* arg), void* arg) {
+    ExtentList runs;
+    memset(&runs, 0, sizeof(runs));
+    CarveAutomaton* automaton = (CarveAutomaton*)malloc(sizeof(CarveAutomaton));
+    if(!automaton || carveFreeRuns(&volume->fat, &runs) != 0) {
+        free(automaton);
+        extentListFree(&runs);
+        errno = ENOMEM;
+        return -1;
+    }
+    carveBuild(automaton);
+
+    unsigned int clusterSize = volume->geometry.clusterSize;
+    unsigned long long chunkSize = CARVE_CHUNK / clusterSize * clusterSize;
+    if(chunkSize == 0) {
+        chunkSize = clusterSize;
+    }
+    char* scratch = 0;
+    unsigned int scratchSize = 0;
+    if(!volume->image.map) {
+        scratch = (char*)malloc(chunkSize);
+        scratchSize = scratch ? (unsigned int)chunkSize : 0;
+    }
+    if(!volume->image.map && !scratch) {
+        free(automaton);
+        extentListFree(&runs);
+        errno = ENOMEM;
+        return -1;
+    }
+
+    CarveScan scan;
+    memset(&scan, 0, sizeof(scan));
+    scan.volume = volume;
+    scan.automaton = automaton;
+    scan.found = found;
+    scan.arg = arg;
+    scan.file.type = -1;
+
+    // the whole pass is one front to back read
+    if(runs.count > 0) {
+        unsigned long long first = volumeClusterOffset(volume, runs.extents[0].start);
+        const Extent* last = &runs.extents[runs.count - 1];
+        imageAdvise(&volume->image, first, volumeClusterOffset(volume, last->start) + (unsigned long long)last->length * clusterSize - first, IMAGE_ADVICE_SEQUENTIAL);
+    }
+    unsigned int aheadRun = 0;
+    unsigned long long aheadPosition = 0;
+    unsigned long long dataStart = 0;   // the data range of a sparse image that the scan is in or before
+    unsigned long long dataEnd = 0;
+    if(readAhead && runs.count > 0) {
+        carvePrefetch(volume, readAhead, &runs.extents[0], 0, chunkSize);
+        unsigned int ahead;
+        for(ahead = 1; ahead < CARVE_READ_AHEAD && carveNextChunk(&runs, chunkSize, clusterSize, &aheadRun, &aheadPosition); ahead++) {
+            carvePrefetch(volume, readAhead, &runs.extents[aheadRun], aheadPosition, chunkSize);
+        }
+    }
+
+    unsigned int run;
+    for(run = 0; run < runs.count; run++) {
+        scan.run = &runs.extents[run];
+        scan.runOffset = volumeClusterOffset(volume, scan.run->start);
+        unsigned long long runBytes = (unsigned long long)scan.run->length * clusterSize;
+        unsigned long long resume = 0;  // where the next header is looked for, after a file was closed
+        unsigned int state = 0;
+        unsigned long long position;
+        for(position = 0; position < runBytes; position += chunkSize) {
+            size_t length = (size_t)(runBytes - position < chunkSize ? runBytes - position : chunkSize);
+            unsigned long long offset = scan.runOffset + position;
+
+            // keep the queue filled with the chunks after this one
+            if(readAhead && carveNextChunk(&runs, chunkSize, clusterSize, &aheadRun, &aheadPosition)) {
+                carvePrefetch(volume, readAhead, &runs.extents[aheadRun], aheadPosition, chunkSize);
+            }
+
+            // nothing open and only holes of a sparse image: there is nothing to read
+            unsigned long long from = resume > position ? scan.runOffset + resume : offset;
+            if(from >= dataEnd) {
+                dataStart = imageNextData(&volume->image, from, &dataEnd);
+            }
+            if(scan.file.type < 0 && dataStart >= offset + length) {
+                continue;
+            }
+
+            const unsigned char* data = readAhead ? (const unsigned char*)readAheadTake(readAhead, offset, length, &scratch, &scratchSize) : 0;
+            if(!data && !volume->image.map && length > scratchSize) {
+                // the buffer swapped in may have been read for a shorter chunk
+                char* larger = (char*)realloc(scratch, length);
+                if(!larger) {
+                    free(scratch);
+                    free(automaton);
+                    extentListFree(&runs);
+                    errno = ENOMEM;
+                    return -1;
+                }
+                scratch = larger;
+                scratchSize = (unsigned int)length;
+            }
+            if(!data) {
+                data = (const unsigned char*)imageView(&volume->image, offset, length, scratch);
+            }
+            if(!data) {
+                // what is open can't go on over a hole
+                if(scan.file.type >= 0) {
+                    carveClose(&scan, position, 0);
+                }
+                state = 0;
+                resume = position + length;
+                continue;
+            }
+
+            size_t i = resume > position ? (size_t)(resume - position) : 0;
+            while(i < length) {
+                if(scan.file.type < 0) {
+                    // nothing open: only the starts of clusters are looked at, those in holes not even that
+                    if(offset + i >= dataEnd) {
+                        dataStart = imageNextData(&volume->image, offset + i, &dataEnd);
+                    }
+                    if(dataStart >= offset + length) {
+                        break;
+                    }
+                    if(dataStart > offset + i) {
+                        i = (size_t)((dataStart - offset) / clusterSize * clusterSize);
+                    }
+                    unsigned int headerLength;
+                    int type = carveHeader(automaton, &data[i], &headerLength, &state);
+                    if(type >= 0) {
+                        carveOpen(&scan, type, position + i);
+                        i += headerLength;
+                    }else{
+                        i += clusterSize;
+                    }
+                    continue;
+                }
+
+                // every byte up to the size limit goes through the automaton
+                unsigned long long limit = scan.file.offset - scan.runOffset + carveTypes[scan.file.type].maxSize;
+                size_t end = limit - position < length ? (size_t)(limit - position) : length;
+                while(i < end && !automaton->matches[state = automaton->next[state][data[i]]]) {
+                    i++;
+                }
+                if(i == end) {
+                    if(end < length || limit == position + length) {
+                        carveClose(&scan, limit, 0);
+                        resume = (limit + clusterSize - 1) / clusterSize * clusterSize;
+                        i = resume - position;
+                        state = 0;
+                    }
+                    continue;
+                }
+
+                unsigned int bits = automaton->matches[state];
+                unsigned long long matchEnd = position + i + 1;
+                if(bits & automaton->footers[scan.file.type]) {
+                    unsigned long long fileEnd = matchEnd + carveTypes[scan.file.type].footerExtra;
+                    carveClose(&scan, fileEnd < runBytes ? fileEnd : runBytes, 1);
+                    resume = (fileEnd + clusterSize - 1) / clusterSize * clusterSize;
+                    i = resume - position < length ? (size_t)(resume - position) : length;
+                    state = 0;
+                    continue;
+                }
+                // a header at the start of a cluster means the open file was cut short
+                bits &= automaton->headers;
+                while(bits) {
+                    unsigned int signature = __builtin_ctz(bits);
+                    bits &= bits - 1;
+                    unsigned long long start = matchEnd - carveSignatures[signature].length;
+                    if(matchEnd >= carveSignatures[signature].length && start % clusterSize == 0) {
+                        carveClose(&scan, start, 0);
+                        carveOpen(&scan, carveSignatures[signature].type, start);
+                        break;
+                    }
+                }
+                i++;
+            }
+        }
+        if(scan.file.type >= 0) {
+            carveClose(&scan, runBytes, 0);
+        }
+    }
+
+    free(scratch);
+    free(automaton);
+    extentListFree(&runs);
+    return 0;
+}
+
+const char* carveTypeName(int type) {
+    return type >= 0 && type < CARVE_TYPES ? carveTypes[type].extension : "bin";
+}
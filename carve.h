@@ -0,0 +1,48 @@
+/*
+ * carve.h
+ *
+ * Finds files in the free clusters of a volume by their content. The free
+ * extents are read front to back in large chunks, which keeps the disk
+ * streaming. A file starts where a known header is at the start of a
+ * cluster and ends at its type's footer; all headers and footers are
+ * looked for in one pass by an Aho-Corasick automaton. Only contiguous
+ * files inside one free extent are found.
+ */
+
+#ifndef __CARVE_H
+#define __CARVE_H
+
+#include "readahead.h"
+#include "volume.h"
+
+#define CARVE_JPG   0
+#define CARVE_PNG   1
+#define CARVE_GIF   2
+#define CARVE_PDF   3
+#define CARVE_ZIP   4
+#define CARVE_TYPES 5
+
+#define CARVE_CHUNK (4u << 20)  // bytes read at once, rounded down to whole clusters
+
+typedef struct CarvedFile_t {
+    int type;                   // CARVE_*
+    unsigned int cluster;       // first cluster
+    unsigned long long offset;  // in the image
+    unsigned long long length;
+    int complete;               // 1 if the footer was found, 0 if cut at the end of the extent, the next header or the size limit
+} CarvedFile;
+
+/**
+ * @brief Scans the free clusters for files
+ * @param readAhead to read the next chunks while one is scanned, 0 for none
+ * @param found called for each file found, in the order of the image
+ * @return 0 on success, -1 if out of memory (errno is set); chunks that can't be read are passed over
+ */
+int carveScan(Volume* volume, ReadAhead* readAhead, void (*found)(const CarvedFile* file, void* arg), void* arg);
+
+/**
+ * @return file name extension of a CARVE_* type
+ */
+const char* carveTypeName(int type);
+
+#endif
@@ -0,0 +1,404 @@
+#define _FILE_OFFSET_BITS 64
+
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "check.h"
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define CHECK_X86_SIMD
+#include <immintrin.h>
+#endif
+
+#define CHECK_CHUNK (1 << 20)   // bytes of a FAT copy compared per request
+
+#define BIT_TEST(set, i)    (((set)[(i) / 64] >> ((i) % 64)) & 1)
+#define BIT_SET(set, i)     ((set)[(i) / 64] |= 1ull << ((i) % 64))
+
+/**
+ * @brief Share of one thread: a range of bitset words of the FAT scan and a byte range of every FAT copy
+ */
+typedef struct CheckWorker_t {
+    Checker* checker;
+    pthread_t thread;
+    unsigned int firstWord;
+    unsigned int endWord;
+    unsigned long long firstByte;
+    unsigned long long endByte;
+    const FatClasses* classes;
+
+    unsigned int freeClusters;
+    unsigned int badClusters;
+    unsigned int invalidEntries;
+    unsigned long long* differences;        // per FAT copy: bytes that differ from the first copy
+    unsigned long long* firstDifference;    // per FAT copy: offset of the first one, ~0 if none
+    int failed;
+} CheckWorker;
+
+/**
+ * @brief Bits of the clusters of a bitset word that exist, 0 and 1 don't
+ */
+static unsigned long long checkWordRange(unsigned int word, unsigned int count) {
+    unsigned long long bits = word == 0 ? ~3ull : ~0ull;
+    if((unsigned long long)word * 64 + 64 > count) {
+        bits = count <= word * 64 ? 0 : bits & ((1ull << (count - word * 64)) - 1);
+    }
+    return bits;
+}
+
+int checkInit(Checker* checker, Image* image, const FatGeometry* geometry, const FatTable* fat, Output* out) {
+    memset(checker, 0, sizeof(Checker));
+    checker->image = image;
+    checker->geometry = geometry;
+    checker->fat = fat;
+    checker->out = out;
+
+    checker->words = fat->count / 64 + 1;
+    checker->allocated = (unsigned long long*)calloc(checker->words, sizeof(unsigned long long));
+    checker->owned = (unsigned long long*)calloc(checker->words, sizeof(unsigned long long));
+    if(!checker->allocated || !checker->owned) {
+        checkFree(checker);
+        return -1;
+    }
+    return 0;
+}
+
+#ifdef CHECK_X86_SIMD
+
+/**
+ * @brief Counts the bytes that differ, 32 per compare
+ * @return number of bytes done
+ */
+__attribute__((target("avx2")))
+static size_t checkCompareAVX2(const unsigned char* a, const unsigned char* b, size_t length, unsigned long long* differences, size_t* first) {
+    size_t i;
+    for(i = 0; i + 32 <= length; i += 32) {
+        __m256i equal = _mm256_cmpeq_epi8(_mm256_loadu_si256((const __m256i*)&a[i]), _mm256_loadu_si256((const __m256i*)&b[i]));
+        unsigned int differing = ~(unsigned int)_mm256_movemask_epi8(equal);
+        if(differing) {
+            if(*first == (size_t)-1) {
+                *first = i + __builtin_ctz(differing);
+            }
+            *differences += __builtin_popcount(differing);
+        }
+    }
+    return i;
+}
+
+#endif
+
+/**
+ * @brief Counts the bytes that differ between two blocks
+ * @param first receives the offset of the first differing byte if it is still (size_t)-1
+ */
+static void checkCompare(const unsigned char* a, const unsigned char* b, size_t length, unsigned long long* differences, size_t* first) {
+    size_t i = 0;
+#ifdef CHECK_X86_SIMD
+    if(__builtin_cpu_supports("avx2")) {
+        i = checkCompareAVX2(a, b, length, differences, first);
+    }
+#endif
+    for(; i < length; i++) {
+        if(a[i] != b[i]) {
+            if(*first == (size_t)-1) {
+                *first = i;
+            }
+            (*differences)++;
+        }
+    }
+}
+
+static void* checkWorker(void* arg) {
+    CheckWorker* worker = (CheckWorker*)arg;
+    Checker* checker = worker->checker;
+    const FatGeometry* geometry = checker->geometry;
+
+    // FAT scan, whole words per thread so the bitsets need no locking
+    const FatClasses* classes = worker->classes;
+    FatClasses share = {&classes->free[worker->firstWord], &classes->bad[worker->firstWord], 0, &classes->invalid[worker->firstWord]};
+    fatClassify(checker->fat, worker->firstWord, worker->endWord, &share);
+    unsigned int word;
+    for(word = worker->firstWord; word < worker->endWord; word++) {
+        unsigned long long freeBits = classes->free[word];
+        unsigned long long badBits = classes->bad[word];
+        checker->allocated[word] = ~(freeBits | badBits) & checkWordRange(word, checker->fat->count);
+        worker->freeClusters += __builtin_popcountll(freeBits);
+        worker->badClusters += __builtin_popcountll(badBits);
+        worker->invalidEntries += __builtin_popcountll(classes->invalid[word]);
+    }
+
+    // compare the other copies with the first one
+    void* scratch = checker->image->map ? 0 : malloc(2 * CHECK_CHUNK);
+    unsigned int copy;
+    for(copy = 1; copy < geometry->numberOfFATs && !worker->failed; copy++) {
+        unsigned long long offset;
+        for(offset = worker->firstByte; offset < worker->endByte; offset += CHECK_CHUNK) {
+            size_t length = worker->endByte - offset > CHECK_CHUNK ? CHECK_CHUNK : (size_t)(worker->endByte - offset);
+            const unsigned char* a = (const unsigned char*)imageView(checker->image, geometry->fatOffset + offset, length, scratch);
+            const unsigned char* b = (const unsigned char*)imageView(checker->image, geometry->fatOffset + copy * geometry->fatSize + offset,
+                                                                     length, scratch ? (char*)scratch + CHECK_CHUNK : 0);
+            if(!a || !b) {
+                worker->failed = 1;
+                break;
+            }
+            size_t first = (size_t)-1;
+            checkCompare(a, b, length, &worker->differences[copy], &first);
+            if(first != (size_t)-1 && worker->firstDifference[copy] == ~0ull) {
+                worker->firstDifference[copy] = offset + first;
+            }
+        }
+    }
+    free(scratch);
+    return 0;
+}
+
+/**
+ * @brief Cluster whose FAT entry holds a byte of the FAT
+ */
+static unsigned int checkByteCluster(const FatGeometry* geometry, unsigned long long offset) {
+    switch(geometry->fatType) {
+        case 12: return (unsigned int)(offset * 2 / 3);
+        case 16: return (unsigned int)(offset / 2);
+        default: return (unsigned int)(offset / 4);
+    }
+}
+
+int checkFat(Checker* checker, unsigned int threads) {
+    const FatGeometry* geometry = checker->geometry;
+    unsigned int copies = geometry->numberOfFATs;
+    if(threads < 1) {
+        threads = 1;
+    }
+    if(threads > checker->words) {
+        threads = checker->words;
+    }
+
+    CheckWorker* workers = (CheckWorker*)calloc(threads, sizeof(CheckWorker));
+    unsigned long long* results = (unsigned long long*)malloc(sizeof(unsigned long long) * 2 * threads * (copies ? copies : 1));
+    unsigned long long* bitsets = (unsigned long long*)malloc(sizeof(unsigned long long) * 3 * checker->words);
+    if(!workers || !results || !bitsets) {
+        free(workers);
+        free(results);
+        free(bitsets);
+        return -1;
+    }
+    FatClasses classes = {bitsets, &bitsets[checker->words], 0, &bitsets[2 * checker->words]};
+
+    // even shares, the byte ranges on 64 byte boundaries
+    unsigned int i;
+    unsigned long long share = (geometry->fatSize / threads + 63) & ~63ull;
+    for(i = 0; i < threads; i++) {
+        CheckWorker* worker = &workers[i];
+        worker->checker = checker;
+        worker->classes = &classes;
+        worker->firstWord = (unsigned long long)checker->words * i / threads;
+        worker->endWord = (unsigned long long)checker->words * (i + 1) / threads;
+        worker->firstByte = share * i < geometry->fatSize ? share * i : geometry->fatSize;
+        worker->endByte = share * (i + 1) < geometry->fatSize ? share * (i + 1) : geometry->fatSize;
+        worker->differences = &results[2 * i * copies];
+        worker->firstDifference = &results[(2 * i + 1) * copies];
+        unsigned int copy;
+        for(copy = 0; copy < copies; copy++) {
+            worker->differences[copy] = 0;
+            worker->firstDifference[copy] = ~0ull;
+        }
+    }
+
+    unsigned int started = 1;
+    while(started < threads && pthread_create(&workers[started].thread, 0, checkWorker, &workers[started]) == 0) {
+        started++;
+    }
+    // the calling thread takes the first share, shares without a thread as well
+    for(i = 0; i < threads; i += (i == 0 ? started : 1)) {
+        checkWorker(&workers[i]);
+    }
+    for(i = 1; i < started; i++) {
+        pthread_join(workers[i].thread, 0);
+    }
+
+    int ret = 0;
+    for(i = 0; i < threads; i++) {
+        checker->freeClusters += workers[i].freeClusters;
+        checker->badClusters += workers[i].badClusters;
+        checker->invalidEntries += workers[i].invalidEntries;
+        ret |= workers[i].failed ? -1 : 0;
+    }
+
+    char line[160];
+    unsigned int copy;
+    for(copy = 1; copy < copies && ret == 0; copy++) {
+        unsigned long long differences = 0;
+        unsigned long long first = ~0ull;
+        for(i = 0; i < threads; i++) {
+            differences += workers[i].differences[copy];
+            if(workers[i].firstDifference[copy] < first) {
+                first = workers[i].firstDifference[copy];
+            }
+        }
+        if(differences) {
+            checker->fatMismatches++;
+            snprintf(line, sizeof(line), "FAT copy %u differs from copy 1 in %llu bytes, first at byte %llu (cluster %u)\n",
+                     copy + 1, differences, first, checkByteCluster(geometry, first));
+            outputString(checker->out, line);
+        }
+    }
+
+    // the values themselves
+    unsigned int reported = 0;
+    unsigned int word;
+    for(word = 0; word < checker->words && reported < CHECK_REPORT_MAX; word++) {
+        unsigned long long bits;
+        for(bits = classes.invalid[word]; bits && reported < CHECK_REPORT_MAX; bits &= bits - 1, reported++) {
+            unsigned int cluster = word * 64 + __builtin_ctzll(bits);
+            snprintf(line, sizeof(line), "FAT entry of cluster %u points to invalid cluster %u\n", cluster, fatEntry(checker->fat, cluster));
+            outputString(checker->out, line);
+        }
+    }
+
+    free(workers);
+    free(results);
+    free(bitsets);
+    return ret;
+}
+
+/**
+ * @brief Reports a problem of an entry
+ */
+static void checkReport(Checker* checker, const char* path, const char* problem) {
+    outputString(checker->out, path);
+    outputString(checker->out, ": ");
+    outputString(checker->out, problem);
+    outputChar(checker->out, '\n');
+}
+
+/**
+ * @brief Follows a chain and marks its clusters as owned
+ * @param complete set to 1 if the chain ends with an end of chain marker
+ * @return number of clusters claimed
+ */
+static unsigned int checkClaim(Checker* checker, const char* path, unsigned int cluster, int* complete) {
+    const FatTable* fat = checker->fat;
+    char problem[96];
+    unsigned int length = 0;
+    *complete = 0;
+
+    while(1) {
+        if(cluster < 2 || cluster >= fat->count) {
+            snprintf(problem, sizeof(problem), "chain leads to nonexistent cluster %u", cluster);
+            break;
+        }
+        if(BIT_TEST(checker->owned, cluster)) {
+            checker->crossLinks++;
+            snprintf(problem, sizeof(problem), "cross-linked at cluster %u", cluster);
+            checkReport(checker, path, problem);
+            return length;
+        }
+        BIT_SET(checker->owned, cluster);
+        length++;
+
+        unsigned int next = fatEntry(fat, cluster);
+        if(FAT_IS_LAST(next)) {
+            *complete = 1;
+            return length;
+        }
+        if(next == CLUSTER_FREE || next == FAT_CLUSTER_BAD) {
+            snprintf(problem, sizeof(problem), "cluster %u of the chain is marked %s", cluster, next == CLUSTER_FREE ? "free" : "bad");
+            break;
+        }
+        cluster = next;
+    }
+    checker->brokenChains++;
+    checkReport(checker, path, problem);
+    return length;
+}
+
+int checkEntry(Checker* checker, const DIRENTRY* directoryEntry, const char* path) {
+    unsigned int firstCluster = fatFirstCluster(directoryEntry, checker->geometry->fatType);
+    unsigned int clusterSize = checker->geometry->clusterSize;
+    int directory = IS_DIR(directoryEntry->attr);
+    char problem[96];
+
+    if(directory) {
+        checker->directories++;
+    }else{
+        checker->files++;
+    }
+
+    if(firstCluster == 0) {
+        if(directory) {
+            checker->brokenChains++;
+            checkReport(checker, path, "directory without clusters");
+        }else if(directoryEntry->size > 0) {
+            checker->sizeMismatches++;
+            snprintf(problem, sizeof(problem), "no clusters for %u bytes", directoryEntry->size);
+            checkReport(checker, path, problem);
+        }
+        return 0;
+    }
+
+    // a directory seen before is not read again
+    int claimed = firstCluster < checker->fat->count && !BIT_TEST(checker->owned, firstCluster);
+    int complete;
+    unsigned int length = checkClaim(checker, path, firstCluster, &complete);
+
+    // directories have no size, files need exactly the clusters their size takes
+    unsigned int needed = (unsigned int)(((unsigned long long)directoryEntry->size + clusterSize - 1) / clusterSize);
+    if(!directory && ((complete && length != needed) || (!complete && length > needed))) {
+        checker->sizeMismatches++;
+        snprintf(problem, sizeof(problem), "chain of %u clusters is too %s for %u bytes", length, length < needed ? "short" : "long", directoryEntry->size);
+        checkReport(checker, path, problem);
+    }
+    return directory && claimed && length > 0;
+}
+
+void checkRoot(Checker* checker) {
+    if(checker->geometry->fatType == 32) {
+        int complete;
+        checkClaim(checker, "\\", checker->geometry->rootCluster, &complete);
+    }
+}
+
+void checkLost(Checker* checker, const ExtentIndex* index) {
+    unsigned int i;
+    for(i = 0; i < checker->words; i++) {
+        checker->lostClusters += __builtin_popcountll(checker->allocated[i] & ~checker->owned[i]);
+    }
+    if(!checker->lostClusters) {
+        return;
+    }
+
+    // chains nobody points to, a lost cycle has no head and only shows in the cluster count
+    char line[96];
+    for(i = 0; i < index->headCount; i++) {
+        unsigned int head = index->heads[i];
+        if(BIT_TEST(checker->allocated, head) && !BIT_TEST(checker->owned, head)) {
+            if(checker->lostChains++ < CHECK_REPORT_MAX) {
+                unsigned int length = 0;
+                unsigned int run;
+                for(run = index->firstRun[i]; run < index->firstRun[i + 1]; run++) {
+                    length += index->runs.extents[run].length;
+                }
+                snprintf(line, sizeof(line), "Lost chain at cluster %u, %u clusters\n", head, length);
+                outputString(checker->out, line);
+            }
+        }
+    }
+    snprintf(line, sizeof(line), "Lost clusters: %u in %u chains\n", checker->lostClusters, checker->lostChains);
+    outputString(checker->out, line);
+}
+
+unsigned int checkProblems(const Checker* checker) {
+    // lost clusters count once per chain, lost cycles once for all
+    unsigned int lost = checker->lostChains ? checker->lostChains : (checker->lostClusters ? 1 : 0);
+    return checker->invalidEntries + checker->crossLinks + checker->brokenChains + checker->sizeMismatches +
+           lost + checker->fatMismatches;
+}
+
+void checkFree(Checker* checker) {
+    free(checker->allocated);
+    free(checker->owned);
+    checker->allocated = 0;
+    checker->owned = 0;
+}
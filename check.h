@@ -0,0 +1,85 @@
+/*
+ * check.h
+ *
+ * Consistency check of a volume, like dosfsck without repairs. Every
+ * cluster owned by a file or directory is marked in a bitset while the tree
+ * is walked; the allocated clusters come from one pass over the decoded FAT.
+ * Clusters that are allocated but not owned are lost. The FAT pass and the
+ * comparison of the FAT copies are split across threads.
+ */
+
+#ifndef __CHECK_H
+#define __CHECK_H
+
+#include "data.h"
+#include "extent.h"
+#include "fat.h"
+#include "format.h"
+#include "image.h"
+
+#define CHECK_REPORT_MAX 20     // invalid FAT entries reported one by one
+
+typedef struct Checker_t {
+    Image* image;
+    const FatGeometry* geometry;
+    const FatTable* fat;
+    Output* out;                        // problems are reported here
+
+    unsigned long long* allocated;      // bitset: FAT entry is neither free nor bad
+    unsigned long long* owned;          // bitset: cluster belongs to a file or directory
+    unsigned int words;                 // size of the bitsets in 64 bit words
+
+    unsigned int files;
+    unsigned int directories;
+    unsigned int freeClusters;
+    unsigned int badClusters;
+    unsigned int invalidEntries;        // FAT values pointing to reserved or nonexistent clusters
+    unsigned int crossLinks;
+    unsigned int brokenChains;          // ending in a free, bad or nonexistent cluster
+    unsigned int sizeMismatches;        // chain too short or too long for the size
+    unsigned int lostClusters;
+    unsigned int lostChains;
+    unsigned int fatMismatches;         // FAT copies that differ from the first one
+} Checker;
+
+/**
+ * @return 0 on success, -1 if out of memory
+ */
+int checkInit(Checker* checker, Image* image, const FatGeometry* geometry, const FatTable* fat, Output* out);
+
+/**
+ * @brief Scans the decoded FAT for allocated, free, bad and invalid entries
+ * and compares all FAT copies with the first one
+ * @param threads number of threads sharing the work
+ * @return 0 on success, -1 if a FAT copy could not be read
+ */
+int checkFat(Checker* checker, unsigned int threads);
+
+/**
+ * @brief Claims the chain of a file or directory, reports cross-links, broken
+ * chains and chains that don't fit the size
+ * @param path of the entry for the report
+ * @return 1 if the entry is a directory whose chain was claimed just now and
+ * can be read, 0 otherwise (also for directories seen before, which ends cycles)
+ */
+int checkEntry(Checker* checker, const DIRENTRY* directoryEntry, const char* path);
+
+/**
+ * @brief Claims the root directory chain (FAT32 only)
+ */
+void checkRoot(Checker* checker);
+
+/**
+ * @brief Counts and reports the clusters and chains no entry owns, after all entries were checked
+ * @param index the chain heads of the FAT
+ */
+void checkLost(Checker* checker, const ExtentIndex* index);
+
+/**
+ * @return number of problems found
+ */
+unsigned int checkProblems(const Checker* checker);
+
+void checkFree(Checker* checker);
+
+#endif
@@ -0,0 +1,81 @@
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+
+#include "counters.h"
+
+static const char* const counterNames[COUNTER_COUNT] = {
+    "read_calls", "read_bytes", "views", "view_bytes", "seek_distance", "copy_calls", "copy_bytes",
+    "entries", "directory_runs", "clusters", "chains", "allocations", "arena_blocks",
+    "output_writes", "output_bytes", "async_reads", "async_bytes", "prefetch_hits",
+    "blocks_decoded", "block_hits"
+};
+
+static const char* const phaseNames[PHASE_COUNT] = {
+    "bootsector", "fat", "extents", "index", "root", "traversal", "command", "output"
+};
+
+#ifdef WTF_STATS
+
+unsigned long long counters[COUNTER_COUNT];
+unsigned long long phaseTimes[PHASE_COUNT];
+
+/**
+ * @brief End of the previous access
+ */
+static unsigned long long lastEnd;
+
+unsigned long long countersClock(void) {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (unsigned long long)now.tv_sec * 1000000000ull + now.tv_nsec;
+}
+
+void countersSeek(unsigned long long offset, unsigned long long length) {
+    unsigned long long previous = __atomic_exchange_n(&lastEnd, offset + length, __ATOMIC_RELAXED);
+    COUNT(COUNTER_SEEK_DISTANCE, offset > previous ? offset - previous : previous - offset);
+}
+
+void countersWrite(Output* out, int format) {
+    char line[96];
+    unsigned int i;
+    if(format == COUNTERS_JSON) {
+        outputString(out, "{\"phases_ns\":{");
+        for(i = 0; i < PHASE_COUNT; i++) {
+            snprintf(line, sizeof(line), "%s\"%s\":%llu", i ? "," : "", phaseNames[i], phaseTimes[i]);
+            outputString(out, line);
+        }
+        outputString(out, "},\"counters\":{");
+        for(i = 0; i < COUNTER_COUNT; i++) {
+            snprintf(line, sizeof(line), "%s\"%s\":%llu", i ? "," : "", counterNames[i], counters[i]);
+            outputString(out, line);
+        }
+        outputString(out, "}}\n");
+        return;
+    }
+
+    outputString(out, "Phase                  ms\n");
+    for(i = 0; i < PHASE_COUNT; i++) {
+        snprintf(line, sizeof(line), "%-15s %10.3f\n", phaseNames[i], phaseTimes[i] / 1e6);
+        outputString(out, line);
+    }
+    outputString(out, "Counter                        value\n");
+    for(i = 0; i < COUNTER_COUNT; i++) {
+        snprintf(line, sizeof(line), "%-15s %20llu\n", counterNames[i], counters[i]);
+        outputString(out, line);
+    }
+}
+
+#else
+
+void countersWrite(Output* out, int format) {
+    (void)counterNames;
+    (void)phaseNames;
+    if(format == COUNTERS_JSON) {
+        outputString(out, "{}\n");
+    }else{
+        outputString(out, "No figures, built without -DWTF_STATS\n");
+    }
+}
+
+#endif
@@ -0,0 +1,86 @@
+/*
+ * counters.h
+ *
+ * Opt-in instrumentation of a run: I/O, decoding and allocation counters
+ * and a timer per phase. Built with -DWTF_STATS the macros update process
+ * wide counters (relaxed atomics, the walk may run on several threads);
+ * without it they compile to nothing.
+ */
+
+#ifndef __COUNTERS_H
+#define __COUNTERS_H
+
+#include "format.h"
+
+#define COUNTER_READ_CALLS      0   // pread (or lseek + read) system calls
+#define COUNTER_READ_BYTES      1
+#define COUNTER_VIEWS           2   // ranges used in place from the mapping
+#define COUNTER_VIEW_BYTES      3
+#define COUNTER_SEEK_DISTANCE   4   // bytes between the end of one access and the start of the next
+#define COUNTER_COPY_CALLS      5   // copy_file_range, sendfile or write system calls of the extraction
+#define COUNTER_COPY_BYTES      6
+#define COUNTER_ENTRIES         7   // directory entries decoded
+#define COUNTER_DIRECTORY_RUNS  8   // runs of directory clusters listed
+#define COUNTER_CLUSTERS        9   // FAT hops while following chains
+#define COUNTER_CHAINS          10  // chains looked up in the extent index
+#define COUNTER_ALLOCATIONS     11  // arena allocations
+#define COUNTER_ARENA_BLOCKS    12  // blocks the arenas got from malloc
+#define COUNTER_OUTPUT_WRITES   13  // buffers written to the output stream
+#define COUNTER_OUTPUT_BYTES    14
+#define COUNTER_ASYNC_READS     15  // reads submitted to the asynchronous queue
+#define COUNTER_ASYNC_BYTES     16
+#define COUNTER_PREFETCH_HITS   17  // directory runs and carved chunks that had been read ahead
+#define COUNTER_BLOCKS_DECODED  18  // blocks of a compressed image decompressed
+#define COUNTER_BLOCK_HITS      19  // reads of a compressed image served from the block cache
+#define COUNTER_COUNT           20
+
+#define PHASE_BOOTSECTOR    0
+#define PHASE_FAT           1   // decoding the FAT, or opening a snapshot
+#define PHASE_EXTENTS       2   // building the extent index
+#define PHASE_INDEX         3   // building the path index and writing the snapshot
+#define PHASE_ROOT          4   // listing the root directory
+#define PHASE_TRAVERSAL     5   // listing everything below the root
+#define PHASE_COMMAND       6   // extract, check, stat, ...
+#define PHASE_OUTPUT        7   // writing full buffers, part of the phases above
+#define PHASE_COUNT         8
+
+#define COUNTERS_TABLE  0
+#define COUNTERS_JSON   1
+
+#ifdef WTF_STATS
+
+extern unsigned long long counters[COUNTER_COUNT];
+extern unsigned long long phaseTimes[PHASE_COUNT];
+
+/**
+ * @return monotonic time in nanoseconds
+ */
+unsigned long long countersClock(void);
+
+/**
+ * @brief Adds the distance of an access at offset from the end of the previous one
+ */
+void countersSeek(unsigned long long offset, unsigned long long length);
+
+#define COUNT(counter, amount)  __atomic_fetch_add(&counters[counter], (amount), __ATOMIC_RELAXED)
+#define PHASE_START()           countersClock()
+#define PHASE_END(phase, start) __atomic_fetch_add(&phaseTimes[phase], countersClock() - (start), __ATOMIC_RELAXED)
+#define COUNT_SEEK(offset, length) countersSeek((offset), (length))
+
+#else
+
+#define COUNT(counter, amount)      ((void)0)
+#define PHASE_START()               0ull
+#define PHASE_END(phase, start)     ((void)(start))
+#define COUNT_SEEK(offset, length)  ((void)0)
+
+#endif
+
+/**
+ * @brief Writes the phase times and counters as a table or as one JSON object,
+ * only a note if the counters were compiled out
+ * @param format COUNTERS_TABLE or COUNTERS_JSON
+ */
+void countersWrite(Output* out, int format);
+
+#endif
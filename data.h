@@ -45,13 +45,11 @@
 #define CLUSTER_BAD(b)          ((1<<(b))-9)    //0xFF7
 #define CLUSTER_LAST_MIN(b)     ((1<<(b))-8)    //0xFF8
 #define CLUSTER_LAST_MAX(b)     ((1<<(b))-1)    //0xFFF
-#define CLUSTER_LAST_MIN        0xFF8
-#define CLUSTER_LAST_MAX        0xFFF
 
 
 #define VFAT_END 0x0000
-#define VFAT_SEQUENCE_END(v)  (v)>>6  //check the 6th bit
-#define VFAT_SEQUENCE_NUMBER(v) (v)&0x1F //mask all bits above 5th
+#define VFAT_SEQUENCE_END(v)  (((v)&0x40)!=0)  //check the 6th bit
+#define VFAT_SEQUENCE_NUMBER(v) ((v)&0x1F) //mask all bits above 5th
 
 #define IS_DIR(attr)		  (((attr)&DIRENTRY_ATTR_DIR)==DIRENTRY_ATTR_DIR)
 #define IS_VFAT(attr)		  (((attr)&DIRENTRY_ATTR_VFAT)==DIRENTRY_ATTR_VFAT)	
@@ -90,19 +88,53 @@ typedef struct _BOOTSEC_T{
     unsigned short numberofheads; //1a
     unsigned int hiddensectors; //1c
     unsigned int totalsectors; // 20
-    struct _EBPB{
-        unsigned char drivenumber; //24
-        unsigned char reserved; //25
-        unsigned char signature; // 26
-        unsigned int serialnumber; // 27
-        unsigned char volumelabel[11]; // 2b
-        unsigned char fattype[8] ; //36 
-        unsigned char bootcode[448]; //3e
-        unsigned short endofsector; // 1fe  0x55 0xaa       
-    } EBPB;
+    union {
+        struct _EBPB{   // FAT12/16
+            unsigned char drivenumber; //24
+            unsigned char reserved; //25
+            unsigned char signature; // 26
+            unsigned int serialnumber; // 27
+            unsigned char volumelabel[11]; // 2b
+            unsigned char fattype[8] ; //36 
+            unsigned char bootcode[448]; //3e
+            unsigned short endofsector; // 1fe  0x55 0xaa       
+        } EBPB;
+        struct _EBPB32{ // FAT32
+            unsigned int FATsectors; //24  replaces BPB.FATsectors
+            unsigned short flags; //28  active FAT / mirroring
+            unsigned short version; //2a
+            unsigned int rootcluster; //2c  first cluster of the root directory
+            unsigned short fsinfosector; //30
+            unsigned short backupbootsector; //32
+            unsigned char reserved[12]; //34
+            unsigned char drivenumber; //40
+            unsigned char reserved1; //41
+            unsigned char signature; // 42
+            unsigned int serialnumber; // 43
+            unsigned char volumelabel[11]; // 47
+            unsigned char fattype[8]; //52
+            unsigned char bootcode[420]; //5a
+            unsigned short endofsector; // 1fe  0x55 0xaa
+        } EBPB32;
+    };
 } BOOTSECTOR;  //512 Byte
 
 
+#define FSINFO_LEADSIGNATURE   0x41615252
+#define FSINFO_STRUCTSIGNATURE 0x61417272
+#define FSINFO_UNKNOWN         0xFFFFFFFF
+
+typedef struct _FSINFO_T{ // FAT32 only
+    unsigned int leadsignature; //0  0x41615252
+    unsigned char reserved[480]; //4
+    unsigned int structsignature; //1e4  0x61417272
+    unsigned int freecount; //1e8  last known free cluster count, 0xFFFFFFFF if unknown
+    unsigned int nextfree; //1ec  hint where to look for free clusters
+    unsigned char reserved2[12]; //1f0
+    unsigned int trailsignature; //1fc  0xAA550000
+} FSINFO; //512 Byte
+
+
 typedef struct _DIRENTRY_T{
     unsigned char       name[8]; //0x0
     unsigned char		ext[3];  //0x8
@@ -120,15 +152,16 @@ typedef struct _DIRENTRY_T{
 } DIRENTRY; //32 Byte
 
 
+// name parts are UCS-2 (2 bytes each), not wchar_t
 typedef struct _DIRENTRY_V{
 	unsigned char		sequence_number; //0x0
-	wchar_t				name_0[5]; //0x1
+	unsigned short		name_0[5]; //0x1
 	unsigned char		attr; //allways 0xF  0xb
 	unsigned char		reserved; //0x0   0xc
 	unsigned char		checksum; //0xd
-	wchar_t				name_1[6]; // 0xe
+	unsigned short		name_1[6]; // 0xe
 	unsigned short		firstcluster; //0x1a allways 0
-	wchar_t				name_2[2]; //0x1c
+	unsigned short		name_2[2]; //0x1c
 } DIRENTRY_V; //32 Bytes
 #pragma pack()
 
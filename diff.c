@@ -0,0 +1,860 @@
+#include <errno.h>
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+
+#include "arena.h"
+#include "diff.h"
+#include "hash.h"
+#include "path.h"
+
+#define DIFF_FAT_BLOCK 1024 // FAT entries compared with one memcmp
+
+/**
+ * @brief An entry of one of the images
+ */
+typedef struct DiffEntry_t {
+    PathNode* parent;           // directory holding it
+    const char* name;           // in the arena
+    DIRENTRY directoryEntry;
+    unsigned int cluster;       // first cluster
+    int side;                   // 0 for the first image, 1 for the second
+    int done;                   // matched, or a directory whose content was listed
+    unsigned long long hash;    // of the content, once hashed
+} DiffEntry;
+
+typedef struct DiffList_t {
+    DiffEntry* items;
+    unsigned int count;
+    unsigned int capacity;
+} DiffList;
+
+typedef struct DiffRecord_t {
+    int kind;
+    DiffEntry entries[2];       // in the first and the second image, as far as there are any
+    char* path;
+    char* oldPath;
+} DiffRecord;
+
+typedef struct DiffPair_t {
+    PathNode* nodes[2];         // the same directory in both images
+} DiffPair;
+
+typedef struct DiffWalk_t {
+    Volume* volumes[2];
+    unsigned char* changed;     // bitset of clusters whose FAT entries differ, 0 if the layouts differ
+    unsigned char* visited[2];  // bitsets of the directory clusters queued, per image
+    Arena arena;
+    VolumeDir dir;
+    ExtentList scratch;
+    char* buffers[2];           // DIFF_BUFFER bytes each, for unmapped images
+    DiffPair* pairs;
+    unsigned int pairCount;
+    unsigned int pairCapacity;
+    DiffList listed[2];         // entries of the directories being compared
+    DiffList gone;              // entries only in the first image
+    DiffList come;              // entries only in the second image
+    DiffList suspects;          // files of the same size in both whose entry or chain differs, in pairs
+    DiffRecord* records;
+    unsigned int recordCount;
+    unsigned int recordCapacity;
+    DiffStats stats;
+} DiffWalk;
+
+/**
+ * @brief Files to be hashed, taken by the workers one at a time
+ */
+typedef struct DiffHasher_t {
+    DiffWalk* walk;
+    DiffEntry** jobs;
+    unsigned int count;
+    unsigned int next;
+    int error;                  // errno of the first file that could not be read
+} DiffHasher;
+
+const char* diffKindName(int kind) {
+    switch(kind) {
+        case DIFF_ADDED:    return "added";
+        case DIFF_REMOVED:  return "removed";
+        case DIFF_MODIFIED: return "modified";
+        default:            return "moved";
+    }
+}
+
+static DiffEntry* diffListAdd(DiffList* list) {
+    if(list->count == list->capacity) {
+        unsigned int capacity = list->capacity ? list->capacity * 2 : 64;
+        DiffEntry* items = (DiffEntry*)realloc(list->items, sizeof(DiffEntry) * capacity);
+        if(!items) {
+            return 0;
+        }
+        list->items = items;
+        list->capacity = capacity;
+    }
+    DiffEntry* entry = &list->items[list->count++];
+    memset(entry, 0, sizeof(DiffEntry));
+    return entry;
+}
+
+static inline int diffBit(const unsigned char* bits, unsigned int cluster) {
+    return (bits[cluster / 8] >> (cluster % 8)) & 1;
+}
+
+/**
+ * @brief Marks the clusters whose FAT entries differ, if both volumes have the same layout
+ * @return 0 on success, -1 if out of memory
+ */
+static int diffFats(DiffWalk* walk) {
+    const FatGeometry* first = &walk->volumes[0]->geometry;
+    const FatGeometry* second = &walk->volumes[1]->geometry;
+    const FatTable* fats[2] = {&walk->volumes[0]->fat, &walk->volumes[1]->fat};
+    if(first->fatType != second->fatType || first->clusterSize != second->clusterSize || first->clusterCount != second->clusterCount ||
+       first->dataOffset != second->dataOffset || first->rootOffset != second->rootOffset || first->rootSize != second->rootSize ||
+       first->rootCluster != second->rootCluster || fats[0]->count != fats[1]->count) {
+        return 0;
+    }
+    unsigned int count = fats[0]->count;
+    walk->changed = (unsigned char*)calloc(count / 8 + 1, 1);
+    if(!walk->changed) {
+        return -1;
+    }
+
+    // blocks that are the same as a whole are passed over; the reserved top bits of FAT32 don't count
+    unsigned int block;
+    for(block = 0; block < count; block += DIFF_FAT_BLOCK) {
+        unsigned int length = count - block < DIFF_FAT_BLOCK ? count - block : DIFF_FAT_BLOCK;
+        if(memcmp(&fats[0]->next[block], &fats[1]->next[block], sizeof(unsigned int) * length) == 0) {
+            continue;
+        }
+        unsigned int cluster;
+        for(cluster = block; cluster < block + length; cluster++) {
+            if(fatEntry(fats[0], cluster) != fatEntry(fats[1], cluster)) {
+                walk->changed[cluster / 8] |= 1 << (cluster % 8);
+                walk->stats.fatDifferences++;
+            }
+        }
+    }
+    return 0;
+}
+
+/**
+ * @return 1 if a chain of the first image is the same in the second one: none of its FAT entries differ
+ * @param firstCluster 0 for the root directory
+ */
+static int diffChainSame(DiffWalk* walk, unsigned int firstCluster) {
+    if(!walk->changed) {
+        return 0;
+    }
+    if(firstCluster < 2 && (firstCluster != 0 || walk->volumes[0]->geometry.fatType != 32)) {
+        return 1;
+    }
+    const Extent* runs;
+    unsigned int runCount = volumeChain(walk->volumes[0], firstCluster, &runs, &walk->scratch);
+    if(runCount == 0) {
+        return 0;
+    }
+    unsigned int run;
+    for(run = 0; run < runCount; run++) {
+        unsigned int cluster;
+        for(cluster = runs[run].start; cluster < runs[run].start + runs[run].length; cluster++) {
+            if(diffBit(walk->changed, cluster)) {
+                return 0;
+            }
+        }
+    }
+    return 1;
+}
+
+/**
+ * @return 1 if a range has the same bytes in both images
+ */
+static int diffRangeSame(DiffWalk* walk, unsigned long long offset, unsigned long long length) {
+    while(length > 0) {
+        size_t chunk = length < DIFF_BUFFER ? (size_t)length : DIFF_BUFFER;
+        const void* first = imageView(&walk->volumes[0]->image, offset, chunk, walk->buffers[0]);
+        const void* second = imageView(&walk->volumes[1]->image, offset, chunk, walk->buffers[1]);
+        if(!first || !second || memcmp(first, second, chunk) != 0) {
+            return 0;
+        }
+        offset += chunk;
+        length -= chunk;
+    }
+    return 1;
+}
+
+/**
+ * @return 1 if a directory has the same chain and the same entries in both images
+ * @param firstCluster 0 for the root directory
+ */
+static int diffDirectorySame(DiffWalk* walk, unsigned int firstCluster) {
+    Volume* volume = walk->volumes[0];
+    if(!diffChainSame(walk, firstCluster)) {
+        return 0;
+    }
+    if(firstCluster == 0 && volume->geometry.fatType != 32) {
+        return diffRangeSame(walk, volume->geometry.rootOffset, volume->geometry.rootSize);
+    }
+    const Extent* runs;
+    unsigned int runCount = volumeChain(volume, firstCluster, &runs, &walk->scratch);
+    unsigned int run;
+    for(run = 0; run < runCount; run++) {
+        if(!diffRangeSame(walk, volumeClusterOffset(volume, runs[run].start), (unsigned long long)runs[run].length * volume->geometry.clusterSize)) {
+            return 0;
+        }
+    }
+    return 1;
+}
+
+/**
+ * @return 1 if a directory cluster of an image has not been queued yet, and marks it
+ */
+static int diffVisit(DiffWalk* walk, int side, unsigned int cluster) {
+    if(cluster >= walk->volumes[side]->fat.count || diffBit(walk->visited[side], cluster)) {
+        return 0;
+    }
+    walk->visited[side][cluster / 8] |= 1 << (cluster % 8);
+    return 1;
+}
+
+/**
+ * @brief Queues a directory of both images to be compared
+ * @return 0 on success, -1 if out of memory
+ */
+static int diffPush(DiffWalk* walk, PathNode* first, PathNode* second) {
+    if(!first || !second) {
+        return -1;
+    }
+    if(!diffVisit(walk, 0, first->firstCluster) || !diffVisit(walk, 1, second->firstCluster)) {
+        return 0;
+    }
+    if(walk->pairCount == walk->pairCapacity) {
+        unsigned int capacity = walk->pairCapacity ? walk->pairCapacity * 2 : 64;
+        DiffPair* pairs = (DiffPair*)realloc(walk->pairs, sizeof(DiffPair) * capacity);
+        if(!pairs) {
+            return -1;
+        }
+        walk->pairs = pairs;
+        walk->pairCapacity = capacity;
+    }
+    walk->pairs[walk->pairCount].nodes[0] = first;
+    walk->pairs[walk->pairCount].nodes[1] = second;
+    walk->pairCount++;
+    return 0;
+}
+
+static PathNode* diffNode(DiffWalk* walk, const DiffEntry* entry) {
+    return pathNodeCreate(&walk->arena, entry->parent, entry->name, entry->cluster, 0);
+}
+
+/**
+ * @brief Records a change, its paths are formatted at the end
+ * @param first entry in the first image, 0 if added
+ * @param second entry in the second image, 0 if removed
+ * @return 0 on success, -1 if out of memory
+ */
+static int diffRecord(DiffWalk* walk, int kind, const DiffEntry* first, const DiffEntry* second) {
+    if(walk->recordCount == walk->recordCapacity) {
+        unsigned int capacity = walk->recordCapacity ? walk->recordCapacity * 2 : 64;
+        DiffRecord* records = (DiffRecord*)realloc(walk->records, sizeof(DiffRecord) * capacity);
+        if(!records) {
+            return -1;
+        }
+        walk->records = records;
+        walk->recordCapacity = capacity;
+    }
+    DiffRecord* record = &walk->records[walk->recordCount++];
+    memset(record, 0, sizeof(DiffRecord));
+    record->kind = kind;
+    if(first) {
+        record->entries[0] = *first;
+    }
+    if(second) {
+        record->entries[1] = *second;
+    }
+    return 0;
+}
+
+/**
+ * @brief Appends the entries of a directory of one image to a list, '.', '..', labels and deleted entries left out
+ * @return 0 on success, -1 if out of memory; a directory that can't be read ends early
+ */
+static int diffList(DiffWalk* walk, int side, PathNode* node, DiffList* list) {
+    VolumeDir* dir = &walk->dir;
+    dir->skip = VOLUME_SKIP_DELETED | VOLUME_SKIP_DOTS | VOLUME_SKIP_LABELS;
+    volumeDirOpen(walk->volumes[side], dir, node->firstCluster);
+    const DIRENTRY* directoryEntry;
+    while((directoryEntry = volumeDirRead(dir))) {
+        DiffEntry* entry = diffListAdd(list);
+        char* name = (char*)arenaAlloc(&walk->arena, dir->nameLength + 1);
+        if(!entry || !name) {
+            return -1;
+        }
+        memcpy(name, dir->name, dir->nameLength + 1);
+        entry->parent = node;
+        entry->name = name;
+        entry->directoryEntry = *directoryEntry;
+        entry->cluster = fatFirstCluster(directoryEntry, walk->volumes[side]->geometry.fatType);
+        entry->side = side;
+    }
+    return 0;
+}
+
+static int diffByName(const void* a, const void* b) {
+    return strcasecmp(((const DiffEntry*)a)->name, ((const DiffEntry*)b)->name);
+}
+
+/**
+ * @brief Sorts out a file that is in both images: unchanged if its entry and chain are, modified if its size
+ * differs, to be hashed otherwise
+ * @return 0 on success, -1 if out of memory
+ */
+static int diffFiles(DiffWalk* walk, const DiffEntry* first, const DiffEntry* second) {
+    const DIRENTRY* before = &first->directoryEntry;
+    const DIRENTRY* after = &second->directoryEntry;
+    unsigned int firstCluster = first->cluster;
+    if(before->size != after->size) {
+        return diffRecord(walk, DIFF_MODIFIED, first, second);
+    }
+    if(firstCluster == second->cluster && before->changedate == after->changedate && before->changetime == after->changetime &&
+       diffChainSame(walk, firstCluster)) {
+        walk->stats.unchanged++;
+        return 0;
+    }
+    DiffEntry* suspect = diffListAdd(&walk->suspects);
+    if(!suspect) {
+        return -1;
+    }
+    *suspect = *first;
+    suspect = diffListAdd(&walk->suspects);
+    if(!suspect) {
+        return -1;
+    }
+    *suspect = *second;
+    return 0;
+}
+
+/**
+ * @brief Compares a directory of both images. A directory with the same chain and bytes in both
+ * is read from the first image only, its entries are the same.
+ * @return 0 on success, -1 if out of memory
+ */
+static int diffDirectories(DiffWalk* walk, const DiffPair* pair) {
+    walk->stats.directories++;
+    DiffList* lists = walk->listed;
+    lists[0].count = 0;
+    lists[1].count = 0;
+
+    if(pair->nodes[0]->firstCluster == pair->nodes[1]->firstCluster && diffDirectorySame(walk, pair->nodes[0]->firstCluster)) {
+        if(diffList(walk, 0, pair->nodes[0], &lists[0]) != 0) {
+            return -1;
+        }
+        unsigned int i;
+        for(i = 0; i < lists[0].count; i++) {
+            DiffEntry first = lists[0].items[i];
+            DiffEntry second = first;
+            second.side = 1;
+            second.parent = pair->nodes[1];
+            int ret;
+            if(IS_DIR(first.directoryEntry.attr)) {
+                ret = diffPush(walk, diffNode(walk, &first), diffNode(walk, &second));
+            }else{
+                ret = diffFiles(walk, &first, &second);
+            }
+            if(ret != 0) {
+                return -1;
+            }
+        }
+        return 0;
+    }
+
+    if(diffList(walk, 0, pair->nodes[0], &lists[0]) != 0 || diffList(walk, 1, pair->nodes[1], &lists[1]) != 0) {
+        return -1;
+    }
+    int side;
+    for(side = 0; side < 2; side++) {
+        if(lists[side].count > 1) {
+            qsort(lists[side].items, lists[side].count, sizeof(DiffEntry), diffByName);
+        }
+    }
+
+    unsigned int i = 0, j = 0;
+    while(i < lists[0].count || j < lists[1].count) {
+        int order = i == lists[0].count ? 1 : j == lists[1].count ? -1 : diffByName(&lists[0].items[i], &lists[1].items[j]);
+        DiffEntry* entry;
+        if(order < 0) {
+            entry = diffListAdd(&walk->gone);
+            if(!entry) {
+                return -1;
+            }
+            *entry = lists[0].items[i++];
+            continue;
+        }
+        if(order > 0) {
+            entry = diffListAdd(&walk->come);
+            if(!entry) {
+                return -1;
+            }
+            *entry = lists[1].items[j++];
+            continue;
+        }
+
+        const DiffEntry* first = &lists[0].items[i++];
+        const DiffEntry* second = &lists[1].items[j++];
+        int directories = IS_DIR(first->directoryEntry.attr) + IS_DIR(second->directoryEntry.attr);
+        int ret;
+        if(directories == 2) {
+            ret = diffPush(walk, diffNode(walk, first), diffNode(walk, second));
+        }else if(directories == 0) {
+            ret = diffFiles(walk, first, second);
+        }else{
+            // a file became a directory or the other way round
+            DiffEntry* gone = diffListAdd(&walk->gone);
+            DiffEntry* come = gone ? diffListAdd(&walk->come) : 0;
+            if(come) {
+                *gone = *first;
+                *come = *second;
+            }
+            ret = come ? 0 : -1;
+        }
+        if(ret != 0) {
+            return -1;
+        }
+    }
+    return 0;
+}
+
+static int diffByCluster(const void* a, const void* b) {
+    unsigned int first = (*(const DiffEntry* const*)a)->cluster;
+    unsigned int second = (*(const DiffEntry* const*)b)->cluster;
+    return first < second ? -1 : first > second;
+}
+
+/**
+ * @brief Collects the entries of a list that are not done yet, directories or files
+ * @return array of pointers into the list (count in *count), 0 if out of memory
+ */
+static DiffEntry** diffOpen(DiffList* list, int directories, unsigned int* count) {
+    DiffEntry** open = (DiffEntry**)malloc(sizeof(DiffEntry*) * (list->count + 1));
+    if(!open) {
+        return 0;
+    }
+    *count = 0;
+    unsigned int i;
+    for(i = 0; i < list->count; i++) {
+        if(!list->items[i].done && IS_DIR(list->items[i].directoryEntry.attr) == directories) {
+            open[(*count)++] = &list->items[i];
+        }
+    }
+    return open;
+}
+
+/**
+ * @brief Finds an open entry that starts at a cluster
+ * @param open sorted by first cluster
+ * @return the first one that is not done, 0 if there is none
+ */
+static DiffEntry* diffFindCluster(DiffEntry** open, unsigned int count, unsigned int cluster) {
+    unsigned int low = 0, high = count;
+    while(low < high) {
+        unsigned int middle = low + (high - low) / 2;
+        if(open[middle]->cluster < cluster) {
+            low = middle + 1;
+        }else{
+            high = middle;
+        }
+    }
+    for(; low < count && open[low]->cluster == cluster; low++) {
+        if(!open[low]->done) {
+            return open[low];
+        }
+    }
+    return 0;
+}
+
+/**
+ * @brief Pairs directories that vanished from one path and appeared at another with the same first cluster;
+ * they are moved and their content is compared like that of any other directory
+ * @return number of directories moved, -1 if out of memory
+ */
+static int diffMoveDirectories(DiffWalk* walk) {
+    if(!walk->changed) {
+        return 0;
+    }
+    unsigned int goneCount, comeCount;
+    DiffEntry** gone = diffOpen(&walk->gone, 1, &goneCount);
+    DiffEntry** come = gone ? diffOpen(&walk->come, 1, &comeCount) : 0;
+    if(!come) {
+        free(gone);
+        return -1;
+    }
+    qsort(come, comeCount, sizeof(DiffEntry*), diffByCluster);
+    int moved = 0;
+    unsigned int i;
+    for(i = 0; i < goneCount && moved >= 0; i++) {
+        unsigned int cluster = gone[i]->cluster;
+        DiffEntry* match = cluster >= 2 ? diffFindCluster(come, comeCount, cluster) : 0;
+        if(!match) {
+            continue;
+        }
+        gone[i]->done = 1;
+        match->done = 1;
+        if(diffRecord(walk, DIFF_MOVED, gone[i], match) != 0 || diffPush(walk, diffNode(walk, gone[i]), diffNode(walk, match)) != 0) {
+            moved = -1;
+        }else{
+            moved++;
+        }
+    }
+    free(gone);
+    free(come);
+    return moved;
+}
+
+/**
+ * @brief Records the directories of a list that are neither moved nor listed yet, and adds their entries to the list
+ * @return number of directories listed, -1 if out of memory
+ */
+static int diffExpand(DiffWalk* walk, DiffList* list, int side, int kind) {
+    int expanded = 0;
+    unsigned int i;
+    for(i = 0; i < list->count; i++) {
+        if(list->items[i].done || !IS_DIR(list->items[i].directoryEntry.attr)) {
+            continue;
+        }
+        list->items[i].done = 1;
+        DiffEntry entry = list->items[i];
+        if(diffRecord(walk, kind, side == 0 ? &entry : 0, side == 1 ? &entry : 0) != 0) {
+            return -1;
+        }
+        unsigned int cluster = entry.cluster;
+        if(cluster >= 2 && diffVisit(walk, side, cluster)) {
+            PathNode* node = diffNode(walk, &entry);
+            if(!node || diffList(walk, side, node, list) != 0) {
+                return -1;
+            }
+        }
+        expanded++;
+    }
+    return expanded;
+}
+
+/**
+ * @brief Worker thread: hashes the next file until all are done
+ */
+static void* diffHashWorker(void* arg) {
+    DiffHasher* hasher = (DiffHasher*)arg;
+    DiffWalk* walk = hasher->walk;
+    char* buffer = (char*)malloc(DIFF_BUFFER);
+    ExtentList scratch = {0, 0, 0};
+    if(!buffer) {
+        __atomic_store_n(&hasher->error, ENOMEM, __ATOMIC_RELAXED);
+        return 0;
+    }
+    for(;;) {
+        unsigned int i = __atomic_fetch_add(&hasher->next, 1, __ATOMIC_RELAXED);
+        if(i >= hasher->count) {
+            break;
+        }
+        DiffEntry* entry = hasher->jobs[i];
+        Volume* volume = walk->volumes[entry->side];
+        const Extent* runs;
+        unsigned int runCount = volumeChain(volume, entry->cluster, &runs, &scratch);
+        unsigned long long remaining = entry->directoryEntry.size;
+        Xxh64 state;
+        xxh64Init(&state, 0);
+
+        // a chain that is too short for the size ends the content early
+        unsigned int run;
+        for(run = 0; run < runCount && remaining > 0; run++) {
+            unsigned long long offset = volumeClusterOffset(volume, runs[run].start);
+            unsigned long long length = (unsigned long long)runs[run].length * volume->geometry.clusterSize;
+            if(length > remaining) {
+                length = remaining;
+            }
+            remaining -= length;
+            while(length > 0) {
+                size_t chunk = length < DIFF_BUFFER ? (size_t)length : DIFF_BUFFER;
+                const void* data = imageView(&volume->image, offset, chunk, buffer);
+                if(!data) {
+                    __atomic_store_n(&hasher->error, errno ? errno : EIO, __ATOMIC_RELAXED);
+                    break;
+                }
+                xxh64Update(&state, data, chunk);
+                offset += chunk;
+                length -= chunk;
+            }
+        }
+        entry->hash = xxh64Digest(&state);
+        __atomic_add_fetch(&walk->stats.hashedBytes, entry->directoryEntry.size - remaining, __ATOMIC_RELAXED);
+    }
+    extentListFree(&scratch);
+    free(buffer);
+    return 0;
+}
+
+/**
+ * @brief Hashes the content of files, by several threads
+ * @return 0 on success, -1 otherwise (errno is set)
+ */
+static int diffHash(DiffWalk* walk, DiffEntry** jobs, unsigned int count, unsigned int threads) {
+    DiffHasher hasher = {walk, jobs, count, 0, 0};
+    walk->stats.hashed += count;
+    if(threads > count) {
+        threads = count;
+    }
+    pthread_t workers[threads > 1 ? threads - 1 : 1];
+    unsigned int started = 0;
+    while(started + 1 < threads && pthread_create(&workers[started], 0, diffHashWorker, &hasher) == 0) {
+        started++;
+    }
+    diffHashWorker(&hasher);
+    while(started > 0) {
+        pthread_join(workers[--started], 0);
+    }
+    if(hasher.error) {
+        errno = hasher.error;
+        return -1;
+    }
+    return 0;
+}
+
+static int diffBySizeAndHash(const void* a, const void* b) {
+    const DiffEntry* first = *(const DiffEntry* const*)a;
+    const DiffEntry* second = *(const DiffEntry* const*)b;
+    if(first->directoryEntry.size != second->directoryEntry.size) {
+        return first->directoryEntry.size < second->directoryEntry.size ? -1 : 1;
+    }
+    return first->hash < second->hash ? -1 : first->hash > second->hash;
+}
+
+/**
+ * @brief Settles the files: pairs of the same size by their hashes, files that vanished from one path and
+ * appeared at another by their first cluster and chain, then by size and hash. The rest is removed or added.
+ * @return 0 on success, -1 otherwise (errno is set)
+ */
+static int diffSettle(DiffWalk* walk, unsigned int threads) {
+    unsigned int goneCount, comeCount;
+    DiffEntry** gone = diffOpen(&walk->gone, 0, &goneCount);
+    DiffEntry** come = gone ? diffOpen(&walk->come, 0, &comeCount) : 0;
+    DiffEntry** jobs = come ? (DiffEntry**)malloc(sizeof(DiffEntry*) * (walk->suspects.count + goneCount + comeCount + 1)) : 0;
+    int ret = jobs ? 0 : -1;
+    if(ret != 0) {
+        errno = ENOMEM;
+    }
+
+    // kept their first cluster and chain: renamed, nothing to read
+    unsigned int i, j;
+    if(ret == 0) {
+        qsort(come, comeCount, sizeof(DiffEntry*), diffByCluster);
+        for(i = 0; i < goneCount && ret == 0; i++) {
+            unsigned int cluster = gone[i]->cluster;
+            DiffEntry* match = cluster >= 2 ? diffFindCluster(come, comeCount, cluster) : 0;
+            if(match && match->directoryEntry.size == gone[i]->directoryEntry.size && diffChainSame(walk, cluster)) {
+                gone[i]->done = 1;
+                match->done = 1;
+                ret = diffRecord(walk, DIFF_MOVED, gone[i], match);
+            }
+        }
+    }
+
+    // what is left with a size both sides have is hashed, along with the suspects
+    unsigned int jobCount = 0;
+    if(ret == 0) {
+        for(i = 0; i < walk->suspects.count; i++) {
+            jobs[jobCount++] = &walk->suspects.items[i];
+        }
+        unsigned int sizes[2] = {0, 0};
+        DiffEntry** sides[2] = {gone, come};
+        unsigned int counts[2] = {goneCount, comeCount};
+        int side;
+        for(side = 0; side < 2; side++) {
+            for(i = 0; i < counts[side]; i++) {
+                if(!sides[side][i]->done) {
+                    sides[side][sizes[side]++] = sides[side][i];
+                }
+            }
+            counts[side] = sizes[side];
+            qsort(sides[side], counts[side], sizeof(DiffEntry*), diffBySizeAndHash);
+        }
+        goneCount = counts[0];
+        comeCount = counts[1];
+        i = 0;
+        j = 0;
+        while(i < goneCount && j < comeCount) {
+            unsigned int size = gone[i]->directoryEntry.size;
+            if(size != come[j]->directoryEntry.size) {
+                if(size < come[j]->directoryEntry.size) {
+                    i++;
+                }else{
+                    j++;
+                }
+                continue;
+            }
+            for(; i < goneCount && gone[i]->directoryEntry.size == size; i++) {
+                if(size > 0) {
+                    jobs[jobCount++] = gone[i];
+                }
+            }
+            for(; j < comeCount && come[j]->directoryEntry.size == size; j++) {
+                if(size > 0) {
+                    jobs[jobCount++] = come[j];
+                }
+            }
+        }
+        ret = diffHash(walk, jobs, jobCount, threads);
+    }
+
+    for(i = 0; i + 1 < walk->suspects.count && ret == 0; i += 2) {
+        if(walk->suspects.items[i].hash != walk->suspects.items[i + 1].hash) {
+            ret = diffRecord(walk, DIFF_MODIFIED, &walk->suspects.items[i], &walk->suspects.items[i + 1]);
+        }
+    }
+
+    // same size and hash: moved; empty files are never paired, nothing tells them apart
+    if(ret == 0) {
+        qsort(gone, goneCount, sizeof(DiffEntry*), diffBySizeAndHash);
+        qsort(come, comeCount, sizeof(DiffEntry*), diffBySizeAndHash);
+        i = 0;
+        j = 0;
+        while(i < goneCount && j < comeCount && ret == 0) {
+            int order = diffBySizeAndHash(&gone[i], &come[j]);
+            if(order == 0 && gone[i]->directoryEntry.size > 0) {
+                gone[i]->done = 1;
+                come[j]->done = 1;
+                ret = diffRecord(walk, DIFF_MOVED, gone[i++], come[j++]);
+            }else if(order <= 0) {
+                i++;
+            }else{
+                j++;
+            }
+        }
+    }
+    for(i = 0; i < goneCount && ret == 0; i++) {
+        if(!gone[i]->done) {
+            ret = diffRecord(walk, DIFF_REMOVED, gone[i], 0);
+        }
+    }
+    for(i = 0; i < comeCount && ret == 0; i++) {
+        if(!come[i]->done) {
+            ret = diffRecord(walk, DIFF_ADDED, 0, come[i]);
+        }
+    }
+    free(gone);
+    free(come);
+    free(jobs);
+    return ret;
+}
+
+/**
+ * @brief Formats the path of an entry into the arena
+ * @return the path, 0 if out of memory
+ */
+static char* diffPath(DiffWalk* walk, const DiffEntry* entry) {
+    PathNode* node = diffNode(walk, entry);
+    char* path = node ? (char*)arenaAlloc(&walk->arena, node->length + 1) : 0;
+    return path ? pathFormat(node, path) : 0;
+}
+
+static int diffByPath(const void* a, const void* b) {
+    const DiffRecord* first = (const DiffRecord*)a;
+    const DiffRecord* second = (const DiffRecord*)b;
+    int order = strcmp(first->path, second->path);
+    return order ? order : first->kind - second->kind;
+}
+
+int diffVolumes(Volume* first, Volume* second, unsigned int threads, void (*changed)(const DiffChange* change, void* arg), void* arg, DiffStats* stats) {
+    DiffWalk walk;
+    memset(&walk, 0, sizeof(walk));
+    walk.volumes[0] = first;
+    walk.volumes[1] = second;
+    walk.visited[0] = (unsigned char*)calloc(first->fat.count / 8 + 1, 1);
+    walk.visited[1] = (unsigned char*)calloc(second->fat.count / 8 + 1, 1);
+    walk.buffers[0] = (char*)malloc(DIFF_BUFFER);
+    walk.buffers[1] = (char*)malloc(DIFF_BUFFER);
+    int ret = walk.visited[0] && walk.visited[1] && walk.buffers[0] && walk.buffers[1] ? diffFats(&walk) : -1;
+    if(ret == 0) {
+        ret = diffPush(&walk, pathNodeCreate(&walk.arena, 0, "", first->geometry.rootCluster, 0), pathNodeCreate(&walk.arena, 0, "", second->geometry.rootCluster, 0));
+    }
+
+    // the directories of both trees, then those that moved, then those only one image has
+    while(ret == 0) {
+        while(ret == 0 && walk.pairCount > 0) {
+            DiffPair pair = walk.pairs[--walk.pairCount];
+            ret = diffDirectories(&walk, &pair);
+        }
+        int moved = ret == 0 ? diffMoveDirectories(&walk) : -1;
+        if(moved != 0) {
+            ret = moved < 0 ? -1 : 0;
+            continue;
+        }
+        int removed = diffExpand(&walk, &walk.gone, 0, DIFF_REMOVED);
+        int added = removed >= 0 ? diffExpand(&walk, &walk.come, 1, DIFF_ADDED) : -1;
+        if(removed < 0 || added < 0) {
+            ret = -1;
+        }
+        if(removed + added == 0) {
+            break;
+        }
+    }
+    if(ret != 0) {
+        errno = ENOMEM;
+    }
+    if(ret == 0) {
+        ret = diffSettle(&walk, threads > 0 ? threads : 1);
+    }
+
+    unsigned int i;
+    for(i = 0; i < walk.recordCount && ret == 0; i++) {
+        DiffRecord* record = &walk.records[i];
+        record->path = diffPath(&walk, &record->entries[record->kind == DIFF_REMOVED ? 0 : 1]);
+        record->oldPath = record->kind == DIFF_MOVED ? diffPath(&walk, &record->entries[0]) : 0;
+        if(!record->path || (record->kind == DIFF_MOVED && !record->oldPath)) {
+            errno = ENOMEM;
+            ret = -1;
+        }
+    }
+    if(ret == 0 && walk.recordCount > 1) {
+        qsort(walk.records, walk.recordCount, sizeof(DiffRecord), diffByPath);
+    }
+    if(ret == 0) {
+        for(i = 0; i < walk.recordCount; i++) {
+            const DiffRecord* record = &walk.records[i];
+            DiffChange change;
+            memset(&change, 0, sizeof(change));
+            change.kind = record->kind;
+            change.path = record->path;
+            change.pathLength = strlen(record->path);
+            change.oldPath = record->oldPath;
+            change.oldPathLength = record->oldPath ? strlen(record->oldPath) : 0;
+            if(record->kind != DIFF_ADDED) {
+                change.before = record->entries[0].directoryEntry;
+            }
+            if(record->kind != DIFF_REMOVED) {
+                change.after = record->entries[1].directoryEntry;
+            }
+            changed(&change, arg);
+        }
+    }
+    if(stats) {
+        *stats = walk.stats;
+    }
+
+    int error = errno;
+    volumeDirClose(&walk.dir);
+    extentListFree(&walk.scratch);
+    arenaFree(&walk.arena);
+    free(walk.changed);
+    free(walk.visited[0]);
+    free(walk.visited[1]);
+    free(walk.buffers[0]);
+    free(walk.buffers[1]);
+    free(walk.pairs);
+    free(walk.listed[0].items);
+    free(walk.listed[1].items);
+    free(walk.gone.items);
+    free(walk.come.items);
+    free(walk.suspects.items);
+    free(walk.records);
+    errno = error;
+    return ret;
+}
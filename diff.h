@@ -0,0 +1,62 @@
+/*
+ * diff.h
+ *
+ * Differences between two images of the same volume, e.g. successive
+ * snapshots of a device. Both trees are read directory by directory and the
+ * entries matched by name; file data is only read where the metadata can't
+ * tell. A file whose entry (size, modification time, first cluster) is the
+ * same in both images and whose chain has no FAT entry that differs between
+ * them is unchanged without reading it, so a subtree that was not touched
+ * costs its directories only. Files of the same size whose entry or chain
+ * differs are hashed (XXH64, by several threads) to see whether their
+ * content changed. Files that vanished from one path and appeared at
+ * another are moved if they kept their first cluster and chain, or have the
+ * same size and hash; directories are moved if they kept their first cluster.
+ * Content rewritten in place with the entry left as it was is not noticed.
+ */
+
+#ifndef __DIFF_H
+#define __DIFF_H
+
+#include "volume.h"
+
+#define DIFF_ADDED      0
+#define DIFF_REMOVED    1
+#define DIFF_MODIFIED   2
+#define DIFF_MOVED      3
+
+#define DIFF_BUFFER     (1u << 20)  // bytes hashed at once by a thread, unmapped images only
+
+typedef struct DiffChange_t {
+    int kind;                   // DIFF_*
+    const char* path;           // absolute path, in the first image for a removed entry
+    size_t pathLength;
+    const char* oldPath;        // moved: path in the first image, 0 otherwise
+    size_t oldPathLength;
+    DIRENTRY before;            // entry in the first image, zeroed if added
+    DIRENTRY after;             // entry in the second image, zeroed if removed
+} DiffChange;
+
+typedef struct DiffStats_t {
+    unsigned int fatDifferences;    // clusters whose FAT entries differ
+    unsigned int directories;       // pairs of directories compared
+    unsigned int unchanged;         // files found unchanged without reading them
+    unsigned int hashed;            // files hashed, of both images
+    unsigned long long hashedBytes;
+} DiffStats;
+
+/**
+ * @brief Compares two volumes, both loaded, and reports the changes sorted by path
+ * @param changed called for each change; the change is valid during the call
+ * @param threads hashing the files
+ * @param stats receives the figures of the comparison, 0 if not wanted
+ * @return 0 on success, -1 otherwise (errno is set: ENOMEM, or the error of a file that could not be read)
+ */
+int diffVolumes(Volume* first, Volume* second, unsigned int threads, void (*changed)(const DiffChange* change, void* arg), void* arg, DiffStats* stats);
+
+/**
+ * @return name of a DIFF_* kind
+ */
+const char* diffKindName(int kind);
+
+#endif
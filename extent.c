@@ -0,0 +1,192 @@
+#include <stdlib.h>
+#include <string.h>
+
+#include "counters.h"
+#include "extent.h"
+
+#define IS_DATA_CLUSTER(fat, c) ((c) >= 2 && (c) < (fat)->count)
+
+/**
+ * @brief Appends a cluster to the last run if it is contiguous, starts a new run otherwise
+ * @return 0 on success, -1 if out of memory
+ */
+static int extentAppend(ExtentList* list, unsigned int cluster, int newChain) {
+    if(!newChain && list->count > 0) {
+        Extent* last = &list->extents[list->count - 1];
+        if(last->start + last->length == cluster) {
+            last->length++;
+            return 0;
+        }
+    }
+
+    if(list->count == list->capacity) {
+        unsigned int capacity = list->capacity ? list->capacity * 2 : 64;
+        Extent* extents = (Extent*)realloc(list->extents, sizeof(Extent) * capacity);
+        if(!extents) {
+            return -1;
+        }
+        list->extents = extents;
+        list->capacity = capacity;
+    }
+    list->extents[list->count].start = cluster;
+    list->extents[list->count].length = 1;
+    list->count++;
+    return 0;
+}
+
+/**
+ * @brief Walks one chain and appends its runs
+ * @param stamp per cluster marker array, cleared clusters hold a value != mark
+ * @param mark identifies the current chain in stamp (cycle detection)
+ */
+static int extentWalk(const FatTable* fat, unsigned int cluster, ExtentList* list, unsigned int* stamp, unsigned int mark) {
+    unsigned int before = list->count;
+    int newChain = 1;
+
+    while(IS_DATA_CLUSTER(fat, cluster) && stamp[cluster] != mark) {
+        unsigned int next = fatEntry(fat, cluster);
+        if(next == CLUSTER_FREE || next == FAT_CLUSTER_BAD) {
+            break;
+        }
+        stamp[cluster] = mark;
+        if(extentAppend(list, cluster, newChain) != 0) {
+            return -1;
+        }
+        newChain = 0;
+        cluster = next;
+    }
+    return list->count - before;
+}
+
+int extentFollow(const FatTable* fat, unsigned int firstCluster, ExtentList* list) {
+    unsigned int hops = 0;
+    unsigned int before = list->count;
+    unsigned int cluster = firstCluster;
+    int newChain = 1;
+
+    // without a stamp array a cycle is caught by the hop limit
+    while(IS_DATA_CLUSTER(fat, cluster) && hops++ < fat->count) {
+        unsigned int next = fatEntry(fat, cluster);
+        if(next == CLUSTER_FREE || next == FAT_CLUSTER_BAD) {
+            break;
+        }
+        if(extentAppend(list, cluster, newChain) != 0) {
+            return -1;
+        }
+        newChain = 0;
+        cluster = next;
+    }
+    COUNT(COUNTER_CLUSTERS, hops);
+    return list->count - before;
+}
+
+int extentIndexBuild(ExtentIndex* index, const FatTable* fat) {
+    memset(index, 0, sizeof(ExtentIndex));
+
+    unsigned int count = fat->count;
+    unsigned int* stamp = (unsigned int*)calloc(count ? count : 1, sizeof(unsigned int));
+    unsigned char* hasPredecessor = (unsigned char*)calloc(count / 8 + 1, 1);
+    if(!stamp || !hasPredecessor) {
+        free(stamp);
+        free(hasPredecessor);
+        return -1;
+    }
+
+    // first pass: every cluster that is pointed to is not a chain head
+    unsigned int cluster;
+    unsigned int headCount = 0;
+    for(cluster = 2; cluster < count; cluster++) {
+        unsigned int next = fatEntry(fat, cluster);
+        if(IS_DATA_CLUSTER(fat, next)) {
+            hasPredecessor[next / 8] |= 1 << (next % 8);
+        }
+    }
+    for(cluster = 2; cluster < count; cluster++) {
+        unsigned int next = fatEntry(fat, cluster);
+        if(next != CLUSTER_FREE && next != FAT_CLUSTER_BAD && !(hasPredecessor[cluster / 8] & (1 << (cluster % 8)))) {
+            headCount++;
+        }
+    }
+
+    index->heads = (unsigned int*)malloc(sizeof(unsigned int) * (headCount + 1));
+    index->firstRun = (unsigned int*)malloc(sizeof(unsigned int) * (headCount + 1));
+    if(!index->heads || !index->firstRun) {
+        goto fail;
+    }
+
+    // second pass: walk every chain from its head, heads come out ascending
+    for(cluster = 2; cluster < count; cluster++) {
+        unsigned int next = fatEntry(fat, cluster);
+        if(next == CLUSTER_FREE || next == FAT_CLUSTER_BAD || (hasPredecessor[cluster / 8] & (1 << (cluster % 8)))) {
+            continue;
+        }
+        index->heads[index->headCount] = cluster;
+        index->firstRun[index->headCount] = index->runs.count;
+        index->headCount++;
+        if(extentWalk(fat, cluster, &index->runs, stamp, index->headCount) < 0) {
+            goto fail;
+        }
+    }
+    index->firstRun[index->headCount] = index->runs.count;
+
+    free(stamp);
+    free(hasPredecessor);
+    return 0;
+
+fail:
+    free(stamp);
+    free(hasPredecessor);
+    extentIndexFree(index);
+    return -1;
+}
+
+void extentIndexFree(ExtentIndex* index) {
+    if(index->borrowed) {
+        memset(index, 0, sizeof(ExtentIndex));
+        return;
+    }
+    extentListFree(&index->runs);
+    free(index->heads);
+    free(index->firstRun);
+    index->heads = 0;
+    index->firstRun = 0;
+    index->headCount = 0;
+}
+
+unsigned int extentChain(const ExtentIndex* index, const FatTable* fat, unsigned int firstCluster, const Extent** runs, ExtentList* scratch) {
+    COUNT(COUNTER_CHAINS, 1);
+
+    // binary search for the chain head
+    unsigned int low = 0;
+    unsigned int high = index->headCount;
+    while(low < high) {
+        unsigned int middle = low + (high - low) / 2;
+        if(index->heads[middle] < firstCluster) {
+            low = middle + 1;
+        }else{
+            high = middle;
+        }
+    }
+    if(low < index->headCount && index->heads[low] == firstCluster) {
+        *runs = &index->runs.extents[index->firstRun[low]];
+        return index->firstRun[low + 1] - index->firstRun[low];
+    }
+
+    scratch->count = 0;
+    if(extentFollow(fat, firstCluster, scratch) <= 0) {
+        return 0;
+    }
+    *runs = scratch->extents;
+    return scratch->count;
+}
+
+int extentListAdd(ExtentList* list, unsigned int cluster) {
+    return extentAppend(list, cluster, 0);
+}
+
+void extentListFree(ExtentList* list) {
+    free(list->extents);
+    list->extents = 0;
+    list->count = 0;
+    list->capacity = 0;
+}
@@ -0,0 +1,71 @@
+/*
+ * extent.h
+ *
+ * Run-length index over the cluster chains of a decoded FAT.
+ * Each chain is stored as a list of (start cluster, length) runs of
+ * physically contiguous clusters, so a chain can be read with one
+ * request per run instead of one per cluster.
+ */
+
+#ifndef __EXTENT_H
+#define __EXTENT_H
+
+#include "fat.h"
+
+typedef struct Extent_t {
+    unsigned int start;     // first cluster of the run
+    unsigned int length;    // number of consecutive clusters
+} Extent;
+
+/**
+ * @brief Growable list of runs
+ */
+typedef struct ExtentList_t {
+    Extent* extents;
+    unsigned int count;
+    unsigned int capacity;
+} ExtentList;
+
+typedef struct ExtentIndex_t {
+    ExtentList runs;            // runs of all chains, chain by chain
+    unsigned int* heads;        // first clusters of all chains, ascending
+    unsigned int* firstRun;     // index into runs for each head, headCount + 1 entries
+    unsigned int headCount;
+    int borrowed;               // the arrays belong to a snapshot, they are not freed
+} ExtentIndex;
+
+/**
+ * @brief Builds the index in one pass over the FAT.
+ * A chain head is an allocated cluster that no other cluster points to.
+ * Chains end at an end-of-chain marker, a free/bad/out of range cluster or
+ * when they run into themselves.
+ * @return 0 on success, -1 if out of memory
+ */
+int extentIndexBuild(ExtentIndex* index, const FatTable* fat);
+
+void extentIndexFree(ExtentIndex* index);
+
+/**
+ * @brief Collects the runs of a chain by following the FAT, appends them to list
+ * @return number of runs appended, -1 if out of memory
+ */
+int extentFollow(const FatTable* fat, unsigned int firstCluster, ExtentList* list);
+
+/**
+ * @brief Returns the runs of the chain starting at firstCluster.
+ * Chain heads are answered from the index; for anything else (e.g. a
+ * cross-linked chain) the FAT is followed and the runs are stored in scratch.
+ * @param runs receives a pointer to the first run
+ * @return number of runs, 0 if firstCluster is not a data cluster
+ */
+unsigned int extentChain(const ExtentIndex* index, const FatTable* fat, unsigned int firstCluster, const Extent** runs, ExtentList* scratch);
+
+/**
+ * @brief Appends a cluster, to the last run if it continues it
+ * @return 0 on success, -1 if out of memory
+ */
+int extentListAdd(ExtentList* list, unsigned int cluster);
+
+void extentListFree(ExtentList* list);
+
+#endif
@@ -0,0 +1,202 @@
+#define _FILE_OFFSET_BITS 64
+
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "extract.h"
+
+#ifndef O_BINARY
+#define O_BINARY 0
+#endif
+
+void extractInit(Extractor* extractor, Image* image, const FatGeometry* geometry, const FatTable* fat, const ExtentIndex* index) {
+    memset(extractor, 0, sizeof(Extractor));
+    extractor->image = image;
+    extractor->geometry = geometry;
+    extractor->fat = fat;
+    extractor->index = index;
+}
+
+int extractAdd(Extractor* extractor, const DIRENTRY* directoryEntry, const char* hostPath) {
+    if(extractor->count == extractor->capacity) {
+        unsigned int capacity = extractor->capacity ? extractor->capacity * 2 : 256;
+        ExtractItem* items = (ExtractItem*)realloc(extractor->items, sizeof(ExtractItem) * capacity);
+        if(!items) {
+            return -1;
+        }
+        extractor->items = items;
+        extractor->capacity = capacity;
+    }
+
+    ExtractItem* item = &extractor->items[extractor->count];
+    item->directoryEntry = *directoryEntry;
+    item->hostPath = strdup(hostPath);
+    if(!item->hostPath) {
+        return -1;
+    }
+    extractor->count++;
+    return 0;
+}
+
+int extractFile(Extractor* extractor, const DIRENTRY* directoryEntry, const char* hostPath, ExtentList* scratch) {
+    int fd = open(hostPath, O_WRONLY | O_CREAT | O_TRUNC | O_BINARY, 0644);
+    if(fd == -1) {
+        return -1;
+    }
+
+    unsigned long long remaining = directoryEntry->size;
+    unsigned int firstCluster = fatFirstCluster(directoryEntry, extractor->geometry->fatType);
+    const Extent* runs;
+    unsigned int runCount = remaining ? extentChain(extractor->index, extractor->fat, firstCluster, &runs, scratch) : 0;
+
+    // all fragments are known now, the kernel can read the later ones while the first is copied
+    unsigned int run;
+    unsigned long long before = 0;  // bytes of the file in the runs so far
+    for(run = 0; run < runCount && before < remaining; run++) {
+        unsigned long long length = (unsigned long long)runs[run].length * extractor->geometry->clusterSize;
+        if(run > 0) {
+            imageAdvise(extractor->image, fatClusterOffset(extractor->geometry, runs[run].start), length < remaining - before ? length : remaining - before, IMAGE_ADVICE_WILLNEED);
+        }
+        before += length;
+    }
+
+    // one request per run, the last one cut to the file size
+    int ret = 0;
+    for(run = 0; run < runCount && remaining > 0 && ret == 0; run++) {
+        unsigned long long length = (unsigned long long)runs[run].length * extractor->geometry->clusterSize;
+        if(length > remaining) {
+            length = remaining;
+        }
+        ret = imageCopy(extractor->image, fd, fatClusterOffset(extractor->geometry, runs[run].start), length);
+        remaining -= length;
+    }
+    if(ret == 0 && remaining > 0) {
+        // the chain ends before the file does
+        errno = EIO;
+        ret = -1;
+    }
+
+    if(close(fd) != 0) {
+        ret = -1;
+    }
+    if(ret == 0) {
+        __atomic_add_fetch(&extractor->bytes, directoryEntry->size, __ATOMIC_RELAXED);
+    }
+    return ret;
+}
+
+int extractTimes(const DIRENTRY* directoryEntry, const char* hostPath) {
+    unsigned short date = directoryEntry->changedate;
+    unsigned short time = directoryEntry->changetime;
+    if(date == 0) {
+        // never set, leave the host's time
+        return 0;
+    }
+
+    struct tm local;
+    memset(&local, 0, sizeof(local));
+    local.tm_year = 80 + (date >> 9);
+    local.tm_mon = ((date & 0x1E0) >> 5) - 1;
+    local.tm_mday = date & 0x1F;
+    local.tm_hour = time >> 11;
+    local.tm_min = (time & 0x7E0) >> 5;
+    local.tm_sec = (time & 0x1F) * 2;
+    local.tm_isdst = -1;
+
+    struct timespec times[2];
+    times[0].tv_sec = mktime(&local);
+    times[0].tv_nsec = 0;
+    times[1] = times[0];
+    if(times[0].tv_sec == (time_t)-1) {
+        errno = EINVAL;
+        return -1;
+    }
+    return utimensat(AT_FDCWD, hostPath, times, 0);
+}
+
+/**
+ * @brief Worker thread: takes the next file until all are done
+ * @param arg the extractor
+ */
+static void* extractWorker(void* arg) {
+    Extractor* extractor = (Extractor*)arg;
+    ExtentList scratch = {0, 0, 0};
+
+    for(;;) {
+        unsigned int i = __atomic_fetch_add(&extractor->next, 1, __ATOMIC_RELAXED);
+        if(i >= extractor->count) {
+            break;
+        }
+        ExtractItem* item = &extractor->items[i];
+        if(IS_DIR(item->directoryEntry.attr)) {
+            continue;
+        }
+
+        if(extractFile(extractor, &item->directoryEntry, item->hostPath, &scratch) != 0 ||
+           extractTimes(&item->directoryEntry, item->hostPath) != 0) {
+            if(extractor->report) {
+                extractor->report(item, errno);
+            }
+            __atomic_add_fetch(&extractor->errors, 1, __ATOMIC_RELAXED);
+        }else{
+            __atomic_add_fetch(&extractor->files, 1, __ATOMIC_RELAXED);
+        }
+    }
+
+    extentListFree(&scratch);
+    return 0;
+}
+
+unsigned int extractRun(Extractor* extractor, unsigned int threads) {
+    if(threads < 1) {
+        threads = 1;
+    }
+    pthread_t* workers = (pthread_t*)malloc(sizeof(pthread_t) * threads);
+    unsigned int started = 0;
+    while(workers && started < threads && pthread_create(&workers[started], 0, extractWorker, extractor) == 0) {
+        started++;
+    }
+    if(started == 0) {
+        // no threads at all, do it here
+        extractWorker(extractor);
+    }
+    unsigned int i;
+    for(i = 0; i < started; i++) {
+        pthread_join(workers[i], 0);
+    }
+    free(workers);
+
+    // writing the files changed the directories' times, children come after their parents
+    for(i = extractor->count; i > 0; i--) {
+        ExtractItem* item = &extractor->items[i - 1];
+        if(!IS_DIR(item->directoryEntry.attr)) {
+            continue;
+        }
+        if(extractTimes(&item->directoryEntry, item->hostPath) != 0) {
+            if(extractor->report) {
+                extractor->report(item, errno);
+            }
+            extractor->errors++;
+        }else{
+            extractor->directories++;
+        }
+    }
+    return extractor->errors;
+}
+
+void extractFree(Extractor* extractor) {
+    unsigned int i;
+    for(i = 0; i < extractor->count; i++) {
+        free(extractor->items[i].hostPath);
+    }
+    free(extractor->items);
+    extractor->items = 0;
+    extractor->count = 0;
+    extractor->capacity = 0;
+}
@@ -0,0 +1,77 @@
+/*
+ * extract.h
+ *
+ * Copies files out of an image to the host. Files are collected first and
+ * then copied by a pool of threads, one large request per run of contiguous
+ * clusters, kept in the kernel where the platform allows it.
+ */
+
+#ifndef __EXTRACT_H
+#define __EXTRACT_H
+
+#include "data.h"
+#include "extent.h"
+#include "fat.h"
+#include "image.h"
+
+typedef struct ExtractItem_t {
+    DIRENTRY directoryEntry;
+    char* hostPath;
+} ExtractItem;
+
+typedef struct Extractor_t {
+    Image* image;
+    const FatGeometry* geometry;
+    const FatTable* fat;
+    const ExtentIndex* index;
+
+    ExtractItem* items;         // files and directories in the order they were added
+    unsigned int count;
+    unsigned int capacity;
+    unsigned int next;          // next item to be taken by a worker
+
+    /**
+     * @brief Called for every file or directory that failed, from the workers; 0 to stay quiet
+     * @param error errno of the failure
+     */
+    void (*report)(const ExtractItem* item, int error);
+
+    unsigned int files;         // results, updated by the workers
+    unsigned int directories;
+    unsigned int errors;
+    unsigned long long bytes;
+} Extractor;
+
+void extractInit(Extractor* extractor, Image* image, const FatGeometry* geometry, const FatTable* fat, const ExtentIndex* index);
+
+/**
+ * @brief Adds a file or directory to extract. Directories have to exist on the host
+ * already, they only get their timestamps at the end.
+ * @param hostPath is copied
+ * @return 0 on success, -1 if out of memory
+ */
+int extractAdd(Extractor* extractor, const DIRENTRY* directoryEntry, const char* hostPath);
+
+/**
+ * @brief Extracts everything that was added, then sets the timestamps of the directories
+ * @param threads number of worker threads
+ * @return number of items that failed
+ */
+unsigned int extractRun(Extractor* extractor, unsigned int threads);
+
+/**
+ * @brief Copies the contents of one file, following its chain run by run
+ * @param scratch for chains that are not in the extent index
+ * @return 0 on success, -1 otherwise (errno is set)
+ */
+int extractFile(Extractor* extractor, const DIRENTRY* directoryEntry, const char* hostPath, ExtentList* scratch);
+
+/**
+ * @brief Sets access and modification time of a host file to changedate/changetime (local time)
+ * @return 0 on success, -1 otherwise
+ */
+int extractTimes(const DIRENTRY* directoryEntry, const char* hostPath);
+
+void extractFree(Extractor* extractor);
+
+#endif
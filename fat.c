@@ -0,0 +1,492 @@
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "fat.h"
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define FAT_X86_SIMD
+#include <immintrin.h>
+#endif
+
+// FAT12: values from 0xFF0 up are reserved/bad/last markers
+#define FAT12_SPECIAL_MIN   CLUSTER_RESERVED_MIN(FAT12_BITS)
+#define FAT12_WIDEN         (CLUSTER_LAST_MAX(FAT_ENTRY_BITS) & ~CLUSTER_LAST_MAX(FAT12_BITS))
+#define FAT16_SPECIAL_MIN   CLUSTER_RESERVED_MIN(FAT16_BITS)
+#define FAT16_WIDEN         (CLUSTER_LAST_MAX(FAT_ENTRY_BITS) & ~CLUSTER_LAST_MAX(FAT16_BITS))
+
+/**
+ * @brief Scalar FAT12 unpacking, also handles the tails of the SIMD kernels
+ */
+static void fatUnpack12Scalar(const unsigned char* raw, unsigned int* out, unsigned int first, unsigned int count) {
+    unsigned int cluster;
+    for(cluster = first; cluster < count; cluster++) {
+        const unsigned char* p = &raw[cluster + cluster / 2];
+        unsigned int value = (cluster % 2) ? (p[0] >> 4) | (p[1] << 4)
+                                           : p[0] | ((p[1] & 0x0F) << 8);
+        if(value >= FAT12_SPECIAL_MIN) {
+            value |= FAT12_WIDEN;
+        }
+        out[cluster] = value;
+    }
+}
+
+#ifdef FAT_X86_SIMD
+
+/* Both kernels take 12 bytes per 128 bit lane and spread them to 8 16-bit
+ * lanes: even entries get bytes (0,1), odd entries bytes (1,2) of each
+ * 3 byte group. Multiplying the even lanes by 16 drops their high nibble,
+ * so a final shift right by 4 yields all 8 entries.
+ */
+
+__attribute__((target("ssse3")))
+static unsigned int fatUnpack12SSSE3(const unsigned char* raw, unsigned int* out, unsigned int count) {
+    const __m128i spread = _mm_setr_epi8(0,1, 1,2, 3,4, 4,5, 6,7, 7,8, 9,10, 10,11);
+    const __m128i scale = _mm_setr_epi16(16,1, 16,1, 16,1, 16,1);
+    const __m128i special = _mm_set1_epi16(FAT12_SPECIAL_MIN - 1);
+    const __m128i widen = _mm_set1_epi32(FAT12_WIDEN);
+    const __m128i zero = _mm_setzero_si128();
+
+    // 16 bytes are loaded for 12 used ones, stop early enough
+    unsigned int cluster = 0;
+    unsigned int bytes = (count * 3 + 1) / 2;
+    for(; cluster + 8 <= count && cluster / 2 * 3 + 16 <= bytes; cluster += 8) {
+        __m128i v = _mm_loadu_si128((const __m128i*)&raw[cluster / 2 * 3]);
+        v = _mm_shuffle_epi8(v, spread);
+        v = _mm_srli_epi16(_mm_mullo_epi16(v, scale), 4);
+        __m128i isSpecial = _mm_cmpgt_epi16(v, special);
+
+        __m128i lo = _mm_unpacklo_epi16(v, zero);
+        __m128i hi = _mm_unpackhi_epi16(v, zero);
+        lo = _mm_or_si128(lo, _mm_and_si128(_mm_unpacklo_epi16(isSpecial, isSpecial), widen));
+        hi = _mm_or_si128(hi, _mm_and_si128(_mm_unpackhi_epi16(isSpecial, isSpecial), widen));
+        _mm_storeu_si128((__m128i*)&out[cluster], lo);
+        _mm_storeu_si128((__m128i*)&out[cluster + 4], hi);
+    }
+    return cluster;
+}
+
+__attribute__((target("avx2")))
+static unsigned int fatUnpack12AVX2(const unsigned char* raw, unsigned int* out, unsigned int count) {
+    const __m256i spread = _mm256_setr_epi8(0,1, 1,2, 3,4, 4,5, 6,7, 7,8, 9,10, 10,11,
+                                            0,1, 1,2, 3,4, 4,5, 6,7, 7,8, 9,10, 10,11);
+    const __m256i scale = _mm256_setr_epi16(16,1, 16,1, 16,1, 16,1, 16,1, 16,1, 16,1, 16,1);
+    const __m256i special = _mm256_set1_epi32(FAT12_SPECIAL_MIN - 1);
+    const __m256i widen = _mm256_set1_epi32(FAT12_WIDEN);
+
+    // 24 bytes hold 16 entries, the upper lane loads 16 bytes from byte 12 on
+    unsigned int cluster = 0;
+    unsigned int bytes = (count * 3 + 1) / 2;
+    for(; cluster + 16 <= count && cluster / 2 * 3 + 28 <= bytes; cluster += 16) {
+        const unsigned char* p = &raw[cluster / 2 * 3];
+        __m256i v = _mm256_inserti128_si256(_mm256_castsi128_si256(_mm_loadu_si128((const __m128i*)p)),
+                                            _mm_loadu_si128((const __m128i*)(p + 12)), 1);
+        v = _mm256_shuffle_epi8(v, spread);
+        v = _mm256_srli_epi16(_mm256_mullo_epi16(v, scale), 4);
+
+        __m256i lo = _mm256_cvtepu16_epi32(_mm256_castsi256_si128(v));
+        __m256i hi = _mm256_cvtepu16_epi32(_mm256_extracti128_si256(v, 1));
+        lo = _mm256_or_si256(lo, _mm256_and_si256(_mm256_cmpgt_epi32(lo, special), widen));
+        hi = _mm256_or_si256(hi, _mm256_and_si256(_mm256_cmpgt_epi32(hi, special), widen));
+        _mm256_storeu_si256((__m256i*)&out[cluster], lo);
+        _mm256_storeu_si256((__m256i*)&out[cluster + 8], hi);
+    }
+    return cluster;
+}
+
+#endif
+
+void fatUnpack12(const unsigned char* raw, unsigned int* out, unsigned int count) {
+    unsigned int done = 0;
+#ifdef FAT_X86_SIMD
+    if(__builtin_cpu_supports("avx2")) {
+        done = fatUnpack12AVX2(raw, out, count);
+    }else if(__builtin_cpu_supports("ssse3")) {
+        done = fatUnpack12SSSE3(raw, out, count);
+    }
+#endif
+    fatUnpack12Scalar(raw, out, done, count);
+}
+
+/* Bytes read per request when the FAT can't be used in place. A multiple of
+ * 3 (FAT12: 2 entries), 2 (FAT16) and 4 (FAT32) so chunks end on entry boundaries.
+ */
+#define FAT_STREAM_CHUNK (3 << 18)
+
+/**
+ * @brief Unpacks count FAT16 entries
+ */
+static void fatUnpack16(const unsigned char* raw, unsigned int* out, unsigned int count) {
+    unsigned int cluster;
+    for(cluster = 0; cluster < count; cluster++) {
+        unsigned int value = raw[cluster * 2] | (raw[cluster * 2 + 1] << 8);
+        out[cluster] = (value >= FAT16_SPECIAL_MIN) ? value | FAT16_WIDEN : value;
+    }
+}
+
+int fatGeometry(const BOOTSECTOR* bootsector, FatGeometry* geometry) {
+    const struct _BPB* bpb = &bootsector->BPB;
+    // padding included, geometries are compared byte by byte (snapshot keys)
+    memset(geometry, 0, sizeof(FatGeometry));
+
+    // sector and cluster sizes have to be powers of two
+    if(bpb->sectorsize < 512 || (bpb->sectorsize & (bpb->sectorsize - 1)) ||
+       bpb->sectorspercluster == 0 || (bpb->sectorspercluster & (bpb->sectorspercluster - 1)) ||
+       bpb->reservedsectors == 0 || bpb->numberofFATs == 0) {
+        return -1;
+    }
+
+    unsigned int fatSectors = bpb->FATsectors ? bpb->FATsectors : bootsector->EBPB32.FATsectors;
+    unsigned int totalSectors = bpb->numberofsectors ? bpb->numberofsectors : bootsector->totalsectors;
+    unsigned int rootSectors = (bpb->rootentries * sizeof(DIRENTRY) + bpb->sectorsize - 1) / bpb->sectorsize;
+    unsigned long long firstDataSector = bpb->reservedsectors + (unsigned long long)bpb->numberofFATs * fatSectors + rootSectors;
+    if(fatSectors == 0 || totalSectors <= firstDataSector) {
+        return -1;
+    }
+
+    geometry->sectorSize = bpb->sectorsize;
+    geometry->clusterSize = bpb->sectorsize * bpb->sectorspercluster;
+    geometry->totalSectors = totalSectors;
+    geometry->numberOfFATs = bpb->numberofFATs;
+    geometry->clusterCount = (unsigned int)((totalSectors - firstDataSector) / bpb->sectorspercluster);
+    geometry->fatOffset = (unsigned long long)bpb->reservedsectors * bpb->sectorsize;
+    geometry->fatSize = (unsigned long long)fatSectors * bpb->sectorsize;
+    geometry->rootOffset = geometry->fatOffset + geometry->numberOfFATs * geometry->fatSize;
+    geometry->rootSize = bpb->rootentries * sizeof(DIRENTRY);
+    geometry->dataOffset = firstDataSector * bpb->sectorsize;
+
+    if(geometry->clusterCount < 4085) {
+        geometry->fatType = 12;
+    } else if(geometry->clusterCount < 65525) {
+        geometry->fatType = 16;
+    } else {
+        geometry->fatType = 32;
+    }
+
+    geometry->rootCluster = 0;
+    if(geometry->fatType == 32) {
+        // FAT32 has no fixed root directory region
+        if(bpb->rootentries != 0 || bootsector->EBPB32.rootcluster < 2) {
+            return -1;
+        }
+        geometry->rootCluster = bootsector->EBPB32.rootcluster;
+        geometry->rootSize = 0;
+    }else if(geometry->rootSize == 0) {
+        return -1;
+    }
+    return 0;
+}
+
+unsigned long long fatClusterOffset(const FatGeometry* geometry, unsigned int cluster) {
+    if(cluster == 0) {
+        if(geometry->fatType != 32) {
+            return geometry->rootOffset;
+        }
+        cluster = geometry->rootCluster;
+    }
+    return geometry->dataOffset + (unsigned long long)(cluster - 2) * geometry->clusterSize;
+}
+
+int fatLoad(FatTable* table, Image* image, const FatGeometry* geometry) {
+    unsigned long long entries;
+    switch(geometry->fatType) {
+        case 12: entries = geometry->fatSize * 2 / 3; break;
+        case 16: entries = geometry->fatSize / 2; break;
+        case 32: entries = geometry->fatSize / 4; break;
+        default: return -1;
+    }
+    // the FAT is usually a bit larger than needed, skip the slack
+    unsigned int count = (entries > (unsigned long long)geometry->clusterCount + 2) ? geometry->clusterCount + 2 : (unsigned int)entries;
+
+    table->count = count;
+    table->mask = 0xFFFFFFFF;
+    table->owned = 0;
+    table->dirty = 0;
+
+    // FAT32 entries already are what the table holds (up to the top 4 bits)
+    if(geometry->fatType == 32) {
+        table->mask = FAT_ENTRY_MASK;
+        if(image->map) {
+            table->next = (const unsigned int*)imageView(image, geometry->fatOffset, sizeof(unsigned int) * (size_t)count, 0);
+            return table->next ? 0 : -1;
+        }
+    }
+
+    unsigned int* out = (unsigned int*)malloc(sizeof(unsigned int) * (count ? count : 1));
+    if(!out) {
+        return -1;
+    }
+    table->owned = out;
+    table->next = out;
+
+    // raw FAT bytes holding count entries
+    unsigned long long rawSize = (geometry->fatType == 12) ? ((unsigned long long)count * 3 + 1) / 2
+                                                           : (unsigned long long)count * geometry->fatType / 8;
+    if(image->map) {
+        const unsigned char* raw = (const unsigned char*)imageView(image, geometry->fatOffset, (size_t)rawSize, 0);
+        if(!raw) {
+            fatFree(table);
+            return -1;
+        }
+        imageAdvise(image, geometry->fatOffset, rawSize, IMAGE_ADVICE_SEQUENTIAL);
+        if(geometry->fatType == 12) {
+            fatUnpack12(raw, out, count);
+        }else{
+            fatUnpack16(raw, out, count);
+        }
+        return 0;
+    }
+
+    // stream it: FAT32 is read straight into the table, FAT12/16 through a chunk buffer
+    unsigned char* chunk = (geometry->fatType == 32) ? 0 : (unsigned char*)malloc(FAT_STREAM_CHUNK + 1);
+    unsigned long long done = 0;
+    unsigned int cluster = 0;
+    int ret = 0;
+    while(done < rawSize) {
+        unsigned int length = (rawSize - done > FAT_STREAM_CHUNK) ? FAT_STREAM_CHUNK : (unsigned int)(rawSize - done);
+        unsigned int chunkEntries = (geometry->fatType == 12) ? (length * 2) / 3 : length * 8 / geometry->fatType;
+        if(cluster + chunkEntries > count || done + length == rawSize) {
+            chunkEntries = count - cluster;
+        }
+
+        if(geometry->fatType == 32) {
+            ret = imageRead(image, &out[cluster], length, geometry->fatOffset + done);
+        }else if(!chunk) {
+            ret = -1;
+        }else if((ret = imageRead(image, chunk, length, geometry->fatOffset + done)) == 0) {
+            if(geometry->fatType == 12) {
+                fatUnpack12(chunk, &out[cluster], chunkEntries);
+            }else{
+                fatUnpack16(chunk, &out[cluster], chunkEntries);
+            }
+        }
+        if(ret != 0) {
+            break;
+        }
+        done += length;
+        cluster += chunkEntries;
+    }
+    free(chunk);
+
+    if(ret != 0) {
+        fatFree(table);
+    }
+    return ret;
+}
+
+/**
+ * @brief Kinds of 64 entries, one bit each
+ */
+typedef struct FatWord_t {
+    unsigned long long free;
+    unsigned long long bad;
+    unsigned long long last;
+    unsigned long long invalid;
+} FatWord;
+
+static inline void fatStoreWord(const FatClasses* classes, unsigned int word, const FatWord* kinds) {
+    if(classes->free) {
+        classes->free[word] = kinds->free;
+    }
+    if(classes->bad) {
+        classes->bad[word] = kinds->bad;
+    }
+    if(classes->last) {
+        classes->last[word] = kinds->last;
+    }
+    if(classes->invalid) {
+        classes->invalid[word] = kinds->invalid;
+    }
+}
+
+/**
+ * @brief Scalar classification of one word, for tables without AVX2 and the partial words
+ */
+static void fatClassifyWord(const FatTable* table, unsigned int word, FatWord* kinds) {
+    memset(kinds, 0, sizeof(FatWord));
+    unsigned int first = word * 64 < 2 ? 2 : word * 64;
+    unsigned int end = (word + 1) * 64 < table->count ? (word + 1) * 64 : table->count;
+    unsigned int cluster;
+    for(cluster = first; cluster < end; cluster++) {
+        unsigned int next = fatEntry(table, cluster);
+        unsigned long long bit = 1ull << (cluster % 64);
+        if(next == CLUSTER_FREE) {
+            kinds->free |= bit;
+        }else if(next == FAT_CLUSTER_BAD) {
+            kinds->bad |= bit;
+        }else if(FAT_IS_LAST(next)) {
+            kinds->last |= bit;
+        }else if(next == 1 || next >= table->count) {
+            kinds->invalid |= bit;
+        }
+    }
+}
+
+#ifdef FAT_X86_SIMD
+
+/**
+ * @brief Classifies 64 entries, 8 per compare
+ */
+__attribute__((target("avx2")))
+static void fatClassifyWordAVX2(const FatTable* table, unsigned int word, FatWord* kinds) {
+    const __m256i mask = _mm256_set1_epi32(table->mask);
+    const __m256i zero = _mm256_setzero_si256();
+    const __m256i one = _mm256_set1_epi32(1);
+    const __m256i bad = _mm256_set1_epi32(FAT_CLUSTER_BAD);
+    const __m256i lastMin = _mm256_set1_epi32(CLUSTER_LAST_MIN(FAT_ENTRY_BITS) - 1);
+    const __m256i beyond = _mm256_set1_epi32(table->count - 1);    // values fit 28 bits, signed compares do
+
+    const unsigned int* next = &table->next[word * 64];
+    memset(kinds, 0, sizeof(FatWord));
+    unsigned int i;
+    for(i = 0; i < 64; i += 8) {
+        __m256i v = _mm256_and_si256(_mm256_loadu_si256((const __m256i*)&next[i]), mask);
+        __m256i isLast = _mm256_cmpgt_epi32(v, lastMin);
+        __m256i isInvalid = _mm256_or_si256(_mm256_cmpeq_epi32(v, one),
+                                            _mm256_andnot_si256(isLast, _mm256_and_si256(_mm256_cmpgt_epi32(v, beyond), _mm256_cmpgt_epi32(bad, v))));
+        kinds->free |= (unsigned long long)_mm256_movemask_ps(_mm256_castsi256_ps(_mm256_cmpeq_epi32(v, zero))) << i;
+        kinds->bad |= (unsigned long long)_mm256_movemask_ps(_mm256_castsi256_ps(_mm256_cmpeq_epi32(v, bad))) << i;
+        kinds->last |= (unsigned long long)_mm256_movemask_ps(_mm256_castsi256_ps(isLast)) << i;
+        kinds->invalid |= (unsigned long long)_mm256_movemask_ps(_mm256_castsi256_ps(isInvalid)) << i;
+    }
+}
+
+#endif
+
+void fatClassify(const FatTable* table, unsigned int firstWord, unsigned int endWord, const FatClasses* classes) {
+    void (*classifyWord)(const FatTable*, unsigned int, FatWord*) = fatClassifyWord;
+#ifdef FAT_X86_SIMD
+    if(__builtin_cpu_supports("avx2")) {
+        classifyWord = fatClassifyWordAVX2;
+    }
+#endif
+
+    // the first word and partial words are done one by one
+    FatWord kinds;
+    unsigned int word;
+    for(word = firstWord; word < endWord; word++) {
+        if(word > 0 && (word + 1) * 64 <= table->count) {
+            classifyWord(table, word, &kinds);
+        }else{
+            fatClassifyWord(table, word, &kinds);
+        }
+        fatStoreWord(classes, word - firstWord, &kinds);
+    }
+}
+
+int fatWritable(FatTable* table) {
+    if(table->dirty) {
+        return 0;
+    }
+    unsigned int blocks = table->count / FAT_DIRTY_BLOCK + 1;
+    table->dirty = (unsigned char*)calloc(blocks / 8 + 1, 1);
+    if(!table->dirty) {
+        return -1;
+    }
+    if(!table->owned) {
+        unsigned int* owned = (unsigned int*)malloc(sizeof(unsigned int) * (table->count ? table->count : 1));
+        if(!owned) {
+            free(table->dirty);
+            table->dirty = 0;
+            return -1;
+        }
+        memcpy(owned, table->next, sizeof(unsigned int) * table->count);
+        table->owned = owned;
+        table->next = owned;
+    }
+    return 0;
+}
+
+/**
+ * @brief Packs entries first to end - 1 into the on-disk format
+ * @param raw receives them from the byte of entry first on; on FAT12 the
+ * byte an odd count of entries shares with the entry behind them has to be there already
+ */
+static void fatPack(const FatTable* table, unsigned char fatType, unsigned int first, unsigned int end, unsigned char* raw) {
+    unsigned int cluster;
+    for(cluster = first; cluster < end; cluster++) {
+        unsigned int value = table->next[cluster];
+        unsigned int i = cluster - first;
+        if(fatType == 12) {
+            value &= CLUSTER_LAST_MAX(FAT12_BITS);
+            unsigned char* p = &raw[i + i / 2];
+            if(i % 2) {
+                p[0] = (p[0] & 0x0F) | (value << 4);
+                p[1] = value >> 4;
+            }else{
+                p[0] = value;
+                p[1] = (p[1] & 0xF0) | (value >> 8);
+            }
+        }else if(fatType == 16) {
+            raw[i * 2] = value;
+            raw[i * 2 + 1] = value >> 8;
+        }else{
+            memcpy(&raw[i * 4], &value, 4);
+        }
+    }
+}
+
+int fatFlush(FatTable* table, Image* image, const FatGeometry* geometry) {
+    if(!table->dirty) {
+        return 0;
+    }
+
+    unsigned int blocks = (table->count + FAT_DIRTY_BLOCK - 1) / FAT_DIRTY_BLOCK;
+    unsigned char* raw = 0;
+    size_t rawSize = 0;
+    unsigned int block = 0;
+    while(block < blocks) {
+        if(!(table->dirty[block / 8] & (1 << (block % 8)))) {
+            block++;
+            continue;
+        }
+        unsigned int last = block;
+        while(last + 1 < blocks && (table->dirty[(last + 1) / 8] & (1 << ((last + 1) % 8)))) {
+            last++;
+        }
+
+        // entries of the dirty blocks; FAT12 blocks have an even number of entries, they start on a byte
+        unsigned int first = block * FAT_DIRTY_BLOCK;
+        unsigned int end = (last + 1) * FAT_DIRTY_BLOCK < table->count ? (last + 1) * FAT_DIRTY_BLOCK : table->count;
+        unsigned long long offset = geometry->fatType == 12 ? (unsigned long long)first * 3 / 2 : (unsigned long long)first * geometry->fatType / 8;
+        size_t length = geometry->fatType == 12 ? ((size_t)(end - first) * 3 + 1) / 2 : (size_t)(end - first) * geometry->fatType / 8;
+        if(length > rawSize) {
+            unsigned char* larger = (unsigned char*)realloc(raw, length);
+            if(!larger) {
+                free(raw);
+                errno = ENOMEM;
+                return -1;
+            }
+            raw = larger;
+            rawSize = length;
+        }
+        memset(raw, 0, length);
+        if(geometry->fatType == 12 && (end - first) % 2 && imageRead(image, &raw[length - 1], 1, geometry->fatOffset + offset + length - 1) != 0) {
+            free(raw);
+            return -1;
+        }
+        fatPack(table, geometry->fatType, first, end, raw);
+
+        unsigned int copy;
+        for(copy = 0; copy < geometry->numberOfFATs; copy++) {
+            if(imageWrite(image, raw, length, geometry->fatOffset + copy * geometry->fatSize + offset) != 0) {
+                free(raw);
+                return -1;
+            }
+        }
+        for(; block <= last; block++) {
+            table->dirty[block / 8] &= ~(1 << (block % 8));
+        }
+    }
+    free(raw);
+    return 0;
+}
+
+void fatFree(FatTable* table) {
+    free(table->owned);
+    free(table->dirty);
+    table->owned = 0;
+    table->dirty = 0;
+    table->next = 0;
+    table->count = 0;
+}
@@ -0,0 +1,148 @@
+/*
+ * fat.h
+ *
+ * Volume geometry and the decoded File Allocation Table:
+ * one next-cluster value per cluster. A writable table is changed in memory
+ * and written back in blocks, to all FAT copies at once.
+ */
+
+#ifndef __FAT_H
+#define __FAT_H
+
+#include "data.h"
+#include "image.h"
+
+/* The decoded table uses the 28 bit FAT32 value space for all FAT types,
+ * so the reserved, bad and end-of-chain markers of FAT12/16 are widened
+ * (0xFF7 -> 0x0FFFFFF7, 0xFFF8 -> 0x0FFFFFF8, ...).
+ */
+#define FAT_ENTRY_BITS 28
+#define FAT_ENTRY_MASK      CLUSTER_LAST_MAX(FAT_ENTRY_BITS)
+#define FAT_CLUSTER_BAD     CLUSTER_BAD(FAT_ENTRY_BITS)
+#define FAT_CLUSTER_LAST    CLUSTER_LAST_MAX(FAT_ENTRY_BITS)
+#define FAT_IS_LAST(c)      ((c) >= CLUSTER_LAST_MIN(FAT_ENTRY_BITS))
+
+/**
+ * @brief Layout of a volume, derived from the bootsector. All offsets are in bytes.
+ */
+typedef struct FatGeometry_t {
+    unsigned char fatType;              // 12, 16 or 32
+    unsigned int sectorSize;
+    unsigned int clusterSize;
+    unsigned int totalSectors;
+    unsigned int numberOfFATs;
+    unsigned long long fatOffset;       // first FAT copy
+    unsigned long long fatSize;         // size of one FAT copy
+    unsigned long long rootOffset;      // FAT12/16 root directory region
+    unsigned int rootSize;              // 0 on FAT32
+    unsigned int rootCluster;           // FAT32 root directory chain, 0 on FAT12/16
+    unsigned long long dataOffset;      // cluster 2
+    unsigned int clusterCount;          // number of data clusters
+} FatGeometry;
+
+#define FAT_DIRTY_BLOCK 1024    // entries per block of the write-back cache (1.5, 2 or 4 KiB of FAT)
+
+typedef struct FatTable_t {
+    const unsigned int* next;   // next cluster for each cluster number, see fatEntry
+    unsigned int count;         // number of entries, including the two reserved ones
+    unsigned int mask;          // FAT32 tables used in place keep the reserved top 4 bits
+    unsigned int* owned;        // heap memory behind next, 0 if next points into the image
+    unsigned char* dirty;       // bit per block of entries changed since the last flush, 0 if read only
+} FatTable;
+
+/**
+ * @brief Derives the volume layout and the FAT type (by cluster count, as the spec says)
+ * @return 0 on success, -1 if the bootsector doesn't describe a FAT volume
+ */
+int fatGeometry(const BOOTSECTOR* bootsector, FatGeometry* geometry);
+
+/**
+ * @brief Loads the first FAT copy of a volume.
+ * FAT32 tables of mapped images are used in place, everything else is read
+ * in bounded chunks and unpacked into a flat table (no copy of the raw FAT).
+ * @param table to fill, free with fatFree
+ * @return 0 on success, -1 otherwise
+ */
+int fatLoad(FatTable* table, Image* image, const FatGeometry* geometry);
+
+/**
+ * @brief Unpacks count FAT12 entries (3 bytes hold 2 entries) to normalized values
+ * @param raw has to hold at least (count * 3 + 1) / 2 bytes
+ */
+void fatUnpack12(const unsigned char* raw, unsigned int* out, unsigned int count);
+
+/**
+ * @brief Bitsets of the kinds of FAT values, one bit per cluster. Clusters 0
+ * and 1 and those beyond the table are in none of them.
+ */
+typedef struct FatClasses_t {
+    unsigned long long* free;       // 0 if not wanted
+    unsigned long long* bad;
+    unsigned long long* last;       // end of chain
+    unsigned long long* invalid;    // pointing to cluster 1, a reserved value or beyond the table
+} FatClasses;
+
+/**
+ * @brief Classifies the entries of clusters firstWord * 64 to endWord * 64 - 1
+ * @param classes bitsets of endWord - firstWord words, the first one for firstWord
+ */
+void fatClassify(const FatTable* table, unsigned int firstWord, unsigned int endWord, const FatClasses* classes);
+
+/**
+ * @brief Makes the table writable: a table used in place (or from a snapshot) is copied
+ * @return 0 on success, -1 if out of memory
+ */
+int fatWritable(FatTable* table);
+
+/**
+ * @brief Encodes the blocks changed since the last flush and writes them to all FAT copies,
+ * consecutive blocks in one request
+ * @return 0 on success, -1 otherwise (errno is set); the blocks stay dirty on error
+ */
+int fatFlush(FatTable* table, Image* image, const FatGeometry* geometry);
+
+void fatFree(FatTable* table);
+
+/**
+ * @brief Byte offset of a cluster. Cluster 0 stands for the root directory
+ * (the fixed region on FAT12/16, the root chain on FAT32).
+ */
+unsigned long long fatClusterOffset(const FatGeometry* geometry, unsigned int cluster);
+
+/**
+ * @brief Table entry of a cluster inside the table, no bounds check
+ */
+static inline unsigned int fatEntry(const FatTable* table, unsigned int cluster) {
+    return table->next[cluster] & table->mask;
+}
+
+/**
+ * @brief Follows a chain by one hop
+ * @return next cluster, FAT_CLUSTER_LAST if cluster is outside the table
+ */
+static inline unsigned int fatNext(const FatTable* table, unsigned int cluster) {
+    return (cluster < table->count) ? fatEntry(table, cluster) : FAT_CLUSTER_LAST;
+}
+
+/**
+ * @brief Changes a table entry of a writable table in memory, see fatFlush
+ * @param value normalized like the table (FAT_CLUSTER_LAST ends a chain, CLUSTER_FREE frees)
+ */
+static inline void fatSet(FatTable* table, unsigned int cluster, unsigned int value) {
+    // FAT32 keeps the reserved top 4 bits of what is on disk
+    table->owned[cluster] = (table->owned[cluster] & ~table->mask) | value;
+    table->dirty[cluster / FAT_DIRTY_BLOCK / 8] |= 1 << (cluster / FAT_DIRTY_BLOCK % 8);
+}
+
+/**
+ * @brief First cluster of a directory entry, including the high bits on FAT32
+ */
+static inline unsigned int fatFirstCluster(const DIRENTRY* directoryEntry, unsigned char fatType) {
+    unsigned int cluster = directoryEntry->firstcluser;
+    if(fatType == 32) {
+        cluster |= (unsigned int)directoryEntry->EAindex << 16;
+    }
+    return cluster;
+}
+
+#endif
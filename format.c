@@ -0,0 +1,356 @@
+#include <stdlib.h>
+
+#include "counters.h"
+#include "format.h"
+
+static const char digitPairs[201] =
+    "00010203040506070809101112131415161718192021222324252627282930313233343536373839"
+    "40414243444546474849505152535455565758596061626364656667686970717273747576777879"
+    "8081828384858687888990919293949596979899";
+
+void outputInit(Output* output, FILE* stream) {
+    output->stream = stream;
+    output->data = 0;
+    output->used = 0;
+    output->capacity = 0;
+}
+
+void outputFlush(Output* output) {
+    if(output->stream && output->used > 0) {
+        unsigned long long start = PHASE_START();
+        fwrite(output->data, 1, output->used, output->stream);
+        PHASE_END(PHASE_OUTPUT, start);
+        COUNT(COUNTER_OUTPUT_WRITES, 1);
+        COUNT(COUNTER_OUTPUT_BYTES, output->used);
+        output->used = 0;
+    }
+}
+
+void outputFree(Output* output) {
+    outputFlush(output);
+    free(output->data);
+    output->data = 0;
+    output->used = 0;
+    output->capacity = 0;
+}
+
+char* outputReserve(Output* output, size_t length) {
+    if(output->capacity - output->used >= length) {
+        return &output->data[output->used];
+    }
+
+    outputFlush(output);
+    if(output->capacity - output->used < length) {
+        // in-memory outputs double, streamed ones only grow for oversized writes
+        size_t capacity = output->capacity ? output->capacity : (output->stream ? OUTPUT_BUFFER_SIZE : 4096);
+        while(capacity - output->used < length) {
+            capacity *= 2;
+        }
+        char* data = (char*)realloc(output->data, capacity);
+        if(!data) {
+            printf("Out of memory!\n");
+            exit(1);
+        }
+        output->data = data;
+        output->capacity = capacity;
+    }
+    return &output->data[output->used];
+}
+
+/**
+ * @brief Writes two digits, value < 100
+ */
+static inline void outputTwoDigits(char* dst, unsigned int value) {
+    dst[0] = digitPairs[value * 2];
+    dst[1] = digitPairs[value * 2 + 1];
+}
+
+void outputNumber(Output* output, unsigned long long number, unsigned int width) {
+    // fill from the back
+    char digits[20];
+    unsigned int length = 0;
+    while(number >= 100) {
+        length += 2;
+        outputTwoDigits(&digits[20 - length], number % 100);
+        number /= 100;
+    }
+    if(number >= 10) {
+        length += 2;
+        outputTwoDigits(&digits[20 - length], number);
+    }else{
+        digits[20 - ++length] = '0' + number;
+    }
+
+    unsigned int padding = width > length ? width - length : 0;
+    char* dst = outputReserve(output, padding + length);
+    memset(dst, ' ', padding);
+    memcpy(dst + padding, &digits[20 - length], length);
+    output->used += padding + length;
+}
+
+void outputDate(Output* output, unsigned short date) {
+    unsigned int year = 1980 + (date >> 9);
+    char* dst = outputReserve(output, 10);
+    outputTwoDigits(&dst[0], date & 0x1F);
+    dst[2] = '.';
+    outputTwoDigits(&dst[3], (date & 0x1E0) >> 5);
+    dst[5] = '.';
+    outputTwoDigits(&dst[6], year / 100);
+    outputTwoDigits(&dst[8], year % 100);
+    output->used += 10;
+}
+
+void outputTime(Output* output, unsigned short time) {
+    char* dst = outputReserve(output, 8);
+    // hours 0 - 23, minutes 0 - 59, seconds 0 - 29 (times two, only even seconds)
+    outputTwoDigits(&dst[0], time >> 11);
+    dst[2] = ':';
+    outputTwoDigits(&dst[3], (time & 0x7E0) >> 5);
+    dst[5] = ':';
+    outputTwoDigits(&dst[6], (time & 0x1F) * 2);
+    output->used += 8;
+}
+
+void outputTimestamp(Output* output, unsigned short date, unsigned short time) {
+    unsigned int year = 1980 + (date >> 9);
+    char* dst = outputReserve(output, 19);
+    outputTwoDigits(&dst[0], year / 100);
+    outputTwoDigits(&dst[2], year % 100);
+    dst[4] = '-';
+    outputTwoDigits(&dst[5], (date & 0x1E0) >> 5);
+    dst[7] = '-';
+    outputTwoDigits(&dst[8], date & 0x1F);
+    dst[10] = 'T';
+    outputTwoDigits(&dst[11], time >> 11);
+    dst[13] = ':';
+    outputTwoDigits(&dst[14], (time & 0x7E0) >> 5);
+    dst[16] = ':';
+    outputTwoDigits(&dst[17], (time & 0x1F) * 2);
+    output->used += 19;
+}
+
+void outputJsonString(Output* output, const char* text, size_t length) {
+    static const char hex[] = "0123456789abcdef";
+    // worst case every byte is escaped as '\u00XX'
+    char* dst = outputReserve(output, length * 6 + 2);
+    char* start = dst;
+
+    *dst++ = '"';
+    size_t i;
+    for(i = 0; i < length; i++) {
+        unsigned char c = (unsigned char)text[i];
+        if(c == '"' || c == '\\') {
+            *dst++ = '\\';
+            *dst++ = c;
+        }else if(c < 0x20) {
+            memcpy(dst, "\\u00", 4);
+            dst[4] = hex[c >> 4];
+            dst[5] = hex[c & 0xF];
+            dst += 6;
+        }else{
+            *dst++ = c;
+        }
+    }
+    *dst++ = '"';
+    output->used += dst - start;
+}
+
+void outputCsvField(Output* output, const char* text, size_t length) {
+    size_t i;
+    int quote = 0;
+    for(i = 0; i < length && !quote; i++) {
+        quote = text[i] == ',' || text[i] == '"' || text[i] == '\n' || text[i] == '\r';
+    }
+    if(!quote) {
+        outputWrite(output, text, length);
+        return;
+    }
+
+    char* dst = outputReserve(output, length * 2 + 2);
+    char* start = dst;
+    *dst++ = '"';
+    for(i = 0; i < length; i++) {
+        if(text[i] == '"') {
+            *dst++ = '"';
+        }
+        *dst++ = text[i];
+    }
+    *dst++ = '"';
+    output->used += dst - start;
+}
+
+int formatByName(const char* name) {
+    if(strcmp(name, "dir") == 0) {
+        return FORMAT_DIR;
+    }
+    if(strcmp(name, "jsonl") == 0) {
+        return FORMAT_JSONL;
+    }
+    if(strcmp(name, "csv") == 0) {
+        return FORMAT_CSV;
+    }
+    return -1;
+}
+
+void formatBegin(Output* output, int format, int tagged) {
+    if(format == FORMAT_CSV) {
+        outputString(output, tagged ? "image,path,attributes,first_cluster,size,modified\n" : "path,attributes,first_cluster,size,modified\n");
+    }
+}
+
+void formatDirLine(Output* output, const DIRENTRY* directoryEntry, const char* name, const char* longName, size_t longNameLength) {
+    outputDate(output, directoryEntry->changedate);
+    outputChar(output, ' ');
+    outputTime(output, directoryEntry->changetime);
+    outputChar(output, ' ');
+
+    // directory or file
+    if(IS_DIR(directoryEntry->attr)) {
+        outputWrite(output, " <DIR> ", 7);
+    }else{
+        outputWrite(output, "       ", 7);
+    }
+
+    outputNumber(output, directoryEntry->size, 10);
+    outputChar(output, ' ');
+
+    // name left aligned in 12 characters, the long name follows like in 'dir /x'
+    size_t nameLength = strlen(name);
+    char* dst = outputReserve(output, 15 + nameLength + longNameLength);
+    memcpy(dst, name, nameLength);
+    size_t padding = nameLength < 12 ? 12 - nameLength : 0;
+    memset(dst + nameLength, ' ', padding + 2);
+    dst += nameLength + padding + 2;
+    memcpy(dst, longName, longNameLength);
+    dst[longNameLength] = '\n';
+    output->used += nameLength + padding + 3 + longNameLength;
+}
+
+/**
+ * @brief Writes the fields of formatRecord, the record is left open for more fields
+ */
+static void formatFields(Output* output, int format, const char* image, const char* directory, size_t directoryLength, const char* name, const DIRENTRY* directoryEntry, unsigned int firstCluster) {
+    // full path, the root's '\' is not repeated
+    size_t nameLength = strlen(name);
+    if(directoryLength == 1) {
+        directoryLength = 0;
+    }
+    char path[directoryLength + 1 + nameLength];
+    memcpy(path, directory, directoryLength);
+    path[directoryLength] = '\\';
+    memcpy(&path[directoryLength + 1], name, nameLength);
+
+    if(format == FORMAT_JSONL) {
+        if(image) {
+            outputWrite(output, "{\"image\":", 9);
+            outputJsonString(output, image, strlen(image));
+            outputWrite(output, ",\"path\":", 8);
+        }else{
+            outputWrite(output, "{\"path\":", 8);
+        }
+        outputJsonString(output, path, sizeof(path));
+        outputWrite(output, ",\"attributes\":", 14);
+        outputNumber(output, directoryEntry->attr, 0);
+        outputWrite(output, ",\"first_cluster\":", 17);
+        outputNumber(output, firstCluster, 0);
+        outputWrite(output, ",\"size\":", 8);
+        outputNumber(output, directoryEntry->size, 0);
+        outputWrite(output, ",\"modified\":\"", 13);
+        outputTimestamp(output, directoryEntry->changedate, directoryEntry->changetime);
+        outputChar(output, '"');
+    }else{
+        if(image) {
+            outputCsvField(output, image, strlen(image));
+            outputChar(output, ',');
+        }
+        outputCsvField(output, path, sizeof(path));
+        outputChar(output, ',');
+        outputNumber(output, directoryEntry->attr, 0);
+        outputChar(output, ',');
+        outputNumber(output, firstCluster, 0);
+        outputChar(output, ',');
+        outputNumber(output, directoryEntry->size, 0);
+        outputChar(output, ',');
+        outputTimestamp(output, directoryEntry->changedate, directoryEntry->changetime);
+    }
+}
+
+void formatRecord(Output* output, int format, const char* image, const char* directory, size_t directoryLength, const char* name, const DIRENTRY* directoryEntry, unsigned int firstCluster) {
+    formatFields(output, format, image, directory, directoryLength, name, directoryEntry, firstCluster);
+    if(format == FORMAT_JSONL) {
+        outputWrite(output, "}\n", 2);
+    }else{
+        outputChar(output, '\n');
+    }
+}
+
+void formatDeletedRecord(Output* output, int format, const char* directory, size_t directoryLength, const char* name, const DIRENTRY* directoryEntry, unsigned int firstCluster, const char* status) {
+    formatFields(output, format, 0, directory, directoryLength, name, directoryEntry, firstCluster);
+    if(format == FORMAT_JSONL) {
+        outputWrite(output, ",\"status\":\"", 11);
+        outputString(output, status);
+        outputWrite(output, "\"}\n", 3);
+    }else{
+        outputChar(output, ',');
+        outputString(output, status);
+        outputChar(output, '\n');
+    }
+}
+
+void formatCarvedRecord(Output* output, int format, const char* type, unsigned int cluster, unsigned long long offset, unsigned long long length, int complete) {
+    if(format == FORMAT_JSONL) {
+        outputWrite(output, "{\"type\":\"", 9);
+        outputString(output, type);
+        outputWrite(output, "\",\"cluster\":", 12);
+        outputNumber(output, cluster, 0);
+        outputWrite(output, ",\"offset\":", 10);
+        outputNumber(output, offset, 0);
+        outputWrite(output, ",\"length\":", 10);
+        outputNumber(output, length, 0);
+        outputString(output, complete ? ",\"complete\":true}\n" : ",\"complete\":false}\n");
+    }else{
+        outputString(output, type);
+        outputChar(output, ',');
+        outputNumber(output, cluster, 0);
+        outputChar(output, ',');
+        outputNumber(output, offset, 0);
+        outputChar(output, ',');
+        outputNumber(output, length, 0);
+        outputString(output, complete ? ",1\n" : ",0\n");
+    }
+}
+
+void formatDiffRecord(Output* output, int format, const char* change, const char* path, size_t pathLength, const char* oldPath, size_t oldPathLength, const DIRENTRY* directoryEntry) {
+    if(format == FORMAT_JSONL) {
+        outputWrite(output, "{\"change\":\"", 11);
+        outputString(output, change);
+        outputWrite(output, "\",\"path\":", 9);
+        outputJsonString(output, path, pathLength);
+        if(oldPath) {
+            outputWrite(output, ",\"old_path\":", 12);
+            outputJsonString(output, oldPath, oldPathLength);
+        }
+        outputWrite(output, ",\"attributes\":", 14);
+        outputNumber(output, directoryEntry->attr, 0);
+        outputWrite(output, ",\"size\":", 8);
+        outputNumber(output, directoryEntry->size, 0);
+        outputWrite(output, ",\"modified\":\"", 13);
+        outputTimestamp(output, directoryEntry->changedate, directoryEntry->changetime);
+        outputWrite(output, "\"}\n", 3);
+    }else{
+        outputString(output, change);
+        outputChar(output, ',');
+        outputCsvField(output, path, pathLength);
+        outputChar(output, ',');
+        if(oldPath) {
+            outputCsvField(output, oldPath, oldPathLength);
+        }
+        outputChar(output, ',');
+        outputNumber(output, directoryEntry->attr, 0);
+        outputChar(output, ',');
+        outputNumber(output, directoryEntry->size, 0);
+        outputChar(output, ',');
+        outputTimestamp(output, directoryEntry->changedate, directoryEntry->changetime);
+        outputChar(output, '\n');
+    }
+}
@@ -0,0 +1,148 @@
+/*
+ * format.h
+ *
+ * Output layer of the listing. Text is collected in large buffers and
+ * numbers, dates and times are formatted by hand, so that listing millions
+ * of entries is not dominated by printf. Entries can be written in the
+ * classic 'dir' style or as JSON Lines / CSV records.
+ */
+
+#ifndef __FORMAT_H
+#define __FORMAT_H
+
+#include <stddef.h>
+#include <stdio.h>
+#include <string.h>
+
+#include "data.h"
+
+#define OUTPUT_BUFFER_SIZE (1024 * 1024)
+
+#define FORMAT_DIR   0
+#define FORMAT_JSONL 1
+#define FORMAT_CSV   2
+
+typedef struct Output_t {
+    FILE* stream;       // where full buffers go, 0 to keep everything in memory
+    char* data;
+    size_t used;
+    size_t capacity;
+} Output;
+
+/**
+ * @brief Prepares an output
+ * @param stream buffers are flushed to, 0 for an in-memory output that grows instead
+ */
+void outputInit(Output* output, FILE* stream);
+
+/**
+ * @brief Writes the buffered text to the stream (nothing for in-memory outputs)
+ */
+void outputFlush(Output* output);
+
+/**
+ * @brief Flushes and releases the buffer
+ */
+void outputFree(Output* output);
+
+/**
+ * @brief Makes room for length more bytes
+ * @return where to write them
+ */
+char* outputReserve(Output* output, size_t length);
+
+static inline void outputWrite(Output* output, const char* text, size_t length) {
+    char* dst = outputReserve(output, length);
+    memcpy(dst, text, length);
+    output->used += length;
+}
+
+static inline void outputString(Output* output, const char* text) {
+    outputWrite(output, text, strlen(text));
+}
+
+static inline void outputChar(Output* output, char c) {
+    *outputReserve(output, 1) = c;
+    output->used++;
+}
+
+/**
+ * @brief Writes a decimal number, right aligned in width characters padded with spaces
+ * @param width minimum width, 0 for none
+ */
+void outputNumber(Output* output, unsigned long long number, unsigned int width);
+
+/**
+ * @brief Writes a FAT date like 'DD.MM.YYYY'
+ */
+void outputDate(Output* output, unsigned short date);
+
+/**
+ * @brief Writes a FAT time like 'HH:MM:SS'
+ */
+void outputTime(Output* output, unsigned short time);
+
+/**
+ * @brief Writes a FAT date and time like 'YYYY-MM-DDTHH:MM:SS'
+ */
+void outputTimestamp(Output* output, unsigned short date, unsigned short time);
+
+/**
+ * @brief Writes a JSON string literal, text is UTF-8 and copied as is
+ */
+void outputJsonString(Output* output, const char* text, size_t length);
+
+/**
+ * @brief Writes a CSV field, quoted only if needed
+ */
+void outputCsvField(Output* output, const char* text, size_t length);
+
+/**
+ * @return FORMAT_*, -1 for an unknown name
+ */
+int formatByName(const char* name);
+
+/**
+ * @brief Writes what comes before the first entry (the CSV header)
+ * @param tagged 1 if the records name their image (see formatRecord)
+ */
+void formatBegin(Output* output, int format, int tagged);
+
+/**
+ * @brief Writes one entry in the 'dir' style: date, time, <DIR>, size and name
+ * @param name formatted 8.3 name
+ * @param longName UTF-8 long name written after the 8.3 name, longNameLength 0 if there is none
+ */
+void formatDirLine(Output* output, const DIRENTRY* directoryEntry, const char* name, const char* longName, size_t longNameLength);
+
+/**
+ * @brief Writes one entry as a JSON Lines or CSV record
+ * @param image name of the image the entry belongs to, written first; 0 to leave it out
+ * @param directory absolute path of the directory holding the entry
+ * @param name formatted name of the entry
+ * @param firstCluster of the entry
+ */
+void formatRecord(Output* output, int format, const char* image, const char* directory, size_t directoryLength, const char* name, const DIRENTRY* directoryEntry, unsigned int firstCluster);
+
+/**
+ * @brief Writes a deleted entry as a JSON Lines or CSV record, like formatRecord with the recovery status added
+ * @param status name of the status
+ */
+void formatDeletedRecord(Output* output, int format, const char* directory, size_t directoryLength, const char* name, const DIRENTRY* directoryEntry, unsigned int firstCluster, const char* status);
+
+/**
+ * @brief Writes a carved file as a JSON Lines or CSV record
+ * @param type file name extension of its type
+ * @param complete 1 if its end was found
+ */
+void formatCarvedRecord(Output* output, int format, const char* type, unsigned int cluster, unsigned long long offset, unsigned long long length, int complete);
+
+/**
+ * @brief Writes a difference between two images as a JSON Lines or CSV record
+ * @param change name of the kind of change
+ * @param oldPath where a moved entry was, 0 for other changes
+ * @param directoryEntry in the second image, in the first one for a removed entry
+ */
+void formatDiffRecord(Output* output, int format, const char* change, const char* path, size_t pathLength, const char* oldPath, size_t oldPathLength, const DIRENTRY* directoryEntry);
+
+#endif
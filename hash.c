@@ -0,0 +1,146 @@
+#include <string.h>
+
+#include "hash.h"
+
+#define PRIME64_1 0x9E3779B185EBCA87ull
+#define PRIME64_2 0xC2B2AE3D27D4EB4Full
+#define PRIME64_3 0x165667B19E3779F9ull
+#define PRIME64_4 0x85EBCA77C2B2AE63ull
+#define PRIME64_5 0x27D4EB2F165667C5ull
+
+static inline unsigned long long rotl64(unsigned long long x, int r) {
+    return (x << r) | (x >> (64 - r));
+}
+
+// little endian loads, memcpy keeps them legal for unaligned data
+static inline unsigned long long read64(const unsigned char* p) {
+    unsigned long long v;
+    memcpy(&v, p, 8);
+#if defined(__BYTE_ORDER__) && __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+    v = __builtin_bswap64(v);
+#endif
+    return v;
+}
+
+static inline unsigned int read32(const unsigned char* p) {
+    unsigned int v;
+    memcpy(&v, p, 4);
+#if defined(__BYTE_ORDER__) && __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+    v = __builtin_bswap32(v);
+#endif
+    return v;
+}
+
+static inline unsigned long long round64(unsigned long long accumulator, unsigned long long input) {
+    accumulator += input * PRIME64_2;
+    accumulator = rotl64(accumulator, 31);
+    return accumulator * PRIME64_1;
+}
+
+static inline unsigned long long mergeRound(unsigned long long hash, unsigned long long accumulator) {
+    hash ^= round64(0, accumulator);
+    return hash * PRIME64_1 + PRIME64_4;
+}
+
+/**
+ * @brief Consumes whole 32 byte stripes
+ * @return number of bytes consumed
+ */
+static size_t consumeStripes(unsigned long long* v, const unsigned char* p, size_t length) {
+    const unsigned char* start = p;
+    const unsigned char* limit = p + length - (length % 32);
+    unsigned long long v1 = v[0], v2 = v[1], v3 = v[2], v4 = v[3];
+    while(p < limit) {
+        v1 = round64(v1, read64(p));
+        v2 = round64(v2, read64(p + 8));
+        v3 = round64(v3, read64(p + 16));
+        v4 = round64(v4, read64(p + 24));
+        p += 32;
+    }
+    v[0] = v1;
+    v[1] = v2;
+    v[2] = v3;
+    v[3] = v4;
+    return p - start;
+}
+
+void xxh64Init(Xxh64* state, unsigned long long seed) {
+    memset(state, 0, sizeof(Xxh64));
+    state->seed = seed;
+    state->v[0] = seed + PRIME64_1 + PRIME64_2;
+    state->v[1] = seed + PRIME64_2;
+    state->v[2] = seed;
+    state->v[3] = seed - PRIME64_1;
+}
+
+void xxh64Update(Xxh64* state, const void* data, size_t length) {
+    const unsigned char* p = (const unsigned char*)data;
+    state->total += length;
+
+    // complete a buffered stripe first
+    if(state->buffered > 0) {
+        size_t fill = 32 - state->buffered;
+        if(fill > length) {
+            fill = length;
+        }
+        memcpy(&state->buffer[state->buffered], p, fill);
+        state->buffered += fill;
+        p += fill;
+        length -= fill;
+        if(state->buffered < 32) {
+            return;
+        }
+        consumeStripes(state->v, state->buffer, 32);
+        state->buffered = 0;
+    }
+
+    size_t consumed = consumeStripes(state->v, p, length);
+    memcpy(state->buffer, p + consumed, length - consumed);
+    state->buffered = length - consumed;
+}
+
+unsigned long long xxh64Digest(const Xxh64* state) {
+    unsigned long long hash;
+    if(state->total >= 32) {
+        const unsigned long long* v = state->v;
+        hash = rotl64(v[0], 1) + rotl64(v[1], 7) + rotl64(v[2], 12) + rotl64(v[3], 18);
+        hash = mergeRound(hash, v[0]);
+        hash = mergeRound(hash, v[1]);
+        hash = mergeRound(hash, v[2]);
+        hash = mergeRound(hash, v[3]);
+    }else{
+        hash = state->seed + PRIME64_5;
+    }
+    hash += state->total;
+
+    // the tail in 8, 4 and 1 byte steps
+    const unsigned char* p = state->buffer;
+    const unsigned char* end = p + state->buffered;
+    for(; p + 8 <= end; p += 8) {
+        hash ^= round64(0, read64(p));
+        hash = rotl64(hash, 27) * PRIME64_1 + PRIME64_4;
+    }
+    if(p + 4 <= end) {
+        hash ^= (unsigned long long)read32(p) * PRIME64_1;
+        hash = rotl64(hash, 23) * PRIME64_2 + PRIME64_3;
+        p += 4;
+    }
+    for(; p < end; p++) {
+        hash ^= *p * PRIME64_5;
+        hash = rotl64(hash, 11) * PRIME64_1;
+    }
+
+    hash ^= hash >> 33;
+    hash *= PRIME64_2;
+    hash ^= hash >> 29;
+    hash *= PRIME64_3;
+    hash ^= hash >> 32;
+    return hash;
+}
+
+unsigned long long xxh64(const void* data, size_t length, unsigned long long seed) {
+    Xxh64 state;
+    xxh64Init(&state, seed);
+    xxh64Update(&state, data, length);
+    return xxh64Digest(&state);
+}
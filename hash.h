@@ -0,0 +1,38 @@
+/*
+ * hash.h
+ *
+ * XXH64, a fast non-cryptographic hash, for recognising unchanged data
+ * (e.g. the FAT region of an image) without comparing it byte by byte.
+ */
+
+#ifndef __HASH_H
+#define __HASH_H
+
+#include <stddef.h>
+
+/**
+ * @brief State of a hash over data that arrives in pieces
+ */
+typedef struct Xxh64_t {
+    unsigned long long v[4];        // accumulators of the 32 byte stripes
+    unsigned long long seed;
+    unsigned long long total;       // bytes hashed so far
+    unsigned char buffer[32];       // incomplete stripe
+    unsigned int buffered;
+} Xxh64;
+
+void xxh64Init(Xxh64* state, unsigned long long seed);
+
+void xxh64Update(Xxh64* state, const void* data, size_t length);
+
+/**
+ * @return hash of everything passed to xxh64Update so far, the state can be updated further
+ */
+unsigned long long xxh64Digest(const Xxh64* state);
+
+/**
+ * @return hash of length bytes in one go
+ */
+unsigned long long xxh64(const void* data, size_t length, unsigned long long seed);
+
+#endif
@@ -0,0 +1,510 @@
+#define _FILE_OFFSET_BITS 64
+#define _GNU_SOURCE
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <unistd.h>
+
+#ifndef _WIN32
+#include <sys/mman.h>
+#endif
+#ifdef __linux__
+#include <sys/sendfile.h>
+#endif
+
+#include "counters.h"
+#include "image.h"
+
+// Unix / Windows interop
+#ifndef O_BINARY
+#define O_BINARY 0
+#endif
+
+#define IMAGE_COPY_RANGE    0   // copy_file_range
+#define IMAGE_COPY_SENDFILE 1
+#define IMAGE_COPY_WRITE    2   // write from the mapping or a buffer
+
+#define IMAGE_COPY_BUFFER   (1024 * 1024)
+#define IMAGE_RANGES_MAX    (1u << 20)  // data ranges of a sparse file that are looked up, more and it counts as all data
+
+/**
+ * @brief Finds the ranges of a sparse file that hold data, leaves image->data 0 if there are no holes
+ */
+static void imageFindData(Image* image) {
+#if defined(SEEK_DATA) && defined(SEEK_HOLE)
+    unsigned int capacity = 16;
+    ImageRange* ranges = (ImageRange*)malloc(sizeof(ImageRange) * capacity);
+    unsigned int count = 0;
+    unsigned long long offset = 0;
+    while(ranges && offset < image->size) {
+        off_t data = lseek(image->handle, (off_t)offset, SEEK_DATA);
+        if(data < 0) {
+            // ENXIO: only a hole is left; anything else and the file system can't tell
+            if(errno != ENXIO) {
+                free(ranges);
+                ranges = 0;
+            }
+            break;
+        }
+        off_t hole = lseek(image->handle, data, SEEK_HOLE);
+        unsigned long long end = hole < 0 || (unsigned long long)hole > image->size ? image->size : (unsigned long long)hole;
+        if(count == capacity) {
+            ImageRange* larger = capacity < IMAGE_RANGES_MAX ? (ImageRange*)realloc(ranges, sizeof(ImageRange) * capacity * 2) : 0;
+            if(!larger) {
+                free(ranges);
+                ranges = 0;
+                break;
+            }
+            ranges = larger;
+            capacity *= 2;
+        }
+        ranges[count].offset = data;
+        ranges[count].length = end - data;
+        count++;
+        offset = end;
+    }
+    if(ranges && count == 1 && ranges[0].offset == 0 && ranges[0].length == image->size) {
+        // no holes after all
+        free(ranges);
+        ranges = 0;
+    }
+    image->data = ranges;
+    image->dataCount = ranges ? count : 0;
+#else
+    (void)image;
+#endif
+}
+
+/**
+ * @brief Opens an image read only or for reading and writing
+ */
+static int imageOpenMode(Image* image, const char* filename, int writable) {
+    image->handle = open(filename, (writable ? O_RDWR : O_RDONLY) | O_BINARY);
+    image->size = 0;
+    image->map = 0;
+    image->copyMode = IMAGE_COPY_RANGE;
+    image->device = 0;
+    image->data = 0;
+    image->dataCount = 0;
+    image->writable = writable;
+    image->base = 0;
+    image->mapping = 0;
+    image->mappingSize = 0;
+
+    if(image->handle == -1) {
+        return -1;
+    }
+
+    // block devices report a size of 0, ask the device itself
+    struct stat st;
+    int regular = fstat(image->handle, &st) == 0 && S_ISREG(st.st_mode);
+    if(regular) {
+        image->size = st.st_size;
+    }else{
+        off_t end = lseek(image->handle, 0, SEEK_END);
+        image->size = (end > 0) ? (unsigned long long)end : 0;
+    }
+
+    // a boot sector never starts like a compressed file
+    unsigned char magic[4];
+    int format = imageRead(image, magic, sizeof(magic), 0) == 0 ? blockFormat(magic, sizeof(magic)) : 0;
+    if(format && writable) {
+        close(image->handle);
+        image->handle = -1;
+        errno = EROFS;
+        return -1;
+    }
+    if(format) {
+        image->device = (BlockDevice*)malloc(sizeof(BlockDevice));
+        if(!image->device || blockDeviceOpen(image->device, image->handle, format) != 0) {
+            int error = image->device ? errno : ENOMEM;
+            free(image->device);
+            image->device = 0;
+            close(image->handle);
+            image->handle = -1;
+            errno = error;
+            return -1;
+        }
+        image->size = image->device->size;
+        return 0;
+    }
+
+    // the blocks a file takes up tell whether it has holes at all; writes would fill them
+    if(regular && !writable && (unsigned long long)st.st_blocks * 512 < image->size) {
+        imageFindData(image);
+    }
+
+#ifndef _WIN32
+    if(image->size > 0 && image->size == (size_t)image->size) {
+        // a shared mapping sees what is written through the file
+        void* map = mmap(0, (size_t)image->size, PROT_READ, writable ? MAP_SHARED : MAP_PRIVATE, image->handle, 0);
+        if(map != MAP_FAILED) {
+            image->map = (const unsigned char*)map;
+            image->mapping = map;
+            image->mappingSize = (size_t)image->size;
+            // a directory walk jumps all over the image, don't read ahead by default
+            imageAdvise(image, 0, image->size, IMAGE_ADVICE_RANDOM);
+        }
+    }
+#endif
+
+    return 0;
+}
+
+int imageOpen(Image* image, const char* filename) {
+    return imageOpenMode(image, filename, 0);
+}
+
+int imageOpenWritable(Image* image, const char* filename) {
+    return imageOpenMode(image, filename, 1);
+}
+
+int imageRestrict(Image* image, unsigned long long offset, unsigned long long length) {
+    if(offset > image->size || length > image->size - offset) {
+        errno = EINVAL;
+        return -1;
+    }
+    image->base += offset;
+    image->size = length;
+    if(image->map) {
+        image->map += offset;
+    }
+
+    // data ranges outside the window go, the others are clipped to it; none left and it is all hole
+    if(image->data) {
+        unsigned int count = 0;
+        unsigned int i;
+        for(i = 0; i < image->dataCount; i++) {
+            unsigned long long start = image->data[i].offset;
+            unsigned long long end = start + image->data[i].length;
+            if(end <= offset || start >= offset + length) {
+                continue;
+            }
+            start = start > offset ? start - offset : 0;
+            end = end - offset < length ? end - offset : length;
+            image->data[count].offset = start;
+            image->data[count].length = end - start;
+            count++;
+        }
+        image->dataCount = count;
+    }
+    return 0;
+}
+
+void imageClose(Image* image) {
+    if(image->device) {
+        blockDeviceClose(image->device);
+        free(image->device);
+        image->device = 0;
+    }
+    free(image->data);
+    image->data = 0;
+    image->dataCount = 0;
+#ifndef _WIN32
+    if(image->mapping) {
+        munmap(image->mapping, image->mappingSize);
+    }
+#endif
+    if(image->handle != -1) {
+        close(image->handle);
+    }
+    image->map = 0;
+    image->mapping = 0;
+    image->handle = -1;
+}
+
+const void* imageView(Image* image, unsigned long long offset, size_t length, void* scratch) {
+    if(image->map) {
+        if(offset > image->size || length > image->size - offset) {
+            errno = EINVAL;
+            return 0;
+        }
+        COUNT_SEEK(offset, length);
+        COUNT(COUNTER_VIEWS, 1);
+        COUNT(COUNTER_VIEW_BYTES, length);
+        return image->map + offset;
+    }
+
+    if(imageRead(image, scratch, length, offset) != 0) {
+        return 0;
+    }
+    return scratch;
+}
+
+int imageRead(Image* image, void* buf, size_t length, unsigned long long offset) {
+    if(image->map) {
+        const void* view = imageView(image, offset, length, 0);
+        if(!view) {
+            return -1;
+        }
+        memcpy(buf, view, length);
+        return 0;
+    }
+
+    COUNT_SEEK(offset, length);
+    if(image->device) {
+        return blockDeviceRead(image->device, buf, length, image->base + offset);
+    }
+
+    char* dst = (char*)buf;
+    unsigned long long dataEnd = 0;
+    while(length > 0) {
+        // holes read as zeros without asking the file system
+        if(image->data && offset >= dataEnd) {
+            unsigned long long dataStart = imageNextData(image, offset, &dataEnd);
+            if(dataStart > offset) {
+                size_t zeros = dataStart - offset < length ? (size_t)(dataStart - offset) : length;
+                memset(dst, 0, zeros);
+                dst += zeros;
+                offset += zeros;
+                length -= zeros;
+                continue;
+            }
+        }
+        size_t request = image->data && dataEnd - offset < length ? (size_t)(dataEnd - offset) : length;
+#ifdef _WIN32
+        ssize_t bytesRead = -1;
+        if(lseek(image->handle, (off_t)(image->base + offset), SEEK_SET) != (off_t)-1) {
+            bytesRead = read(image->handle, dst, request);
+        }
+#else
+        ssize_t bytesRead = pread(image->handle, dst, request, (off_t)(image->base + offset));
+#endif
+        COUNT(COUNTER_READ_CALLS, 1);
+        if(bytesRead < 0 && errno == EINTR) {
+            continue;
+        }
+        if(bytesRead <= 0) {
+            if(bytesRead == 0) {
+                errno = EIO;
+            }
+            return -1;
+        }
+        COUNT(COUNTER_READ_BYTES, bytesRead);
+        dst += bytesRead;
+        offset += bytesRead;
+        length -= bytesRead;
+    }
+    return 0;
+}
+
+int imageWrite(Image* image, const void* buf, size_t length, unsigned long long offset) {
+    if(!image->writable) {
+        errno = EBADF;
+        return -1;
+    }
+    if(offset > image->size || length > image->size - offset) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    const char* src = (const char*)buf;
+    while(length > 0) {
+#ifdef _WIN32
+        ssize_t written = -1;
+        if(lseek(image->handle, (off_t)(image->base + offset), SEEK_SET) != (off_t)-1) {
+            written = write(image->handle, src, length);
+        }
+#else
+        ssize_t written = pwrite(image->handle, src, length, (off_t)(image->base + offset));
+#endif
+        if(written < 0 && errno == EINTR) {
+            continue;
+        }
+        if(written <= 0) {
+            if(written == 0) {
+                errno = EIO;
+            }
+            return -1;
+        }
+        src += written;
+        offset += written;
+        length -= written;
+    }
+    return 0;
+}
+
+/**
+ * @brief Writes all of length bytes
+ * @return 0 on success, -1 otherwise
+ */
+static int writeAll(int fd, const char* src, unsigned long long length) {
+    while(length > 0) {
+        ssize_t written = write(fd, src, length > (1u << 30) ? (1u << 30) : (size_t)length);
+        COUNT(COUNTER_COPY_CALLS, 1);
+        if(written < 0 && errno == EINTR) {
+            continue;
+        }
+        if(written <= 0) {
+            return -1;
+        }
+        COUNT(COUNTER_COPY_BYTES, written);
+        src += written;
+        length -= written;
+    }
+    return 0;
+}
+
+/**
+ * @return 1 if a kernel side copy is not supported for this pair of files, so a slower mode has to be tried
+ */
+static int copyUnsupported(int error) {
+    return error == ENOSYS || error == EXDEV || error == EINVAL || error == EOPNOTSUPP || error == EBADF;
+}
+
+int imageCopy(Image* image, int fd, unsigned long long offset, unsigned long long length) {
+    if(offset > image->size || length > image->size - offset) {
+        errno = EINVAL;
+        return -1;
+    }
+    COUNT_SEEK(offset, length);
+
+#ifdef __linux__
+    // several workers may copy at once, they all learn from the first failure; the kernel can't decompress
+    int mode = image->device ? IMAGE_COPY_WRITE : __atomic_load_n(&image->copyMode, __ATOMIC_RELAXED);
+    while(mode < IMAGE_COPY_WRITE && length > 0) {
+        loff_t inputOffset = image->base + offset;
+        ssize_t copied = (mode == IMAGE_COPY_RANGE)
+            ? copy_file_range(image->handle, &inputOffset, fd, 0, (size_t)length, 0)
+            : sendfile(fd, image->handle, (off_t*)&inputOffset, (size_t)length);
+        COUNT(COUNTER_COPY_CALLS, 1);
+        if(copied > 0) {
+            COUNT(COUNTER_COPY_BYTES, copied);
+            offset += copied;
+            length -= copied;
+        }else if(copied < 0 && errno == EINTR) {
+            continue;
+        }else if(copied < 0 && copyUnsupported(errno)) {
+            mode++;
+            __atomic_store_n(&image->copyMode, mode, __ATOMIC_RELAXED);
+        }else{
+            if(copied == 0) {
+                errno = EIO;
+            }
+            return -1;
+        }
+    }
+#endif
+
+    if(length == 0) {
+        return 0;
+    }
+    if(image->map) {
+        return writeAll(fd, (const char*)image->map + offset, length);
+    }
+
+    char* buffer = (char*)malloc(IMAGE_COPY_BUFFER);
+    if(!buffer) {
+        return -1;
+    }
+    int ret = 0;
+    while(length > 0 && ret == 0) {
+        size_t chunk = length > IMAGE_COPY_BUFFER ? IMAGE_COPY_BUFFER : (size_t)length;
+        ret = imageRead(image, buffer, chunk, offset);
+        if(ret == 0) {
+            ret = writeAll(fd, buffer, chunk);
+        }
+        offset += chunk;
+        length -= chunk;
+    }
+    free(buffer);
+    return ret;
+}
+
+/**
+ * @brief Passes a hint for a range inside the image on
+ */
+static void imageAdviseRange(Image* image, unsigned long long offset, unsigned long long length, int advice) {
+#ifndef _WIN32
+    // reads and copies of an unmapped image go through the page cache as well
+    if(!image->map) {
+        int fileAdvice;
+        switch(advice) {
+            case IMAGE_ADVICE_SEQUENTIAL: fileAdvice = POSIX_FADV_SEQUENTIAL; break;
+            case IMAGE_ADVICE_RANDOM:     fileAdvice = POSIX_FADV_RANDOM; break;
+            case IMAGE_ADVICE_WILLNEED:   fileAdvice = POSIX_FADV_WILLNEED; break;
+            default:                      fileAdvice = POSIX_FADV_NORMAL; break;
+        }
+        posix_fadvise(image->handle, (off_t)(image->base + offset), (off_t)length, fileAdvice);
+        return;
+    }
+
+    // madvise wants a page aligned start, pages count from the start of the whole file mapping
+    long pageSize = sysconf(_SC_PAGESIZE);
+    offset += image->base;
+    unsigned long long start = offset - (offset % pageSize);
+    length += offset - start;
+
+    int posixAdvice;
+    switch(advice) {
+        case IMAGE_ADVICE_SEQUENTIAL: posixAdvice = POSIX_MADV_SEQUENTIAL; break;
+        case IMAGE_ADVICE_RANDOM:     posixAdvice = POSIX_MADV_RANDOM; break;
+        case IMAGE_ADVICE_WILLNEED:   posixAdvice = POSIX_MADV_WILLNEED; break;
+        default:                      posixAdvice = POSIX_MADV_NORMAL; break;
+    }
+    posix_madvise((char*)image->mapping + start, (size_t)length, posixAdvice);
+#endif
+}
+
+void imageAdvise(Image* image, unsigned long long offset, unsigned long long length, int advice) {
+    // the compressed file is read block by block, hints on it would be for the wrong offsets
+    if(offset >= image->size || image->device) {
+        return;
+    }
+    if(length > image->size - offset) {
+        length = image->size - offset;
+    }
+    if(advice != IMAGE_ADVICE_WILLNEED || !image->data) {
+        imageAdviseRange(image, offset, length, advice);
+        return;
+    }
+
+    // reading the holes of a sparse file ahead would only fill the page cache with zeros
+    unsigned long long end = offset + length;
+    while(offset < end) {
+        unsigned long long dataEnd;
+        unsigned long long dataStart = imageNextData(image, offset, &dataEnd);
+        if(dataStart >= end) {
+            break;
+        }
+        if(dataEnd > end) {
+            dataEnd = end;
+        }
+        imageAdviseRange(image, dataStart, dataEnd - dataStart, advice);
+        offset = dataEnd;
+    }
+}
+
+unsigned long long imageNextData(const Image* image, unsigned long long offset, unsigned long long* end) {
+    if(!image->data) {
+        *end = image->size;
+        return offset;
+    }
+
+    // first range ending after offset
+    unsigned int low = 0, high = image->dataCount;
+    while(low < high) {
+        unsigned int middle = low + (high - low) / 2;
+        if(image->data[middle].offset + image->data[middle].length <= offset) {
+            low = middle + 1;
+        }else{
+            high = middle;
+        }
+    }
+    if(low == image->dataCount) {
+        *end = image->size;
+        return image->size;
+    }
+    *end = image->data[low].offset + image->data[low].length;
+    return image->data[low].offset > offset ? image->data[low].offset : offset;
+}
+
+void imageCacheSize(Image* image, size_t bytes) {
+    if(image->device) {
+        blockDeviceCacheSize(image->device, bytes);
+    }
+}
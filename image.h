@@ -0,0 +1,121 @@
+/*
+ * image.h
+ *
+ * Access to the raw image file. The image is memory mapped whenever possible
+ * so that directory entries and the FAT can be used in place; inputs that
+ * can't be mapped are read with pread into caller supplied buffers.
+ * Compressed images (gzip, seekable zstd) are read through a block device
+ * that decompresses what is touched (see blockdev.h). The holes of sparse
+ * files are known, they are not read and can be passed over. Raw images
+ * can be opened for writing as well.
+ */
+
+#ifndef __IMAGE_H
+#define __IMAGE_H
+
+#include <stddef.h>
+
+#include "blockdev.h"
+
+#define IMAGE_ADVICE_NORMAL     0
+#define IMAGE_ADVICE_SEQUENTIAL 1
+#define IMAGE_ADVICE_RANDOM     2
+#define IMAGE_ADVICE_WILLNEED   3
+
+/**
+ * @brief Range of a sparse file that holds data
+ */
+typedef struct ImageRange_t {
+    unsigned long long offset;
+    unsigned long long length;
+} ImageRange;
+
+typedef struct Image_t {
+    int handle;
+    unsigned long long size;    // uncompressed
+    const unsigned char* map;   // 0 if the image could not be mapped
+    int copyMode;               // fastest way imageCopy found to work so far
+    BlockDevice* device;        // compressed images, 0 for raw ones
+    ImageRange* data;           // sparse files: the ranges with data, ascending; 0 if there are no holes
+    unsigned int dataCount;
+    int writable;               // opened with imageOpenWritable
+    unsigned long long base;    // offset of what the image shows in the file, see imageRestrict
+    void* mapping;              // whole file mapping, map points into it
+    size_t mappingSize;
+} Image;
+
+/**
+ * @brief Opens an image read only and maps it if possible; a compressed one is opened as a block device
+ * @return 0 on success, -1 otherwise (errno is set, ENOTSUP for a compression that is not compiled in)
+ */
+int imageOpen(Image* image, const char* filename);
+
+/**
+ * @brief Opens an image for reading and writing. The mapping is shared, so it
+ * sees what imageWrite writes; holes are not looked up, they may be filled.
+ * @return 0 on success, -1 otherwise (errno is set, EROFS for a compressed image)
+ */
+int imageOpenWritable(Image* image, const char* filename);
+
+/**
+ * @brief Narrows an open image down to a range of the file, e.g. one partition
+ * of a disk: offsets, the size and the sparse data ranges are relative to its
+ * start from then on
+ * @param offset of the range, relative to the current start
+ * @return 0 on success, -1 otherwise (errno is set, EINVAL if the range is outside the image)
+ */
+int imageRestrict(Image* image, unsigned long long offset, unsigned long long length);
+
+/**
+ * @brief Unmaps and closes the image
+ */
+void imageClose(Image* image);
+
+/**
+ * @brief Returns a view on length bytes at offset.
+ * If the image is mapped, the view points directly into the mapping and
+ * scratch is not touched. Otherwise the bytes are read into scratch, which
+ * must hold at least length bytes.
+ * @return pointer to the data, 0 if the range can't be read
+ */
+const void* imageView(Image* image, unsigned long long offset, size_t length, void* scratch);
+
+/**
+ * @brief Copies length bytes at offset into buf
+ * @return 0 on success, -1 otherwise
+ */
+int imageRead(Image* image, void* buf, size_t length, unsigned long long offset);
+
+/**
+ * @brief Writes length bytes at offset, inside the image
+ * @return 0 on success, -1 otherwise (errno is set, EBADF if the image is read only)
+ */
+int imageWrite(Image* image, const void* buf, size_t length, unsigned long long offset);
+
+/**
+ * @brief Copies length bytes at offset to the current position of a file.
+ * The copy stays in the kernel where possible (copy_file_range, then sendfile),
+ * otherwise it is written from the mapping or through a buffer.
+ * @param fd file to write to
+ * @return 0 on success, -1 otherwise (errno is set)
+ */
+int imageCopy(Image* image, int fd, unsigned long long offset, unsigned long long length);
+
+/**
+ * @brief Passes an access pattern hint for a range on to the kernel, for the mapping or the file
+ */
+void imageAdvise(Image* image, unsigned long long offset, unsigned long long length, int advice);
+
+/**
+ * @brief Finds the next data of a sparse file, everything is data in other images
+ * @param end receives the end of the data found
+ * @return start of the first data at or after offset, the image size if there is none
+ */
+unsigned long long imageNextData(const Image* image, unsigned long long offset, unsigned long long* end);
+
+/**
+ * @brief Sets how many bytes of decompressed blocks a compressed image keeps, nothing for raw images
+ */
+void imageCacheSize(Image* image, size_t bytes);
+
+#endif
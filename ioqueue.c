@@ -0,0 +1,347 @@
+#define _FILE_OFFSET_BITS 64
+#define _GNU_SOURCE
+
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#ifdef __linux__
+#include <linux/io_uring.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#endif
+
+#include "counters.h"
+#include "ioqueue.h"
+
+#if defined(__linux__) && defined(__NR_io_uring_setup) && defined(IORING_OFF_SQ_RING)
+#define IO_HAVE_URING 1
+#endif
+
+#ifdef IO_HAVE_URING
+
+static int uringSetup(unsigned int entries, struct io_uring_params* params) {
+    return (int)syscall(__NR_io_uring_setup, entries, params);
+}
+
+static int uringEnter(int ring, unsigned int submit, unsigned int complete, unsigned int flags) {
+    return (int)syscall(__NR_io_uring_enter, ring, submit, complete, flags, 0, 0);
+}
+
+/**
+ * @brief Releases the rings of a queue, also after a half done setup
+ */
+static void uringFree(IoQueue* queue) {
+    if(queue->sqes) {
+        munmap(queue->sqes, queue->sqesSize);
+    }
+    if(queue->cqMap && queue->cqMap != queue->sqMap) {
+        munmap(queue->cqMap, queue->cqMapSize);
+    }
+    if(queue->sqMap) {
+        munmap(queue->sqMap, queue->sqMapSize);
+    }
+    if(queue->ring != -1) {
+        close(queue->ring);
+    }
+    queue->sqes = 0;
+    queue->cqMap = 0;
+    queue->sqMap = 0;
+    queue->ring = -1;
+}
+
+/**
+ * @return 0 on success, -1 if the kernel has no io_uring for us (errno is set)
+ */
+static int uringInit(IoQueue* queue) {
+    struct io_uring_params params;
+    memset(&params, 0, sizeof(params));
+    queue->ring = uringSetup(queue->depth, &params);
+    if(queue->ring < 0) {
+        queue->ring = -1;
+        return -1;
+    }
+
+    queue->sqMapSize = params.sq_off.array + params.sq_entries * sizeof(unsigned int);
+    queue->cqMapSize = params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+    // newer kernels put both rings in one mapping
+    if(params.features & IORING_FEAT_SINGLE_MMAP) {
+        if(queue->cqMapSize > queue->sqMapSize) {
+            queue->sqMapSize = queue->cqMapSize;
+        }
+        queue->cqMapSize = queue->sqMapSize;
+    }
+
+    void* map = mmap(0, queue->sqMapSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, queue->ring, IORING_OFF_SQ_RING);
+    if(map == MAP_FAILED) {
+        uringFree(queue);
+        return -1;
+    }
+    queue->sqMap = map;
+    if(params.features & IORING_FEAT_SINGLE_MMAP) {
+        queue->cqMap = queue->sqMap;
+    }else{
+        map = mmap(0, queue->cqMapSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, queue->ring, IORING_OFF_CQ_RING);
+        if(map == MAP_FAILED) {
+            uringFree(queue);
+            return -1;
+        }
+        queue->cqMap = map;
+    }
+    queue->sqesSize = params.sq_entries * sizeof(struct io_uring_sqe);
+    map = mmap(0, queue->sqesSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, queue->ring, IORING_OFF_SQES);
+    if(map == MAP_FAILED) {
+        uringFree(queue);
+        return -1;
+    }
+    queue->sqes = map;
+
+    char* sq = (char*)queue->sqMap;
+    char* cq = (char*)queue->cqMap;
+    queue->sqTail = (unsigned int*)(sq + params.sq_off.tail);
+    queue->sqMask = (unsigned int*)(sq + params.sq_off.ring_mask);
+    queue->sqArray = (unsigned int*)(sq + params.sq_off.array);
+    queue->cqHead = (unsigned int*)(cq + params.cq_off.head);
+    queue->cqTail = (unsigned int*)(cq + params.cq_off.tail);
+    queue->cqMask = (unsigned int*)(cq + params.cq_off.ring_mask);
+    queue->cqes = cq + params.cq_off.cqes;
+    queue->engine = IO_ENGINE_URING;
+    return 0;
+}
+
+static int uringSubmit(IoQueue* queue, IoRequest* request) {
+    // only this thread writes the submission ring, the kernel reads it
+    unsigned int tail = *queue->sqTail;
+    unsigned int index = tail & *queue->sqMask;
+    struct io_uring_sqe* sqe = &((struct io_uring_sqe*)queue->sqes)[index];
+    memset(sqe, 0, sizeof(struct io_uring_sqe));
+    sqe->opcode = IORING_OP_READ;
+    sqe->fd = queue->fd;
+    sqe->addr = (unsigned long long)(size_t)request->buf;
+    sqe->len = (unsigned int)request->length;
+    sqe->off = request->offset;
+    sqe->user_data = (unsigned long long)(size_t)request;
+    queue->sqArray[index] = index;
+    __atomic_store_n(queue->sqTail, tail + 1, __ATOMIC_RELEASE);
+
+    int submitted;
+    while((submitted = uringEnter(queue->ring, 1, 0, 0)) < 0 && errno == EINTR) ;
+    if(submitted != 1) {
+        // not taken by the kernel, take it back
+        __atomic_store_n(queue->sqTail, tail, __ATOMIC_RELEASE);
+        return -1;
+    }
+    return 0;
+}
+
+static IoRequest* uringWait(IoQueue* queue, int block) {
+    for(;;) {
+        unsigned int head = *queue->cqHead;
+        if(head != __atomic_load_n(queue->cqTail, __ATOMIC_ACQUIRE)) {
+            struct io_uring_cqe* cqe = &((struct io_uring_cqe*)queue->cqes)[head & *queue->cqMask];
+            IoRequest* request = (IoRequest*)(size_t)cqe->user_data;
+            request->result = cqe->res;
+            __atomic_store_n(queue->cqHead, head + 1, __ATOMIC_RELEASE);
+            return request;
+        }
+        if(!block) {
+            return 0;
+        }
+        if(uringEnter(queue->ring, 0, 1, IORING_ENTER_GETEVENTS) < 0 && errno != EINTR) {
+            return 0;
+        }
+    }
+}
+
+#endif
+
+/**
+ * @brief Worker of the thread engine: reads queued requests until the queue stops
+ */
+static void* ioWorker(void* arg) {
+    IoQueue* queue = (IoQueue*)arg;
+    pthread_mutex_lock(&queue->mutex);
+    for(;;) {
+        while(!queue->queued && !queue->stopping) {
+            pthread_cond_wait(&queue->queuedChanged, &queue->mutex);
+        }
+        IoRequest* request = queue->queued;
+        if(!request) {
+            break;
+        }
+        queue->queued = request->next;
+        pthread_mutex_unlock(&queue->mutex);
+
+        // like a read from the ring: as much as there is, short at the end of the file
+        size_t done = 0;
+        long long result = 0;
+        while(done < request->length) {
+            ssize_t bytesRead = pread(queue->fd, (char*)request->buf + done, request->length - done, (off_t)(request->offset + done));
+            if(bytesRead < 0 && errno == EINTR) {
+                continue;
+            }
+            if(bytesRead < 0) {
+                result = -errno;
+                break;
+            }
+            if(bytesRead == 0) {
+                break;
+            }
+            done += bytesRead;
+        }
+        request->result = result < 0 ? result : (long long)done;
+
+        pthread_mutex_lock(&queue->mutex);
+        request->next = queue->completed;
+        queue->completed = request;
+        pthread_cond_signal(&queue->completedChanged);
+    }
+    pthread_mutex_unlock(&queue->mutex);
+    return 0;
+}
+
+/**
+ * @return 0 on success, -1 if not a single worker could be started
+ */
+static int threadsInit(IoQueue* queue) {
+    pthread_mutex_init(&queue->mutex, 0);
+    pthread_cond_init(&queue->queuedChanged, 0);
+    pthread_cond_init(&queue->completedChanged, 0);
+    unsigned int threads = queue->depth < IO_QUEUE_THREADS ? queue->depth : IO_QUEUE_THREADS;
+    while(queue->threadCount < threads && pthread_create(&queue->threads[queue->threadCount], 0, ioWorker, queue) == 0) {
+        queue->threadCount++;
+    }
+    if(queue->threadCount == 0) {
+        pthread_cond_destroy(&queue->completedChanged);
+        pthread_cond_destroy(&queue->queuedChanged);
+        pthread_mutex_destroy(&queue->mutex);
+        errno = EAGAIN;
+        return -1;
+    }
+    queue->engine = IO_ENGINE_THREADS;
+    return 0;
+}
+
+int ioQueueInit(IoQueue* queue, int fd, unsigned int depth, int engine) {
+    memset(queue, 0, sizeof(IoQueue));
+    queue->fd = fd;
+    queue->depth = depth > 0 ? depth : 1;
+    queue->ring = -1;
+
+#ifdef IO_HAVE_URING
+    if(engine != IO_ENGINE_THREADS && uringInit(queue) == 0) {
+        return 0;
+    }
+#endif
+    if(engine == IO_ENGINE_URING) {
+#ifndef IO_HAVE_URING
+        errno = ENOSYS;
+#endif
+        return -1;
+    }
+    return threadsInit(queue);
+}
+
+int ioQueueSubmit(IoQueue* queue, IoRequest* request) {
+    if(queue->pending >= queue->depth) {
+        errno = EBUSY;
+        return -1;
+    }
+    request->result = 0;
+    request->next = 0;
+
+#ifdef IO_HAVE_URING
+    if(queue->engine == IO_ENGINE_URING) {
+        if(uringSubmit(queue, request) != 0) {
+            return -1;
+        }
+    }
+#endif
+    if(queue->engine == IO_ENGINE_THREADS) {
+        pthread_mutex_lock(&queue->mutex);
+        if(queue->queuedLast && queue->queued) {
+            queue->queuedLast->next = request;
+        }else{
+            queue->queued = request;
+        }
+        queue->queuedLast = request;
+        pthread_cond_signal(&queue->queuedChanged);
+        pthread_mutex_unlock(&queue->mutex);
+    }
+
+    queue->pending++;
+    COUNT(COUNTER_ASYNC_READS, 1);
+    COUNT_SEEK(request->offset, request->length);
+    return 0;
+}
+
+IoRequest* ioQueueWait(IoQueue* queue, int block) {
+    if(queue->pending == 0) {
+        return 0;
+    }
+
+    IoRequest* request = 0;
+#ifdef IO_HAVE_URING
+    if(queue->engine == IO_ENGINE_URING) {
+        request = uringWait(queue, block);
+    }
+#endif
+    if(queue->engine == IO_ENGINE_THREADS) {
+        pthread_mutex_lock(&queue->mutex);
+        while(!queue->completed && block) {
+            pthread_cond_wait(&queue->completedChanged, &queue->mutex);
+        }
+        request = queue->completed;
+        if(request) {
+            queue->completed = request->next;
+        }
+        pthread_mutex_unlock(&queue->mutex);
+    }
+
+    if(request) {
+        queue->pending--;
+        if(request->result > 0) {
+            COUNT(COUNTER_ASYNC_BYTES, request->result);
+        }
+    }
+    return request;
+}
+
+void ioQueueFree(IoQueue* queue) {
+    // the buffers of requests still in flight belong to the caller, wait for them
+    while(queue->pending > 0 && ioQueueWait(queue, 1)) ;
+
+#ifdef IO_HAVE_URING
+    if(queue->engine == IO_ENGINE_URING) {
+        uringFree(queue);
+    }
+#endif
+    if(queue->engine == IO_ENGINE_THREADS) {
+        pthread_mutex_lock(&queue->mutex);
+        queue->stopping = 1;
+        pthread_cond_broadcast(&queue->queuedChanged);
+        pthread_mutex_unlock(&queue->mutex);
+        unsigned int i;
+        for(i = 0; i < queue->threadCount; i++) {
+            pthread_join(queue->threads[i], 0);
+        }
+        pthread_cond_destroy(&queue->completedChanged);
+        pthread_cond_destroy(&queue->queuedChanged);
+        pthread_mutex_destroy(&queue->mutex);
+    }
+    queue->engine = 0;
+}
+
+int ioEngineByName(const char* name) {
+    if(strcmp(name, "auto") == 0) {
+        return IO_ENGINE_AUTO;
+    }
+    if(strcmp(name, "uring") == 0) {
+        return IO_ENGINE_URING;
+    }
+    if(strcmp(name, "threads") == 0) {
+        return IO_ENGINE_THREADS;
+    }
+    return -1;
+}
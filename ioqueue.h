@@ -0,0 +1,98 @@
+/*
+ * ioqueue.h
+ *
+ * Asynchronous reads from a file. On Linux the reads go through io_uring
+ * (set up with the raw system calls, no liburing needed); where io_uring is
+ * missing or not allowed, a few threads do blocking preads instead. Either
+ * way the caller submits requests and later waits for their completions,
+ * so decoding can go on while the reads are in flight.
+ */
+
+#ifndef __IOQUEUE_H
+#define __IOQUEUE_H
+
+#include <pthread.h>
+#include <stddef.h>
+
+#define IO_ENGINE_AUTO      0   // io_uring if the kernel has it, threads otherwise
+#define IO_ENGINE_URING     1
+#define IO_ENGINE_THREADS   2
+
+#define IO_QUEUE_THREADS    4   // workers of the thread engine
+
+typedef struct IoRequest_t {
+    void* buf;
+    size_t length;
+    unsigned long long offset;
+    long long result;               // bytes read or -errno, once completed
+    void* user;                     // for the caller
+    struct IoRequest_t* next;       // thread engine: queued or completed requests
+} IoRequest;
+
+typedef struct IoQueue_t {
+    int engine;                     // IO_ENGINE_URING or IO_ENGINE_THREADS once set up
+    int fd;
+    unsigned int depth;             // requests in flight at most
+    unsigned int pending;           // submitted and not returned by ioQueueWait yet
+
+    // io_uring: the two rings and the submission entries, all shared with the kernel
+    int ring;
+    void* sqMap;
+    size_t sqMapSize;
+    void* cqMap;
+    size_t cqMapSize;
+    void* sqes;
+    size_t sqesSize;
+    unsigned int* sqTail;
+    unsigned int* sqMask;
+    unsigned int* sqArray;
+    unsigned int* cqHead;
+    unsigned int* cqTail;
+    unsigned int* cqMask;
+    void* cqes;
+
+    // threads: requests go through two lists guarded by one mutex
+    pthread_t threads[IO_QUEUE_THREADS];
+    unsigned int threadCount;
+    pthread_mutex_t mutex;
+    pthread_cond_t queuedChanged;   // a request was queued, or the workers have to stop
+    pthread_cond_t completedChanged;
+    IoRequest* queued;              // oldest first
+    IoRequest* queuedLast;
+    IoRequest* completed;
+    int stopping;
+} IoQueue;
+
+/**
+ * @brief Sets up a queue for reads from fd
+ * @param depth requests in flight at most
+ * @param engine IO_ENGINE_*
+ * @return 0 on success, -1 otherwise (errno is set)
+ */
+int ioQueueInit(IoQueue* queue, int fd, unsigned int depth, int engine);
+
+/**
+ * @brief Starts reading request->length bytes at request->offset into request->buf.
+ * The request must stay where it is until ioQueueWait returned it.
+ * @return 0 on success, -1 if depth requests are in flight already or the submission failed
+ */
+int ioQueueSubmit(IoQueue* queue, IoRequest* request);
+
+/**
+ * @brief Returns a completed request, short reads are completed as such
+ * @param block 1 to wait for one, 0 to return at once
+ * @return the request with its result set, 0 if none is pending (or none completed yet without block)
+ */
+IoRequest* ioQueueWait(IoQueue* queue, int block);
+
+/**
+ * @brief Waits for the pending requests and releases the queue
+ */
+void ioQueueFree(IoQueue* queue);
+
+/**
+ * @return IO_ENGINE_* for 'auto', 'uring' or 'threads', -1 for an unknown name
+ */
+int ioEngineByName(const char* name);
+
+#endif
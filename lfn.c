@@ -0,0 +1,227 @@
+#include <string.h>
+
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+#include "lfn.h"
+
+/**
+ * @brief Unicode of the upper half of code page 437
+ */
+static const unsigned short oemHigh[128] = {
+    0x00C7, 0x00FC, 0x00E9, 0x00E2, 0x00E4, 0x00E0, 0x00E5, 0x00E7, 0x00EA, 0x00EB, 0x00E8, 0x00EF, 0x00EE, 0x00EC, 0x00C4, 0x00C5,
+    0x00C9, 0x00E6, 0x00C6, 0x00F4, 0x00F6, 0x00F2, 0x00FB, 0x00F9, 0x00FF, 0x00D6, 0x00DC, 0x00A2, 0x00A3, 0x00A5, 0x20A7, 0x0192,
+    0x00E1, 0x00ED, 0x00F3, 0x00FA, 0x00F1, 0x00D1, 0x00AA, 0x00BA, 0x00BF, 0x2310, 0x00AC, 0x00BD, 0x00BC, 0x00A1, 0x00AB, 0x00BB,
+    0x2591, 0x2592, 0x2593, 0x2502, 0x2524, 0x2561, 0x2562, 0x2556, 0x2555, 0x2563, 0x2551, 0x2557, 0x255D, 0x255C, 0x255B, 0x2510,
+    0x2514, 0x2534, 0x252C, 0x251C, 0x2500, 0x253C, 0x255E, 0x255F, 0x255A, 0x2554, 0x2569, 0x2566, 0x2560, 0x2550, 0x256C, 0x2567,
+    0x2568, 0x2564, 0x2565, 0x2559, 0x2558, 0x2552, 0x2553, 0x256B, 0x256A, 0x2518, 0x250C, 0x2588, 0x2584, 0x258C, 0x2590, 0x2580,
+    0x03B1, 0x00DF, 0x0393, 0x03C0, 0x03A3, 0x03C3, 0x00B5, 0x03C4, 0x03A6, 0x0398, 0x03A9, 0x03B4, 0x221E, 0x03C6, 0x03B5, 0x2229,
+    0x2261, 0x00B1, 0x2265, 0x2264, 0x2320, 0x2321, 0x00F7, 0x2248, 0x00B0, 0x2219, 0x00B7, 0x221A, 0x207F, 0x00B2, 0x25A0, 0x00A0
+};
+
+void lfnFeed(LfnState* state, const DIRENTRY_V* lfnEntry) {
+    unsigned char sequence = lfnEntry->sequence_number;
+    unsigned char number = VFAT_SEQUENCE_NUMBER(sequence);
+    if(sequence == 0xE5 || number == 0 || number > LFN_MAX_ENTRIES) {
+        lfnReset(state);
+        return;
+    }
+
+    // the entry with the end flag comes first and holds the last part of the name
+    if(VFAT_SEQUENCE_END(sequence)) {
+        state->entries = number;
+        state->checksum = lfnEntry->checksum;
+    }else if(state->entries == 0 || number != state->expected || lfnEntry->checksum != state->checksum) {
+        lfnReset(state);
+        return;
+    }
+    state->expected = number - 1;
+
+    unsigned short* chars = &state->chars[(number - 1) * LFN_CHARS_PER_ENTRY];
+    memcpy(&chars[0], lfnEntry->name_0, sizeof(lfnEntry->name_0));
+    memcpy(&chars[5], lfnEntry->name_1, sizeof(lfnEntry->name_1));
+    memcpy(&chars[11], lfnEntry->name_2, sizeof(lfnEntry->name_2));
+}
+
+unsigned char lfnChecksum(const unsigned char* shortName) {
+    unsigned char sum = 0;
+    int i;
+    for(i = 0; i < 11; i++) {
+        sum = ((sum & 1) << 7) + (sum >> 1) + shortName[i];
+    }
+    return sum;
+}
+
+size_t lfnFinish(LfnState* state, const DIRENTRY* directoryEntry, char* utf8) {
+    size_t length = 0;
+
+    // complete down to part 1 and made for this very 8.3 name
+    if(state->entries > 0 && state->expected == 0 && state->checksum == lfnChecksum(directoryEntry->name)) {
+        size_t count = state->entries * LFN_CHARS_PER_ENTRY;
+        size_t end = 0;
+        while(end < count && state->chars[end] != VFAT_END) {
+            end++;
+        }
+        length = ucs2ToUtf8(state->chars, end, utf8);
+    }
+
+    utf8[length] = '\0';
+    lfnReset(state);
+    return length;
+}
+
+/**
+ * @brief Appends one character as UTF-8
+ * @return position behind it
+ */
+static inline char* putUtf8(char* dst, unsigned int c) {
+    if(c < 0x80) {
+        *dst++ = c;
+    }else if(c < 0x800) {
+        *dst++ = 0xC0 | (c >> 6);
+        *dst++ = 0x80 | (c & 0x3F);
+    }else if(c < 0x10000) {
+        *dst++ = 0xE0 | (c >> 12);
+        *dst++ = 0x80 | ((c >> 6) & 0x3F);
+        *dst++ = 0x80 | (c & 0x3F);
+    }else{
+        *dst++ = 0xF0 | (c >> 18);
+        *dst++ = 0x80 | ((c >> 12) & 0x3F);
+        *dst++ = 0x80 | ((c >> 6) & 0x3F);
+        *dst++ = 0x80 | (c & 0x3F);
+    }
+    return dst;
+}
+
+size_t ucs2ToUtf8(const unsigned short* chars, size_t count, char* utf8) {
+    char* dst = utf8;
+    size_t i = 0;
+
+    while(i < count) {
+#ifdef __SSE2__
+        // most names are ASCII: 8 characters at a time, narrowed to bytes
+        const __m128i nonAscii = _mm_set1_epi16((short)0xFF80);
+        while(i + 8 <= count) {
+            __m128i v = _mm_loadu_si128((const __m128i*)&chars[i]);
+            if(_mm_movemask_epi8(_mm_cmpeq_epi16(_mm_and_si128(v, nonAscii), _mm_setzero_si128())) != 0xFFFF) {
+                break;
+            }
+            _mm_storel_epi64((__m128i*)dst, _mm_packus_epi16(v, v));
+            dst += 8;
+            i += 8;
+        }
+        if(i == count) {
+            break;
+        }
+#endif
+
+        unsigned int c = chars[i++];
+        if(c >= 0xD800 && c < 0xDC00 && i < count && chars[i] >= 0xDC00 && chars[i] < 0xE000) {
+            c = 0x10000 + ((c - 0xD800) << 10) + (chars[i++] - 0xDC00);
+        }else if(c >= 0xD800 && c < 0xE000) {
+            c = 0xFFFD;
+        }
+        dst = putUtf8(dst, c);
+    }
+    return dst - utf8;
+}
+
+size_t oemToUtf8(const char* name, size_t length, char* utf8) {
+    char* dst = utf8;
+    size_t i;
+    for(i = 0; i < length; i++) {
+        unsigned char c = (unsigned char)name[i];
+        dst = putUtf8(dst, c < 0x80 ? c : oemHigh[c - 0x80]);
+    }
+    *dst = '\0';
+    return dst - utf8;
+}
+
+int utf8ToUcs2(const char* utf8, size_t length, unsigned short* chars, size_t max) {
+    const unsigned char* src = (const unsigned char*)utf8;
+    size_t count = 0;
+    size_t i = 0;
+    while(i < length) {
+        unsigned int c = src[i];
+        unsigned int follow = c < 0x80 ? 0 : c >= 0xF5 ? 4 : c >= 0xF0 ? 3 : c >= 0xE0 ? 2 : c >= 0xC2 ? 1 : 4;
+        if(follow > 3 || i + follow >= length + (follow ? 0 : 1)) {
+            return -1;
+        }
+        if(follow) {
+            c &= 0x3F >> follow;
+        }
+        size_t k;
+        for(k = 1; k <= follow; k++) {
+            if((src[i + k] & 0xC0) != 0x80) {
+                return -1;
+            }
+            c = (c << 6) | (src[i + k] & 0x3F);
+        }
+        // no overlong forms, no surrogates of their own
+        if((follow == 2 && c < 0x800) || (follow == 3 && (c < 0x10000 || c > 0x10FFFF)) || (c >= 0xD800 && c < 0xE000)) {
+            return -1;
+        }
+        i += follow + 1;
+
+        if(count + (c >= 0x10000 ? 2 : 1) > max) {
+            return -1;
+        }
+        if(c >= 0x10000) {
+            chars[count++] = 0xD800 + ((c - 0x10000) >> 10);
+            chars[count++] = 0xDC00 + ((c - 0x10000) & 0x3FF);
+        }else{
+            chars[count++] = c;
+        }
+    }
+    return (int)count;
+}
+
+int lfnShortName(const unsigned short* chars, size_t count, unsigned char* shortName) {
+    memset(shortName, ' ', 11);
+    int lossy = 0;
+
+    // the extension starts behind the last period, unless that is a leading one
+    size_t start = 0;
+    while(start < count && (chars[start] == '.' || chars[start] == ' ')) {
+        start++;
+    }
+    size_t dot = count;
+    size_t i;
+    for(i = start; i < count; i++) {
+        if(chars[i] == '.') {
+            dot = i;
+        }
+    }
+    lossy = start > 0;
+
+    size_t length = 0;
+    for(i = start; i < count; i++) {
+        unsigned short c = chars[i];
+        size_t limit = i < dot ? 8 : 11;
+        if(i == dot) {
+            length = 8;
+            continue;
+        }
+        if(c == ' ' || c == '.') {
+            lossy = 1;
+            continue;
+        }
+        if(c >= 'a' && c <= 'z') {
+            c -= 'a' - 'A';
+        }else if(c < 0x20 || c >= 0x7F || strchr("\"*+,/:;<=>?[\\]|", c)) {
+            c = '_';
+            lossy = 1;
+        }
+        if(length >= limit) {
+            lossy = 1;
+            continue;
+        }
+        shortName[length++] = (unsigned char)c;
+    }
+    if(shortName[0] == ' ') {
+        shortName[0] = '_';
+        lossy = 1;
+    }
+    return lossy;
+}
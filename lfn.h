@@ -0,0 +1,81 @@
+/*
+ * lfn.h
+ *
+ * VFAT long file names. The name is spread over up to 20 directory entries
+ * in front of the 8.3 entry, last part first, 13 UCS-2 characters each.
+ * They are collected in a fixed buffer per directory and only accepted if
+ * the sequence is complete and the checksum matches the 8.3 name.
+ */
+
+#ifndef __LFN_H
+#define __LFN_H
+
+#include <stddef.h>
+
+#include "data.h"
+
+#define LFN_CHARS_PER_ENTRY 13
+#define LFN_MAX_ENTRIES     20
+#define LFN_MAX_CHARS       (LFN_CHARS_PER_ENTRY * LFN_MAX_ENTRIES)
+#define LFN_UTF8_MAX        (LFN_MAX_CHARS * 3 + 1)     // UCS-2 needs at most 3 bytes per character
+
+typedef struct LfnState_t {
+    unsigned short chars[LFN_MAX_CHARS];
+    unsigned char checksum;     // of the 8.3 name, from the first entry of the sequence
+    unsigned char entries;      // number of entries of the sequence, 0 if there is none
+    unsigned char expected;     // sequence number of the next entry
+} LfnState;
+
+static inline void lfnReset(LfnState* state) {
+    state->entries = 0;
+    state->expected = 0;
+}
+
+/**
+ * @brief Takes the next LFN entry of a directory. An entry that doesn't continue
+ * the current sequence drops it; a deleted entry drops it as well.
+ */
+void lfnFeed(LfnState* state, const DIRENTRY_V* lfnEntry);
+
+/**
+ * @brief Completes the long name with the 8.3 entry that follows the sequence, and resets the state
+ * @param utf8 is a buffer >= LFN_UTF8_MAX bytes
+ * @return length of the name in utf8, 0 if there is no valid long name for the entry
+ */
+size_t lfnFinish(LfnState* state, const DIRENTRY* directoryEntry, char* utf8);
+
+/**
+ * @brief Checksum of an 8.3 name (name and ext, 11 bytes) as stored in its LFN entries
+ */
+unsigned char lfnChecksum(const unsigned char* shortName);
+
+/**
+ * @brief Converts UCS-2 to UTF-8. Surrogate pairs become one character, unpaired surrogates U+FFFD.
+ * @param utf8 is a buffer >= count * 3 bytes
+ * @return number of bytes written, no terminating '\0'
+ */
+size_t ucs2ToUtf8(const unsigned short* chars, size_t count, char* utf8);
+
+/**
+ * @brief Converts UTF-8 to UCS-2, characters beyond the BMP become surrogate pairs
+ * @param chars receives at most max characters
+ * @return number of characters, -1 if the UTF-8 is invalid or longer than max characters
+ */
+int utf8ToUcs2(const char* utf8, size_t length, unsigned short* chars, size_t max);
+
+/**
+ * @brief Derives the basis 8.3 name of a long name: upper case, without spaces and
+ * leading periods, characters an 8.3 name can't hold as '_', cut to 8 and 3 characters
+ * @param shortName receives the 11 bytes of name and ext
+ * @return 1 if the long name doesn't survive that as it is, so a numeric tail is needed; 0 otherwise
+ */
+int lfnShortName(const unsigned short* chars, size_t count, unsigned char* shortName);
+
+/**
+ * @brief Converts an 8.3 name in the OEM code page (437) to UTF-8
+ * @param utf8 is a buffer >= length * 3 + 1 bytes, '\0' terminated
+ * @return number of bytes written
+ */
+size_t oemToUtf8(const char* name, size_t length, char* utf8);
+
+#endif
@@ -1,117 +1,174 @@
+#define _GNU_SOURCE
+
 #include <errno.h>
+#include <fcntl.h>
+#include <ftw.h>
+#include <getopt.h>
+#include <limits.h>
+#include <pthread.h>
 #include <stdio.h>
 #include <stdlib.h>
-#include <fcntl.h>
-
+#include <string.h>
+#include <strings.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "batch.h"
+#include "bench.h"
+#include "carve.h"
+#include "check.h"
+#include "counters.h"
 #include "data.h"
+#include "diff.h"
+#include "extent.h"
+#include "extract.h"
+#include "fat.h"
+#include "format.h"
+#include "image.h"
+#include "lfn.h"
+#include "partition.h"
+#include "path.h"
+#include "pathindex.h"
+#include "readahead.h"
+#include "snapshot.h"
+#include "stats.h"
+#include "undelete.h"
+#include "volume.h"
+#include "writer.h"
 
-// Unix / Windows interop
-#ifndef O_BINARY
-#define O_BINARY 0
-#endif
+/**
+ * @brief Work list item: a directory that still has to be listed.
+ * Entries are copied into the list, so they outlive the directory view they were read from.
+ */
+typedef struct DirStackItem_t {
+    DIRENTRY directoryEntry;
+    PathNode* path;     // the directory's own path node
+} DirStackItem;
 
 /**
- * @brief Simple linked list for DIRENTRYs, used as queue
+ * @brief Contiguous stack of directories, the top is listed next
  */
-typedef struct DirQueueItem_t {
-    DIRENTRY* directoryEntry;
-    struct DirQueueItem_t* next;
-} DirQueueItem;
+typedef struct DirStack_t {
+    DirStackItem* items;
+    unsigned int count;
+    unsigned int capacity;
+} DirStack;
 
 /**
- * @brief Global list head, only the 'next' pointer should be used!
+ * @brief Global work list of the traversal
  */
-DirQueueItem* firstDirItem;
+DirStack dirStack;
 
 /**
- * @brief Pop list head and return entry
- * @return pointer to first item in queue
+ * @brief Pop the top item and copy its entry
+ * @param directoryEntry receives the top item
+ * @param path receives the item's path node
+ * @return 1 if an item was popped, 0 if the stack is empty
  */
-DIRENTRY* dir_pop_front() {
-    DirQueueItem* front = firstDirItem->next;
-    DIRENTRY* ret = 0;
-    if(firstDirItem->next) {
-        ret = front->directoryEntry;
-        firstDirItem->next = firstDirItem->next->next;
-        free(front);
+int dir_pop(DIRENTRY* directoryEntry, PathNode** path) {
+    if(dirStack.count == 0) {
+        return 0;
     }
-    return ret;
+    DirStackItem* top = &dirStack.items[--dirStack.count];
+    *directoryEntry = top->directoryEntry;
+    *path = top->path;
+    return 1;
 }
 
 /**
- * @brief Appends entry to the list tail
- * @param directoryEntry pointer to push back
+ * @brief Pushes a copy of an entry, amortized O(1)
+ * @param directoryEntry entry to push
+ * @param path of the directory
  */
-void* dir_push_back(DIRENTRY* directoryEntry) {
-    DirQueueItem* newDirItem = (DirQueueItem*)malloc(sizeof(DirQueueItem));
-
-    newDirItem->directoryEntry = directoryEntry;
-    newDirItem->next = 0;
-
-    DirQueueItem* lastItem = firstDirItem;
-
-    while(lastItem && lastItem->next) {
-        lastItem = lastItem->next;
+void dir_push(const DIRENTRY* directoryEntry, PathNode* path) {
+    if(dirStack.count == dirStack.capacity) {
+        unsigned int capacity = dirStack.capacity ? dirStack.capacity * 2 : 256;
+        DirStackItem* items = (DirStackItem*)realloc(dirStack.items, sizeof(DirStackItem) * capacity);
+        if(!items) {
+            printf("Out of memory!\n");
+            exit(1);
+        }
+        dirStack.items = items;
+        dirStack.capacity = capacity;
     }
-
-    lastItem->next = newDirItem;
+    dirStack.items[dirStack.count].directoryEntry = *directoryEntry;
+    dirStack.items[dirStack.count].path = path;
+    dirStack.count++;
 }
 
 /**
- * @brief Insert an entry after a given entry
- * @param entryBefore
- * @param newEntry
+ * @brief Reverses the items pushed since mark, so the first one pushed is popped first.
+ * Subdirectories are pushed in listing order, this keeps the depth-first order of a listing.
+ * @param mark stack size before the subdirectories were pushed
  */
-void dir_insert(DIRENTRY* entryBefore, DIRENTRY* directoryEntry) {
-    // find entry
-    DirQueueItem* itemBefore = firstDirItem;
-
-    while(itemBefore->directoryEntry != entryBefore && itemBefore->next) {
-        itemBefore = itemBefore->next;
-    }
-    if(itemBefore->directoryEntry != entryBefore) {
-        printf("could not find the given entry in the list!\n");
-        return;
+void dir_reverse(unsigned int mark) {
+    unsigned int low = mark;
+    unsigned int high = dirStack.count;
+    while(high > low + 1) {
+        DirStackItem tmp = dirStack.items[low];
+        dirStack.items[low++] = dirStack.items[--high];
+        dirStack.items[high] = tmp;
     }
+}
+
+/**
+ * @brief The image, decoded FAT and extent index
+ */
+Volume volume;
+/**
+ * @brief Holds path nodes, released after the traversal
+ */
+Arena traversalArena;
+/**
+ * @brief Paths of all directories met so far, by first cluster
+ */
+PathCache pathCache;
+/**
+ * @brief FORMAT_* of the listing
+ */
+int outputFormat = FORMAT_DIR;
+/**
+ * @brief IO_ENGINE_* of the read-ahead, -1 to read every directory when it is listed
+ */
+int ioEngine = IO_ENGINE_AUTO;
 
-    DirQueueItem* newDirItem = (DirQueueItem*)malloc(sizeof(DirQueueItem));
+#define READ_AHEAD_DIRECTORIES 8    // subdirectories of a listing that are read ahead
 
-    newDirItem->directoryEntry = directoryEntry;
-    newDirItem->next = itemBefore->next;
-    itemBefore->next = newDirItem;
-}
+#define LIST_ALL            0
+#define LIST_FILES          1
+#define LIST_DIRECTORIES    2
 
-int handle;
-unsigned char fatType;
-BOOTSECTOR* bootsector;
-char* FAT;
+/**
+ * @brief LIST_* of the listing, everything else is walked but not shown
+ */
+int listFilter = LIST_ALL;
+/**
+ * @brief Files and directories of the whole volume, built on demand or taken from a snapshot
+ */
+PathIndex pathIndex;
+int pathIndexReady;
+Snapshot snapshot;
+/**
+ * @brief Partition of a disk image given with -p, 0 if none was
+ */
+unsigned int partitionNumber;
 char dot[8] = {0x2E,0x20,0x20,0x20,0x20,0x20,0x20,0x20};
 char dotdot[8] = {0x2E,0x2E,0x20,0x20,0x20,0x20,0x20,0x20};
 
 /**
- * @brief print FAT volume information from bootsector
- * @param bootsector
+ * @brief print FAT volume information from bootsector (and FSInfo sector)
+ * @param volume 0 if the bootsector is not valid
  */
-void printVolumeInformation(BOOTSECTOR* bootsector){
-	if (!bootsector){
+void printVolumeInformation(const Volume* volume){
+	if (!volume){
 		printf("not a valid FAT bootsector!\n");
 		return;
 	}
+	const BOOTSECTOR* bootsector = &volume->bootsector;
+	const FSINFO* fsinfo = volume->hasFsinfo ? &volume->fsinfo : 0;
 
-	// append NULL byte to terminate string
-	bootsector->EBPB.volumelabel[10] = '\0';
-	bootsector->EBPB.fattype[7] = '\0';
-
-        unsigned int numberofclusters = bootsector->BPB.numberofsectors / bootsector->BPB.sectorspercluster;
-        if(numberofclusters < 4086) {
-            fatType = 12;
-        } else if(numberofclusters < 65526) {
-            fatType = 16;
-        } else {
-            fatType = 32;
-        }
-
-	printf("Vendor: %s\n", bootsector->vendor);
+	printf("Vendor: %.8s\n", bootsector->vendor);
 	printf("Bios Parameter Block:\n");
 	printf("  Sector size: %d\n", bootsector->BPB.sectorsize);
 	printf("  Sectors per cluster: %d\n", bootsector->BPB.sectorspercluster);
@@ -123,50 +180,57 @@ void printVolumeInformation(BOOTSECTOR* bootsector){
 	printf("  FAT sectors: %d\n", bootsector->BPB.FATsectors);
 	printf("Sectors per Track: %d\n", bootsector->sectorspertrack);
 	printf("Number of heads: %d\n", bootsector->numberofheads);
-	printf("Hidden sectors: %d\n", bootsector->hiddensectors);
-	printf("Total sectors: %d\n", bootsector->totalsectors);
-	printf("Extended Bios Parameter Block\n");
-	printf("  Drive number: %d\n", bootsector->EBPB.drivenumber);
-	printf("  Reserved: %d\n", bootsector->EBPB.reserved);
-	printf("  Signature: %d\n", bootsector->EBPB.signature);
-	printf("  Serial number: %d\n", bootsector->EBPB.serialnumber);
-	printf("  Volume label: %s\n", bootsector->EBPB.volumelabel);
-	printf("  FAT type: %s\n", bootsector->EBPB.fattype);
-	printf("  Bootcode: [not shown]\n");
-	printf("  End of sector: %x\n", bootsector->EBPB.endofsector);
-        printf("Total number of clusters: %d ( suggests FAT %d )\n", bootsector->BPB.numberofsectors / bootsector->BPB.sectorspercluster, fatType);
-}
-
-/* FAT starts with 2nd cluster after #FAT-bits for signature
- * FAT1 contains the File Allocation Table as unsigned char*
- * works for FAT 12 & 16 only
- */
-unsigned short getnextcluster(unsigned short cluster)
+	printf("Hidden sectors: %u\n", bootsector->hiddensectors);
+	printf("Total sectors: %u\n", bootsector->totalsectors);
+	if (volume->geometry.fatType == 32){
+		printf("FAT32 Extended Bios Parameter Block\n");
+		printf("  FAT sectors: %u\n", bootsector->EBPB32.FATsectors);
+		printf("  Flags: %x\n", bootsector->EBPB32.flags);
+		printf("  Version: %d.%d\n", bootsector->EBPB32.version >> 8, bootsector->EBPB32.version & 0xFF);
+		printf("  Root directory cluster: %u\n", bootsector->EBPB32.rootcluster);
+		printf("  FSInfo sector: %d\n", bootsector->EBPB32.fsinfosector);
+		printf("  Backup boot sector: %d\n", bootsector->EBPB32.backupbootsector);
+		printf("  Drive number: %d\n", bootsector->EBPB32.drivenumber);
+		printf("  Signature: %d\n", bootsector->EBPB32.signature);
+		printf("  Serial number: %u\n", bootsector->EBPB32.serialnumber);
+		printf("  Volume label: %.11s\n", bootsector->EBPB32.volumelabel);
+		printf("  FAT type: %.8s\n", bootsector->EBPB32.fattype);
+		printf("  Bootcode: [not shown]\n");
+		printf("  End of sector: %x\n", bootsector->EBPB32.endofsector);
+	}else{
+		printf("Extended Bios Parameter Block\n");
+		printf("  Drive number: %d\n", bootsector->EBPB.drivenumber);
+		printf("  Reserved: %d\n", bootsector->EBPB.reserved);
+		printf("  Signature: %d\n", bootsector->EBPB.signature);
+		printf("  Serial number: %u\n", bootsector->EBPB.serialnumber);
+		printf("  Volume label: %.11s\n", bootsector->EBPB.volumelabel);
+		printf("  FAT type: %.8s\n", bootsector->EBPB.fattype);
+		printf("  Bootcode: [not shown]\n");
+		printf("  End of sector: %x\n", bootsector->EBPB.endofsector);
+	}
+	if (fsinfo){
+		printf("FSInfo\n");
+		if (fsinfo->freecount == FSINFO_UNKNOWN){
+			printf("  Free clusters: unknown\n");
+		}else{
+			printf("  Free clusters: %u\n", fsinfo->freecount);
+		}
+		if (fsinfo->nextfree == FSINFO_UNKNOWN){
+			printf("  Next free cluster: unknown\n");
+		}else{
+			printf("  Next free cluster: %u\n", fsinfo->nextfree);
+		}
+	}
+        printf("Total number of clusters: %u ( suggests FAT %d )\n", volume->geometry.clusterCount, volume->geometry.fatType);
+}
+
+/* The FAT is decoded once in main(), following a chain is a table lookup.
+ * Markers are widened to the FAT32 value space, compare with FAT_IS_LAST().
+ */
+unsigned int getnextcluster(unsigned int cluster)
 {
-    char high=cluster%2;
-    unsigned short ncluster;
-    unsigned int offset;
-
-    switch(fatType)
-    {
-        case 12:
-            offset=3;
-            offset += ((cluster/2)-1)*3;
-            offset += high;
-            memcpy(&ncluster,&FAT[ offset ],2); // copy relevant bytes 0-1 or 1-2
-            ncluster &= (high)? 0xFFF0:0x0FFF; //mask low or high part
-            ncluster >>= (high)?4:0; // modify relevant bits
-            break;
-        case 16:
-            offset=3;
-            offset += cluster*2;
-            memcpy(&ncluster,&FAT[ offset ],2); // copy relevant bytes 0-1 or 1-2
-            break;
-        default:
-            exit(1);
-            break;
-    }
-    return ncluster;
+    COUNT(COUNTER_CLUSTERS, 1);
+    return volumeNext(&volume, cluster);
 }
 
 /* return fileoffset of a cluster
@@ -174,51 +238,11 @@ unsigned short getnextcluster(unsigned short cluster)
  *                     sectorspercluster; number of sectors per cluster
  *                                                                    FAT (sectors)                                       RootDir (Bytes)
  *                     Dataregion = ( reservedsectors (0xe) + numberofFATs(0x10)*sectorsperFAT(0x16) ) * sectorsize + RootEntries(0x11) * 32 ; Start of Data Clusters
- *
+ * cluster 0 is the root directory, on FAT32 that is the first cluster of its chain
  */
-unsigned int getclusteroffset(unsigned short cluster)
+unsigned long long getclusteroffset(unsigned int cluster)
 {
-    unsigned int ret=0;
-
-    unsigned int DataRegion = (bootsector->BPB.reservedsectors + bootsector->BPB.numberofFATs * bootsector->BPB.FATsectors) *
-                                    bootsector->BPB.sectorsize + bootsector->BPB.rootentries * 32;
-
-    switch(fatType)
-    {
-        case 12:
-        case 16:
-            if(cluster == 0) {
-                ret = (bootsector->BPB.reservedsectors + bootsector->BPB.numberofFATs * bootsector->BPB.FATsectors) * bootsector->BPB.sectorsize;
-            }else{
-                ret = DataRegion /* * bootsector->BPB.sectorsize */ + (cluster-2) * bootsector->BPB.sectorspercluster * bootsector->BPB.sectorsize;
-            }
-            break;
-        default:
-            exit(1);
-    }
-    //printf("Cluster %d has offset %d\n", cluster, ret);
-    return ret;
-}
-
-/**
- * @brief Allocates 32 bytes on the heap, reads next DIRENTRY (from current position).
- * @return pointer to a DIRENTRY structure on the heap
- */
-DIRENTRY* readDirectoryEntry() {
-    DIRENTRY* directoryEntry = (DIRENTRY*)malloc(sizeof(DIRENTRY));
-
-    //printf("reading from offset %d...\n", tell(handle));
-    unsigned int bytesRead;
-    if((bytesRead = read(handle, directoryEntry, sizeof(DIRENTRY))) != sizeof(DIRENTRY)) {
-        printf("Could not read %d Bytes(read %d)! errno: %d\n", sizeof(DIRENTRY), bytesRead, errno);
-        exit(1);
-    }
-
-    if(directoryEntry->name[0] == '\0') {
-        return 0;
-    }
-
-    return directoryEntry;
+    return volumeClusterOffset(&volume, cluster);
 }
 
 /**
@@ -226,7 +250,7 @@ DIRENTRY* readDirectoryEntry() {
  * @param directoryEntry
  * @return 1 if directoryEntry is a directory, 0 otherwise
  */
-int isDirectory(DIRENTRY* directoryEntry) {
+int isDirectory(const DIRENTRY* directoryEntry) {
     if(!directoryEntry){
         return 0;
     }
@@ -234,329 +258,2268 @@ int isDirectory(DIRENTRY* directoryEntry) {
     return ((directoryEntry->attr & (1<<4)) > 0);
 }
 
-/**
- * @brief Formats a date entry like 'DD.MM.YYYY'
- * @param date is in FAT format
- * @param buf is a buffer >= 11 bytes which will hold the formatted string
- */
-void formatDirectoryEntryDate(unsigned short date, char* buf) {
-    unsigned short year = 1980 + (date >> 9);
-    unsigned short month = (date & 0x1E0) >> 5;
-    unsigned short day = (date & 0x1F);
-    sprintf(buf, "%02d.%02d.%d", day, month, year);
+int matchParentEntry(const DIRENTRY* directoryEntry, const char* name, const void* arg) {
+    (void)name;
+    (void)arg;
+    return memcmp(directoryEntry->name, dotdot, 8) == 0;
 }
 
-/**
- * @brief Formats a time entry like 'HH:MM:SS' (24 hour format)
- * @param time is in FAT format
- * @param buf is a buffer >= 9 bytes
- */
-void formatDirectoryEntryTime(unsigned short time, char* buf) {
-    // Bytes 15 - 11, hours 0 - 23
-    unsigned short hour = time >> 11;
-    // Bytes 10 - 05, minutes 0 - 59
-    unsigned short minute = (time & 0x7E0) >> 5;
-    // Bytes 04 - 00, seconds 0 - 29 ( times two, only even seconds)
-    unsigned short second = (time & 0x1F) * 2;
-    sprintf(buf, "%02d:%02d:%02d", hour, minute, second);
+int matchFirstCluster(const DIRENTRY* directoryEntry, const char* name, const void* arg) {
+    (void)name;
+    return fatFirstCluster(directoryEntry, volume.geometry.fatType) == *(const unsigned int*)arg;
 }
 
-/**
- * @brief Formats directory entry like 'file.ext'
- * @param directoryEntry
- * @param buf is a buffer >= 13 bytes
- */
-void formatDirectoryEntryName(DIRENTRY* directoryEntry, char* buf) {
-    strncpy(buf, directoryEntry->name, 8);
-
-    if(directoryEntry->ext[0] != ' '){
-
-        // find end of file name
-        unsigned short i = 7;
-        while(i > 0 && buf[i] == 0x20) { --i; }
-
-        // append '.' and file extension
-        buf[i+1] = '.';
-        strncpy(&buf[i+2], directoryEntry->ext, 3);
-        buf[i+5] = '\0';
-    }else{
-        // terminate as early as possible
-        unsigned short i;
-        for(i = 1; i < 8 && buf[i] != 0x20; i++) ;
-        buf[i] = '\0';
-    }
-}
 /**
  * @brief parentDirectory
  * @param currentDirectoryEntry
- * @return parent DIRENTRY*
+ * @param parentDirectoryEntry receives the parent's '..' entry
+ * @return 1 if there is a parent directory, 0 otherwise
  */
-DIRENTRY* parentDirectory(DIRENTRY* currentDirectoryEntry) {
-    lseek(handle, getclusteroffset(currentDirectoryEntry->firstcluser), SEEK_SET);
-
-    DIRENTRY* directoryEntry = 0;
-    DIRENTRY* parentDirectoryEntry = 0;
-
+int parentDirectory(const DIRENTRY* currentDirectoryEntry, DIRENTRY* parentDirectoryEntry) {
     // read current directory, find parent entry ('..')
-    while(directoryEntry = readDirectoryEntry()) {
-        if(memcmp(directoryEntry->name, dotdot, 8) == 0) {
-            parentDirectoryEntry = directoryEntry;
-            break;
-        }
-    }
-
-    return parentDirectoryEntry;
+    return volumeFind(&volume, fatFirstCluster(currentDirectoryEntry, volume.geometry.fatType), matchParentEntry, 0, parentDirectoryEntry, 0);
 }
 
 /**
  * @brief Retrieves the current folder's name (handy if you only have a '.' entry at hand)
  * @param currentDirectoryEntry
- * @param buf is a buffer big enough to hold the folder name
+ * @param buf is a buffer >= LFN_UTF8_MAX bytes
  */
-void currentFolderName(DIRENTRY* currentDirectoryEntry, char* buf) {
+void currentFolderName(const DIRENTRY* currentDirectoryEntry, char* buf) {
 
-    DIRENTRY* directoryEntry;
-    DIRENTRY* parentDirectoryEntry = 0;
+    DIRENTRY directoryEntry;
+    DIRENTRY parentDirectoryEntry;
 
-    parentDirectoryEntry = parentDirectory(currentDirectoryEntry);
+    buf[0] = '\0';
+    if(!parentDirectory(currentDirectoryEntry, &parentDirectoryEntry)) {
+        return;
+    }
 
     // read parent directory, find entry that matches current (original) folder's first cluster
-    lseek(handle, getclusteroffset(parentDirectoryEntry->firstcluser), SEEK_SET);
-
-    while(directoryEntry = readDirectoryEntry()) {
-        if(directoryEntry->firstcluser == currentDirectoryEntry->firstcluser) {
-            formatDirectoryEntryName(directoryEntry, buf);
-            return;
-        }
+    unsigned int firstCluster = fatFirstCluster(currentDirectoryEntry, volume.geometry.fatType);
+    if(!volumeFind(&volume, fatFirstCluster(&parentDirectoryEntry, volume.geometry.fatType), matchFirstCluster, &firstCluster, &directoryEntry, buf)) {
+        buf[0] = '\0';
     }
 }
 
 /**
- * @brief Retrieves the absolute path of a given directory
+ * @brief Retrieves the absolute path of a given directory.
+ * Directories seen by the traversal are answered from the path cache,
+ * others are resolved by reading their ancestors.
  * @param directoryEntry
  * @param buf is a buffer big enough to hold the absolute path
  */
-void absoluteDirectoryPath(DIRENTRY* directoryEntry, char* buf) {
+void absoluteDirectoryPath(const DIRENTRY* directoryEntry, char* buf) {
+    PathNode* node = pathCacheLookup(&pathCache, fatFirstCluster(directoryEntry, volume.geometry.fatType));
+    if(node) {
+        pathFormat(node, buf);
+        return;
+    }
+
     // if there is no parent directory, we are at root level
-    DIRENTRY* parent = parentDirectory(directoryEntry);
-    if(parent == 0) {
+    DIRENTRY parent;
+    if(!parentDirectory(directoryEntry, &parent)) {
         sprintf(buf, "\\");
         return;
     }
 
     // if we are not at root level, fire up the recursion
-    absoluteDirectoryPath(parent, buf);
+    absoluteDirectoryPath(&parent, buf);
 
     // concatenate the path until here and this directory's name
-    unsigned short stringLength = strlen(buf);
-    char dirname[512];
+    unsigned int stringLength = strlen(buf);
+    if(stringLength == 1) {
+        // parent is the root directory, don't repeat its '\'
+        stringLength = 0;
+    }
+    char dirname[LFN_UTF8_MAX];
     currentFolderName(directoryEntry, dirname);
     sprintf(&buf[stringLength], "\\%s", dirname);
 }
 
 /**
  * @brief Prints a directory entry in a format similar to 'dir'
+ * @param out stream to print to
  * @param directoryEntry
+ * @param longName UTF-8 long name shown after the 8.3 name, longNameLength 0 if there is none
  */
-void printDirectoryEntry(DIRENTRY* directoryEntry) {
-
-    // date
-    char changedate[11];
-    formatDirectoryEntryDate(directoryEntry->changedate, changedate);
-    printf("%s ", changedate);
-
-    // time
-    char changetime[9];
-    formatDirectoryEntryTime(directoryEntry->changetime, changetime);
-    printf("%s ", changetime);
-
-    // directory or file
-    if(isDirectory(directoryEntry)) {
-        printf(" <DIR> ");
-    }else{
-        printf("       ");
-    }
-
-    // file size
-    printf("%10d ", directoryEntry->size);
-
-    // file name
+void printDirectoryEntry(Output* out, const DIRENTRY* directoryEntry, const char* longName, size_t longNameLength) {
     char name[14];
-    formatDirectoryEntryName(directoryEntry, name);
-    printf("%-12s  ", name);
+    volumeShortName(directoryEntry, name);
+
+    // date, time, <DIR>, size, name and long name
+    formatDirLine(out, directoryEntry, name, longName, longNameLength);
 
     /*
     // cluster dev info
-    unsigned short firstcluster = directoryEntry->firstcluser;
-    unsigned short nextcluster = getnextcluster(firstcluster);
+    unsigned int firstcluster = fatFirstCluster(directoryEntry, volume.geometry.fatType);
+    unsigned int nextcluster = getnextcluster(firstcluster);
 
-    printf("Cluster(s) %d", directoryEntry->firstcluser);
-    if(nextcluster < CLUSTER_LAST_MIN) {
-           printf(" -> %d -> ...", nextcluster);
+    fprintf(out, "Cluster(s) %u", firstcluster);
+    if(!FAT_IS_LAST(nextcluster)) {
+           fprintf(out, " -> %d -> ...", nextcluster);
     }
     */
-
-    printf("\n");
 }
 
-void handleLFN(DIRENTRY* directoryEntry, char* LFNBuffer) {
-    DIRENTRY_V* lfnEntry = (DIRENTRY_V*)directoryEntry;
+/**
+ * @brief State of a directory listing
+ */
+typedef struct DirListing_t {
+    PathNode* path;                 // the directory being listed
+    unsigned int stackMark;         // work list size before the first subdirectory was pushed
+    Output* out;                    // where the listing is printed
+    char* pathText;                 // absolute path of the directory, formatted on first use
+    Arena* arena;                   // path nodes of subdirectories are allocated here
+    /**
+     * @brief Called for every subdirectory, with its new path node
+     */
+    void (*subdirectory)(struct DirListing_t* listing, const DIRENTRY* directoryEntry, PathNode* path);
+    void* context;                  // for subdirectory
+    VolumeDir* dir;                 // reads the directory, its buffers are reused by the next listing
+} DirListing;
 
-    int sequenceNumber = lfnEntry->sequence_number & 0x5;
-    int lastSequenceNumber = (lfnEntry->sequence_number & 0x6) == 0x6;
-    printf("Sequence number: %d\n", sequenceNumber);
-    if(lastSequenceNumber) {
-        printf("this is the last sequence number.\n");
+/**
+ * @brief Subdirectory handler of the serial traversal: remember the path, push to the global work list
+ */
+void pushSubdirectory(DirListing* listing, const DIRENTRY* directoryEntry, PathNode* path) {
+    (void)listing;
+    if(pathCacheInsert(&pathCache, path) != 0) {
+        printf("Out of memory!\n");
+        exit(1);
     }
+    dir_push(directoryEntry, path);
+}
 
-    int offset = sequenceNumber * 13;
+/**
+ * @brief Path buffer of the directory being listed, one per thread
+ */
+_Thread_local char* pathBuffer;
+_Thread_local unsigned int pathBufferSize;
 
-    if(offset > 255) {
-        printf("offset %d > 255!\n", offset);
-        return;
+/**
+ * @brief Formats the absolute path of the listed directory once per listing
+ * @return the path, valid until the next listing of this thread
+ */
+const char* listingPath(DirListing* listing) {
+    if(!listing->pathText) {
+        if(listing->path->length + 1 > pathBufferSize) {
+            free(pathBuffer);
+            pathBufferSize = (listing->path->length + 1) * 2;
+            pathBuffer = (char*)malloc(pathBufferSize);
+            if(!pathBuffer) {
+                printf("Out of memory!\n");
+                exit(1);
+            }
+        }
+        listing->pathText = pathFormat(listing->path, pathBuffer);
     }
+    return listing->pathText;
+}
 
-    memcpy(&LFNBuffer[offset], lfnEntry->name_0, 10);
-    memcpy(&LFNBuffer[offset+10], lfnEntry->name_1, 12);
-    memcpy(&LFNBuffer[offset+22], lfnEntry->name_2, 4);
+/**
+ * @brief Writes an entry as a JSON Lines / CSV record, skips everything but files and subdirectories
+ * @param name UTF-8 long name, or 8.3 name if there is none
+ */
+void printDirectoryRecord(DirListing* listing, const DIRENTRY* directoryEntry, const char* name) {
+    // LFN entries carry the volume bit as well
+    if((directoryEntry->attr & DIRENTRY_ATTR_VOLUME) || directoryEntry->name[0] == 0xE5 ||
+       memcmp(directoryEntry->name, dot, 8) == 0 || memcmp(directoryEntry->name, dotdot, 8) == 0) {
+        return;
+    }
+    if(listFilter == LIST_FILES && isDirectory(directoryEntry)) {
+        return;
+    }
 
-    printf("LFN so far: %s\n", LFNBuffer);
+    const char* path = listingPath(listing);
+    formatRecord(listing->out, outputFormat, 0, path, listing->path->length, name, directoryEntry, fatFirstCluster(directoryEntry, volume.geometry.fatType));
 }
 
 /**
- * @brief Reads a folder listing, prints all items and adds all subdirectories to the global queue
- * @param offset where the first directory entry of the folder structure begins
+ * @brief Reads a folder listing, prints all items and hands all subdirectories to listing->subdirectory
+ * @param listing state of the directory, path, handlers and iterator have to be set
  */
-void listDirectory(unsigned int offset) {
-
-    // do not read into next cluster
-    long maxOffset = offset + (bootsector->BPB.sectorspercluster * bootsector->BPB.sectorsize);
-    long newOffset = offset;
-    lseek(handle, newOffset, SEEK_SET);
+void listDirectory(DirListing* listing) {
+    // a subdirectory without clusters would be the root directory again
+    if(listing->path->parent && listing->path->firstCluster < 2) {
+        return;
+    }
 
-    // the reference point in the list where we want to add the subdirectories
-    // by default, we want to add subdirectories to the top so that we get depth-first search
-    DIRENTRY* referencePoint = firstDirItem->directoryEntry;
+    // the iterator passes over what is neither shown nor walked into
+    VolumeDir* dir = listing->dir;
+    dir->skip = outputFormat != FORMAT_DIR ? VOLUME_SKIP_DOTS | VOLUME_SKIP_DELETED : 0;
+    if(listFilter == LIST_DIRECTORIES) {
+        dir->skip |= VOLUME_SKIP_FILES;
+    }
+    volumeDirOpen(&volume, dir, listing->path->firstCluster);
 
     // this is where we read into
-    DIRENTRY* directoryEntry;
+    const DIRENTRY* directoryEntry;
+    while((directoryEntry = volumeDirRead(dir))) {
+        // long name of the current entry, or its 8.3 name in UTF-8
+        const char* name = dir->name;
+
+        if(outputFormat != FORMAT_DIR) {
+            printDirectoryRecord(listing, directoryEntry, name);
+        }else{
+            if(memcmp(directoryEntry->name, dot, 8) == 0) {
+                // the path came along with the directory, no need to look at the parents
+                outputString(listing->out, "Directory of ");
+                outputWrite(listing->out, listingPath(listing), listing->path->length);
+                outputChar(listing->out, '\n');
+            }
+
+            if(listFilter != LIST_FILES || !isDirectory(directoryEntry)) {
+                printDirectoryEntry(listing->out, directoryEntry, name, dir->longNameLength);
+            }
+        }
 
-    // in case we have to handle VFAT / LFN entries, prepare the buffer
-    char LFN[260];
+        if(isDirectory(directoryEntry)) {
+            // add subdirectories to the work list
+            // please ignore the current directory entry ('.') and parent ('..'), and deleted ones: their clusters may be reused (see undelete)
+            if(directoryEntry->name[0] != DIRENTRY_EMPTY && (memcmp(directoryEntry->name, dot, 8) != 0) && (memcmp(directoryEntry->name, dotdot, 8) != 0)) {
+                PathNode* path = pathNodeCreate(listing->arena, listing->path, name, fatFirstCluster(directoryEntry, volume.geometry.fatType), dir->entryIndex);
+                if(!path) {
+                    printf("Out of memory!\n");
+                    exit(1);
+                }
+                listing->subdirectory(listing, directoryEntry, path);
+            }
+        }
+    }
+    if(dir->error) {
+        printf("Could not read directory '%s'! errno: %d\n", listingPath(listing), errno);
+    }
+}
 
-    while((newOffset < maxOffset) && (directoryEntry = readDirectoryEntry())) {
-        // we need to preserve the offset in case any operations move the file pointer
-        //newOffset = tell(handle);
-        newOffset = lseek(handle, 0, SEEK_CUR);
+/**
+ * @brief Recursively lists all directories in the global work list and empties it
+ * @param out where the listings are written
+ */
+void list_recursive(Output* out) {
+    DIRENTRY directoryEntry;
+    PathNode* path;
+    VolumeDir dir;
+    memset(&dir, 0, sizeof(dir));
+
+    // directories are read while the one before them is decoded, no read-ahead if that can't be set up
+    ReadAhead readAhead;
+    if(ioEngine >= 0 && readAheadInit(&readAhead, &volume.image, ioEngine) == 0) {
+        dir.readAhead = &readAhead;
+    }
 
-        if(memcmp(directoryEntry->name, dot, 8) == 0) {
-            char buf2[1024];
-            absoluteDirectoryPath(directoryEntry, buf2);
-            printf("Directory of %s\n", buf2);
+    while(dir_pop(&directoryEntry, &path)) {
+        // the next one on the stack is listed after this one, unless this one has subdirectories
+        if(dir.readAhead && dirStack.count > 0 && dirStack.items[dirStack.count - 1].path->firstCluster >= 2) {
+            volumeDirPrefetch(&volume, dir.readAhead, dirStack.items[dirStack.count - 1].path->firstCluster);
         }
 
-        if(directoryEntry->attr == DIRENTRY_ATTR_VFAT) {
-            printf("this is a VFAT entry!\n");
-            handleLFN(directoryEntry, LFN);
-        }else{
-            printDirectoryEntry(directoryEntry);
+        DirListing listing = {path, dirStack.count, out, 0, &traversalArena, pushSubdirectory, 0, &dir};
+        listDirectory(&listing);
+
+        // subdirectories go on top in listing order so that we get depth-first search
+        dir_reverse(listing.stackMark);
+        if(outputFormat == FORMAT_DIR) {
+            outputChar(out, '\n');
         }
 
-        if(isDirectory(directoryEntry)) {
-            // add subdirectories to the queue
-            // please ignore the current directory entry ('.') and parent ('..')
-            if((memcmp(directoryEntry->name, dot, 8) != 0) && (memcmp(directoryEntry->name, dotdot, 8) != 0)) {
-                dir_insert(referencePoint, directoryEntry);
-                referencePoint = directoryEntry;
-                //dir_push_back(directoryEntry);
+        // their chains are known now, the first ones are listed next
+        unsigned int i;
+        for(i = dirStack.count; dir.readAhead && i > listing.stackMark && i + READ_AHEAD_DIRECTORIES > dirStack.count; i--) {
+            if(dirStack.items[i - 1].path->firstCluster >= 2) {
+                volumeDirPrefetch(&volume, dir.readAhead, dirStack.items[i - 1].path->firstCluster);
             }
         }
+    }
 
-        lseek(handle, newOffset, SEEK_SET);
+    if(dir.readAhead) {
+        readAheadFree(dir.readAhead);
     }
+    volumeDirClose(&dir);
+}
+
+
+/**
+ * @brief A directory of the parallel traversal. Its listing is printed into an in-memory output of its own,
+ * the main thread writes the buffers in depth-first order once the tasks are done.
+ */
+typedef struct DirTask_t {
+    PathNode* path;
+    Output output;                  // listing of the directory
+    struct DirTask_t** children;    // subdirectories in listing order
+    unsigned int childCount;
+    unsigned int childCapacity;
+    int done;                       // set under taskMutex
+} DirTask;
+
+/**
+ * @brief Work-stealing deque of a worker. The owner takes from the bottom, thieves from the top.
+ */
+typedef struct DirDeque_t {
+    pthread_mutex_t mutex;
+    DirTask** tasks;
+    unsigned int top;               // index of the oldest task
+    unsigned int bottom;            // index behind the newest task
+    unsigned int capacity;
+} DirDeque;
+
+typedef struct DirWorker_t {
+    pthread_t thread;
+    unsigned int id;
+    DirDeque deque;
+    DirTask* current;               // the task being listed
+    Arena arena;                    // path nodes of the subdirectories found by this worker
+    VolumeDir dir;
+} DirWorker;
+
+DirWorker* workers;
+unsigned int workerCount;
+/**
+ * @brief Number of tasks that were created but not listed yet, the traversal ends at 0
+ */
+unsigned int tasksPending;
+pthread_mutex_t taskMutex = PTHREAD_MUTEX_INITIALIZER;
+pthread_cond_t taskDone = PTHREAD_COND_INITIALIZER;         // a task has been listed
+pthread_cond_t taskAvailable = PTHREAD_COND_INITIALIZER;    // a task has been pushed, or all are done
+pthread_mutex_t pathCacheMutex = PTHREAD_MUTEX_INITIALIZER;
 
+/**
+ * @brief Pushes a task at the bottom of a deque
+ */
+void deque_push(DirDeque* deque, DirTask* task) {
+    pthread_mutex_lock(&deque->mutex);
+    if(deque->bottom == deque->capacity) {
+        unsigned int count = deque->bottom - deque->top;
+        if(deque->top >= count && count > 0) {
+            // enough room in front of the live part
+            memmove(deque->tasks, &deque->tasks[deque->top], sizeof(DirTask*) * count);
+        }else{
+            unsigned int capacity = deque->capacity ? deque->capacity * 2 : 256;
+            DirTask** tasks = (DirTask**)malloc(sizeof(DirTask*) * capacity);
+            if(!tasks) {
+                printf("Out of memory!\n");
+                exit(1);
+            }
+            if(count > 0) {
+                memcpy(tasks, &deque->tasks[deque->top], sizeof(DirTask*) * count);
+            }
+            free(deque->tasks);
+            deque->tasks = tasks;
+            deque->capacity = capacity;
+        }
+        deque->top = 0;
+        deque->bottom = count;
+    }
+    deque->tasks[deque->bottom++] = task;
+    pthread_mutex_unlock(&deque->mutex);
 }
 
 /**
- * @brief Recursively lists all directories in the global queue and empties that queue
+ * @brief Takes a task from a deque
+ * @param steal 1 to take the oldest task (top), 0 for the newest one (bottom)
+ * @return the task, 0 if the deque is empty
  */
-void list_recursive() {
-    DIRENTRY* directoryEntry;
+DirTask* deque_pop(DirDeque* deque, int steal) {
+    DirTask* task = 0;
+    pthread_mutex_lock(&deque->mutex);
+    if(deque->bottom > deque->top) {
+        task = steal ? deque->tasks[deque->top++] : deque->tasks[--deque->bottom];
+    }
+    pthread_mutex_unlock(&deque->mutex);
+    return task;
+}
 
-    unsigned int nextCluster;
-    while((directoryEntry = dir_pop_front())) {
+/**
+ * @brief Creates the task of a directory and makes it available to the workers
+ * @param deque to push the task to
+ * @return the new task
+ */
+DirTask* createTask(PathNode* path, DirDeque* deque) {
+    DirTask* task = (DirTask*)calloc(1, sizeof(DirTask));
+    if(!task) {
+        printf("Out of memory!\n");
+        exit(1);
+    }
+    task->path = path;
+
+    __atomic_add_fetch(&tasksPending, 1, __ATOMIC_SEQ_CST);
+    deque_push(deque, task);
+    pthread_mutex_lock(&taskMutex);
+    pthread_cond_signal(&taskAvailable);
+    pthread_mutex_unlock(&taskMutex);
+    return task;
+}
 
-        nextCluster = directoryEntry->firstcluser;
-        do{
-            listDirectory(getclusteroffset(nextCluster));
-        }while((nextCluster = getnextcluster(nextCluster)) < CLUSTER_LAST_MIN);
-        printf("\n");
+/**
+ * @brief Subdirectory handler of the parallel traversal: remember the path, create a child task
+ */
+void spawnSubdirectory(DirListing* listing, const DIRENTRY* directoryEntry, PathNode* path) {
+    (void)directoryEntry;
+    DirWorker* worker = (DirWorker*)listing->context;
+    DirTask* parent = worker->current;
+
+    pthread_mutex_lock(&pathCacheMutex);
+    int inserted = pathCacheInsert(&pathCache, path);
+    pthread_mutex_unlock(&pathCacheMutex);
+
+    if(parent->childCount == parent->childCapacity) {
+        unsigned int capacity = parent->childCapacity ? parent->childCapacity * 2 : 8;
+        DirTask** children = (DirTask**)realloc(parent->children, sizeof(DirTask*) * capacity);
+        if(!children) {
+            inserted = -1;
+        }else{
+            parent->children = children;
+            parent->childCapacity = capacity;
+        }
+    }
+    if(inserted != 0) {
+        printf("Out of memory!\n");
+        exit(1);
     }
+    parent->children[parent->childCount++] = createTask(path, &worker->deque);
 }
 
-int main(int argc, char* argv[]) {
+/**
+ * @brief Lists the directory of a task into its output buffer and creates the subdirectories' tasks
+ */
+void listTask(DirWorker* worker, DirTask* task) {
+    Output* out = &task->output;
+    outputInit(out, 0);
+
+    worker->current = task;
+    DirListing listing = {task->path, 0, out, 0, &worker->arena, spawnSubdirectory, worker, &worker->dir};
+    listDirectory(&listing);
+    if(outputFormat == FORMAT_DIR) {
+        outputChar(out, '\n');
+    }
 
-    // initialize list
-    firstDirItem = (DirQueueItem*)malloc(sizeof(DirQueueItem));
-    firstDirItem->directoryEntry = 0;
-    firstDirItem->next = 0;
+    // the task belongs to the main thread from here on
+    pthread_mutex_lock(&taskMutex);
+    task->done = 1;
+    pthread_cond_broadcast(&taskDone);
+    pthread_mutex_unlock(&taskMutex);
+
+    // children were counted before, so 0 means there is nothing left anywhere
+    if(__atomic_sub_fetch(&tasksPending, 1, __ATOMIC_SEQ_CST) == 0) {
+        pthread_mutex_lock(&taskMutex);
+        pthread_cond_broadcast(&taskAvailable);
+        pthread_mutex_unlock(&taskMutex);
+    }
+}
 
-    char filename[1024] = "BSA.img";
-    if(argc != 2) {
-        printf("Usage: %s filename\n", argv[0]);
-        printf("I will pick file '%s' for you.\n", filename);
-    }else{
-        strncpy(filename, argv[1], 1023);
+/**
+ * @brief Worker thread: lists tasks from its own deque, steals from the others when it runs dry
+ * @param arg the worker
+ */
+void* dirWorker(void* arg) {
+    DirWorker* worker = (DirWorker*)arg;
+
+    for(;;) {
+        DirTask* task = deque_pop(&worker->deque, 0);
+        unsigned int i;
+        for(i = 1; !task && i < workerCount; i++) {
+            task = deque_pop(&workers[(worker->id + i) % workerCount].deque, 1);
+        }
+        if(task) {
+            listTask(worker, task);
+            continue;
+        }
+
+        pthread_mutex_lock(&taskMutex);
+        if(__atomic_load_n(&tasksPending, __ATOMIC_SEQ_CST) == 0) {
+            pthread_mutex_unlock(&taskMutex);
+            break;
+        }
+        // a push between the steal attempts and this wait is picked up on timeout
+        struct timespec timeout;
+        clock_gettime(CLOCK_REALTIME, &timeout);
+        timeout.tv_nsec += 1000000;
+        if(timeout.tv_nsec >= 1000000000) {
+            timeout.tv_sec++;
+            timeout.tv_nsec -= 1000000000;
+        }
+        pthread_cond_timedwait(&taskAvailable, &taskMutex, &timeout);
+        pthread_mutex_unlock(&taskMutex);
     }
 
-    handle = open(filename, O_RDONLY | O_BINARY);
+    free(pathBuffer);
+    return 0;
+}
 
-	if (handle == -1){
-		printf("Can't open file! errno: %d\n", errno);
-		exit(1);
-	}
+/**
+ * @brief Lists root and all directories below with several threads.
+ * The output is the same as with list_recursive: listings are buffered per directory
+ * and written in depth-first order.
+ * @param root path node of the root directory
+ * @param threads number of worker threads
+ * @param out where the listings are written
+ */
+void list_parallel(PathNode* root, unsigned int threads, Output* out) {
+    workerCount = threads;
+    workers = (DirWorker*)calloc(workerCount, sizeof(DirWorker));
+    if(!workers) {
+        printf("Out of memory!\n");
+        exit(1);
+    }
+    unsigned int i;
+    for(i = 0; i < workerCount; i++) {
+        workers[i].id = i;
+        pthread_mutex_init(&workers[i].deque.mutex, 0);
+    }
 
-    bootsector = (BOOTSECTOR*)malloc(sizeof(char)* 512);
+    DirTask* rootTask = createTask(root, &workers[0].deque);
+    for(i = 0; i < workerCount; i++) {
+        if(pthread_create(&workers[i].thread, 0, dirWorker, &workers[i]) != 0) {
+            printf("Could not start worker thread! errno: %d\n", errno);
+            exit(1);
+        }
+    }
 
-    unsigned int bytesRead;
-    if ((bytesRead = read(handle, bootsector, 512)) != 512) {
-        printf("Could not read 512 Bytes (read %d)! errno: %d\n", bytesRead, errno);
-		exit(1);
-	}
+    // write the listings in depth-first order, waiting for the ones still being listed
+    DirTask** order = 0;
+    unsigned int orderCount = 0;
+    unsigned int orderCapacity = 0;
+    DirTask* task = rootTask;
+    for(;;) {
+        pthread_mutex_lock(&taskMutex);
+        while(!task->done) {
+            pthread_cond_wait(&taskDone, &taskMutex);
+        }
+        pthread_mutex_unlock(&taskMutex);
 
-	printVolumeInformation(bootsector);
+        outputWrite(out, task->output.data, task->output.used);
+        outputFree(&task->output);
 
-    unsigned int firstFATStartPos = bootsector->BPB.reservedsectors * bootsector->BPB.sectorsize;
-    unsigned int FATSize = bootsector->BPB.FATsectors * bootsector->BPB.sectorsize;
+        if(orderCount + task->childCount > orderCapacity) {
+            orderCapacity = (orderCount + task->childCount) * 2;
+            order = (DirTask**)realloc(order, sizeof(DirTask*) * orderCapacity);
+            if(!order) {
+                printf("Out of memory!\n");
+                exit(1);
+            }
+        }
+        // first child on top
+        unsigned int child = task->childCount;
+        while(child > 0) {
+            order[orderCount++] = task->children[--child];
+        }
+        free(task->children);
+        free(task);
 
-    FAT = (char*)malloc(sizeof(char) * FATSize);
+        if(orderCount == 0) {
+            break;
+        }
+        task = order[--orderCount];
+    }
+    free(order);
 
-    printf("First FAT starting at byte %d, length %d\n", firstFATStartPos, FATSize);
+    for(i = 0; i < workerCount; i++) {
+        pthread_join(workers[i].thread, 0);
+    }
+    // the path nodes go with the arenas, the cache only holds pointers to them
+    for(i = 0; i < workerCount; i++) {
+        free(workers[i].deque.tasks);
+        pthread_mutex_destroy(&workers[i].deque.mutex);
+        arenaFree(&workers[i].arena);
+        volumeDirClose(&workers[i].dir);
+    }
+    free(workers);
+    workers = 0;
+}
 
-    unsigned int newPos;
-    newPos = lseek(handle, firstFATStartPos, SEEK_SET);
+/**
+ * @brief Prints why a file or directory could not be extracted
+ */
+void reportExtractFailure(const ExtractItem* item, int error) {
+    if(IS_DIR(item->directoryEntry.attr)) {
+        printf("Could not set the time of '%s'! errno: %d\n", item->hostPath, error);
+    }else{
+        printf("Could not extract '%s'! errno: %d\n", item->hostPath, error);
+    }
+}
 
-    if((bytesRead = read(handle, FAT, FATSize)) != FATSize) {
-        printf("Could not read %d Bytes(read %d)! errno: %d\n", FATSize, bytesRead, errno);
-        exit(1);
+/**
+ * @brief State of collecting a directory for extraction
+ */
+typedef struct ExtractWalk_t {
+    Extractor* extractor;
+    const char* hostPath;       // where the directory goes
+    unsigned int failed;
+} ExtractWalk;
+
+void extractDirectory(Extractor* extractor, unsigned int directoryCluster, const char* hostPath, unsigned int* failed);
+
+/**
+ * @brief Visits all entries of a directory for extraction, never matches (see volumeFind).
+ * Subdirectories are created on the host right away and collected recursively.
+ * @param arg the ExtractWalk
+ */
+int collectEntry(const DIRENTRY* directoryEntry, const char* entryName, const void* arg) {
+    ExtractWalk* walk = (ExtractWalk*)arg;
+
+    if((directoryEntry->attr & DIRENTRY_ATTR_VOLUME) || directoryEntry->name[0] == 0xE5 ||
+       memcmp(directoryEntry->name, dot, 8) == 0 || memcmp(directoryEntry->name, dotdot, 8) == 0) {
+        return 0;
     }
 
-    unsigned int rootDirectoryStartPos = firstFATStartPos + (bootsector->BPB.numberofFATs * FATSize);
-    unsigned int rootDirectoryStartCluster = bootsector->BPB.reservedsectors + bootsector->BPB.FATsectors * bootsector->BPB.numberofFATs;
+    size_t hostLength = strlen(walk->hostPath);
+    size_t nameLength = strlen(entryName);
+    char hostPath[hostLength + 1 + nameLength + 1];
+    memcpy(hostPath, walk->hostPath, hostLength);
+    hostPath[hostLength] = '/';
+    char* c = &hostPath[hostLength + 1];
+    memcpy(c, entryName, nameLength + 1);
+    for(; *c; c++) {
+        if(*c == '/') {
+            *c = '_';
+        }
+    }
 
+    if(isDirectory(directoryEntry)) {
+        // cluster 0 would be the root directory again
+        unsigned int firstCluster = fatFirstCluster(directoryEntry, volume.geometry.fatType);
+        if(firstCluster < 2 || (mkdir(hostPath, 0755) != 0 && errno != EEXIST)) {
+            printf("Could not create directory '%s'! errno: %d\n", hostPath, errno);
+            walk->failed++;
+            return 0;
+        }
+        if(extractAdd(walk->extractor, directoryEntry, hostPath) != 0) {
+            printf("Out of memory!\n");
+            exit(1);
+        }
+        extractDirectory(walk->extractor, firstCluster, hostPath, &walk->failed);
+    }else if(extractAdd(walk->extractor, directoryEntry, hostPath) != 0) {
+        printf("Out of memory!\n");
+        exit(1);
+    }
+    return 0;
+}
 
-    printf("Root directory starting at cluster %d / byte %d\n", rootDirectoryStartCluster, rootDirectoryStartPos);
+/**
+ * @brief Collects a directory and everything below it for extraction
+ * @param directoryCluster first cluster of the directory, 0 for the root directory
+ * @param hostPath existing host directory the contents go to
+ * @param failed is increased for every subdirectory that could not be created
+ */
+void extractDirectory(Extractor* extractor, unsigned int directoryCluster, const char* hostPath, unsigned int* failed) {
+    ExtractWalk walk = {extractor, hostPath, 0};
+    DIRENTRY unused;
+    volumeFind(&volume, directoryCluster, collectEntry, &walk, &unused, 0);
+    *failed += walk.failed;
+}
 
-    newPos = lseek(handle, rootDirectoryStartPos, SEEK_SET);
+/**
+ * @brief Copies a file, a directory tree or the whole volume to the host, keeping the timestamps
+ * @param path in the image, '\' for the whole volume
+ * @param destination host directory for directories, host file or directory for a file
+ * @param threads number of files copied at once
+ * @return 0 on success, 1 if anything failed
+ */
+int extract(const char* path, const char* destination, unsigned int threads) {
+    DIRENTRY directoryEntry;
+    char name[LFN_UTF8_MAX];
+    if(!volumeLookup(&volume, path, &directoryEntry, name)) {
+        printf("'%s' not found!\n", path);
+        return 1;
+    }
 
-    printf("\n");
+    Extractor extractor;
+    extractInit(&extractor, &volume.image, &volume.geometry, &volume.fat, &volume.extents);
+    extractor.report = reportExtractFailure;
+    unsigned int failed = 0;
 
-    // list root directory and add subdirectories to global queue
-    listDirectory(rootDirectoryStartPos);
-    printf("\n");
+    if(isDirectory(&directoryEntry)) {
+        if(mkdir(destination, 0755) != 0 && errno != EEXIST) {
+            printf("Could not create directory '%s'! errno: %d\n", destination, errno);
+            return 1;
+        }
+        // the root directory has no times of its own
+        if(fatFirstCluster(&directoryEntry, volume.geometry.fatType) != 0 && extractAdd(&extractor, &directoryEntry, destination) != 0) {
+            printf("Out of memory!\n");
+            exit(1);
+        }
+        extractDirectory(&extractor, fatFirstCluster(&directoryEntry, volume.geometry.fatType), destination, &failed);
+    }else{
+        // into an existing directory under its own name, or to the given file name
+        struct stat st;
+        char hostPath[strlen(destination) + 1 + strlen(name) + 1];
+        strcpy(hostPath, destination);
+        if(stat(destination, &st) == 0 && S_ISDIR(st.st_mode)) {
+            strcat(hostPath, "/");
+            strcat(hostPath, name);
+        }
+        if(extractAdd(&extractor, &directoryEntry, hostPath) != 0) {
+            printf("Out of memory!\n");
+            exit(1);
+        }
+    }
 
-    // recursively list all directories inside the global queue
-    list_recursive();
+    failed += extractRun(&extractor, threads);
+    printf("Extracted %u files, %u directories, %llu bytes\n", extractor.files, extractor.directories, extractor.bytes);
+    extractFree(&extractor);
+    return failed ? 1 : 0;
+}
 
+/**
+ * @brief State of checking the tree, directories are checked breadth first
+ */
+typedef struct CheckWalk_t {
+    Checker* checker;
+    Arena* arena;
+    PathNode* directory;        // being read
+    const char* directoryPath;  // its absolute path
+    PathNode** queue;           // directories to read, in the order they were found
+    unsigned int count;
+    unsigned int capacity;
+} CheckWalk;
+
+/**
+ * @brief Checks every file and directory of a directory, never matches (see volumeFind)
+ * @param arg the CheckWalk
+ */
+int checkVisit(const DIRENTRY* directoryEntry, const char* name, const void* arg) {
+    CheckWalk* walk = (CheckWalk*)arg;
+
+    if((directoryEntry->attr & DIRENTRY_ATTR_VOLUME) || directoryEntry->name[0] == 0xE5 ||
+       memcmp(directoryEntry->name, dot, 8) == 0 || memcmp(directoryEntry->name, dotdot, 8) == 0) {
+        return 0;
+    }
+
+    // the root's '\' is not repeated
+    size_t directoryLength = walk->directory->parent ? walk->directory->length : 0;
+    size_t nameLength = strlen(name);
+    char path[directoryLength + 1 + nameLength + 1];
+    memcpy(path, walk->directoryPath, directoryLength);
+    path[directoryLength] = '\\';
+    memcpy(&path[directoryLength + 1], name, nameLength + 1);
+
+    if(checkEntry(walk->checker, directoryEntry, path)) {
+        if(walk->count == walk->capacity) {
+            walk->capacity = walk->capacity ? walk->capacity * 2 : 256;
+            walk->queue = (PathNode**)realloc(walk->queue, sizeof(PathNode*) * walk->capacity);
+        }
+        PathNode* node = pathNodeCreate(walk->arena, walk->directory, name, fatFirstCluster(directoryEntry, volume.geometry.fatType), 0);
+        if(!walk->queue || !node) {
+            printf("Out of memory!\n");
+            exit(1);
+        }
+        walk->queue[walk->count++] = node;
+    }
+    return 0;
+}
+
+/**
+ * @brief Checks the FAT and the directory tree, reports all problems
+ * @param threads number of threads scanning and comparing the FAT copies
+ * @return 0 if the volume is consistent, 1 otherwise
+ */
+int check(unsigned int threads) {
+    Output out;
+    outputInit(&out, stdout);
+    Checker checker;
+    if(checkInit(&checker, &volume.image, &volume.geometry, &volume.fat, &out) != 0) {
+        printf("Out of memory!\n");
+        exit(1);
+    }
+    if(checkFat(&checker, threads) != 0) {
+        printf("Could not read the FAT copies! errno: %d\n", errno);
+        exit(1);
+    }
+
+    // every chain is claimed once, a directory reached twice is only read the first time
+    checkRoot(&checker);
+    Arena arena = {0};
+    CheckWalk walk = {&checker, &arena, 0, 0, 0, 0, 0};
+    PathNode* root = pathNodeCreate(&arena, 0, "", volume.geometry.rootCluster, 0);
+    if(!root) {
+        printf("Out of memory!\n");
+        exit(1);
+    }
+    char* pathText = 0;
+    unsigned int i;
+    for(i = 0, walk.directory = root; walk.directory; walk.directory = i < walk.count ? walk.queue[i++] : 0) {
+        pathText = (char*)realloc(pathText, walk.directory->length + 1);
+        if(!pathText) {
+            printf("Out of memory!\n");
+            exit(1);
+        }
+        walk.directoryPath = pathFormat(walk.directory, pathText);
+        DIRENTRY unused;
+        volumeFind(&volume, walk.directory->firstCluster, checkVisit, &walk, &unused, 0);
+    }
+    free(pathText);
+    free(walk.queue);
+    arenaFree(&arena);
+
+    checkLost(&checker, &volume.extents);
+
+    char line[160];
+    snprintf(line, sizeof(line), "%u directories, %u files, %u free clusters, %u bad clusters\n",
+             checker.directories, checker.files, checker.freeClusters, checker.badClusters);
+    outputString(&out, line);
+    unsigned int problems = checkProblems(&checker);
+    if(problems) {
+        snprintf(line, sizeof(line), "%u problems found\n", problems);
+        outputString(&out, line);
+    }else{
+        outputString(&out, "No problems found\n");
+    }
+    outputFree(&out);
+    checkFree(&checker);
+    return problems ? 1 : 0;
+}
+
+/**
+ * @brief State of adding the children of one directory to the path index
+ */
+typedef struct IndexWalk_t {
+    PathIndex* index;
+    unsigned int parent;
+} IndexWalk;
+
+/**
+ * @brief Adds every file and directory of a directory to the path index, never matches (see volumeFind)
+ * @param arg the IndexWalk
+ */
+int indexEntry(const DIRENTRY* directoryEntry, const char* name, const void* arg) {
+    const IndexWalk* walk = (const IndexWalk*)arg;
+
+    if((directoryEntry->attr & DIRENTRY_ATTR_VOLUME) || directoryEntry->name[0] == 0xE5 ||
+       memcmp(directoryEntry->name, dot, 8) == 0 || memcmp(directoryEntry->name, dotdot, 8) == 0) {
+        return 0;
+    }
+
+    if(pathIndexAdd(walk->index, walk->parent, name, directoryEntry, fatFirstCluster(directoryEntry, volume.geometry.fatType)) == PATHINDEX_NONE) {
+        printf("Out of memory!\n");
+        exit(1);
+    }
+    return 0;
+}
+
+/**
+ * @brief Reads every directory once and builds the path index.
+ * Directories are read breadth first, in the order they were added, so the children of each are contiguous.
+ * @return 0 on success, -1 if out of memory
+ */
+int buildPathIndex(PathIndex* index) {
+    if(pathIndexInit(index, volume.geometry.rootCluster) != 0) {
+        return -1;
+    }
+
+    // a directory that is linked twice (or into its own subtree) is read only once
+    unsigned char* visited = (unsigned char*)calloc(volume.fat.count / 8 + 1, 1);
+    if(!visited) {
+        pathIndexFree(index);
+        return -1;
+    }
+
+    unsigned int i;
+    for(i = 0; i < index->count; i++) {
+        unsigned int cluster = index->entries[i].firstCluster;
+        if(!IS_DIR(index->entries[i].attr)) {
+            continue;
+        }
+        if(i > 0) {
+            if(cluster < 2 || cluster >= volume.fat.count || (visited[cluster / 8] & (1 << (cluster % 8)))) {
+                continue;
+            }
+            visited[cluster / 8] |= 1 << (cluster % 8);
+        }
+
+        pathIndexBeginChildren(index, i);
+        IndexWalk walk = {index, i};
+        DIRENTRY unused;
+        volumeFind(&volume, i == 0 ? 0 : cluster, indexEntry, &walk, &unused, 0);
+    }
+    free(visited);
+
+    if(pathIndexFinish(index) != 0) {
+        pathIndexFree(index);
+        return -1;
+    }
+    return 0;
+}
+
+/**
+ * @brief Prints an entry of the path index
+ * @param details 1 to print everything in dir format (stat), 0 for the path only (find)
+ */
+void printIndexEntry(Output* out, const PathIndex* index, unsigned int entry, int details) {
+    const IndexEntry* e = &index->entries[entry];
+    unsigned int parent = entry == 0 ? 0 : e->parent;
+    unsigned int parentLength = pathIndexPathLength(index, parent);
+    char parentPath[parentLength + 1];
+    pathIndexPath(index, parent, parentPath);
+
+    if(outputFormat != FORMAT_DIR) {
+        // the record of an entry, without going back to the image
+        DIRENTRY directoryEntry;
+        memset(&directoryEntry, 0, sizeof(DIRENTRY));
+        directoryEntry.attr = e->attr;
+        directoryEntry.size = e->size;
+        directoryEntry.changedate = e->changedate;
+        directoryEntry.changetime = e->changetime;
+        formatRecord(out, outputFormat, 0, parentPath, entry == 0 ? 1 : parentLength, pathIndexName(index, entry), &directoryEntry, e->firstCluster);
+        return;
+    }
+
+    unsigned int pathLength = pathIndexPathLength(index, entry);
+    char path[pathLength + 1];
+    if(!details) {
+        outputWrite(out, pathIndexPath(index, entry, path), pathLength);
+        outputChar(out, '\n');
+        return;
+    }
+
+    outputString(out, "Path: ");
+    outputWrite(out, pathIndexPath(index, entry, path), pathLength);
+    outputString(out, "\nAttributes: ");
+    outputNumber(out, e->attr, 0);
+    if(IS_DIR(e->attr)) {
+        outputString(out, "\nEntries: ");
+        outputNumber(out, e->childCount, 0);
+    }else{
+        outputString(out, "\nSize: ");
+        outputNumber(out, e->size, 0);
+    }
+    outputString(out, "\nModified: ");
+    outputTimestamp(out, e->changedate, e->changetime);
+    outputString(out, "\nFirst cluster: ");
+    outputNumber(out, e->firstCluster, 0);
+
+    // runs like 'start-end', single clusters alone
+    outputString(out, "\nClusters:");
+    ExtentList chain = {0, 0, 0};
+    const Extent* runs;
+    unsigned int runCount = extentChain(&volume.extents, &volume.fat, e->firstCluster, &runs, &chain);
+    unsigned int run;
+    for(run = 0; run < runCount; run++) {
+        outputChar(out, ' ');
+        outputNumber(out, runs[run].start, 0);
+        if(runs[run].length > 1) {
+            outputChar(out, '-');
+            outputNumber(out, runs[run].start + runs[run].length - 1, 0);
+        }
+    }
+    extentListFree(&chain);
+    outputChar(out, '\n');
+}
+
+/**
+ * @brief pathIndexFind callback, prints the path of a match
+ * @param arg the Output
+ */
+void printFound(const PathIndex* index, unsigned int entry, void* arg) {
+    printIndexEntry((Output*)arg, index, entry, 0);
+}
+
+/**
+ * @brief Parses a date like 'YYYY-MM-DD'
+ * @return (date << 16) in FAT format, 0 if it is not a valid date
+ */
+unsigned int parseDate(const char* text) {
+    unsigned int year, month, day;
+    if(sscanf(text, "%u-%u-%u", &year, &month, &day) != 3 || year < 1980 || year > 2107 || month < 1 || month > 12 || day < 1 || day > 31) {
+        return 0;
+    }
+    return (((year - 1980) << 9) | (month << 5) | day) << 16;
+}
+
+/**
+ * @brief Parses a filter of find: size>N, size>=N, size<N, size<=N, after=YYYY-MM-DD or before=YYYY-MM-DD
+ * @return 0 on success, -1 if it is not a filter
+ */
+int parseFilter(const char* text, IndexFilter* filter) {
+    char* end;
+    if(strncmp(text, "size", 4) == 0 && (text[4] == '<' || text[4] == '>')) {
+        int inclusive = text[5] == '=';
+        const char* number = &text[5 + inclusive];
+        unsigned long long size = strtoull(number, &end, 10);
+        if(end == number || *end != '\0') {
+            return -1;
+        }
+        if(text[4] == '>') {
+            filter->minSize = inclusive ? size : size + 1;
+        }else if(inclusive || size > 0) {
+            filter->maxSize = inclusive ? size : size - 1;
+        }else{
+            // nothing is smaller than 0
+            filter->minSize = 1;
+            filter->maxSize = 0;
+        }
+        return 0;
+    }
+    if(strncmp(text, "after=", 6) == 0 && parseDate(&text[6])) {
+        filter->after = parseDate(&text[6]);
+        return 0;
+    }
+    if(strncmp(text, "before=", 7) == 0 && parseDate(&text[7])) {
+        filter->before = parseDate(&text[7]);
+        return 0;
+    }
+    return -1;
+}
+
+/**
+ * @brief Answers one query against the path index
+ * @param words the query: 'stat PATH' or 'find GLOB [filter ...]'
+ * @return 0 if something was found, 1 if not, -1 if the query is malformed
+ */
+int answerQuery(Output* out, const PathIndex* index, char** words, unsigned int wordCount) {
+    if(wordCount == 2 && strcmp(words[0], "stat") == 0) {
+        unsigned int entry = pathIndexLookup(index, words[1]);
+        if(entry == PATHINDEX_NONE) {
+            if(outputFormat == FORMAT_DIR) {
+                outputString(out, "Not found\n");
+            }
+            return 1;
+        }
+        printIndexEntry(out, index, entry, 1);
+        return 0;
+    }
+
+    if(wordCount >= 2 && strcmp(words[0], "find") == 0) {
+        IndexFilter filter = {0, ~0ull, 0, 0xFFFFFFFFu};
+        unsigned int i;
+        for(i = 2; i < wordCount; i++) {
+            if(parseFilter(words[i], &filter) != 0) {
+                return -1;
+            }
+        }
+        return pathIndexFind(index, words[1], &filter, printFound, out) ? 0 : 1;
+    }
+    return -1;
+}
+
+/**
+ * @brief Builds the path index and answers queries: one from the command line or one per line from stdin
+ * @param words the query, 0 to read queries from stdin
+ * @return 0 if everything was found, 1 otherwise
+ */
+int runQueries(char** words, unsigned int wordCount) {
+    PathIndex* index = &pathIndex;
+    if(!pathIndexReady) {
+        if(buildPathIndex(index) != 0) {
+            printf("Could not build the path index!\n");
+            return 1;
+        }
+        pathIndexReady = 1;
+    }
+
+    Output out;
+    outputInit(&out, stdout);
+    formatBegin(&out, outputFormat, 0);
+
+    int ret = 0;
+    if(words) {
+        ret = answerQuery(&out, index, words, wordCount);
+    }else{
+        // one query per line, each answer ends with an empty line
+        char* line = 0;
+        size_t lineCapacity = 0;
+        while(getline(&line, &lineCapacity, stdin) > 0) {
+            line[strcspn(line, "\r\n")] = '\0';
+
+            char* lineWords[64];
+            unsigned int lineWordCount = 0;
+            char* word = strtok(line, " \t");
+            while(word && lineWordCount < 64) {
+                lineWords[lineWordCount++] = word;
+                if(lineWordCount == 1 && strcmp(word, "stat") == 0) {
+                    // stat takes the rest of the line, paths may contain spaces
+                    word = strtok(0, "");
+                    while(word && (*word == ' ' || *word == '\t')) {
+                        word++;
+                    }
+                    if(word && *word) {
+                        lineWords[lineWordCount++] = word;
+                    }
+                    break;
+                }
+                word = strtok(0, " \t");
+            }
+            if(lineWordCount == 0) {
+                continue;
+            }
+
+            int answer = answerQuery(&out, index, lineWords, lineWordCount);
+            if(answer < 0) {
+                outputString(&out, "Invalid query\n");
+            }
+            ret |= answer != 0;
+            outputChar(&out, '\n');
+            outputFlush(&out);
+            fflush(stdout);
+        }
+        free(line);
+    }
+
+    outputFree(&out);
+    return ret ? 1 : 0;
+}
+
+/**
+ * @brief Prints the records of a directory and everything below it from the path index,
+ * in the same order as the traversal of the image
+ */
+void listIndexDirectory(Output* out, const PathIndex* index, unsigned int directory) {
+    const IndexEntry* d = &index->entries[directory];
+    if(d->firstChild == PATHINDEX_NONE) {
+        return;
+    }
+
+    unsigned int child;
+    for(child = d->firstChild; child < d->firstChild + d->childCount; child++) {
+        int directory = IS_DIR(index->entries[child].attr);
+        if(listFilter == LIST_ALL || directory == (listFilter == LIST_DIRECTORIES)) {
+            printIndexEntry(out, index, child, 0);
+        }
+    }
+    for(child = d->firstChild; child < d->firstChild + d->childCount; child++) {
+        if(IS_DIR(index->entries[child].attr)) {
+            listIndexDirectory(out, index, child);
+        }
+    }
+}
+
+/**
+ * @brief Prints free space and fragmentation figures: cluster counts, free extent sizes and the most fragmented files
+ * @return 0 on success, 1 if the path index could not be built
+ */
+int stats(void) {
+    if(!pathIndexReady) {
+        if(buildPathIndex(&pathIndex) != 0) {
+            printf("Could not build the path index!\n");
+            return 1;
+        }
+        pathIndexReady = 1;
+    }
+
+    FatStats figures;
+    statsScan(&figures, &volume.fat);
+
+    // fragments are the runs of a file's chain
+    ExtentList chain = {0, 0, 0};
+    unsigned int i;
+    for(i = 1; i < pathIndex.count; i++) {
+        const IndexEntry* e = &pathIndex.entries[i];
+        if(IS_DIR(e->attr) || e->firstCluster < 2) {
+            continue;
+        }
+        const Extent* runs;
+        statsAddFile(&figures, i, extentChain(&volume.extents, &volume.fat, e->firstCluster, &runs, &chain), e->size);
+    }
+    extentListFree(&chain);
+
+    Output out;
+    outputInit(&out, stdout);
+    char line[160];
+    snprintf(line, sizeof(line), "Clusters: %u used, %u free, %u bad, %u chains, %u invalid FAT entries\n",
+             figures.usedClusters, figures.freeClusters, figures.badClusters, figures.chains, figures.invalidEntries);
+    outputString(&out, line);
+    snprintf(line, sizeof(line), "Free extents: %u, largest %u clusters (%llu bytes)\n",
+             figures.freeExtents, figures.largestFreeExtent, (unsigned long long)figures.largestFreeExtent * volume.geometry.clusterSize);
+    outputString(&out, line);
+    for(i = 0; i < STATS_HISTOGRAM; i++) {
+        if(figures.freeHistogram[i]) {
+            snprintf(line, sizeof(line), "  %10u - %10u clusters: %u\n", 1u << i, (unsigned int)((2ull << i) - 1), figures.freeHistogram[i]);
+            outputString(&out, line);
+        }
+    }
+
+    snprintf(line, sizeof(line), "Files: %u, fragmented: %u (%.1f%%), fragments: %llu (%.2f per file)\n",
+             figures.files, figures.fragmentedFiles, figures.files ? 100.0 * figures.fragmentedFiles / figures.files : 0.0,
+             figures.fragments, figures.files ? (double)figures.fragments / figures.files : 0.0);
+    outputString(&out, line);
+    if(figures.worstCount) {
+        outputString(&out, "Most fragmented files:\n");
+    }
+    for(i = 0; i < figures.worstCount; i++) {
+        const StatsFile* file = &figures.worst[i];
+        char path[pathIndexPathLength(&pathIndex, file->entry) + 1];
+        snprintf(line, sizeof(line), "  %10u fragments %10u bytes  ", file->fragments, file->size);
+        outputString(&out, line);
+        outputString(&out, pathIndexPath(&pathIndex, file->entry, path));
+        outputChar(&out, '\n');
+    }
+    outputFree(&out);
+    return 0;
+}
+
+/**
+ * @brief Copies ranges of the image to a new host file
+ * @param runs clusters of the content, the last one cut to length
+ * @return 0 on success, -1 otherwise (errno is set)
+ */
+int recoverRuns(const char* hostPath, const Extent* runs, unsigned int runCount, unsigned long long length) {
+    int fd = open(hostPath, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if(fd == -1) {
+        return -1;
+    }
+    int ret = 0;
+    unsigned int run;
+    for(run = 0; run < runCount && length > 0 && ret == 0; run++) {
+        unsigned long long runLength = (unsigned long long)runs[run].length * volume.geometry.clusterSize;
+        if(runLength > length) {
+            runLength = length;
+        }
+        ret = imageCopy(&volume.image, fd, volumeClusterOffset(&volume, runs[run].start), runLength);
+        length -= runLength;
+    }
+    if(close(fd) != 0) {
+        ret = -1;
+    }
+    return ret;
+}
+
+/**
+ * @brief State of the undelete and carve commands
+ */
+typedef struct Recovery_t {
+    Output* out;
+    const char* destination;    // recovered files are written here, 0 to list them only
+    unsigned int found;
+    unsigned int recovered;
+    unsigned int failed;
+} Recovery;
+
+/**
+ * @brief Lists a deleted entry and recovers its content if there is a destination
+ * @param arg the Recovery
+ */
+void printDeletedEntry(const DeletedEntry* entry, void* arg) {
+    Recovery* recovery = (Recovery*)arg;
+    const char* status = undeleteStatusName(entry->status);
+    unsigned int firstCluster = fatFirstCluster(&entry->directoryEntry, volume.geometry.fatType);
+    recovery->found++;
+
+    if(outputFormat != FORMAT_DIR) {
+        formatDeletedRecord(recovery->out, outputFormat, entry->directory, entry->directoryLength, entry->name, &entry->directoryEntry, firstCluster, status);
+    }else{
+        // status, then the entry like in the listing with its full path as the long name
+        size_t directoryLength = entry->directoryLength == 1 ? 0 : entry->directoryLength;
+        char path[directoryLength + 1 + entry->nameLength];
+        memcpy(path, entry->directory, directoryLength);
+        path[directoryLength] = '\\';
+        memcpy(&path[directoryLength + 1], entry->name, entry->nameLength);
+
+        size_t statusLength = strlen(status);
+        outputString(recovery->out, status);
+        outputWrite(recovery->out, "            ", 12 - statusLength);
+        if(entry->status == UNDELETE_ORPHAN) {
+            outputWrite(recovery->out, path, sizeof(path));
+            outputChar(recovery->out, '\n');
+        }else{
+            char name[14];
+            volumeShortName(&entry->directoryEntry, name);
+            formatDirLine(recovery->out, &entry->directoryEntry, name, path, sizeof(path));
+        }
+    }
+
+    if(!recovery->destination || entry->runCount == 0 || IS_DIR(entry->directoryEntry.attr)) {
+        return;
+    }
+    // the first cluster keeps files of the same name apart
+    char hostPath[strlen(recovery->destination) + 12 + entry->nameLength + 1];
+    snprintf(hostPath, sizeof(hostPath), "%s/%u_%s", recovery->destination, firstCluster, entry->name);
+    if(recoverRuns(hostPath, entry->runs, entry->runCount, entry->directoryEntry.size) != 0) {
+        printf("Can't write '%s'! errno: %d\n", hostPath, errno);
+        recovery->failed++;
+        return;
+    }
+    extractTimes(&entry->directoryEntry, hostPath);
+    recovery->recovered++;
+}
+
+/**
+ * @brief Lists the deleted files and directories, recovering what is left of the files
+ * @param destination directory the files are written to, 0 to list them only
+ * @return exit code
+ */
+int undelete(const char* destination) {
+    if(destination && mkdir(destination, 0755) != 0 && errno != EEXIST) {
+        printf("Could not create directory '%s'! errno: %d\n", destination, errno);
+        return 1;
+    }
+
+    Output out;
+    outputInit(&out, stdout);
+    if(outputFormat == FORMAT_CSV) {
+        outputString(&out, "path,attributes,first_cluster,size,modified,status\n");
+    }
+    Recovery recovery = {&out, destination, 0, 0, 0};
+    if(undeleteScan(&volume, printDeletedEntry, &recovery) != 0) {
+        printf("Out of memory!\n");
+        exit(1);
+    }
+    outputFree(&out);
+    if(outputFormat == FORMAT_DIR) {
+        printf("%u deleted entries", recovery.found);
+        if(destination) {
+            printf(", %u files recovered", recovery.recovered);
+        }
+        printf("\n");
+    }
+    return recovery.failed ? 1 : 0;
+}
+
+/**
+ * @brief Lists a carved file and writes it out if there is a destination
+ * @param arg the Recovery
+ */
+void printCarvedFile(const CarvedFile* file, void* arg) {
+    Recovery* recovery = (Recovery*)arg;
+    const char* type = carveTypeName(file->type);
+    recovery->found++;
+
+    if(outputFormat != FORMAT_DIR) {
+        formatCarvedRecord(recovery->out, outputFormat, type, file->cluster, file->offset, file->length, file->complete);
+    }else{
+        char line[128];
+        snprintf(line, sizeof(line), "%-4s %14llu %12llu  cluster %u%s\n", type, file->offset, file->length, file->cluster, file->complete ? "" : " (incomplete)");
+        outputString(recovery->out, line);
+    }
+
+    if(!recovery->destination) {
+        return;
+    }
+    char hostPath[strlen(recovery->destination) + 32];
+    snprintf(hostPath, sizeof(hostPath), "%s/carved_%u.%s", recovery->destination, file->cluster, type);
+    // a carved file is contiguous by definition
+    unsigned int clusters = (unsigned int)((file->length + volume.geometry.clusterSize - 1) / volume.geometry.clusterSize);
+    Extent run = {file->cluster, clusters};
+    if(recoverRuns(hostPath, &run, 1, file->length) != 0) {
+        printf("Can't write '%s'! errno: %d\n", hostPath, errno);
+        recovery->failed++;
+        return;
+    }
+    recovery->recovered++;
+}
+
+/**
+ * @brief Looks for files in the free clusters by their content
+ * @param destination directory the files are written to, 0 to list them only
+ * @return exit code
+ */
+int carve(const char* destination) {
+    if(destination && mkdir(destination, 0755) != 0 && errno != EEXIST) {
+        printf("Could not create directory '%s'! errno: %d\n", destination, errno);
+        return 1;
+    }
+
+    // the next chunks are read while one is scanned, without a queue it only takes longer
+    ReadAhead readAhead;
+    int readingAhead = ioEngine >= 0 && readAheadInit(&readAhead, &volume.image, ioEngine) == 0;
+
+    Output out;
+    outputInit(&out, stdout);
+    if(outputFormat == FORMAT_CSV) {
+        outputString(&out, "type,cluster,offset,length,complete\n");
+    }
+    Recovery recovery = {&out, destination, 0, 0, 0};
+    if(carveScan(&volume, readingAhead ? &readAhead : 0, printCarvedFile, &recovery) != 0) {
+        printf("Out of memory!\n");
+        exit(1);
+    }
+    outputFree(&out);
+    if(readingAhead) {
+        readAheadFree(&readAhead);
+    }
+    if(outputFormat == FORMAT_DIR) {
+        printf("%u files carved", recovery.found);
+        if(destination) {
+            printf(", %u written", recovery.recovered);
+        }
+        printf("\n");
+    }
+    return recovery.failed ? 1 : 0;
+}
+
+#define BENCH_PATHS 1000   // paths resolved per run
+
+/**
+ * @brief Follows every chain of the FAT to its end, one getnextcluster call per hop
+ * @return number of hops
+ */
+unsigned long long benchFollowChains(void) {
+    unsigned long long hops = 0;
+    unsigned int i;
+    for(i = 0; i < volume.extents.headCount; i++) {
+        unsigned int cluster = volume.extents.heads[i];
+        // a chain that runs into itself ends after visiting every cluster once at most
+        unsigned int limit = volume.fat.count;
+        while(cluster >= 2 && cluster < volume.fat.count && limit--) {
+            cluster = getnextcluster(cluster);
+            hops++;
+        }
+    }
+    return hops;
+}
+
+/**
+ * @brief Subdirectory handler that drops the subdirectory, for listing a single directory
+ */
+void ignoreSubdirectory(DirListing* listing, const DIRENTRY* directoryEntry, PathNode* path) {
+    (void)listing;
+    (void)directoryEntry;
+    (void)path;
+}
+
+/**
+ * @brief Lists the whole volume into out like the plain list command, then forgets all path nodes
+ */
+void benchListVolume(Output* out) {
+    PathNode* root = pathNodeCreate(&traversalArena, 0, "", volume.geometry.rootCluster, 0);
+    if(!root || pathCacheInsert(&pathCache, root) != 0) {
+        printf("Out of memory!\n");
+        exit(1);
+    }
+    VolumeDir dir;
+    memset(&dir, 0, sizeof(dir));
+    DirListing listing = {root, dirStack.count, out, 0, &traversalArena, pushSubdirectory, 0, &dir};
+    listDirectory(&listing);
+    dir_reverse(listing.stackMark);
+    volumeDirClose(&dir);
+    list_recursive(out);
+
+    pathCacheFree(&pathCache);
+    arenaReset(&traversalArena);
+}
+
+/**
+ * @brief Where the differences go and how many there are of each kind
+ */
+typedef struct DiffReport_t {
+    Output* out;
+    unsigned int counts[4];     // by DIFF_*
+} DiffReport;
+
+/**
+ * @brief Lists a difference between the images
+ * @param arg the DiffReport
+ */
+void printDifference(const DiffChange* change, void* arg) {
+    DiffReport* report = (DiffReport*)arg;
+    const DIRENTRY* directoryEntry = change->kind == DIFF_REMOVED ? &change->before : &change->after;
+    report->counts[change->kind]++;
+
+    if(outputFormat != FORMAT_DIR) {
+        formatDiffRecord(report->out, outputFormat, diffKindName(change->kind), change->path, change->pathLength, change->oldPath, change->oldPathLength, directoryEntry);
+        return;
+    }
+    char kind[16];
+    snprintf(kind, sizeof(kind), "%-9s", diffKindName(change->kind));
+    outputString(report->out, kind);
+    outputString(report->out, IS_DIR(directoryEntry->attr) ? "<DIR>  " : "       ");
+    outputWrite(report->out, change->path, change->pathLength);
+    if(change->oldPath) {
+        outputString(report->out, " (from ");
+        outputWrite(report->out, change->oldPath, change->oldPathLength);
+        outputChar(report->out, ')');
+    }
+    outputChar(report->out, '\n');
+}
+
+/**
+ * @brief Reads the partition table of an image, reports it if it can't
+ * @return 0 on success, -1 otherwise
+ */
+int readPartitionTable(const char* filename, PartitionTable* table) {
+    Image image;
+    int ret = imageOpen(&image, filename);
+    if(ret == 0) {
+        ret = partitionRead(&image, table);
+        imageClose(&image);
+    }
+    if(ret != 0) {
+        printf("Can't read the partition table of '%s'! errno: %d\n", filename, errno);
+    }
+    return ret;
+}
+
+/**
+ * @brief Picks the partition of a disk image a command works on: the one -p names, or else the only FAT partition
+ * @return the partition, 0 if there is none or several to choose from (reported)
+ */
+const Partition* pickPartition(const char* filename, const PartitionTable* table) {
+    if(partitionNumber) {
+        const Partition* partition = partitionFind(table, partitionNumber);
+        if(!partition) {
+            printf("'%s' has no partition %u!\n", filename, partitionNumber);
+        }else if(!partition->fatType) {
+            printf("Partition %u of '%s' is not a FAT volume!\n", partitionNumber, filename);
+        }
+        return partition && partition->fatType ? partition : 0;
+    }
+
+    unsigned int count = partitionFatCount(table);
+    if(count != 1) {
+        printf(count ? "'%s' has %u FAT partitions, pick one with -p!\n" : "'%s' has no FAT partition!\n", filename, count);
+        return 0;
+    }
+    unsigned int i;
+    for(i = 0; i < table->count; i++) {
+        if(table->partitions[i].fatType) {
+            break;
+        }
+    }
+    return &table->partitions[i];
+}
+
+/**
+ * @brief Prints the partition table of an image
+ * @return 0 on success, 1 if it can't be read
+ */
+int printPartitions(const char* filename) {
+    PartitionTable table;
+    if(readPartitionTable(filename, &table) != 0) {
+        return 1;
+    }
+    if(table.scheme == PARTITION_NONE) {
+        printf("No partition table, '%s' is a volume or holds none\n", filename);
+        return 0;
+    }
+    printf("Partition table: %s, %u byte sectors\n", partitionSchemeName(table.scheme), table.sectorSize);
+    unsigned int i;
+    for(i = 0; i < table.count; i++) {
+        const Partition* partition = &table.partitions[i];
+        printf("%3u  byte %12llu  length %12llu  ", partition->number, partition->offset, partition->length);
+        if(table.scheme == PARTITION_GPT) {
+            // the first three fields of a GUID are little endian
+            const unsigned char* guid = partition->typeGuid;
+            printf("type %02X%02X%02X%02X-%02X%02X-%02X%02X-%02X%02X-%02X%02X%02X%02X%02X%02X", guid[3], guid[2], guid[1], guid[0], guid[5], guid[4], guid[7], guid[6],
+                   guid[8], guid[9], guid[10], guid[11], guid[12], guid[13], guid[14], guid[15]);
+        }else{
+            printf("type 0x%02x", partition->type);
+        }
+        if(partition->fatType) {
+            printf("  FAT%d", partition->fatType);
+        }
+        if(partition->name[0]) {
+            printf("  \"%s\"", partition->name);
+        }
+        printf("\n");
+    }
+    partitionFree(&table);
+    return 0;
+}
+
+/**
+ * @brief Lists what changed from the open image to another one
+ * @param threads hashing files
+ * @return exit code: 0 if they are the same, 1 if they differ, 2 on error
+ */
+int diffImages(const char* otherFilename, unsigned int threads) {
+    Volume other;
+    int opened = volumeOpen(&other, otherFilename);
+    // a disk, compared by the same partition as the open image or its only FAT partition
+    PartitionTable table;
+    if(opened == VOLUME_ERROR_FORMAT) {
+        if(readPartitionTable(otherFilename, &table) != 0) {
+            return 2;
+        }
+        const Partition* partition = table.scheme != PARTITION_NONE ? pickPartition(otherFilename, &table) : 0;
+        if(partition) {
+            opened = volumeOpenPartition(&other, otherFilename, partition->offset, partition->length, 0);
+        }
+        partitionFree(&table);
+        if(!partition && table.scheme != PARTITION_NONE) {
+            return 2;
+        }
+    }
+    if(opened == 0) {
+        opened = volumeLoad(&other);
+    }
+    if(opened != 0) {
+        printf("Can't read image '%s'! errno: %d\n", otherFilename, errno);
+        return 2;
+    }
+
+    Output out;
+    outputInit(&out, stdout);
+    if(outputFormat == FORMAT_CSV) {
+        outputString(&out, "change,path,old_path,attributes,size,modified\n");
+    }
+    DiffReport report = {&out, {0, 0, 0, 0}};
+    DiffStats diffStats;
+    int ret = diffVolumes(&volume, &other, threads, printDifference, &report, &diffStats);
+    outputFree(&out);
+    volumeClose(&other);
+    if(ret != 0) {
+        printf("Could not compare the images! errno: %d\n", errno);
+        return 2;
+    }
+    if(outputFormat == FORMAT_DIR) {
+        printf("%u added, %u removed, %u modified, %u moved\n", report.counts[DIFF_ADDED], report.counts[DIFF_REMOVED], report.counts[DIFF_MODIFIED], report.counts[DIFF_MOVED]);
+        printf("%u FAT entries differ, %u directories compared, %u files unchanged without reading them, %u files hashed (%llu bytes)\n",
+               diffStats.fatDifferences, diffStats.directories, diffStats.unchanged, diffStats.hashed, diffStats.hashedBytes);
+    }
+    return report.counts[DIFF_ADDED] + report.counts[DIFF_REMOVED] + report.counts[DIFF_MODIFIED] + report.counts[DIFF_MOVED] > 0 ? 1 : 0;
+}
+
+/**
+ * @brief State of 'put', shared with putHostEntry
+ */
+typedef struct Change_t {
+    Writer writer;
+    size_t sourceLength;        // of the host path that is put
+    const char* target;         // path on the volume the host path becomes
+    unsigned int files;
+    unsigned int directories;
+    unsigned long long bytes;
+    unsigned int failed;
+} Change;
+
+Change change;
+
+/**
+ * @brief Puts a host file or directory of the tree given to 'put' on the volume, for nftw
+ */
+int putHostEntry(const char* hostPath, const struct stat* st, int type, struct FTW* ftw) {
+    (void)ftw;
+    char path[PATH_MAX + 1024];
+    snprintf(path, sizeof(path), "%s%s", change.target, hostPath + change.sourceLength);
+    if(type == FTW_D) {
+        // an existing directory is filled up
+        DIRENTRY found;
+        char name[LFN_UTF8_MAX];
+        if(writerMkdir(&change.writer, path, st->st_mtime) == 0) {
+            change.directories++;
+        }else if(errno != EEXIST || !volumeLookup(&volume, path, &found, name) || !IS_DIR(found.attr)) {
+            printf("Could not create directory '%s'! errno: %d\n", path, errno);
+            change.failed++;
+            return FTW_SKIP_SUBTREE;
+        }
+        return FTW_CONTINUE;
+    }
+    if(type != FTW_F) {
+        printf("Skipping '%s', not a regular file or directory\n", hostPath);
+        return FTW_CONTINUE;
+    }
+
+    int fd = open(hostPath, O_RDONLY);
+    if(fd < 0 || writerPut(&change.writer, path, fd, st->st_size, st->st_mtime) != 0) {
+        printf("Could not put '%s' as '%s'! errno: %d\n", hostPath, path, errno);
+        change.failed++;
+    }else{
+        change.files++;
+        change.bytes += st->st_size;
+    }
+    if(fd >= 0) {
+        close(fd);
+    }
+    return FTW_CONTINUE;
+}
+
+/**
+ * @brief Copies a host file or directory tree onto the volume
+ * @param path where it goes; into an existing directory it goes under its own name
+ */
+void put(const char* source, const char* path) {
+    char hostPath[PATH_MAX];
+    size_t length = strlen(source);
+    while(length > 1 && source[length - 1] == '/') {
+        length--;
+    }
+    snprintf(hostPath, sizeof(hostPath), "%.*s", (int)length, source);
+
+    char target[PATH_MAX + 1024];
+    DIRENTRY found;
+    char name[LFN_UTF8_MAX];
+    if(volumeLookup(&volume, path, &found, name) && IS_DIR(found.attr)) {
+        size_t start = length;
+        while(start > 0 && source[start - 1] != '/') {
+            start--;
+        }
+        size_t pathLength = strlen(path);
+        int separator = pathLength == 0 || (path[pathLength - 1] != '\\' && path[pathLength - 1] != '/');
+        snprintf(target, sizeof(target), "%s%s%.*s", path, separator ? "/" : "", (int)(length - start), &source[start]);
+    }else{
+        snprintf(target, sizeof(target), "%s", path);
+    }
+    change.target = target;
+    change.sourceLength = strlen(hostPath);
+    if(nftw(hostPath, putHostEntry, 16, FTW_PHYS | FTW_ACTIONRETVAL) != 0) {
+        printf("Could not read '%s'! errno: %d\n", source, errno);
+        change.failed++;
+    }
+}
+
+/**
+ * @brief Runs 'put', 'mkdir' or 'rm' and writes the FAT back once
+ * @param command its name
+ * @param arguments after the image name
+ * @return exit code
+ */
+int changeVolume(const char* command, char** arguments, int count) {
+    if(writerOpen(&change.writer, &volume) != 0) {
+        printf("Could not prepare the volume for writing! errno: %d\n", errno);
+        return 1;
+    }
+    if(strcmp(command, "put") == 0) {
+        put(arguments[0], count > 1 ? arguments[1] : "\\");
+    }else if(strcmp(command, "mkdir") == 0) {
+        if(writerMkdir(&change.writer, arguments[0], time(0)) != 0) {
+            printf("Could not create directory '%s'! errno: %d\n", arguments[0], errno);
+            change.failed++;
+        }else{
+            change.directories++;
+        }
+    }else if(writerRemove(&change.writer, arguments[0]) != 0) {
+        printf("Could not remove '%s'! errno: %d\n", arguments[0], errno);
+        change.failed++;
+    }
+
+    // what was changed before a failure is kept as well
+    if(writerFlush(&change.writer) != 0) {
+        printf("Could not write the FAT! errno: %d\n", errno);
+        change.failed++;
+    }
+    if(writerClose(&change.writer) != 0) {
+        printf("Out of memory!\n");
+        exit(1);
+    }
+    if(strcmp(command, "put") == 0) {
+        printf("%u files (%llu bytes) and %u directories written\n", change.files, change.bytes, change.directories);
+    }
+    return change.failed ? 1 : 0;
+}
+
+/**
+ * @brief Removes a file or an empty directory, for nftw
+ */
+int removeHostEntry(const char* path, const struct stat* st, int type, struct FTW* ftw) {
+    (void)st;
+    (void)type;
+    (void)ftw;
+    return remove(path);
+}
+
+/**
+ * @brief Times the hot paths of the decoder on the open image and prints one JSON Lines record per benchmark:
+ * following chains, listing the root directory, listing the whole volume, resolving paths by reading
+ * directories and through the path index, and extracting everything to a temporary directory
+ * @param filename of the image, for the records
+ * @param runs of every benchmark
+ * @param threads for the parallel listing and the extraction
+ * @return 0 on success, 1 if the path index could not be built or the extraction failed
+ */
+int bench(const char* filename, unsigned int runs, unsigned int threads) {
+    if(runs > BENCH_RUNS_MAX) {
+        runs = BENCH_RUNS_MAX;
+    }
+    BenchResult results[9];
+    unsigned int resultCount = 0;
+    unsigned int run;
+    unsigned long long start;
+
+    BenchResult* result = &results[resultCount++];
+    benchInit(result, "getnextcluster", benchFollowChains());
+    for(run = 0; run < runs; run++) {
+        start = benchClock();
+        benchFollowChains();
+        benchRecord(result, start);
+    }
+
+    // everything is listed into memory, clearing the output keeps its buffer
+    Output out;
+    outputInit(&out, 0);
+    Arena arena = {0};
+    VolumeDir dir;
+    memset(&dir, 0, sizeof(dir));
+    unsigned int entries = volume.geometry.fatType == 32 ? 0 : volume.geometry.rootSize / sizeof(DIRENTRY);
+    if(volume.geometry.fatType == 32) {
+        const Extent* rootRuns;
+        unsigned int runCount = volumeChain(&volume, 0, &rootRuns, &dir.chain);
+        unsigned int i;
+        for(i = 0; i < runCount; i++) {
+            entries += rootRuns[i].length * volume.geometry.clusterSize / sizeof(DIRENTRY);
+        }
+    }
+    result = &results[resultCount++];
+    benchInit(result, "listDirectory", entries);
+    for(run = 0; run < runs; run++) {
+        start = benchClock();
+        PathNode* root = pathNodeCreate(&arena, 0, "", volume.geometry.rootCluster, 0);
+        if(!root) {
+            printf("Out of memory!\n");
+            exit(1);
+        }
+        DirListing listing = {root, 0, &out, 0, &arena, ignoreSubdirectory, 0, &dir};
+        listDirectory(&listing);
+        benchRecord(result, start);
+        out.used = 0;
+        arenaReset(&arena);
+    }
+    arenaFree(&arena);
+    volumeDirClose(&dir);
+
+    result = &results[resultCount++];
+    benchListVolume(&out);
+    benchInit(result, "list_recursive", out.used);
+    out.used = 0;
+    for(run = 0; run < runs; run++) {
+        start = benchClock();
+        benchListVolume(&out);
+        benchRecord(result, start);
+        out.used = 0;
+    }
+
+    if(threads > 1) {
+        result = &results[resultCount++];
+        benchInit(result, "list_parallel", results[resultCount - 2].operations);
+        for(run = 0; run < runs; run++) {
+            start = benchClock();
+            PathNode* parallelRoot = pathNodeCreate(&traversalArena, 0, "", volume.geometry.rootCluster, 0);
+            if(!parallelRoot || pathCacheInsert(&pathCache, parallelRoot) != 0) {
+                printf("Out of memory!\n");
+                exit(1);
+            }
+            list_parallel(parallelRoot, threads, &out);
+            benchRecord(result, start);
+            out.used = 0;
+            pathCacheFree(&pathCache);
+            arenaReset(&traversalArena);
+        }
+    }
+    outputFree(&out);
+    arenaFree(&traversalArena);
+
+    result = &results[resultCount++];
+    benchInit(result, "buildPathIndex", 0);
+    for(run = 0; run < runs; run++) {
+        PathIndex index;
+        start = benchClock();
+        if(buildPathIndex(&index) != 0) {
+            printf("Could not build the path index!\n");
+            return 1;
+        }
+        benchRecord(result, start);
+        result->operations = index.count;
+        pathIndexFree(&index);
+    }
+    if(!pathIndexReady) {
+        if(buildPathIndex(&pathIndex) != 0) {
+            printf("Could not build the path index!\n");
+            return 1;
+        }
+        pathIndexReady = 1;
+    }
+
+    // paths spread evenly over the index, deep ones as well as shallow ones
+    unsigned int pathCount = pathIndex.count - 1 < BENCH_PATHS ? pathIndex.count - 1 : BENCH_PATHS;
+    char** paths = (char**)malloc(sizeof(char*) * (pathCount + 1));
+    if(!paths) {
+        printf("Out of memory!\n");
+        exit(1);
+    }
+    unsigned int i;
+    for(i = 0; i < pathCount; i++) {
+        unsigned int entry = 1 + (unsigned int)((unsigned long long)i * (pathIndex.count - 1) / pathCount);
+        paths[i] = (char*)malloc(pathIndexPathLength(&pathIndex, entry) + 1);
+        if(!paths[i]) {
+            printf("Out of memory!\n");
+            exit(1);
+        }
+        pathIndexPath(&pathIndex, entry, paths[i]);
+    }
+
+    unsigned int missed = 0;
+    result = &results[resultCount++];
+    benchInit(result, "resolvePath", pathCount);
+    for(run = 0; run < runs; run++) {
+        start = benchClock();
+        for(i = 0; i < pathCount; i++) {
+            DIRENTRY found;
+            char name[LFN_UTF8_MAX];
+            missed += !volumeLookup(&volume, paths[i], &found, name);
+        }
+        benchRecord(result, start);
+    }
+    result = &results[resultCount++];
+    benchInit(result, "pathIndexLookup", pathCount);
+    for(run = 0; run < runs; run++) {
+        start = benchClock();
+        for(i = 0; i < pathCount; i++) {
+            missed += pathIndexLookup(&pathIndex, paths[i]) == PATHINDEX_NONE;
+        }
+        benchRecord(result, start);
+    }
+    for(i = 0; i < pathCount; i++) {
+        free(paths[i]);
+    }
+    free(paths);
+    if(missed) {
+        printf("%u lookups did not find their path!\n", missed);
+    }
+
+    // the files are copied for real, into a directory that is removed after every run
+    char temporary[] = "/tmp/what-the-fat-XXXXXX";
+    if(!mkdtemp(temporary)) {
+        printf("Could not create a temporary directory! errno: %d\n", errno);
+        return 1;
+    }
+    unsigned int failed = 0;
+    result = &results[resultCount++];
+    benchInit(result, "extract", 0);
+    for(run = 0; run < runs && !failed; run++) {
+        Extractor extractor;
+        start = benchClock();
+        extractInit(&extractor, &volume.image, &volume.geometry, &volume.fat, &volume.extents);
+        extractor.report = reportExtractFailure;
+        extractDirectory(&extractor, 0, temporary, &failed);
+        failed += extractRun(&extractor, threads);
+        benchRecord(result, start);
+        result->operations = extractor.bytes;
+        extractFree(&extractor);
+
+        // empty again for the next run
+        nftw(temporary, removeHostEntry, 16, FTW_DEPTH | FTW_PHYS);
+        if(run + 1 < runs && mkdir(temporary, 0700) != 0) {
+            printf("Could not create directory '%s'! errno: %d\n", temporary, errno);
+            failed++;
+        }
+    }
+
+    // the image goes in front of every record
+    Output context;
+    outputInit(&context, 0);
+    outputString(&context, "\"image\":");
+    outputJsonString(&context, filename, strlen(filename));
+    char line[160];
+    snprintf(line, sizeof(line), ",\"fat\":%u,\"clusters\":%u,\"cluster_size\":%u,\"threads\":%u",
+             volume.geometry.fatType, volume.geometry.clusterCount, volume.geometry.clusterSize, threads);
+    outputString(&context, line);
+    outputChar(&context, '\0');
+
+    Output json;
+    outputInit(&json, stdout);
+    benchWrite(&json, context.data, results, resultCount);
+    outputFree(&json);
+    outputFree(&context);
+    return failed ? 1 : 0;
+}
+
+/**
+ * @brief Prints how to call the program
+ */
+void usage(const char* program) {
+    printf("Usage: %s [-j threads] [-f dir|jsonl|csv] [-t files|dirs] [-s snapshot] [list] filename\n", program);
+    printf("       %s [-j threads] extract filename [path [destination]]\n", program);
+    printf("       %s [-f dir|jsonl|csv] [-s snapshot] stat filename path\n", program);
+    printf("       %s [-f dir|jsonl|csv] [-s snapshot] find filename glob [size>N|size<N|after=YYYY-MM-DD|before=YYYY-MM-DD ...]\n", program);
+    printf("       %s [-f dir|jsonl|csv] [-s snapshot] query filename < queries\n", program);
+    printf("       %s [-j threads] check filename\n", program);
+    printf("       %s [-s snapshot] stats filename\n", program);
+    printf("       %s [-j threads] [-f dir|jsonl|csv] [-s snapshot] bench filename [runs]\n", program);
+    printf("       %s [-j threads] [-f dir|jsonl|csv] batch manifest|directory\n", program);
+    printf("       %s [-f dir|jsonl|csv] undelete filename [destination]\n", program);
+    printf("       %s [-f dir|jsonl|csv] carve filename [destination]\n", program);
+    printf("       %s [-j threads] [-f dir|jsonl|csv] diff filename other\n", program);
+    printf("       %s put filename source [path]\n", program);
+    printf("       %s mkdir filename path\n", program);
+    printf("       %s rm filename path\n", program);
+    printf("       %s partitions filename\n", program);
+    printf("-p N before the command works on partition N of a disk image (MBR: 1-4 primary, 5 on logical; GPT: entry number),\n");
+    printf("   a disk with several FAT partitions is listed whole without it\n");
+    printf("--stats[=table|json] before the command prints I/O counters and phase times to stderr (built with -DWTF_STATS)\n");
+    printf("--io=auto|uring|threads|off picks how directories are read ahead of the listing\n");
+    printf("--cache=MiB sets how much of a compressed image is kept decompressed (default %u)\n", BLOCK_CACHE_DEFAULT >> 20);
+}
+
+/**
+ * @brief Prints the counters and phase times if --stats was given
+ * @param format COUNTERS_*, -1 for nothing
+ */
+void printCounters(int format) {
+    if(format < 0) {
+        return;
+    }
+    Output out;
+    outputInit(&out, stderr);
+    countersWrite(&out, format);
+    outputFree(&out);
+}
+
+int main(int argc, char* argv[]) {
+
+    char filename[1024] = "BSA.img";
+    unsigned int threads = 1;
+    int threadsGiven = 0;
+    int option;
+    const char* snapshotFile = 0;
+    int countersFormat = -1;
+    size_t cacheSize = 0;
+    static const struct option longOptions[] = {{"stats", optional_argument, 0, 'S'}, {"io", required_argument, 0, 'I'}, {"cache", required_argument, 0, 'C'}, {0, 0, 0, 0}};
+    while((option = getopt_long(argc, argv, "j:f:s:t:p:", longOptions, 0)) != -1) {
+        if(option == 'S' && (!optarg || strcmp(optarg, "table") == 0)) {
+            countersFormat = COUNTERS_TABLE;
+        }else if(option == 'S' && strcmp(optarg, "json") == 0) {
+            countersFormat = COUNTERS_JSON;
+        }else if(option == 'I' && strcmp(optarg, "off") == 0) {
+            ioEngine = -1;
+        }else if(option == 'I' && ioEngineByName(optarg) >= 0) {
+            ioEngine = ioEngineByName(optarg);
+        }else if(option == 'C' && atoi(optarg) > 0) {
+            cacheSize = (size_t)atoi(optarg) << 20;
+        }else if(option == 't' && (strcmp(optarg, "files") == 0 || strcmp(optarg, "dirs") == 0)) {
+            listFilter = optarg[0] == 'f' ? LIST_FILES : LIST_DIRECTORIES;
+        }else if(option == 's') {
+            snapshotFile = optarg;
+        }else if(option == 'p' && atoi(optarg) > 0) {
+            partitionNumber = atoi(optarg);
+        }else if(option == 'j' && atoi(optarg) > 0) {
+            threads = atoi(optarg);
+            threadsGiven = 1;
+        }else if(option == 'f' && formatByName(optarg) >= 0) {
+            outputFormat = formatByName(optarg);
+        }else{
+            usage(argv[0]);
+            exit(1);
+        }
+    }
+
+    // commands come before the image, a plain image is listed
+    static const struct {
+        const char* name;
+        int minArguments;
+        int maxArguments;
+    } commands[] = {{"list", 0, 0}, {"extract", 0, 2}, {"stat", 1, 1}, {"find", 1, 64}, {"query", 0, 0}, {"check", 0, 0}, {"stats", 0, 0}, {"bench", 0, 1}, {"batch", 0, 0}, {"undelete", 0, 1}, {"carve", 0, 1},
+                    {"diff", 1, 1}, {"put", 1, 2}, {"mkdir", 1, 1}, {"rm", 1, 1}, {"partitions", 0, 0}};
+    unsigned int command = 0;
+    unsigned int i;
+    for(i = 0; optind < argc && i < sizeof(commands) / sizeof(commands[0]); i++) {
+        if(strcmp(argv[optind], commands[i].name) == 0) {
+            command = i;
+            optind++;
+            break;
+        }
+    }
+    int arguments = argc - optind - 1;
+    int listing = command == 0;
+    int writing = strcmp(commands[command].name, "put") == 0 || strcmp(commands[command].name, "mkdir") == 0 || strcmp(commands[command].name, "rm") == 0;
+    if(arguments < commands[command].minArguments || arguments > commands[command].maxArguments) {
+        usage(argv[0]);
+        if(!listing || optind < argc) {
+            exit(1);
+        }
+        printf("I will pick file '%s' for you.\n", filename);
+    }else{
+        strncpy(filename, argv[optind], 1023);
+    }
+
+    // many images, each one opened by the batch workers
+    if(strcmp(commands[command].name, "batch") == 0) {
+        long online = sysconf(_SC_NPROCESSORS_ONLN);
+        int failed = batchRun(filename, outputFormat, threadsGiven || online < 1 ? threads : (unsigned int)online, stdout, stderr);
+        if(failed < 0) {
+            printf("Can't read '%s'! errno: %d\n", filename, errno);
+        }
+        printCounters(countersFormat);
+        return failed != 0 ? 1 : 0;
+    }
+
+    if(strcmp(commands[command].name, "partitions") == 0) {
+        return printPartitions(filename);
+    }
+
+    unsigned long long phaseStart = PHASE_START();
+    int opened = partitionNumber ? VOLUME_ERROR_FORMAT : writing ? volumeOpenWritable(&volume, filename) : volumeOpen(&volume, filename);
+
+    // no FAT volume at the start: a disk, the volume is in one of its partitions
+    Partition partition;
+    memset(&partition, 0, sizeof(partition));
+    if(opened == VOLUME_ERROR_FORMAT) {
+        PartitionTable table;
+        if(readPartitionTable(filename, &table) != 0) {
+            exit(1);
+        }
+        // each FAT partition is a volume of its own, they are listed side by side
+        if(listing && !partitionNumber && partitionFatCount(&table) > 1) {
+            long online = sysconf(_SC_NPROCESSORS_ONLN);
+            int failed = batchRunPartitions(filename, &table, outputFormat, threadsGiven || online < 1 ? threads : (unsigned int)online, stdout, stderr);
+            if(failed < 0) {
+                printf("Out of memory!\n");
+            }
+            partitionFree(&table);
+            printCounters(countersFormat);
+            return failed != 0 ? 1 : 0;
+        }
+        if(table.scheme != PARTITION_NONE || partitionNumber) {
+            const Partition* picked = pickPartition(filename, &table);
+            if(!picked) {
+                exit(1);
+            }
+            partition = *picked;
+            opened = volumeOpenPartition(&volume, filename, partition.offset, partition.length, writing);
+        }
+        partitionFree(&table);
+    }
+    if(opened == VOLUME_ERROR_OPEN && errno == EROFS) {
+        printf("Can't write to a compressed image!\n");
+        exit(1);
+    }
+	if (opened == VOLUME_ERROR_OPEN && errno == ENOTSUP){
+		printf("Can't read this compressed image! gzip needs a build with -DWTF_HAVE_ZLIB, zstd one with -DWTF_HAVE_ZSTD and a seek table\n");
+		exit(1);
+	}
+	if (opened == VOLUME_ERROR_OPEN){
+		printf("Can't open file! errno: %d\n", errno);
+		exit(1);
+	}
+    if (opened == VOLUME_ERROR_READ) {
+        printf("Could not read 512 Bytes! errno: %d\n", errno);
+		exit(1);
+	}
+    if (opened != 0) {
+        printVolumeInformation(0);
+        exit(1);
+    }
+    if(cacheSize) {
+        imageCacheSize(&volume.image, cacheSize);
+    }
+    PHASE_END(PHASE_BOOTSECTOR, phaseStart);
+
+    // records only in the machine readable formats
+    if(listing && outputFormat == FORMAT_DIR) {
+        if(partition.number) {
+            printf("Partition %u starting at byte %llu, length %llu\n", partition.number, partition.offset, partition.length);
+        }
+        printVolumeInformation(&volume);
+        printf("First FAT starting at byte %llu, length %llu\n", volume.geometry.fatOffset, volume.geometry.fatSize);
+    }
+
+    // a snapshot of this very image saves decoding the FAT and reading the directories, one of a volume about to change would be out of date
+    phaseStart = PHASE_START();
+    SnapshotKey key;
+    int fromSnapshot = 0;
+    if(snapshotFile && !writing) {
+        if(snapshotKey(&volume.image, &volume.bootsector, &volume.geometry, &key) != 0) {
+            printf("Could not read FAT%d! errno: %d\n", volume.geometry.fatType, errno);
+            exit(1);
+        }
+        fromSnapshot = snapshotOpen(&snapshot, snapshotFile, &key, &volume.fat, &volume.extents, &pathIndex) == 0;
+        pathIndexReady = fromSnapshot;
+    }
+
+    // decode it once, chains are followed through the table only
+    if(!fromSnapshot && fatLoad(&volume.fat, &volume.image, &volume.geometry) != 0) {
+        printf("Could not load FAT%d! errno: %d\n", volume.geometry.fatType, errno);
+        exit(1);
+    }
+
+    PHASE_END(PHASE_FAT, phaseStart);
+
+    phaseStart = PHASE_START();
+    if(!fromSnapshot && extentIndexBuild(&volume.extents, &volume.fat) != 0) {
+        printf("Could not build the extent index!\n");
+        exit(1);
+    }
+
+    PHASE_END(PHASE_EXTENTS, phaseStart);
+
+    if(snapshotFile && !fromSnapshot && !writing) {
+        phaseStart = PHASE_START();
+        if(buildPathIndex(&pathIndex) != 0) {
+            printf("Could not build the path index!\n");
+            exit(1);
+        }
+        pathIndexReady = 1;
+        // without a snapshot the next run is just as slow, but this one can go on
+        if(snapshotWrite(snapshotFile, &key, &volume.fat, &volume.extents, &pathIndex) != 0) {
+            printf("Could not write snapshot '%s'! errno: %d\n", snapshotFile, errno);
+        }
+        PHASE_END(PHASE_INDEX, phaseStart);
+    }
+
+    if(!listing) {
+        phaseStart = PHASE_START();
+        int ret;
+        if(strcmp(commands[command].name, "extract") == 0) {
+            const char* path = arguments > 0 ? argv[optind + 1] : "\\";
+            const char* destination = arguments > 1 ? argv[optind + 2] : ".";
+            ret = extract(path, destination, threads);
+        }else if(strcmp(commands[command].name, "check") == 0) {
+            ret = check(threads);
+        }else if(strcmp(commands[command].name, "stats") == 0) {
+            ret = stats();
+        }else if(strcmp(commands[command].name, "bench") == 0) {
+            ret = bench(filename, arguments > 0 && atoi(argv[optind + 1]) > 0 ? atoi(argv[optind + 1]) : 5, threads);
+        }else if(strcmp(commands[command].name, "undelete") == 0) {
+            ret = undelete(arguments > 0 ? argv[optind + 1] : 0);
+        }else if(strcmp(commands[command].name, "carve") == 0) {
+            ret = carve(arguments > 0 ? argv[optind + 1] : 0);
+        }else if(strcmp(commands[command].name, "diff") == 0) {
+            ret = diffImages(argv[optind + 1], threads);
+        }else if(writing) {
+            ret = changeVolume(commands[command].name, &argv[optind + 1], arguments);
+        }else if(strcmp(commands[command].name, "query") == 0) {
+            ret = runQueries(0, 0);
+        }else{
+            // 'stat PATH' or 'find GLOB [filter ...]', the command takes the place of the image name
+            argv[optind] = (char*)commands[command].name;
+            ret = runQueries(&argv[optind], arguments + 1);
+        }
+        PHASE_END(PHASE_COMMAND, phaseStart);
+        printCounters(countersFormat);
+        pathIndexFree(&pathIndex);
+        volumeClose(&volume);
+        snapshotClose(&snapshot);
+        return ret;
+    }
+
+    if(outputFormat == FORMAT_DIR) {
+        if(volume.geometry.fatType == 32) {
+            printf("Root directory starting at cluster %u / byte %llu\n", volume.geometry.rootCluster, getclusteroffset(volume.geometry.rootCluster));
+        }else{
+            printf("Root directory starting at sector %llu / byte %llu\n", volume.geometry.rootOffset / volume.geometry.sectorSize, volume.geometry.rootOffset);
+        }
+
+        printf("\n");
+    }
+
+    Output out;
+    outputInit(&out, stdout);
+    formatBegin(&out, outputFormat, 0);
+
+    PathNode* root = pathNodeCreate(&traversalArena, 0, "", volume.geometry.rootCluster, 0);
+    pathCacheInsert(&pathCache, root);
+    phaseStart = PHASE_START();
+    if(pathIndexReady && outputFormat != FORMAT_DIR) {
+        // the records are all in the index, the 'dir' style shows more than that
+        listIndexDirectory(&out, &pathIndex, 0);
+        PHASE_END(PHASE_TRAVERSAL, phaseStart);
+    }else if(threads > 1) {
+        list_parallel(root, threads, &out);
+        PHASE_END(PHASE_TRAVERSAL, phaseStart);
+    }else{
+        // list root directory and add subdirectories to the global work list
+        VolumeDir dir;
+        memset(&dir, 0, sizeof(dir));
+        DirListing listing = {root, dirStack.count, &out, 0, &traversalArena, pushSubdirectory, 0, &dir};
+        listDirectory(&listing);
+        dir_reverse(listing.stackMark);
+        volumeDirClose(&dir);
+        if(outputFormat == FORMAT_DIR) {
+            outputChar(&out, '\n');
+        }
+        PHASE_END(PHASE_ROOT, phaseStart);
+
+        // recursively list all directories in the global work list
+        phaseStart = PHASE_START();
+        list_recursive(&out);
+        PHASE_END(PHASE_TRAVERSAL, phaseStart);
+    }
+    outputFree(&out);
+    printCounters(countersFormat);
+
+    // the traversal's path nodes go in one piece
+    pathCacheFree(&pathCache);
+    arenaFree(&traversalArena);
+    free(dirStack.items);
+    free(pathBuffer);
+    pathIndexFree(&pathIndex);
+    volumeClose(&volume);
+    snapshotClose(&snapshot);
 	return 0;
 }
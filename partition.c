@@ -0,0 +1,278 @@
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "data.h"
+#include "fat.h"
+#include "lfn.h"
+#include "partition.h"
+
+#define PARTITION_MBR_ENTRIES   446     // offset of the four entries in an MBR or EBR
+#define PARTITION_SIGNATURE     510     // 0x55 0xAA
+#define PARTITION_TYPE_GPT      0xEE    // protective MBR entry
+
+static const unsigned int partitionGptSectorSizes[] = {512, 4096};
+
+static unsigned int partitionLe32(const unsigned char* bytes) {
+    return bytes[0] | (bytes[1] << 8) | (bytes[2] << 16) | ((unsigned int)bytes[3] << 24);
+}
+
+static unsigned long long partitionLe64(const unsigned char* bytes) {
+    return partitionLe32(bytes) | ((unsigned long long)partitionLe32(bytes + 4) << 32);
+}
+
+/**
+ * @return 1 for the MBR types of extended partitions (CHS, LBA, Linux)
+ */
+static int partitionExtended(unsigned char type) {
+    return type == 0x05 || type == 0x0F || type == 0x85;
+}
+
+/**
+ * @return 1 if a sector ends with the boot signature
+ */
+static int partitionSigned(const unsigned char* sector) {
+    return sector[PARTITION_SIGNATURE] == 0x55 && sector[PARTITION_SIGNATURE + 1] == 0xAA;
+}
+
+/**
+ * @brief Orders partitions by number, for qsort
+ */
+static int partitionCompare(const void* a, const void* b) {
+    unsigned int first = ((const Partition*)a)->number;
+    unsigned int second = ((const Partition*)b)->number;
+    return (first > second) - (first < second);
+}
+
+/**
+ * @brief Appends a partition, its range is cut off at the end of the image
+ * @return the partition, 0 if out of memory
+ */
+static Partition* partitionAdd(PartitionTable* table, const Image* image, unsigned int number, unsigned long long offset, unsigned long long length) {
+    if((table->count & (table->count - 1)) == 0) {
+        // capacity doubles at every power of two
+        Partition* partitions = (Partition*)realloc(table->partitions, sizeof(Partition) * (table->count ? table->count * 2 : 4));
+        if(!partitions) {
+            errno = ENOMEM;
+            return 0;
+        }
+        table->partitions = partitions;
+    }
+    Partition* partition = &table->partitions[table->count++];
+    memset(partition, 0, sizeof(Partition));
+    partition->number = number;
+    partition->offset = offset < image->size ? offset : image->size;
+    partition->length = length < image->size - partition->offset ? length : image->size - partition->offset;
+    return partition;
+}
+
+/**
+ * @brief Follows the chain of extended boot records and adds the logical partitions, numbered from 5 on
+ * @param start sector of the extended partition, the links of the chain are relative to it
+ * @return 0 on success, -1 if out of memory
+ */
+static int partitionReadLogical(PartitionTable* table, Image* image, unsigned long long start) {
+    unsigned char sector[512];
+    unsigned long long record = start;
+    unsigned int number = 5;
+    unsigned int hop;
+    // a record that can't be read or is not signed ends the chain, what was found so far stays
+    for(hop = 0; hop < PARTITION_LOGICAL_MAX; hop++) {
+        if(imageRead(image, sector, sizeof(sector), record * 512) != 0 || !partitionSigned(sector)) {
+            break;
+        }
+        const unsigned char* logical = &sector[PARTITION_MBR_ENTRIES];
+        const unsigned char* next = &sector[PARTITION_MBR_ENTRIES + 16];
+        unsigned int sectors = partitionLe32(&logical[12]);
+        // the logical partition is relative to its own record
+        if(logical[4] != 0 && sectors != 0) {
+            Partition* partition = partitionAdd(table, image, number++, (record + partitionLe32(&logical[8])) * 512, (unsigned long long)sectors * 512);
+            if(!partition) {
+                return -1;
+            }
+            partition->type = logical[4];
+        }
+        // records follow each other through the extended partition, a link back would go round in circles
+        if(!partitionExtended(next[4]) || start + partitionLe32(&next[8]) <= record) {
+            break;
+        }
+        record = start + partitionLe32(&next[8]);
+    }
+    return 0;
+}
+
+/**
+ * @brief Reads the GPT behind a protective MBR, the logical sector size is guessed from where its header is
+ * @return 1 if a GPT was read, 0 if there is none, -1 if out of memory
+ */
+static int partitionReadGpt(PartitionTable* table, Image* image) {
+    unsigned char header[92];
+    unsigned int sectorSize = 0;
+    unsigned int i;
+    for(i = 0; i < sizeof(partitionGptSectorSizes) / sizeof(partitionGptSectorSizes[0]); i++) {
+        if(imageRead(image, header, sizeof(header), partitionGptSectorSizes[i]) == 0 && memcmp(header, "EFI PART", 8) == 0) {
+            sectorSize = partitionGptSectorSizes[i];
+            break;
+        }
+    }
+    if(!sectorSize) {
+        return 0;
+    }
+
+    unsigned long long entriesOffset = partitionLe64(&header[72]) * sectorSize;
+    unsigned int count = partitionLe32(&header[80]);
+    unsigned int entrySize = partitionLe32(&header[84]);
+    if(entrySize < 128 || entrySize % 8 != 0 || entrySize > 4096) {
+        return 0;
+    }
+    if(count > PARTITION_GPT_ENTRIES) {
+        count = PARTITION_GPT_ENTRIES;
+    }
+
+    unsigned char* entries = (unsigned char*)malloc((size_t)count * entrySize + 1);
+    if(!entries) {
+        errno = ENOMEM;
+        return -1;
+    }
+    if(imageRead(image, entries, (size_t)count * entrySize, entriesOffset) != 0) {
+        free(entries);
+        return 0;
+    }
+    table->scheme = PARTITION_GPT;
+    table->sectorSize = sectorSize;
+
+    static const unsigned char unused[16] = {0};
+    for(i = 0; i < count; i++) {
+        const unsigned char* entry = &entries[(size_t)i * entrySize];
+        unsigned long long first = partitionLe64(&entry[32]);
+        unsigned long long last = partitionLe64(&entry[40]);
+        if(memcmp(entry, unused, 16) == 0 || last < first) {
+            continue;
+        }
+        Partition* partition = partitionAdd(table, image, i + 1, first * sectorSize, (last - first + 1) * sectorSize);
+        if(!partition) {
+            free(entries);
+            return -1;
+        }
+        partition->type = PARTITION_TYPE_GPT;
+        memcpy(partition->typeGuid, entry, 16);
+
+        // the name is UTF-16LE, up to 36 characters and padded with zeros
+        unsigned short chars[36];
+        size_t length = 0;
+        while(length < 36 && (chars[length] = entry[56 + length * 2] | (entry[57 + length * 2] << 8)) != 0) {
+            length++;
+        }
+        partition->name[ucs2ToUtf8(chars, length, partition->name)] = '\0';
+    }
+    free(entries);
+    return 1;
+}
+
+int partitionRead(Image* image, PartitionTable* table) {
+    memset(table, 0, sizeof(PartitionTable));
+    table->sectorSize = 512;
+
+    BOOTSECTOR bootsector;
+    FatGeometry geometry;
+    if(imageRead(image, &bootsector, sizeof(BOOTSECTOR), 0) != 0) {
+        return -1;
+    }
+    const unsigned char* sector = (const unsigned char*)&bootsector;
+    if(fatGeometry(&bootsector, &geometry) == 0 || !partitionSigned(sector)) {
+        return 0;
+    }
+
+    // boot code that happens to end with a signature has no sensible status bytes
+    unsigned int i;
+    for(i = 0; i < 4; i++) {
+        unsigned char status = sector[PARTITION_MBR_ENTRIES + i * 16];
+        if(status != 0x00 && status != 0x80) {
+            return 0;
+        }
+    }
+
+    unsigned char entries[64];
+    memcpy(entries, &sector[PARTITION_MBR_ENTRIES], sizeof(entries));
+    int ret = 0;
+    for(i = 0; i < 4 && ret >= 0; i++) {
+        if(entries[i * 16 + 4] == PARTITION_TYPE_GPT) {
+            ret = partitionReadGpt(table, image);
+            if(ret != 0) {
+                break;
+            }
+        }
+    }
+
+    // no GPT after all: the MBR's own entries, a protective one included
+    if(ret == 0) {
+        table->scheme = PARTITION_MBR;
+        for(i = 0; i < 4 && ret == 0; i++) {
+            const unsigned char* entry = &entries[i * 16];
+            unsigned long long start = partitionLe32(&entry[8]);
+            unsigned int sectors = partitionLe32(&entry[12]);
+            if(entry[4] == 0 || sectors == 0) {
+                continue;
+            }
+            Partition* partition = partitionAdd(table, image, i + 1, start * 512, (unsigned long long)sectors * 512);
+            if(!partition) {
+                ret = -1;
+                break;
+            }
+            partition->type = entry[4];
+            if(partitionExtended(entry[4])) {
+                ret = partitionReadLogical(table, image, start);
+            }
+        }
+    }
+    if(ret < 0) {
+        partitionFree(table);
+        return -1;
+    }
+    if(table->count > 1) {
+        qsort(table->partitions, table->count, sizeof(Partition), partitionCompare);
+    }
+
+    // a FAT volume is told by its boot sector, whatever type the table gives the partition
+    for(i = 0; i < table->count; i++) {
+        Partition* partition = &table->partitions[i];
+        if(partition->length >= sizeof(BOOTSECTOR) && !partitionExtended(partition->type) &&
+           imageRead(image, &bootsector, sizeof(BOOTSECTOR), partition->offset) == 0 && fatGeometry(&bootsector, &geometry) == 0) {
+            partition->fatType = geometry.fatType;
+        }
+    }
+    return 0;
+}
+
+const Partition* partitionFind(const PartitionTable* table, unsigned int number) {
+    unsigned int i;
+    for(i = 0; i < table->count; i++) {
+        if(table->partitions[i].number == number) {
+            return &table->partitions[i];
+        }
+    }
+    return 0;
+}
+
+unsigned int partitionFatCount(const PartitionTable* table) {
+    unsigned int count = 0;
+    unsigned int i;
+    for(i = 0; i < table->count; i++) {
+        count += table->partitions[i].fatType != 0;
+    }
+    return count;
+}
+
+const char* partitionSchemeName(int scheme) {
+    switch(scheme) {
+        case PARTITION_MBR: return "MBR";
+        case PARTITION_GPT: return "GPT";
+        default:            return "none";
+    }
+}
+
+void partitionFree(PartitionTable* table) {
+    free(table->partitions);
+    table->partitions = 0;
+    table->count = 0;
+}
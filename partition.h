@@ -0,0 +1,68 @@
+/*
+ * partition.h
+ *
+ * Partition tables of disk images. A FAT volume need not start at byte 0:
+ * a disk image has a partition table in front, an MBR with up to four
+ * primary partitions and a chain of extended boot records for the logical
+ * ones, or a GPT behind a protective MBR. The tables are read from the open
+ * image and every partition is looked at for a FAT boot sector, so its
+ * volume can be opened with volumeOpenPartition. An image that starts with
+ * a FAT boot sector has no table.
+ */
+
+#ifndef __PARTITION_H
+#define __PARTITION_H
+
+#include "image.h"
+
+#define PARTITION_NONE  0   // the image is a volume, or has no table that can be read
+#define PARTITION_MBR   1
+#define PARTITION_GPT   2
+
+#define PARTITION_LOGICAL_MAX   128     // extended boot records followed at most
+#define PARTITION_GPT_ENTRIES   1024    // GPT entries looked at, at most
+#define PARTITION_NAME_MAX      (36 * 3 + 1)    // UTF-8 bytes of a GPT partition name, '\0' included
+
+typedef struct Partition_t {
+    unsigned int number;        // MBR: 1-4 primary, 5 on logical; GPT: entry number, from 1
+    unsigned long long offset;  // bytes into the image
+    unsigned long long length;  // bytes, cut off at the end of the image
+    unsigned char type;         // MBR partition type, 0xEE for a GPT partition
+    unsigned char typeGuid[16]; // GPT partition type as stored, zeroed for MBR
+    char name[PARTITION_NAME_MAX];  // GPT partition name, empty for MBR
+    int fatType;                // 12, 16 or 32 if the partition holds a FAT volume, 0 otherwise
+} Partition;
+
+typedef struct PartitionTable_t {
+    int scheme;                 // PARTITION_NONE, PARTITION_MBR or PARTITION_GPT
+    unsigned int sectorSize;    // logical sector size of the disk, the table's unit
+    Partition* partitions;      // by number
+    unsigned int count;
+} PartitionTable;
+
+/**
+ * @brief Reads the partition table of an image and finds the FAT volumes in it
+ * @param table receives the partitions, scheme PARTITION_NONE and none if the
+ * image starts with a FAT boot sector or has no table
+ * @return 0 on success, -1 otherwise (errno is set: a read error, or ENOMEM)
+ */
+int partitionRead(Image* image, PartitionTable* table);
+
+/**
+ * @return partition with the given number, 0 if there is none
+ */
+const Partition* partitionFind(const PartitionTable* table, unsigned int number);
+
+/**
+ * @return number of partitions that hold a FAT volume
+ */
+unsigned int partitionFatCount(const PartitionTable* table);
+
+/**
+ * @return name of a PARTITION_* scheme
+ */
+const char* partitionSchemeName(int scheme);
+
+void partitionFree(PartitionTable* table);
+
+#endif
@@ -0,0 +1,113 @@
+#include <stdlib.h>
+#include <string.h>
+
+#include "path.h"
+
+PathNode* pathNodeCreate(Arena* arena, PathNode* parent, const char* name, unsigned int firstCluster, unsigned int entryIndex) {
+    size_t nameLength = strlen(name);
+    PathNode* node = (PathNode*)arenaAlloc(arena, sizeof(PathNode) + nameLength + 1);
+    if(!node) {
+        return 0;
+    }
+
+    node->parent = parent;
+    node->firstCluster = firstCluster;
+    node->entryIndex = entryIndex;
+    memcpy(node->name, name, nameLength + 1);
+
+    if(parent) {
+        node->depth = parent->depth + 1;
+        // '\' + name, the root's own '\' is not repeated
+        node->length = (parent->parent ? parent->length : 0) + 1 + nameLength;
+    }else{
+        node->depth = 0;
+        node->length = 1;
+    }
+    return node;
+}
+
+char* pathFormat(const PathNode* node, char* buf) {
+    buf[node->length] = '\0';
+    if(!node->parent) {
+        buf[0] = '\\';
+        return buf;
+    }
+
+    // fill from the back, the parents' names come first
+    unsigned int end = node->length;
+    for(; node->parent; node = node->parent) {
+        unsigned int nameLength = strlen(node->name);
+        end -= nameLength;
+        memcpy(&buf[end], node->name, nameLength);
+        buf[--end] = '\\';
+    }
+    return buf;
+}
+
+static unsigned int pathHash(unsigned int firstCluster) {
+    // Fibonacci hashing, first clusters of directories are often close to each other
+    return firstCluster * 2654435769u;
+}
+
+static int pathCacheGrow(PathCache* cache) {
+    unsigned int capacity = cache->capacity ? cache->capacity * 2 : 256;
+    PathNode** slots = (PathNode**)calloc(capacity, sizeof(PathNode*));
+    if(!slots) {
+        return -1;
+    }
+
+    unsigned int i;
+    for(i = 0; i < cache->capacity; i++) {
+        PathNode* node = cache->slots[i];
+        if(node) {
+            unsigned int slot = pathHash(node->firstCluster) & (capacity - 1);
+            while(slots[slot]) {
+                slot = (slot + 1) & (capacity - 1);
+            }
+            slots[slot] = node;
+        }
+    }
+
+    free(cache->slots);
+    cache->slots = slots;
+    cache->capacity = capacity;
+    return 0;
+}
+
+int pathCacheInsert(PathCache* cache, PathNode* node) {
+    if((cache->count + 1) * 4 > cache->capacity * 3 && pathCacheGrow(cache) != 0) {
+        return -1;
+    }
+
+    unsigned int slot = pathHash(node->firstCluster) & (cache->capacity - 1);
+    while(cache->slots[slot] && cache->slots[slot]->firstCluster != node->firstCluster) {
+        slot = (slot + 1) & (cache->capacity - 1);
+    }
+    if(!cache->slots[slot]) {
+        cache->count++;
+    }
+    cache->slots[slot] = node;
+    return 0;
+}
+
+PathNode* pathCacheLookup(const PathCache* cache, unsigned int firstCluster) {
+    if(!cache->capacity) {
+        return 0;
+    }
+
+    unsigned int slot = pathHash(firstCluster) & (cache->capacity - 1);
+    while(cache->slots[slot]) {
+        if(cache->slots[slot]->firstCluster == firstCluster) {
+            return cache->slots[slot];
+        }
+        slot = (slot + 1) & (cache->capacity - 1);
+    }
+    return 0;
+}
+
+void pathCacheFree(PathCache* cache) {
+    free(cache->slots);
+    cache->slots = 0;
+    cache->capacity = 0;
+    cache->count = 0;
+}
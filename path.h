@@ -0,0 +1,62 @@
+/*
+ * path.h
+ *
+ * Directory paths carried along during a traversal. Every directory gets a
+ * node pointing to its parent's node, so the absolute path of a directory is
+ * known without reading any of its ancestors again. A cache maps first
+ * clusters to nodes for random lookups.
+ */
+
+#ifndef __PATH_H
+#define __PATH_H
+
+#include "arena.h"
+
+typedef struct PathNode_t {
+    struct PathNode_t* parent;  // 0 for the root directory
+    unsigned int firstCluster;
+    unsigned int entryIndex;    // index of the directory's entry in its parent
+    unsigned int depth;         // 0 for the root directory
+    unsigned int length;        // length of the absolute path
+    char name[];                // UTF-8, long name if there is one
+} PathNode;
+
+typedef struct PathCache_t {
+    PathNode** slots;
+    unsigned int capacity;      // power of two
+    unsigned int count;
+} PathCache;
+
+/**
+ * @brief Creates the node of a directory
+ * @param arena the node is allocated from, it lives as long as the arena's allocations
+ * @param parent node, 0 for the root directory
+ * @param name is copied into the node, it may be of any length
+ * @return new node, 0 if out of memory
+ */
+PathNode* pathNodeCreate(Arena* arena, PathNode* parent, const char* name, unsigned int firstCluster, unsigned int entryIndex);
+
+/**
+ * @brief Writes the absolute path like '\DIR\SUBDIR' ('\' for the root directory)
+ * @param buf is a buffer >= node->length + 1 bytes
+ * @return buf
+ */
+char* pathFormat(const PathNode* node, char* buf);
+
+/**
+ * @brief Remembers a node under its first cluster, replacing an older one
+ * @return 0 on success, -1 if out of memory
+ */
+int pathCacheInsert(PathCache* cache, PathNode* node);
+
+/**
+ * @return the node of the directory starting at firstCluster, 0 if unknown
+ */
+PathNode* pathCacheLookup(const PathCache* cache, unsigned int firstCluster);
+
+/**
+ * @brief Frees the cache, the nodes belong to their arena
+ */
+void pathCacheFree(PathCache* cache);
+
+#endif
@@ -0,0 +1,346 @@
+#include <ctype.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+
+#include "pathindex.h"
+
+#define FNV_OFFSET 14695981039346656037ull
+#define FNV_PRIME  1099511628211ull
+
+/**
+ * @brief Continues an FNV-1a hash over upper case text
+ */
+static unsigned long long hashUpper(unsigned long long hash, const char* text, size_t length) {
+    size_t i;
+    for(i = 0; i < length; i++) {
+        hash ^= (unsigned char)toupper((unsigned char)text[i]);
+        hash *= FNV_PRIME;
+    }
+    return hash;
+}
+
+/**
+ * @brief Hash of a child's path: '\' and the name appended to the parent's path
+ */
+static unsigned long long childHash(const PathIndex* index, unsigned int parent, const char* name, size_t length) {
+    // the root's own '\' is not repeated
+    unsigned long long hash = parent == 0 ? FNV_OFFSET : index->entries[parent].pathHash;
+    return hashUpper(hashUpper(hash, "\\", 1), name, length);
+}
+
+static unsigned int nameHash(const char* name, size_t length) {
+    unsigned long long hash = FNV_OFFSET;
+    size_t i;
+    for(i = 0; i < length; i++) {
+        hash = (hash ^ (unsigned char)name[i]) * FNV_PRIME;
+    }
+    return (unsigned int)(hash ^ (hash >> 32));
+}
+
+/**
+ * @brief Appends a name to the string table unless it is there already
+ * @return offset of the name, PATHINDEX_NONE if out of memory
+ */
+static unsigned int internName(PathIndex* index, const char* name, size_t length) {
+    if((index->nameCount + 1) * 2 > index->nameSlotCount) {
+        unsigned int slotCount = index->nameSlotCount ? index->nameSlotCount * 2 : 1024;
+        unsigned int* names = (unsigned int*)calloc(slotCount, sizeof(unsigned int));
+        if(!names) {
+            return PATHINDEX_NONE;
+        }
+        unsigned int i;
+        for(i = 0; i < index->nameSlotCount; i++) {
+            if(index->names[i]) {
+                const char* s = &index->strings[index->names[i] - 1];
+                unsigned int slot = nameHash(s, strlen(s)) & (slotCount - 1);
+                while(names[slot]) {
+                    slot = (slot + 1) & (slotCount - 1);
+                }
+                names[slot] = index->names[i];
+            }
+        }
+        free(index->names);
+        index->names = names;
+        index->nameSlotCount = slotCount;
+    }
+
+    unsigned int slot = nameHash(name, length) & (index->nameSlotCount - 1);
+    while(index->names[slot]) {
+        const char* s = &index->strings[index->names[slot] - 1];
+        if(strncmp(s, name, length) == 0 && s[length] == '\0') {
+            return index->names[slot] - 1;
+        }
+        slot = (slot + 1) & (index->nameSlotCount - 1);
+    }
+
+    if(index->stringsSize + length + 1 > index->stringsCapacity) {
+        unsigned int capacity = index->stringsCapacity ? index->stringsCapacity : 4096;
+        while(index->stringsSize + length + 1 > capacity) {
+            capacity *= 2;
+        }
+        char* strings = (char*)realloc(index->strings, capacity);
+        if(!strings) {
+            return PATHINDEX_NONE;
+        }
+        index->strings = strings;
+        index->stringsCapacity = capacity;
+    }
+
+    unsigned int offset = index->stringsSize;
+    memcpy(&index->strings[offset], name, length);
+    index->strings[offset + length] = '\0';
+    index->stringsSize += length + 1;
+    index->names[slot] = offset + 1;
+    index->nameCount++;
+    return offset;
+}
+
+int pathIndexInit(PathIndex* index, unsigned int rootCluster) {
+    memset(index, 0, sizeof(PathIndex));
+
+    DIRENTRY root;
+    memset(&root, 0, sizeof(DIRENTRY));
+    root.attr = DIRENTRY_ATTR_DIR;
+    if(pathIndexAdd(index, PATHINDEX_NONE, "", &root, rootCluster) == PATHINDEX_NONE) {
+        pathIndexFree(index);
+        return -1;
+    }
+    index->entries[0].pathHash = hashUpper(FNV_OFFSET, "\\", 1);
+    return 0;
+}
+
+void pathIndexBeginChildren(PathIndex* index, unsigned int parent) {
+    index->entries[parent].firstChild = index->count;
+    index->entries[parent].childCount = 0;
+}
+
+unsigned int pathIndexAdd(PathIndex* index, unsigned int parent, const char* name, const DIRENTRY* directoryEntry, unsigned int firstCluster) {
+    if(index->count == index->capacity) {
+        unsigned int capacity = index->capacity ? index->capacity * 2 : 1024;
+        IndexEntry* entries = (IndexEntry*)realloc(index->entries, sizeof(IndexEntry) * capacity);
+        if(!entries) {
+            return PATHINDEX_NONE;
+        }
+        index->entries = entries;
+        index->capacity = capacity;
+    }
+
+    size_t length = strlen(name);
+    unsigned int offset = internName(index, name, length);
+    if(offset == PATHINDEX_NONE) {
+        return PATHINDEX_NONE;
+    }
+
+    IndexEntry* entry = &index->entries[index->count];
+    memset(entry, 0, sizeof(IndexEntry));
+    entry->parent = parent;
+    entry->name = offset;
+    entry->nameLength = length;
+    entry->firstChild = PATHINDEX_NONE;
+    entry->firstCluster = firstCluster;
+    entry->size = directoryEntry->size;
+    entry->changedate = directoryEntry->changedate;
+    entry->changetime = directoryEntry->changetime;
+    entry->attr = directoryEntry->attr;
+    if(parent != PATHINDEX_NONE) {
+        entry->pathHash = childHash(index, parent, name, length);
+        index->entries[parent].childCount++;
+    }
+    return index->count++;
+}
+
+int pathIndexFinish(PathIndex* index) {
+    free(index->names);
+    index->names = 0;
+    index->nameSlotCount = 0;
+    index->nameCount = 0;
+
+    // at most half full
+    unsigned int slotCount = 1024;
+    while(slotCount < index->count * 2) {
+        slotCount *= 2;
+    }
+    free(index->slots);
+    index->slots = (unsigned int*)calloc(slotCount, sizeof(unsigned int));
+    if(!index->slots) {
+        return -1;
+    }
+    index->slotCount = slotCount;
+
+    unsigned int i;
+    for(i = 0; i < index->count; i++) {
+        unsigned int slot = (unsigned int)index->entries[i].pathHash & (slotCount - 1);
+        while(index->slots[slot]) {
+            slot = (slot + 1) & (slotCount - 1);
+        }
+        index->slots[slot] = i + 1;
+    }
+    return 0;
+}
+
+unsigned int pathIndexPathLength(const PathIndex* index, unsigned int entry) {
+    if(entry == 0) {
+        return 1;
+    }
+    unsigned int length = 0;
+    for(; entry != 0; entry = index->entries[entry].parent) {
+        length += 1 + index->entries[entry].nameLength;
+    }
+    return length;
+}
+
+char* pathIndexPath(const PathIndex* index, unsigned int entry, char* buf) {
+    unsigned int end = pathIndexPathLength(index, entry);
+    buf[end] = '\0';
+    if(entry == 0) {
+        buf[0] = '\\';
+        return buf;
+    }
+
+    // fill from the back, the parents' names come first
+    for(; entry != 0; entry = index->entries[entry].parent) {
+        const IndexEntry* e = &index->entries[entry];
+        end -= e->nameLength;
+        memcpy(&buf[end], &index->strings[e->name], e->nameLength);
+        buf[--end] = '\\';
+    }
+    return buf;
+}
+
+unsigned int pathIndexLookup(const PathIndex* index, const char* path) {
+    // hash the components the same way the entries were hashed
+    unsigned long long hash = FNV_OFFSET;
+    const char* components[256];
+    size_t lengths[256];
+    unsigned int depth = 0;
+    while(*path) {
+        while(*path == '\\' || *path == '/') {
+            path++;
+        }
+        size_t length = strcspn(path, "\\/");
+        if(length == 0) {
+            break;
+        }
+        if(depth == 256) {
+            return PATHINDEX_NONE;
+        }
+        components[depth] = path;
+        lengths[depth++] = length;
+        hash = hashUpper(hashUpper(hash, "\\", 1), path, length);
+        path += length;
+    }
+    if(depth == 0) {
+        return 0;
+    }
+
+    unsigned int slot = (unsigned int)hash & (index->slotCount - 1);
+    for(; index->slots[slot]; slot = (slot + 1) & (index->slotCount - 1)) {
+        unsigned int entry = index->slots[slot] - 1;
+        if(index->entries[entry].pathHash != hash) {
+            continue;
+        }
+
+        // compare the names from the back up to the root
+        unsigned int candidate = entry;
+        unsigned int level = depth;
+        while(level > 0 && candidate != 0) {
+            const IndexEntry* e = &index->entries[candidate];
+            level--;
+            if(e->nameLength != lengths[level] || strncasecmp(&index->strings[e->name], components[level], lengths[level]) != 0) {
+                break;
+            }
+            candidate = e->parent;
+        }
+        if(level == 0 && candidate == 0) {
+            return entry;
+        }
+    }
+    return PATHINDEX_NONE;
+}
+
+int globMatch(const char* pattern, const char* text) {
+    // greedy with backtracking to the last '*'
+    const char* star = 0;
+    const char* resume = 0;
+    while(*text) {
+        if(*pattern == '*') {
+            star = pattern++;
+            resume = text;
+        }else if(*pattern == '?' || (*pattern && toupper((unsigned char)*pattern) == toupper((unsigned char)*text))) {
+            pattern++;
+            text++;
+        }else if(star) {
+            pattern = star + 1;
+            text = ++resume;
+        }else{
+            return 0;
+        }
+    }
+    while(*pattern == '*') {
+        pattern++;
+    }
+    return *pattern == '\0';
+}
+
+unsigned int pathIndexFind(const PathIndex* index, const char* pattern, const IndexFilter* filter, void (*found)(const PathIndex*, unsigned int, void*), void* arg) {
+    // '/' is taken as '\'
+    size_t patternLength = strlen(pattern);
+    char normalized[patternLength + 1];
+    unsigned int i;
+    int fullPath = 0;
+    for(i = 0; i <= patternLength; i++) {
+        normalized[i] = pattern[i] == '/' ? '\\' : pattern[i];
+        fullPath |= normalized[i] == '\\';
+    }
+
+    char* path = 0;
+    unsigned int pathCapacity = 0;
+    unsigned int matches = 0;
+    for(i = 1; i < index->count; i++) {
+        const IndexEntry* e = &index->entries[i];
+        if(filter) {
+            unsigned int stamp = ((unsigned int)e->changedate << 16) | e->changetime;
+            if(e->size < filter->minSize || e->size > filter->maxSize || stamp < filter->after || stamp >= filter->before) {
+                continue;
+            }
+        }
+
+        const char* text = &index->strings[e->name];
+        if(fullPath) {
+            unsigned int length = pathIndexPathLength(index, i);
+            if(length + 1 > pathCapacity) {
+                pathCapacity = (length + 1) * 2;
+                free(path);
+                path = (char*)malloc(pathCapacity);
+                if(!path) {
+                    break;
+                }
+            }
+            text = pathIndexPath(index, i, path);
+        }
+
+        // relative path patterns start below the root
+        if(fullPath && normalized[0] != '\\' && normalized[0] != '*') {
+            text++;
+        }
+        if(globMatch(normalized, text)) {
+            matches++;
+            found(index, i, arg);
+        }
+    }
+    free(path);
+    return matches;
+}
+
+void pathIndexFree(PathIndex* index) {
+    if(index->borrowed) {
+        memset(index, 0, sizeof(PathIndex));
+        return;
+    }
+    free(index->entries);
+    free(index->strings);
+    free(index->slots);
+    free(index->names);
+    memset(index, 0, sizeof(PathIndex));
+}
@@ -0,0 +1,126 @@
+/*
+ * pathindex.h
+ *
+ * Index of all files and directories of a volume, built in one pass.
+ * Everything lives in flat arrays that refer to each other by position:
+ * the entries (the children of a directory are stored next to each other),
+ * a table of interned names and a hash table over the full paths. Lookups
+ * by path don't need to read a single directory cluster.
+ */
+
+#ifndef __PATHINDEX_H
+#define __PATHINDEX_H
+
+#include "data.h"
+
+#define PATHINDEX_NONE 0xFFFFFFFFu
+
+typedef struct IndexEntry_t {
+    unsigned long long pathHash;    // of the upper case full path, see pathIndexHash
+    unsigned int parent;            // entry of the parent directory, PATHINDEX_NONE for the root
+    unsigned int name;              // offset of the name in the string table
+    unsigned int firstChild;        // directories: entry of the first child, children are contiguous
+    unsigned int childCount;
+    unsigned int firstCluster;
+    unsigned int size;
+    unsigned short changedate;
+    unsigned short changetime;
+    unsigned char attr;
+    unsigned char reserved;
+    unsigned short nameLength;      // long names take up to 780 bytes of UTF-8
+} IndexEntry;
+
+typedef struct PathIndex_t {
+    IndexEntry* entries;            // entry 0 is the root directory
+    unsigned int count;
+    unsigned int capacity;
+
+    char* strings;                  // interned names, '\0' terminated
+    unsigned int stringsSize;
+    unsigned int stringsCapacity;
+
+    unsigned int* slots;            // open addressing over pathHash, entry + 1, 0 is empty
+    unsigned int slotCount;         // power of two
+
+    unsigned int* names;            // name interning while building: string offset + 1, 0 is empty
+    unsigned int nameSlotCount;
+    unsigned int nameCount;
+
+    int borrowed;                   // the arrays belong to a snapshot, they are not freed
+} PathIndex;
+
+/**
+ * @brief Filters of pathIndexFind
+ */
+typedef struct IndexFilter_t {
+    unsigned long long minSize;
+    unsigned long long maxSize;
+    unsigned int after;             // (changedate << 16) | changetime, inclusive
+    unsigned int before;            // exclusive
+} IndexFilter;
+
+/**
+ * @brief Creates an index that holds only the root directory
+ * @return 0 on success, -1 if out of memory
+ */
+int pathIndexInit(PathIndex* index, unsigned int rootCluster);
+
+/**
+ * @brief Adds a child. The children of a directory have to be added one after the other,
+ * before the children of any other directory; pathIndexBeginChildren marks the start.
+ * @param name of the entry, interned
+ * @return the new entry, PATHINDEX_NONE if out of memory
+ */
+unsigned int pathIndexAdd(PathIndex* index, unsigned int parent, const char* name, const DIRENTRY* directoryEntry, unsigned int firstCluster);
+
+/**
+ * @brief Marks that the children of parent are added next
+ */
+void pathIndexBeginChildren(PathIndex* index, unsigned int parent);
+
+/**
+ * @brief Builds the path hash table, drops what was only needed while adding
+ * @return 0 on success, -1 if out of memory
+ */
+int pathIndexFinish(PathIndex* index);
+
+/**
+ * @return entry of an absolute path like '\DIR\FILE.TXT' ('/' separates as well, case is ignored),
+ * PATHINDEX_NONE if there is none
+ */
+unsigned int pathIndexLookup(const PathIndex* index, const char* path);
+
+static inline const char* pathIndexName(const PathIndex* index, unsigned int entry) {
+    return &index->strings[index->entries[entry].name];
+}
+
+/**
+ * @return length of the full path of an entry
+ */
+unsigned int pathIndexPathLength(const PathIndex* index, unsigned int entry);
+
+/**
+ * @brief Writes the full path of an entry
+ * @param buf is a buffer >= pathIndexPathLength + 1 bytes
+ * @return buf
+ */
+char* pathIndexPath(const PathIndex* index, unsigned int entry, char* buf);
+
+/**
+ * @brief Calls found for every entry that matches the glob and the filter.
+ * A pattern with a '\' (or '/') is matched against the full path (from below the root
+ * if it doesn't start with '\'), otherwise against the name.
+ * '*' matches any number of characters, '\' included, '?' one character, case is ignored.
+ * @return number of matches
+ */
+unsigned int pathIndexFind(const PathIndex* index, const char* pattern, const IndexFilter* filter, void (*found)(const PathIndex*, unsigned int, void*), void* arg);
+
+/**
+ * @brief Matches a glob like pathIndexFind does, case is ignored
+ * @return 1 if text matches pattern
+ */
+int globMatch(const char* pattern, const char* text);
+
+void pathIndexFree(PathIndex* index);
+
+#endif
@@ -0,0 +1,141 @@
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "counters.h"
+#include "readahead.h"
+
+int readAheadInit(ReadAhead* readAhead, Image* image, int engine) {
+    memset(readAhead, 0, sizeof(ReadAhead));
+    readAhead->image = image;
+    // the kernel reads mapped images by itself, compressed ones are read through their block cache
+    if(image->map || image->device) {
+        return 0;
+    }
+    if(ioQueueInit(&readAhead->queue, image->handle, READ_AHEAD_DEPTH, engine) != 0) {
+        return -1;
+    }
+    readAhead->queued = 1;
+    return 0;
+}
+
+/**
+ * @brief Marks the slot of a completed read as done
+ */
+static void readAheadComplete(IoRequest* request) {
+    ReadAheadSlot* slot = (ReadAheadSlot*)request->user;
+    // a short read is as good as a failed one, the caller reads the range again and finds out
+    slot->state = request->result == (long long)slot->length ? READ_AHEAD_DONE : READ_AHEAD_FREE;
+}
+
+/**
+ * @return slot holding or reading the range, 0 if there is none
+ */
+static ReadAheadSlot* readAheadFind(ReadAhead* readAhead, unsigned long long offset, size_t length) {
+    unsigned int i;
+    for(i = 0; i < READ_AHEAD_DEPTH; i++) {
+        ReadAheadSlot* slot = &readAhead->slots[i];
+        if(slot->state != READ_AHEAD_FREE && slot->offset == offset && slot->length == length) {
+            return slot;
+        }
+    }
+    return 0;
+}
+
+void readAheadStart(ReadAhead* readAhead, unsigned long long offset, size_t length) {
+    if(!readAhead->queued) {
+        imageAdvise(readAhead->image, offset, length, IMAGE_ADVICE_WILLNEED);
+        return;
+    }
+
+    // collect what completed meanwhile, it frees slots of failed reads
+    IoRequest* request;
+    while((request = ioQueueWait(&readAhead->queue, 0))) {
+        readAheadComplete(request);
+    }
+    if(length == 0 || offset > readAhead->image->size || length > readAhead->image->size - offset ||
+       readAheadFind(readAhead, offset, length)) {
+        return;
+    }
+
+    // a free slot, or else the oldest range nobody took
+    ReadAheadSlot* slot = 0;
+    unsigned int i;
+    for(i = 0; i < READ_AHEAD_DEPTH; i++) {
+        ReadAheadSlot* candidate = &readAhead->slots[i];
+        if(candidate->state == READ_AHEAD_FREE) {
+            slot = candidate;
+            break;
+        }
+        if(candidate->state == READ_AHEAD_DONE && (!slot || candidate->age < slot->age)) {
+            slot = candidate;
+        }
+    }
+    if(!slot) {
+        // everything is in flight, the range will be read when it is needed
+        return;
+    }
+
+    if(length > slot->capacity) {
+        char* data = (char*)realloc(slot->data, length);
+        if(!data) {
+            slot->state = READ_AHEAD_FREE;
+            return;
+        }
+        slot->data = data;
+        slot->capacity = length;
+    }
+    slot->offset = offset;
+    slot->length = length;
+    slot->age = readAhead->requests++;
+    slot->request.buf = slot->data;
+    slot->request.length = length;
+    slot->request.offset = readAhead->image->base + offset;
+    slot->request.user = slot;
+    slot->state = ioQueueSubmit(&readAhead->queue, &slot->request) == 0 ? READ_AHEAD_READING : READ_AHEAD_FREE;
+}
+
+const void* readAheadTake(ReadAhead* readAhead, unsigned long long offset, size_t length, char** buffer, unsigned int* capacity) {
+    if(!readAhead->queued) {
+        return 0;
+    }
+    ReadAheadSlot* slot = readAheadFind(readAhead, offset, length);
+    if(!slot) {
+        return 0;
+    }
+    while(slot->state == READ_AHEAD_READING) {
+        IoRequest* request = ioQueueWait(&readAhead->queue, 1);
+        if(!request) {
+            return 0;
+        }
+        readAheadComplete(request);
+    }
+    if(slot->state != READ_AHEAD_DONE) {
+        return 0;
+    }
+
+    // the caller's buffer becomes the slot's buffer for the next range
+    char* data = slot->data;
+    size_t dataCapacity = slot->capacity;
+    slot->data = *buffer;
+    slot->capacity = *capacity;
+    slot->state = READ_AHEAD_FREE;
+    *buffer = data;
+    *capacity = (unsigned int)dataCapacity;
+    COUNT(COUNTER_PREFETCH_HITS, 1);
+    return data;
+}
+
+void readAheadFree(ReadAhead* readAhead) {
+    if(readAhead->queued) {
+        ioQueueFree(&readAhead->queue);
+        readAhead->queued = 0;
+    }
+    unsigned int i;
+    for(i = 0; i < READ_AHEAD_DEPTH; i++) {
+        free(readAhead->slots[i].data);
+        readAhead->slots[i].data = 0;
+        readAhead->slots[i].capacity = 0;
+        readAhead->slots[i].state = READ_AHEAD_FREE;
+    }
+}
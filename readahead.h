@@ -0,0 +1,69 @@
+/*
+ * readahead.h
+ *
+ * Reads ranges of the image before they are needed. Whoever walks the
+ * volume names the ranges as soon as it knows them (the runs of a
+ * directory's chain, right after the directory was found in its parent)
+ * and takes the data later on. Mapped images only get a hint to the kernel,
+ * which then reads into the page cache by itself; for everything else the
+ * reads go to an asynchronous queue and land in buffers of a few slots.
+ * A ReadAhead belongs to one thread.
+ */
+
+#ifndef __READAHEAD_H
+#define __READAHEAD_H
+
+#include "image.h"
+#include "ioqueue.h"
+
+#define READ_AHEAD_DEPTH 16 // ranges in flight or waiting to be taken
+
+#define READ_AHEAD_FREE     0
+#define READ_AHEAD_READING  1
+#define READ_AHEAD_DONE     2
+
+typedef struct ReadAheadSlot_t {
+    int state;                  // READ_AHEAD_*
+    unsigned long long offset;
+    size_t length;
+    char* data;
+    size_t capacity;
+    unsigned long long age;     // when it was requested, the oldest done slot is given up first
+    IoRequest request;
+} ReadAheadSlot;
+
+typedef struct ReadAhead_t {
+    Image* image;
+    IoQueue queue;
+    int queued;                 // 1 if reads go through the queue, 0 for hints only
+    unsigned long long requests;
+    ReadAheadSlot slots[READ_AHEAD_DEPTH];
+} ReadAhead;
+
+/**
+ * @brief Sets up read-ahead for an image
+ * @param engine IO_ENGINE_* of the queue, unused for mapped images
+ * @return 0 on success, -1 if the queue could not be set up (errno is set)
+ */
+int readAheadInit(ReadAhead* readAhead, Image* image, int engine);
+
+/**
+ * @brief Starts reading a range unless it is already there or all slots are in flight
+ */
+void readAheadStart(ReadAhead* readAhead, unsigned long long offset, size_t length);
+
+/**
+ * @brief Takes a range that was started before, waiting for its read if needed.
+ * The data is swapped into the caller's buffer, which may grow on the way.
+ * @param buffer malloc'ed buffer of the caller (or 0), receives the data
+ * @param capacity of the buffer
+ * @return *buffer, 0 if the range was not read ahead or its read failed, so the caller reads it itself
+ */
+const void* readAheadTake(ReadAhead* readAhead, unsigned long long offset, size_t length, char** buffer, unsigned int* capacity);
+
+/**
+ * @brief Waits for the reads still in flight and releases the buffers
+ */
+void readAheadFree(ReadAhead* readAhead);
+
+#endif
@@ -0,0 +1,243 @@
+#define _FILE_OFFSET_BITS 64
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "hash.h"
+#include "snapshot.h"
+
+#define SNAPSHOT_ALIGN 64
+#define SNAPSHOT_HASH_CHUNK (1024 * 1024)
+
+/**
+ * @brief Sections of a snapshot, in file order
+ */
+enum {
+    SECTION_FAT,
+    SECTION_RUNS,
+    SECTION_HEADS,
+    SECTION_FIRST_RUN,
+    SECTION_ENTRIES,
+    SECTION_STRINGS,
+    SECTION_SLOTS,
+    SECTION_COUNT
+};
+
+typedef struct SnapshotSection_t {
+    unsigned long long offset;
+    unsigned long long size;
+} SnapshotSection;
+
+typedef struct SnapshotHeader_t {
+    char magic[8];
+    unsigned int version;
+    unsigned int headerSize;        // sizeof(SnapshotHeader), catches layout changes
+    SnapshotKey key;
+
+    unsigned int fatCount;
+    unsigned int fatMask;
+    unsigned int runCount;
+    unsigned int headCount;
+    unsigned int entryCount;
+    unsigned int stringsSize;
+    unsigned int slotCount;
+    unsigned int reserved;
+    SnapshotSection sections[SECTION_COUNT];
+} SnapshotHeader;
+
+int snapshotKey(Image* image, const BOOTSECTOR* bootsector, const FatGeometry* geometry, SnapshotKey* key) {
+    memset(key, 0, sizeof(SnapshotKey));
+    key->serialNumber = geometry->fatType == 32 ? bootsector->EBPB32.serialnumber : bootsector->EBPB.serialnumber;
+    key->geometry = *geometry;
+
+    Xxh64 state;
+    xxh64Init(&state, 0);
+    void* scratch = image->map ? 0 : malloc(SNAPSHOT_HASH_CHUNK);
+    if(!image->map && !scratch) {
+        return -1;
+    }
+
+    unsigned long long offset;
+    int ret = 0;
+    for(offset = 0; offset < geometry->fatSize; offset += SNAPSHOT_HASH_CHUNK) {
+        size_t length = geometry->fatSize - offset < SNAPSHOT_HASH_CHUNK ? geometry->fatSize - offset : SNAPSHOT_HASH_CHUNK;
+        const void* view = imageView(image, geometry->fatOffset + offset, length, scratch);
+        if(!view) {
+            ret = -1;
+            break;
+        }
+        xxh64Update(&state, view, length);
+    }
+    free(scratch);
+    key->fatHash = xxh64Digest(&state);
+    return ret;
+}
+
+/**
+ * @return pointer to a section if it lies within the snapshot and has the expected size
+ */
+static const void* snapshotSection(const Snapshot* snapshot, const SnapshotHeader* header, int section, unsigned long long size) {
+    const SnapshotSection* s = &header->sections[section];
+    if(s->size != size || s->offset % SNAPSHOT_ALIGN != 0 || s->offset > snapshot->size || size > snapshot->size - s->offset) {
+        return 0;
+    }
+    return snapshot->map + s->offset;
+}
+
+int snapshotOpen(Snapshot* snapshot, const char* filename, const SnapshotKey* key, FatTable* fat, ExtentIndex* extents, PathIndex* paths) {
+    snapshot->map = 0;
+    snapshot->size = 0;
+
+    int handle = open(filename, O_RDONLY);
+    if(handle == -1) {
+        return -1;
+    }
+    struct stat st;
+    if(fstat(handle, &st) != 0 || (unsigned long long)st.st_size < sizeof(SnapshotHeader)) {
+        close(handle);
+        return -1;
+    }
+    void* map = mmap(0, st.st_size, PROT_READ, MAP_PRIVATE, handle, 0);
+    close(handle);
+    if(map == MAP_FAILED) {
+        return -1;
+    }
+    snapshot->map = (const unsigned char*)map;
+    snapshot->size = st.st_size;
+
+    const SnapshotHeader* header = (const SnapshotHeader*)snapshot->map;
+    if(memcmp(header->magic, SNAPSHOT_MAGIC, sizeof(SNAPSHOT_MAGIC)) != 0 || header->version != SNAPSHOT_VERSION ||
+       header->headerSize != sizeof(SnapshotHeader) || memcmp(&header->key, key, sizeof(SnapshotKey)) != 0) {
+        snapshotClose(snapshot);
+        return -1;
+    }
+
+    const void* sections[SECTION_COUNT];
+    sections[SECTION_FAT] = snapshotSection(snapshot, header, SECTION_FAT, (unsigned long long)header->fatCount * sizeof(unsigned int));
+    sections[SECTION_RUNS] = snapshotSection(snapshot, header, SECTION_RUNS, (unsigned long long)header->runCount * sizeof(Extent));
+    sections[SECTION_HEADS] = snapshotSection(snapshot, header, SECTION_HEADS, (unsigned long long)header->headCount * sizeof(unsigned int));
+    sections[SECTION_FIRST_RUN] = snapshotSection(snapshot, header, SECTION_FIRST_RUN, ((unsigned long long)header->headCount + 1) * sizeof(unsigned int));
+    sections[SECTION_ENTRIES] = snapshotSection(snapshot, header, SECTION_ENTRIES, (unsigned long long)header->entryCount * sizeof(IndexEntry));
+    sections[SECTION_STRINGS] = snapshotSection(snapshot, header, SECTION_STRINGS, header->stringsSize);
+    sections[SECTION_SLOTS] = snapshotSection(snapshot, header, SECTION_SLOTS, (unsigned long long)header->slotCount * sizeof(unsigned int));
+    int i;
+    for(i = 0; i < SECTION_COUNT; i++) {
+        if(!sections[i]) {
+            snapshotClose(snapshot);
+            return -1;
+        }
+    }
+
+    memset(fat, 0, sizeof(FatTable));
+    fat->next = (const unsigned int*)sections[SECTION_FAT];
+    fat->count = header->fatCount;
+    fat->mask = header->fatMask;
+
+    memset(extents, 0, sizeof(ExtentIndex));
+    extents->runs.extents = (Extent*)sections[SECTION_RUNS];
+    extents->runs.count = header->runCount;
+    extents->runs.capacity = header->runCount;
+    extents->heads = (unsigned int*)sections[SECTION_HEADS];
+    extents->firstRun = (unsigned int*)sections[SECTION_FIRST_RUN];
+    extents->headCount = header->headCount;
+    extents->borrowed = 1;
+
+    memset(paths, 0, sizeof(PathIndex));
+    paths->entries = (IndexEntry*)sections[SECTION_ENTRIES];
+    paths->count = header->entryCount;
+    paths->capacity = header->entryCount;
+    paths->strings = (char*)sections[SECTION_STRINGS];
+    paths->stringsSize = header->stringsSize;
+    paths->stringsCapacity = header->stringsSize;
+    paths->slots = (unsigned int*)sections[SECTION_SLOTS];
+    paths->slotCount = header->slotCount;
+    paths->borrowed = 1;
+    return 0;
+}
+
+/**
+ * @brief Writes a section at the next aligned offset
+ * @param offset where the file currently ends, updated
+ * @return 0 on success, -1 otherwise
+ */
+static int writeSection(FILE* file, SnapshotHeader* header, int section, const void* data, unsigned long long size, unsigned long long* offset) {
+    static const char padding[SNAPSHOT_ALIGN] = {0};
+    unsigned long long aligned = (*offset + SNAPSHOT_ALIGN - 1) & ~(unsigned long long)(SNAPSHOT_ALIGN - 1);
+    if(fwrite(padding, 1, aligned - *offset, file) != aligned - *offset || (size > 0 && fwrite(data, 1, size, file) != size)) {
+        return -1;
+    }
+    header->sections[section].offset = aligned;
+    header->sections[section].size = size;
+    *offset = aligned + size;
+    return 0;
+}
+
+int snapshotWrite(const char* filename, const SnapshotKey* key, const FatTable* fat, const ExtentIndex* extents, const PathIndex* paths) {
+    SnapshotHeader header;
+    memset(&header, 0, sizeof(SnapshotHeader));
+    memcpy(header.magic, SNAPSHOT_MAGIC, sizeof(SNAPSHOT_MAGIC));
+    header.version = SNAPSHOT_VERSION;
+    header.headerSize = sizeof(SnapshotHeader);
+    header.key = *key;
+    header.fatCount = fat->count;
+    header.fatMask = fat->mask;
+    header.runCount = extents->runs.count;
+    header.headCount = extents->headCount;
+    header.entryCount = paths->count;
+    header.stringsSize = paths->stringsSize;
+    header.slotCount = paths->slotCount;
+
+    // written next to the old one and renamed, readers never see half a snapshot
+    size_t nameLength = strlen(filename);
+    char temporary[nameLength + 5];
+    memcpy(temporary, filename, nameLength);
+    memcpy(&temporary[nameLength], ".tmp", 5);
+
+    FILE* file = fopen(temporary, "wb");
+    if(!file) {
+        return -1;
+    }
+
+    // the header goes first, once the section offsets are known
+    unsigned long long offset = sizeof(SnapshotHeader);
+    int ret = fseek(file, offset, SEEK_SET);
+    if(ret == 0) {
+        ret = writeSection(file, &header, SECTION_FAT, fat->next, (unsigned long long)fat->count * sizeof(unsigned int), &offset) |
+              writeSection(file, &header, SECTION_RUNS, extents->runs.extents, (unsigned long long)extents->runs.count * sizeof(Extent), &offset) |
+              writeSection(file, &header, SECTION_HEADS, extents->heads, (unsigned long long)extents->headCount * sizeof(unsigned int), &offset) |
+              writeSection(file, &header, SECTION_FIRST_RUN, extents->firstRun, ((unsigned long long)extents->headCount + 1) * sizeof(unsigned int), &offset) |
+              writeSection(file, &header, SECTION_ENTRIES, paths->entries, (unsigned long long)paths->count * sizeof(IndexEntry), &offset) |
+              writeSection(file, &header, SECTION_STRINGS, paths->strings, paths->stringsSize, &offset) |
+              writeSection(file, &header, SECTION_SLOTS, paths->slots, (unsigned long long)paths->slotCount * sizeof(unsigned int), &offset);
+    }
+    if(ret == 0 && (fseek(file, 0, SEEK_SET) != 0 || fwrite(&header, sizeof(SnapshotHeader), 1, file) != 1)) {
+        ret = -1;
+    }
+    if(fclose(file) != 0) {
+        ret = -1;
+    }
+
+    if(ret == 0 && rename(temporary, filename) != 0) {
+        ret = -1;
+    }
+    if(ret != 0) {
+        int error = errno;
+        unlink(temporary);
+        errno = error;
+    }
+    return ret;
+}
+
+void snapshotClose(Snapshot* snapshot) {
+    if(snapshot->map) {
+        munmap((void*)snapshot->map, (size_t)snapshot->size);
+    }
+    snapshot->map = 0;
+    snapshot->size = 0;
+}
@@ -0,0 +1,62 @@
+/*
+ * snapshot.h
+ *
+ * Persistent copy of everything a scan derives from an image: the decoded
+ * FAT, the extent index and the path index. A snapshot is only used for the
+ * image it was made from, recognised by the volume serial number, the
+ * geometry and a hash of the FAT region. It is memory mapped and used in
+ * place, so a later run does not read a single directory cluster.
+ * Snapshots are native endian and not meant to move between platforms.
+ */
+
+#ifndef __SNAPSHOT_H
+#define __SNAPSHOT_H
+
+#include "data.h"
+#include "extent.h"
+#include "fat.h"
+#include "image.h"
+#include "pathindex.h"
+
+#define SNAPSHOT_MAGIC "WTFSNAP"
+#define SNAPSHOT_VERSION 2
+
+/**
+ * @brief What identifies the image a snapshot belongs to
+ */
+typedef struct SnapshotKey_t {
+    unsigned int serialNumber;
+    unsigned int reserved;
+    FatGeometry geometry;
+    unsigned long long fatHash;     // XXH64 of the first FAT copy
+} SnapshotKey;
+
+typedef struct Snapshot_t {
+    const unsigned char* map;
+    unsigned long long size;
+} Snapshot;
+
+/**
+ * @brief Derives the key of an image, reads the whole first FAT copy
+ * @return 0 on success, -1 if the FAT could not be read
+ */
+int snapshotKey(Image* image, const BOOTSECTOR* bootsector, const FatGeometry* geometry, SnapshotKey* key);
+
+/**
+ * @brief Maps a snapshot and points the tables into it (they are marked as borrowed)
+ * @return 0 on success, -1 if there is no snapshot or it belongs to another image
+ */
+int snapshotOpen(Snapshot* snapshot, const char* filename, const SnapshotKey* key, FatTable* fat, ExtentIndex* extents, PathIndex* paths);
+
+/**
+ * @brief Writes a snapshot, replacing an older one only once it is complete
+ * @return 0 on success, -1 otherwise (errno is set)
+ */
+int snapshotWrite(const char* filename, const SnapshotKey* key, const FatTable* fat, const ExtentIndex* extents, const PathIndex* paths);
+
+/**
+ * @brief Unmaps a snapshot, the tables pointing into it must not be used anymore
+ */
+void snapshotClose(Snapshot* snapshot);
+
+#endif
@@ -0,0 +1,104 @@
+#include <string.h>
+
+#include "stats.h"
+
+#define STATS_BLOCK 256     // bitset words classified at once
+
+/**
+ * @brief Counts a free extent that just ended
+ */
+static void statsFreeExtent(FatStats* stats, unsigned int length) {
+    stats->freeExtents++;
+    if(length > stats->largestFreeExtent) {
+        stats->largestFreeExtent = length;
+    }
+    stats->freeHistogram[31 - __builtin_clz(length)]++;
+}
+
+void statsScan(FatStats* stats, const FatTable* fat) {
+    memset(stats, 0, sizeof(FatStats));
+
+    unsigned long long freeBits[STATS_BLOCK];
+    unsigned long long badBits[STATS_BLOCK];
+    unsigned long long lastBits[STATS_BLOCK];
+    unsigned long long invalidBits[STATS_BLOCK];
+    FatClasses classes = {freeBits, badBits, lastBits, invalidBits};
+
+    // length of the free extent that is still open at the end of a word
+    unsigned int run = 0;
+    unsigned int words = fat->count / 64 + 1;
+    unsigned int block;
+    for(block = 0; block < words; block += STATS_BLOCK) {
+        unsigned int count = words - block < STATS_BLOCK ? words - block : STATS_BLOCK;
+        fatClassify(fat, block, block + count, &classes);
+
+        unsigned int i;
+        for(i = 0; i < count; i++) {
+            unsigned long long bits = freeBits[i];
+            stats->freeClusters += __builtin_popcountll(bits);
+            stats->badClusters += __builtin_popcountll(badBits[i]);
+            stats->chains += __builtin_popcountll(lastBits[i]);
+            stats->invalidEntries += __builtin_popcountll(invalidBits[i]);
+
+            // whole words of free or used clusters are common, everything else goes run by run
+            if(bits == ~0ull) {
+                run += 64;
+                continue;
+            }
+            unsigned int position = 0;
+            while(position < 64) {
+                unsigned long long rest = bits >> position;
+                if(!run) {
+                    // skip to the next free cluster
+                    if(!rest) {
+                        break;
+                    }
+                    position += __builtin_ctzll(rest);
+                    rest = bits >> position;
+                }
+                // ones continue the extent, the zeros shifted in end it at the latest
+                unsigned int length = __builtin_ctzll(~rest);
+                if(length > 64 - position) {
+                    length = 64 - position;
+                }
+                run += length;
+                position += length;
+                if(position < 64) {
+                    statsFreeExtent(stats, run);
+                    run = 0;
+                }
+            }
+        }
+    }
+    if(run) {
+        statsFreeExtent(stats, run);
+    }
+
+    // clusters 0 and 1 are in none of the classes
+    unsigned int dataClusters = fat->count > 2 ? fat->count - 2 : 0;
+    stats->usedClusters = dataClusters - stats->freeClusters - stats->badClusters;
+}
+
+void statsAddFile(FatStats* stats, unsigned int entry, unsigned int fragments, unsigned int size) {
+    stats->files++;
+    stats->fragments += fragments;
+    if(fragments < 2) {
+        return;
+    }
+    stats->fragmentedFiles++;
+
+    // insert into the sorted list of the worst ones, ties go to the larger file
+    unsigned int i = stats->worstCount < STATS_WORST ? stats->worstCount++ : STATS_WORST;
+    while(i > 0 && (stats->worst[i - 1].fragments < fragments ||
+                    (stats->worst[i - 1].fragments == fragments && stats->worst[i - 1].size < size))) {
+        if(i < STATS_WORST) {
+            stats->worst[i] = stats->worst[i - 1];
+        }
+        i--;
+    }
+    if(i < STATS_WORST) {
+        stats->worst[i].entry = entry;
+        stats->worst[i].fragments = fragments;
+        stats->worst[i].size = size;
+    }
+}
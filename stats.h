@@ -0,0 +1,53 @@
+/*
+ * stats.h
+ *
+ * Free space and fragmentation figures of a volume. The FAT is classified
+ * in one pass, 64 clusters per bitset word; free extents are the runs of
+ * set bits in the free bitset. Fragments of a file are the runs of
+ * contiguous clusters of its chain.
+ */
+
+#ifndef __STATS_H
+#define __STATS_H
+
+#include "fat.h"
+
+#define STATS_HISTOGRAM 32  // free extents by size: 1, 2-3, 4-7, ... clusters
+#define STATS_WORST     10  // most fragmented files kept
+
+typedef struct StatsFile_t {
+    unsigned int entry;         // of the path index
+    unsigned int fragments;
+    unsigned int size;
+} StatsFile;
+
+typedef struct FatStats_t {
+    unsigned int freeClusters;
+    unsigned int usedClusters;
+    unsigned int badClusters;
+    unsigned int chains;                        // end of chain markers
+    unsigned int invalidEntries;
+
+    unsigned int freeExtents;
+    unsigned int largestFreeExtent;             // in clusters
+    unsigned int freeHistogram[STATS_HISTOGRAM];
+
+    unsigned int files;                         // with at least one cluster
+    unsigned int fragmentedFiles;
+    unsigned long long fragments;
+    unsigned int worstCount;
+    StatsFile worst[STATS_WORST];               // most fragments first
+} FatStats;
+
+/**
+ * @brief Counts the kinds of FAT entries and the free extents, clears stats first
+ */
+void statsScan(FatStats* stats, const FatTable* fat);
+
+/**
+ * @brief Counts a file with its number of fragments
+ * @param entry identifies the file in the worst list
+ */
+void statsAddFile(FatStats* stats, unsigned int entry, unsigned int fragments, unsigned int size);
+
+#endif
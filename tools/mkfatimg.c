@@ -0,0 +1,504 @@
+/*
+ * mkfatimg.c
+ *
+ * Builds synthetic FAT12/16/32 images for testing and benchmarking: a tree
+ * of the given depth and fan-out, a number of files per directory, some of
+ * them with long names, and optionally fragmented chains. File contents
+ * are the file's 8.3 name followed by ':' over and over, so extracted files
+ * can be verified without the image.
+ *
+ *     cc -O2 -o mkfatimg tools/mkfatimg.c lfn.c
+ */
+
+#define _FILE_OFFSET_BITS 64
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "../data.h"
+#include "../lfn.h"
+
+#define SECTOR_SIZE 512
+
+// 2025-01-01 13:25:30 for every entry, images are reproducible
+#define ENTRY_DATE (((2025 - 1980) << 9) | (1 << 5) | 1)
+#define ENTRY_TIME ((13 << 11) | (25 << 5) | (30 / 2))
+
+typedef struct Generator_t {
+    int handle;
+    unsigned int fatType;
+    unsigned int sectorsPerCluster;
+    unsigned int clusterSize;
+    unsigned int reservedSectors;
+    unsigned int fatSectors;
+    unsigned int rootEntries;
+    unsigned long long dataOffset;
+    unsigned int clusterCount;
+
+    unsigned int* fat;              // clusterCount + 2 entries, in the 28 bit FAT32 value space
+    unsigned int cursor;            // next cluster to hand out
+    unsigned long long random;      // xorshift state
+
+    unsigned int depth;
+    unsigned int fanOut;
+    unsigned int files;
+    unsigned int lfnPercent;
+    unsigned int fragmentPercent;
+    unsigned int maxSize;
+    unsigned int counter;           // numbers the names
+} Generator;
+
+/**
+ * @brief Directory contents collected before they are written
+ */
+typedef struct EntryBuffer_t {
+    unsigned char* data;
+    unsigned int used;
+    unsigned int capacity;
+} EntryBuffer;
+
+static void fail(const char* message) {
+    printf("%s\n", message);
+    exit(1);
+}
+
+static unsigned int nextRandom(Generator* g, unsigned int range) {
+    g->random ^= g->random << 13;
+    g->random ^= g->random >> 7;
+    g->random ^= g->random << 17;
+    return range ? (unsigned int)(g->random % range) : 0;
+}
+
+static void writeAt(Generator* g, const void* data, size_t length, unsigned long long offset) {
+    const char* p = (const char*)data;
+    while(length > 0) {
+        ssize_t written = pwrite(g->handle, p, length, offset);
+        if(written <= 0) {
+            printf("Could not write the image! errno: %d\n", errno);
+            exit(1);
+        }
+        p += written;
+        length -= written;
+        offset += written;
+    }
+}
+
+/**
+ * @brief Hands out the next free cluster, with fragmentation some clusters are skipped first
+ */
+static unsigned int allocateCluster(Generator* g) {
+    if(g->fragmentPercent && nextRandom(g, 100) < g->fragmentPercent) {
+        g->cursor += 1 + nextRandom(g, 4);
+    }
+    if(g->cursor >= g->clusterCount + 2) {
+        fail("The image is full, make it larger or the tree smaller!");
+    }
+    return g->cursor++;
+}
+
+/**
+ * @brief Allocates a chain behind an already allocated first cluster
+ * @return the clusters of the chain in order, count entries
+ */
+static unsigned int* allocateChain(Generator* g, unsigned int firstCluster, unsigned int count) {
+    unsigned int* clusters = (unsigned int*)malloc(sizeof(unsigned int) * (count ? count : 1));
+    if(!clusters) {
+        fail("Out of memory!");
+    }
+    clusters[0] = firstCluster;
+    unsigned int i;
+    for(i = 1; i < count; i++) {
+        clusters[i] = allocateCluster(g);
+        g->fat[clusters[i - 1]] = clusters[i];
+    }
+    g->fat[clusters[count - 1]] = CLUSTER_LAST_MAX(28);
+    return clusters;
+}
+
+/**
+ * @brief Writes data to a chain, cluster by cluster
+ */
+static void writeChain(Generator* g, const unsigned int* clusters, const unsigned char* data, unsigned int length) {
+    unsigned int i;
+    for(i = 0; i * g->clusterSize < length; i++) {
+        unsigned int part = length - i * g->clusterSize < g->clusterSize ? length - i * g->clusterSize : g->clusterSize;
+        writeAt(g, &data[i * g->clusterSize], part, g->dataOffset + (unsigned long long)(clusters[i] - 2) * g->clusterSize);
+    }
+}
+
+static void addEntry(EntryBuffer* buffer, const void* entry) {
+    if(buffer->used + 32 > buffer->capacity) {
+        buffer->capacity = buffer->capacity ? buffer->capacity * 2 : 1024;
+        buffer->data = (unsigned char*)realloc(buffer->data, buffer->capacity);
+        if(!buffer->data) {
+            fail("Out of memory!");
+        }
+    }
+    memcpy(&buffer->data[buffer->used], entry, 32);
+    buffer->used += 32;
+}
+
+/**
+ * @brief Adds the LFN entries of a long name in front of its 8.3 entry
+ * @param shortName the 11 bytes of the 8.3 entry
+ */
+static void addLongName(EntryBuffer* buffer, const char* name, const unsigned char* shortName) {
+    unsigned short chars[LFN_MAX_CHARS];
+    unsigned int length = strlen(name);
+    unsigned int i;
+    for(i = 0; i < LFN_MAX_CHARS; i++) {
+        // terminated by 0x0000 unless it fills the last entry, padded with 0xFFFF
+        chars[i] = i < length ? (unsigned char)name[i] : (i == length ? VFAT_END : 0xFFFF);
+    }
+    unsigned int entries = (length + LFN_CHARS_PER_ENTRY - 1) / LFN_CHARS_PER_ENTRY;
+    unsigned char checksum = lfnChecksum(shortName);
+
+    // last part first
+    for(i = entries; i > 0; i--) {
+        DIRENTRY_V entry;
+        memset(&entry, 0, sizeof(entry));
+        entry.sequence_number = i | (i == entries ? 0x40 : 0);
+        entry.attr = DIRENTRY_ATTR_VFAT;
+        entry.checksum = checksum;
+        const unsigned short* part = &chars[(i - 1) * LFN_CHARS_PER_ENTRY];
+        memcpy(entry.name_0, &part[0], sizeof(entry.name_0));
+        memcpy(entry.name_1, &part[5], sizeof(entry.name_1));
+        memcpy(entry.name_2, &part[11], sizeof(entry.name_2));
+        addEntry(buffer, &entry);
+    }
+}
+
+static void setShortName(DIRENTRY* entry, const char* name, const char* ext) {
+    memset(entry->name, ' ', 8);
+    memset(entry->ext, ' ', 3);
+    memcpy(entry->name, name, strlen(name) < 8 ? strlen(name) : 8);
+    memcpy(entry->ext, ext, strlen(ext) < 3 ? strlen(ext) : 3);
+}
+
+static void setFirstCluster(DIRENTRY* entry, unsigned int cluster) {
+    entry->firstcluser = cluster & 0xFFFF;
+    entry->EAindex = cluster >> 16;
+}
+
+static void initEntry(DIRENTRY* entry, unsigned char attr) {
+    memset(entry, 0, sizeof(DIRENTRY));
+    entry->attr = attr;
+    entry->createtime = ENTRY_TIME;
+    entry->createdate = ENTRY_DATE;
+    entry->lastaccessdate = ENTRY_DATE;
+    entry->changetime = ENTRY_TIME;
+    entry->changedate = ENTRY_DATE;
+}
+
+static void addFile(Generator* g, EntryBuffer* buffer) {
+    static const unsigned int sizes[] = {0, 10, 3000, 20000, 70000, 300000};
+    unsigned int number = ++g->counter;
+    char name[9];
+    snprintf(name, sizeof(name), "F%06u", number % 1000000);
+
+    DIRENTRY entry;
+    initEntry(&entry, DIRENTRY_ATTR_ARCHIVE);
+    setShortName(&entry, name, "TXT");
+    unsigned int size = sizes[nextRandom(g, sizeof(sizes) / sizeof(sizes[0]))];
+    entry.size = size < g->maxSize ? size : g->maxSize;
+
+    if(entry.size > 0) {
+        // contents: 'F000001.TXT:F000001.TXT:...'
+        unsigned char* data = (unsigned char*)malloc(entry.size);
+        if(!data) {
+            fail("Out of memory!");
+        }
+        char pattern[16];
+        unsigned int patternLength = snprintf(pattern, sizeof(pattern), "%s.TXT:", name);
+        unsigned int i;
+        for(i = 0; i < entry.size; i++) {
+            data[i] = pattern[i % patternLength];
+        }
+        unsigned int count = (entry.size + g->clusterSize - 1) / g->clusterSize;
+        unsigned int* clusters = allocateChain(g, allocateCluster(g), count);
+        writeChain(g, clusters, data, entry.size);
+        setFirstCluster(&entry, clusters[0]);
+        free(clusters);
+        free(data);
+    }
+
+    if(nextRandom(g, 100) < g->lfnPercent) {
+        char longName[64];
+        snprintf(longName, sizeof(longName), "long file name number %u.text", number);
+        addLongName(buffer, longName, entry.name);
+    }
+    addEntry(buffer, &entry);
+}
+
+/**
+ * @brief Fills a directory and everything below it
+ * @param cluster first cluster of the directory, already allocated; 0 for the FAT12/16 root directory
+ * @param parent first cluster of the parent, 0 for the root directory
+ * @param root 1 for the root directory
+ */
+static void makeDirectory(Generator* g, unsigned int cluster, unsigned int parent, unsigned int depth, int root) {
+    EntryBuffer buffer = {0, 0, 0};
+    DIRENTRY entry;
+
+    if(root) {
+        initEntry(&entry, DIRENTRY_ATTR_VOLUME);
+        setShortName(&entry, "WHATTHEF", "AT");
+        addEntry(&buffer, &entry);
+    }else{
+        initEntry(&entry, DIRENTRY_ATTR_DIR);
+        setShortName(&entry, ".", "");
+        setFirstCluster(&entry, cluster);
+        addEntry(&buffer, &entry);
+        setShortName(&entry, "..", "");
+        setFirstCluster(&entry, parent);
+        addEntry(&buffer, &entry);
+    }
+
+    unsigned int i;
+    for(i = 0; i < g->files; i++) {
+        addFile(g, &buffer);
+    }
+
+    for(i = 0; depth > 0 && i < g->fanOut; i++) {
+        unsigned int number = ++g->counter;
+        char name[9];
+        snprintf(name, sizeof(name), "D%06u", number % 1000000);
+        initEntry(&entry, DIRENTRY_ATTR_DIR);
+        setShortName(&entry, name, "");
+        unsigned int subdirectory = allocateCluster(g);
+        setFirstCluster(&entry, subdirectory);
+        if(nextRandom(g, 100) < g->lfnPercent) {
+            char longName[64];
+            snprintf(longName, sizeof(longName), "Long Directory %s", name);
+            addLongName(&buffer, longName, entry.name);
+        }
+        addEntry(&buffer, &entry);
+        // '..' of a directory in the root directory is 0, even on FAT32
+        makeDirectory(g, subdirectory, root ? 0 : cluster, depth - 1, 0);
+    }
+
+    if(cluster == 0) {
+        // the fixed FAT12/16 root directory
+        if(buffer.used > g->rootEntries * 32) {
+            fail("Too many entries for the root directory, use fewer files or subdirectories!");
+        }
+        writeAt(g, buffer.data, buffer.used, g->dataOffset - g->rootEntries * 32);
+    }else{
+        // the first cluster was taken before the subdirectories, the rest comes after them
+        unsigned int count = (buffer.used + g->clusterSize - 1) / g->clusterSize;
+        unsigned int* clusters = allocateChain(g, cluster, count);
+        writeChain(g, clusters, buffer.data, buffer.used);
+        free(clusters);
+    }
+    free(buffer.data);
+}
+
+/**
+ * @brief Chooses the FAT size for the image size and checks the cluster count against the FAT type
+ */
+static void layout(Generator* g, unsigned int totalSectors) {
+    g->reservedSectors = g->fatType == 32 ? 32 : 1;
+    g->rootEntries = g->fatType == 32 ? 0 : 512;
+    unsigned int rootSectors = g->rootEntries * 32 / SECTOR_SIZE;
+
+    // the FAT takes space from the clusters it describes, a few rounds settle it
+    g->fatSectors = 1;
+    while(1) {
+        if(g->reservedSectors + 2 * g->fatSectors + rootSectors >= totalSectors) {
+            fail("The image is too small!");
+        }
+        unsigned int clusters = (totalSectors - g->reservedSectors - 2 * g->fatSectors - rootSectors) / g->sectorsPerCluster;
+        unsigned long long bytes = g->fatType == 12 ? ((unsigned long long)(clusters + 2) * 3 + 1) / 2
+                                                    : (unsigned long long)(clusters + 2) * g->fatType / 8;
+        unsigned int sectors = (bytes + SECTOR_SIZE - 1) / SECTOR_SIZE;
+        g->clusterCount = clusters;
+        if(sectors <= g->fatSectors) {
+            break;
+        }
+        g->fatSectors = sectors;
+    }
+
+    unsigned int type = g->clusterCount < 4085 ? 12 : (g->clusterCount < 65525 ? 16 : 32);
+    if(type != g->fatType) {
+        printf("%u clusters make a FAT%u volume, change the size or the sectors per cluster!\n", g->clusterCount, type);
+        exit(1);
+    }
+    g->clusterSize = g->sectorsPerCluster * SECTOR_SIZE;
+    g->dataOffset = (unsigned long long)(g->reservedSectors + 2 * g->fatSectors + rootSectors) * SECTOR_SIZE;
+}
+
+static void writeBootSector(Generator* g, unsigned int totalSectors, unsigned int serialNumber) {
+    BOOTSECTOR boot;
+    memset(&boot, 0, sizeof(boot));
+    memcpy(boot.bootroutine, "\xEB\x58\x90", 3);
+    memcpy(boot.vendor, "MKFATIMG", 8);
+    boot.BPB.sectorsize = SECTOR_SIZE;
+    boot.BPB.sectorspercluster = g->sectorsPerCluster;
+    boot.BPB.reservedsectors = g->reservedSectors;
+    boot.BPB.numberofFATs = 2;
+    boot.BPB.rootentries = g->rootEntries;
+    boot.BPB.mediatype = 0xF8;
+    boot.sectorspertrack = 32;
+    boot.numberofheads = 64;
+    if(g->fatType != 32 && totalSectors < 65536) {
+        boot.BPB.numberofsectors = totalSectors;
+    }else{
+        boot.totalsectors = totalSectors;
+    }
+
+    if(g->fatType == 32) {
+        boot.EBPB32.FATsectors = g->fatSectors;
+        boot.EBPB32.rootcluster = 2;
+        boot.EBPB32.fsinfosector = 1;
+        boot.EBPB32.backupbootsector = 6;
+        boot.EBPB32.drivenumber = 0x80;
+        boot.EBPB32.signature = 0x29;
+        boot.EBPB32.serialnumber = serialNumber;
+        memcpy(boot.EBPB32.volumelabel, "WHATTHEFAT ", 11);
+        memcpy(boot.EBPB32.fattype, FAT32_SIGNATURE, 8);
+        boot.EBPB32.endofsector = 0xAA55;
+    }else{
+        boot.BPB.FATsectors = g->fatSectors;
+        boot.EBPB.drivenumber = 0x80;
+        boot.EBPB.signature = 0x29;
+        boot.EBPB.serialnumber = serialNumber;
+        memcpy(boot.EBPB.volumelabel, "WHATTHEFAT ", 11);
+        memcpy(boot.EBPB.fattype, g->fatType == 12 ? FAT12_SIGNATURE : FAT16_SIGNATURE, 8);
+        boot.EBPB.endofsector = 0xAA55;
+    }
+    writeAt(g, &boot, sizeof(boot), 0);
+
+    if(g->fatType == 32) {
+        unsigned int freeClusters = 0;
+        unsigned int cluster;
+        for(cluster = 2; cluster < g->clusterCount + 2; cluster++) {
+            freeClusters += g->fat[cluster] == CLUSTER_FREE;
+        }
+        FSINFO fsinfo;
+        memset(&fsinfo, 0, sizeof(fsinfo));
+        fsinfo.leadsignature = FSINFO_LEADSIGNATURE;
+        fsinfo.structsignature = FSINFO_STRUCTSIGNATURE;
+        fsinfo.freecount = freeClusters;
+        fsinfo.nextfree = g->cursor;
+        fsinfo.trailsignature = 0xAA550000;
+        writeAt(g, &fsinfo, sizeof(fsinfo), SECTOR_SIZE);
+        writeAt(g, &boot, sizeof(boot), 6 * SECTOR_SIZE);
+        writeAt(g, &fsinfo, sizeof(fsinfo), 7 * SECTOR_SIZE);
+    }
+}
+
+/**
+ * @brief Packs the table into the on-disk format and writes both copies
+ */
+static void writeFat(Generator* g) {
+    size_t size = (size_t)g->fatSectors * SECTOR_SIZE;
+    unsigned char* raw = (unsigned char*)calloc(size, 1);
+    if(!raw) {
+        fail("Out of memory!");
+    }
+    unsigned int bits = g->fatType == 32 ? 28 : g->fatType;
+    unsigned int cluster;
+    for(cluster = 0; cluster < g->clusterCount + 2; cluster++) {
+        unsigned int value = g->fat[cluster] & CLUSTER_LAST_MAX(bits);
+        if(g->fatType == 12) {
+            unsigned char* p = &raw[cluster + cluster / 2];
+            if(cluster % 2) {
+                p[0] = (p[0] & 0x0F) | (value << 4);
+                p[1] = value >> 4;
+            }else{
+                p[0] = value;
+                p[1] = (p[1] & 0xF0) | (value >> 8);
+            }
+        }else if(g->fatType == 16) {
+            raw[cluster * 2] = value;
+            raw[cluster * 2 + 1] = value >> 8;
+        }else{
+            memcpy(&raw[cluster * 4], &value, 4);
+        }
+    }
+    writeAt(g, raw, size, (unsigned long long)g->reservedSectors * SECTOR_SIZE);
+    writeAt(g, raw, size, (unsigned long long)(g->reservedSectors + g->fatSectors) * SECTOR_SIZE);
+    free(raw);
+}
+
+static void usage(const char* program) {
+    printf("Usage: %s [-t 12|16|32] [-s MiB] [-c sectors per cluster] [-d depth] [-n subdirectories]\n", program);
+    printf("       [-f files] [-l long name %%] [-F fragmentation %%] [-m max file size] [-r seed] image\n");
+}
+
+int main(int argc, char* argv[]) {
+    Generator g;
+    memset(&g, 0, sizeof(g));
+    g.fatType = 16;
+    g.sectorsPerCluster = 4;
+    g.depth = 2;
+    g.fanOut = 3;
+    g.files = 5;
+    g.maxSize = 70000;
+    unsigned int megabytes = 32;
+    unsigned int seed = 1;
+
+    int option;
+    while((option = getopt(argc, argv, "t:s:c:d:n:f:l:F:m:r:")) != -1) {
+        unsigned int value = strtoul(optarg, 0, 10);
+        switch(option) {
+            case 't': g.fatType = value; break;
+            case 's': megabytes = value; break;
+            case 'c': g.sectorsPerCluster = value; break;
+            case 'd': g.depth = value; break;
+            case 'n': g.fanOut = value; break;
+            case 'f': g.files = value; break;
+            case 'l': g.lfnPercent = value; break;
+            case 'F': g.fragmentPercent = value; break;
+            case 'm': g.maxSize = value; break;
+            case 'r': seed = value; break;
+            default: usage(argv[0]); return 1;
+        }
+    }
+    if(optind != argc - 1 || (g.fatType != 12 && g.fatType != 16 && g.fatType != 32) ||
+       g.sectorsPerCluster == 0 || g.sectorsPerCluster > 128 || (g.sectorsPerCluster & (g.sectorsPerCluster - 1)) ||
+       megabytes == 0 || megabytes >= 2 * 1024 * 1024) {
+        usage(argv[0]);
+        return 1;
+    }
+    g.random = 0x9E3779B97F4A7C15ull ^ seed;
+
+    unsigned int totalSectors = megabytes * (1024 * 1024 / SECTOR_SIZE);
+    layout(&g, totalSectors);
+
+    g.fat = (unsigned int*)calloc(g.clusterCount + 2, sizeof(unsigned int));
+    if(!g.fat) {
+        fail("Out of memory!");
+    }
+    g.fat[0] = (CLUSTER_LAST_MAX(28) & ~0xFF) | 0xF8;      // media type
+    g.fat[1] = CLUSTER_LAST_MAX(28);
+    g.cursor = 2;
+
+    // sparse: only what is written takes space
+    g.handle = open(argv[optind], O_RDWR | O_CREAT | O_TRUNC, 0644);
+    if(g.handle == -1 || ftruncate(g.handle, (off_t)totalSectors * SECTOR_SIZE) != 0) {
+        printf("Could not create '%s'! errno: %d\n", argv[optind], errno);
+        return 1;
+    }
+
+    // FAT32 keeps the root directory in a chain starting at cluster 2
+    makeDirectory(&g, g.fatType == 32 ? allocateCluster(&g) : 0, 0, g.depth, 1);
+
+    writeFat(&g);
+    writeBootSector(&g, totalSectors, seed * 2654435761u);
+
+    unsigned int used = 0;
+    unsigned int cluster;
+    for(cluster = 2; cluster < g.clusterCount + 2; cluster++) {
+        used += g.fat[cluster] != CLUSTER_FREE;
+    }
+    printf("FAT%u, %u clusters of %u bytes, %u used, %u files and directories\n", g.fatType, g.clusterCount, g.clusterSize, used, g.counter);
+
+    free(g.fat);
+    close(g.handle);
+    return 0;
+}
@@ -0,0 +1,61 @@
+#!/bin/sh
+# Puts a host tree on synthetic FAT12/16/32 images and removes it again;
+# 'check' has to find no problems after each step and the free cluster count
+# has to be what it was. One letter names are in there on purpose, with the
+# first byte deleted they look like '.' entries.
+#
+#     tools/writertest.sh ./what-the-fat ./mkfatimg
+
+WTF=${1:-./what-the-fat}
+MKFATIMG=${2:-./mkfatimg}
+WORK=$(mktemp -d) || exit 1
+trap 'rm -rf "$WORK"' EXIT
+failed=0
+
+fail() {
+    echo "FAIL: $*"
+    failed=1
+}
+
+# 'check' ends with 'No problems found' on a clean volume, the line before counts the free clusters
+checkClean() {
+    "$WTF" check "$1" > "$WORK/check" 2>&1 || fail "$2: check exited with $?"
+    tail -n 1 "$WORK/check" | grep -q "No problems found" || fail "$2: $(tail -n 3 "$WORK/check")"
+}
+
+freeClusters() {
+    "$WTF" check "$1" | sed -n 's/.* \([0-9]*\) free clusters.*/\1/p'
+}
+
+mkdir -p "$WORK/src/sub" "$WORK/src/X/Q"
+head -c 50000 /dev/urandom > "$WORK/src/A"
+echo b > "$WORK/src/sub/B"
+echo readme > "$WORK/src/readme.txt"
+head -c 30000 /dev/urandom > "$WORK/src/X/Y"
+echo z > "$WORK/src/X/Q/Z"
+
+for type in 12 16 32; do
+    image="$WORK/fat$type.img"
+    size=2 cluster=4
+    [ $type = 16 ] && size=32
+    [ $type = 32 ] && size=64 cluster=1
+    "$MKFATIMG" -t $type -s $size -c $cluster -d 1 -n 2 -f 3 "$image" > /dev/null || { fail "FAT$type: mkfatimg"; continue; }
+    free=$(freeClusters "$image")
+
+    "$WTF" mkdir "$image" /T > /dev/null || fail "FAT$type: mkdir /T"
+    "$WTF" put "$image" "$WORK/src" /T > /dev/null || fail "FAT$type: put into /T"
+    "$WTF" put "$image" "$WORK/src/A" /A > /dev/null || fail "FAT$type: put /A"
+    "$WTF" put "$image" "$WORK/src/X" /X > /dev/null || fail "FAT$type: put /X"
+    checkClean "$image" "FAT$type after put"
+    "$WTF" extract "$image" /T/src/X/Y "$WORK/Y" > /dev/null && cmp -s "$WORK/Y" "$WORK/src/X/Y" || fail "FAT$type: /T/src/X/Y differs"
+
+    "$WTF" rm "$image" /T/src > /dev/null || fail "FAT$type: rm /T/src"
+    "$WTF" rm "$image" /A > /dev/null || fail "FAT$type: rm /A"
+    "$WTF" rm "$image" /X > /dev/null || fail "FAT$type: rm /X"
+    "$WTF" rm "$image" /T > /dev/null || fail "FAT$type: rm /T"
+    checkClean "$image" "FAT$type after rm"
+    [ "$(freeClusters "$image")" = "$free" ] || fail "FAT$type: $(freeClusters "$image") free clusters after rm, $free before"
+done
+
+[ $failed = 0 ] && echo "All writer tests passed"
+exit $failed
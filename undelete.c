@@ -0,0 +1,293 @@
+#include <stdlib.h>
+#include <string.h>
+
+#include "arena.h"
+#include "lfn.h"
+#include "path.h"
+#include "undelete.h"
+
+typedef struct UndeleteItem_t {
+    PathNode* node;
+    int deleted;                // the directory is deleted, it is read from its first cluster only
+} UndeleteItem;
+
+typedef struct UndeleteWalk_t {
+    Volume* volume;
+    void (*found)(const DeletedEntry* entry, void* arg);
+    void* arg;
+    ExtentList runs;
+    UndeleteItem* stack;
+    unsigned int count;
+    unsigned int capacity;
+    unsigned char* visited;     // bitset: directory clusters already queued
+} UndeleteWalk;
+
+int undeleteChain(const Volume* volume, const DIRENTRY* directoryEntry, ExtentList* runs) {
+    const FatTable* fat = &volume->fat;
+    unsigned int firstCluster = fatFirstCluster(directoryEntry, volume->geometry.fatType);
+    runs->count = 0;
+    if(directoryEntry->size == 0 || firstCluster < 2 || firstCluster >= fat->count) {
+        return UNDELETE_EMPTY;
+    }
+    if(fatEntry(fat, firstCluster) != CLUSTER_FREE) {
+        return UNDELETE_OVERWRITTEN;
+    }
+
+    // files are mostly written in one piece; clusters taken since then are passed over
+    unsigned int needed = (directoryEntry->size + volume->geometry.clusterSize - 1) / volume->geometry.clusterSize;
+    int status = UNDELETE_CONTIGUOUS;
+    unsigned int cluster;
+    for(cluster = firstCluster; needed > 0 && cluster < fat->count; cluster++) {
+        if(fatEntry(fat, cluster) != CLUSTER_FREE) {
+            status = UNDELETE_GAPS;
+            continue;
+        }
+        if(extentListAdd(runs, cluster) != 0) {
+            return -1;
+        }
+        needed--;
+    }
+    return needed > 0 ? UNDELETE_GAPS : status;
+}
+
+const char* undeleteStatusName(int status) {
+    switch(status) {
+        case UNDELETE_CONTIGUOUS:  return "contiguous";
+        case UNDELETE_GAPS:        return "gaps";
+        case UNDELETE_OVERWRITTEN: return "overwritten";
+        case UNDELETE_EMPTY:       return "empty";
+        default:                   return "orphan";
+    }
+}
+
+/**
+ * @brief Collects the deleted long name entries right in front of an entry.
+ * Their sequence numbers are gone, the nearest one is part 1.
+ * @param position of the entry in the view
+ * @param checksum receives the checksum the entries agree on
+ * @param utf8 is a buffer >= LFN_UTF8_MAX bytes, receives the name
+ * @return number of entries, 0 if there are none
+ */
+static unsigned int undeleteLongName(const DIRENTRY* view, unsigned int position, unsigned char* checksum, char* utf8) {
+    unsigned short chars[LFN_MAX_CHARS];
+    unsigned int parts = 0;
+    while(parts < LFN_MAX_ENTRIES && parts < position) {
+        const DIRENTRY_V* lfnEntry = (const DIRENTRY_V*)&view[position - 1 - parts];
+        if(lfnEntry->attr != DIRENTRY_ATTR_VFAT || lfnEntry->sequence_number != DIRENTRY_EMPTY ||
+           (parts > 0 && lfnEntry->checksum != *checksum)) {
+            break;
+        }
+        *checksum = lfnEntry->checksum;
+        unsigned short* part = &chars[parts * LFN_CHARS_PER_ENTRY];
+        memcpy(&part[0], lfnEntry->name_0, sizeof(lfnEntry->name_0));
+        memcpy(&part[5], lfnEntry->name_1, sizeof(lfnEntry->name_1));
+        memcpy(&part[11], lfnEntry->name_2, sizeof(lfnEntry->name_2));
+        parts++;
+    }
+
+    size_t end = 0;
+    while(end < parts * LFN_CHARS_PER_ENTRY && chars[end] != VFAT_END) {
+        end++;
+    }
+    utf8[ucs2ToUtf8(chars, end, utf8)] = '\0';
+    return parts;
+}
+
+/**
+ * @return 1 if c may start an 8.3 name
+ */
+static int undeleteShortNameChar(unsigned char c) {
+    return c > 0x20 && c != DIRENTRY_EMPTY && !(c >= 'a' && c <= 'z') && !strchr("\"*+,./:;<=>?[\\]|", c);
+}
+
+/**
+ * @brief Restores the first character of a deleted 8.3 name from the checksum in its long name entries.
+ * Every byte gives a different checksum, so there is exactly one candidate.
+ * @return 1 if it was restored, 0 if the candidate can't start a name (the entries belong to another one)
+ */
+static int undeleteFirstChar(DIRENTRY* directoryEntry, unsigned char checksum) {
+    unsigned int c;
+    for(c = 0; c < 256; c++) {
+        directoryEntry->name[0] = (unsigned char)c;
+        if(lfnChecksum(directoryEntry->name) == checksum) {
+            break;
+        }
+    }
+    if(c < 256 && undeleteShortNameChar((unsigned char)c)) {
+        return 1;
+    }
+    directoryEntry->name[0] = '_';
+    return 0;
+}
+
+/**
+ * @brief Queues a directory to be read
+ * @return 0 on success, -1 if out of memory
+ */
+static int undeletePush(UndeleteWalk* walk, PathNode* node, int deleted) {
+    if(!node) {
+        return -1;
+    }
+    if(walk->count == walk->capacity) {
+        unsigned int capacity = walk->capacity ? walk->capacity * 2 : 64;
+        UndeleteItem* stack = (UndeleteItem*)realloc(walk->stack, sizeof(UndeleteItem) * capacity);
+        if(!stack) {
+            return -1;
+        }
+        walk->stack = stack;
+        walk->capacity = capacity;
+    }
+    walk->stack[walk->count].node = node;
+    walk->stack[walk->count].deleted = deleted;
+    walk->count++;
+    return 0;
+}
+
+/**
+ * @return 1 if a directory cluster has not been queued yet, and marks it
+ */
+static int undeleteVisit(UndeleteWalk* walk, unsigned int cluster) {
+    if(cluster < 2 || cluster >= walk->volume->fat.count || (walk->visited[cluster / 8] & (1 << (cluster % 8)))) {
+        return 0;
+    }
+    walk->visited[cluster / 8] |= 1 << (cluster % 8);
+    return 1;
+}
+
+/**
+ * @return 1 if the free cluster of a deleted directory still starts with its '.' entry
+ */
+static int undeleteDirectoryIntact(Volume* volume, unsigned int cluster) {
+    DIRENTRY first;
+    if(fatEntry(&volume->fat, cluster) != CLUSTER_FREE || imageRead(&volume->image, &first, sizeof(first), volumeClusterOffset(volume, cluster)) != 0) {
+        return 0;
+    }
+    return memcmp(first.name, ".       ", 8) == 0 && IS_DIR(first.attr);
+}
+
+int undeleteScan(Volume* volume, void (*found)(const DeletedEntry* entry, void* arg), void* arg) {
+    UndeleteWalk walk;
+    memset(&walk, 0, sizeof(walk));
+    walk.volume = volume;
+    walk.found = found;
+    walk.arg = arg;
+    walk.visited = (unsigned char*)calloc(volume->fat.count / 8 + 1, 1);
+
+    Arena arena = {0};
+    VolumeDir dir;
+    memset(&dir, 0, sizeof(dir));
+    dir.skip = VOLUME_SKIP_DOTS | VOLUME_SKIP_LABELS;
+    char* path = 0;
+    unsigned int pathSize = 0;
+    char name[LFN_UTF8_MAX];
+
+    int ret = walk.visited ? undeletePush(&walk, pathNodeCreate(&arena, 0, "", volume->geometry.rootCluster, 0), 0) : -1;
+    if(ret == 0) {
+        undeleteVisit(&walk, volume->geometry.rootCluster);
+    }
+    while(ret == 0 && walk.count > 0) {
+        UndeleteItem item = walk.stack[--walk.count];
+        if(item.node->length + 1 > pathSize) {
+            pathSize = (item.node->length + 1) * 2;
+            free(path);
+            path = (char*)malloc(pathSize);
+            if(!path) {
+                ret = -1;
+                break;
+            }
+        }
+        pathFormat(item.node, path);
+
+        // a deleted directory lost its chain, its first cluster is all there is
+        Extent run = {item.node->firstCluster, 1};
+        if(item.deleted) {
+            volumeDirOpenRuns(volume, &dir, &run, 1);
+        }else{
+            volumeDirOpen(volume, &dir, item.node->firstCluster);
+        }
+
+        const DIRENTRY* directoryEntry;
+        while(ret == 0 && (directoryEntry = volumeDirRead(&dir))) {
+            unsigned int position = dir.index - 1;
+            unsigned int firstCluster = fatFirstCluster(directoryEntry, volume->geometry.fatType);
+            int erased = directoryEntry->name[0] == DIRENTRY_EMPTY;
+            DeletedEntry entry;
+            memset(&entry, 0, sizeof(entry));
+            entry.directory = path;
+            entry.directoryLength = item.node->length;
+            entry.deletedDirectory = item.deleted;
+
+            if(!erased) {
+                // deleted long name entries in front of the live ones of this entry lost their 8.3 entry
+                unsigned int lfnStart = position;
+                while(lfnStart > 0 && dir.view[lfnStart - 1].attr == DIRENTRY_ATTR_VFAT && dir.view[lfnStart - 1].name[0] != DIRENTRY_EMPTY) {
+                    lfnStart--;
+                }
+                unsigned char checksum;
+                if(undeleteLongName(dir.view, lfnStart, &checksum, name)) {
+                    entry.name = name;
+                    entry.nameLength = strlen(name);
+                    entry.longName = 1;
+                    entry.status = UNDELETE_ORPHAN;
+                    found(&entry, arg);
+                }
+                if(!item.deleted) {
+                    if(IS_DIR(directoryEntry->attr) && undeleteVisit(&walk, firstCluster)) {
+                        ret = undeletePush(&walk, pathNodeCreate(&arena, item.node, dir.name, firstCluster, dir.entryIndex), 0);
+                    }
+                    continue;
+                }
+            }
+
+            // everything in a deleted directory is gone, erased or not
+            entry.directoryEntry = *directoryEntry;
+            if(erased) {
+                unsigned char checksum;
+                unsigned int parts = undeleteLongName(dir.view, position, &checksum, name);
+                if(parts && undeleteFirstChar(&entry.directoryEntry, checksum)) {
+                    entry.longName = 1;
+                    entry.nameLength = strlen(name);
+                }else{
+                    if(parts) {
+                        // long name entries of some other entry
+                        entry.name = name;
+                        entry.nameLength = strlen(name);
+                        entry.longName = 1;
+                        entry.status = UNDELETE_ORPHAN;
+                        found(&entry, arg);
+                        entry.longName = 0;
+                    }
+                    entry.directoryEntry.name[0] = '_';
+                    entry.nameLength = volumeShortNameUtf8(&entry.directoryEntry, name);
+                }
+            }else{
+                memcpy(name, dir.name, dir.nameLength + 1);
+                entry.nameLength = dir.nameLength;
+                entry.longName = dir.longNameLength > 0;
+            }
+            entry.name = name;
+
+            entry.status = undeleteChain(volume, &entry.directoryEntry, &walk.runs);
+            if(entry.status < 0) {
+                ret = -1;
+                break;
+            }
+            entry.runs = walk.runs.extents;
+            entry.runCount = walk.runs.count;
+            found(&entry, arg);
+
+            if(IS_DIR(directoryEntry->attr) && !(directoryEntry->attr & DIRENTRY_ATTR_VOLUME) &&
+               undeleteDirectoryIntact(volume, firstCluster) && undeleteVisit(&walk, firstCluster)) {
+                ret = undeletePush(&walk, pathNodeCreate(&arena, item.node, name, firstCluster, dir.entryIndex), 1);
+            }
+        }
+    }
+
+    volumeDirClose(&dir);
+    extentListFree(&walk.runs);
+    free(walk.stack);
+    free(walk.visited);
+    free(path);
+    arenaFree(&arena);
+    return ret;
+}
@@ -0,0 +1,60 @@
+/*
+ * undelete.h
+ *
+ * Deleted files of a volume. Deleting a file on FAT overwrites the first
+ * byte of its 8.3 name and of its long name entries with 0xE5 and frees its
+ * chain, everything else stays until it is reused. The long name entries
+ * still carry the checksum of the 8.3 name, which gives back its first
+ * character; the content is guessed from the first cluster and the size,
+ * taking free clusters from the first one on. Deleted directories whose
+ * first cluster is still free are read as well.
+ */
+
+#ifndef __UNDELETE_H
+#define __UNDELETE_H
+
+#include <stddef.h>
+
+#include "data.h"
+#include "extent.h"
+#include "volume.h"
+
+#define UNDELETE_CONTIGUOUS     0   // the clusters the size needs are all free, from the first one on
+#define UNDELETE_GAPS           1   // clusters in use were passed over, or there are too few free ones
+#define UNDELETE_OVERWRITTEN    2   // the first cluster is in use again
+#define UNDELETE_EMPTY          3   // no data (size 0 or no first cluster)
+#define UNDELETE_ORPHAN         4   // long name entries whose 8.3 entry is gone
+
+typedef struct DeletedEntry_t {
+    const char* directory;          // absolute path of the directory holding the entry
+    size_t directoryLength;
+    const char* name;               // UTF-8, long name if there is one
+    size_t nameLength;
+    DIRENTRY directoryEntry;        // first character of the 8.3 name restored ('_' if unknown)
+    int longName;                   // 1 if the name came from long name entries
+    int deletedDirectory;           // 1 if the directory holding it is deleted itself
+    int status;                     // UNDELETE_*
+    const Extent* runs;             // probable clusters of the content, cut to the size
+    unsigned int runCount;
+} DeletedEntry;
+
+/**
+ * @brief Walks the whole tree, deleted directories included, and reports every deleted entry
+ * @param found called for each deleted file, directory and orphaned long name; the entry is valid during the call
+ * @return 0 on success, -1 if out of memory; directories that can't be read are passed over
+ */
+int undeleteScan(Volume* volume, void (*found)(const DeletedEntry* entry, void* arg), void* arg);
+
+/**
+ * @brief Works out the probable clusters of a deleted file
+ * @param runs cleared, receives the runs
+ * @return UNDELETE_CONTIGUOUS, UNDELETE_GAPS, UNDELETE_OVERWRITTEN or UNDELETE_EMPTY; -1 if out of memory
+ */
+int undeleteChain(const Volume* volume, const DIRENTRY* directoryEntry, ExtentList* runs);
+
+/**
+ * @return name of an UNDELETE_* status
+ */
+const char* undeleteStatusName(int status);
+
+#endif
@@ -0,0 +1,501 @@
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+
+#include "counters.h"
+#include "volume.h"
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define VOLUME_X86_SIMD
+#include <immintrin.h>
+#endif
+
+/**
+ * @brief Reads the boot sector (and FSInfo) of an image opened read only or writable
+ * @param length of the volume in the image, 0 for all of the image from offset on
+ */
+static int volumeOpenMode(Volume* volume, const char* filename, int writable, unsigned long long offset, unsigned long long length) {
+    memset(volume, 0, sizeof(Volume));
+    if((writable ? imageOpenWritable(&volume->image, filename) : imageOpen(&volume->image, filename)) != 0) {
+        return VOLUME_ERROR_OPEN;
+    }
+
+    // a partition is a volume of its own, with offsets from its start
+    if(length == 0 && offset < volume->image.size) {
+        length = volume->image.size - offset;
+    }
+    int ret = 0;
+    if((offset || length != volume->image.size) && imageRestrict(&volume->image, offset, length) != 0) {
+        ret = VOLUME_ERROR_READ;
+    }else if(imageRead(&volume->image, &volume->bootsector, sizeof(BOOTSECTOR), 0) != 0) {
+        ret = VOLUME_ERROR_READ;
+    }else if(fatGeometry(&volume->bootsector, &volume->geometry) != 0) {
+        ret = VOLUME_ERROR_FORMAT;
+    }
+    if(ret != 0) {
+        int error = errno;
+        imageClose(&volume->image);
+        errno = error;
+        return ret;
+    }
+
+    // FAT32 keeps the free cluster count in the FSInfo sector
+    const BOOTSECTOR* bootsector = &volume->bootsector;
+    volume->hasFsinfo = volume->geometry.fatType == 32 && bootsector->EBPB32.fsinfosector != 0 &&
+        imageRead(&volume->image, &volume->fsinfo, sizeof(FSINFO), (unsigned long long)bootsector->EBPB32.fsinfosector * volume->geometry.sectorSize) == 0 &&
+        volume->fsinfo.leadsignature == FSINFO_LEADSIGNATURE && volume->fsinfo.structsignature == FSINFO_STRUCTSIGNATURE;
+    return 0;
+}
+
+int volumeOpen(Volume* volume, const char* filename) {
+    return volumeOpenMode(volume, filename, 0, 0, 0);
+}
+
+int volumeOpenWritable(Volume* volume, const char* filename) {
+    return volumeOpenMode(volume, filename, 1, 0, 0);
+}
+
+int volumeOpenPartition(Volume* volume, const char* filename, unsigned long long offset, unsigned long long length, int writable) {
+    return volumeOpenMode(volume, filename, writable, offset, length);
+}
+
+int volumeLoad(Volume* volume) {
+    if(fatLoad(&volume->fat, &volume->image, &volume->geometry) != 0) {
+        return VOLUME_ERROR_READ;
+    }
+    if(extentIndexBuild(&volume->extents, &volume->fat) != 0) {
+        return VOLUME_ERROR_MEMORY;
+    }
+    return 0;
+}
+
+void volumeClose(Volume* volume) {
+    extentIndexFree(&volume->extents);
+    fatFree(&volume->fat);
+    imageClose(&volume->image);
+}
+
+unsigned int volumeChain(const Volume* volume, unsigned int firstCluster, const Extent** runs, ExtentList* scratch) {
+    if(firstCluster == 0) {
+        firstCluster = volume->geometry.rootCluster;
+    }
+    return extentChain(&volume->extents, &volume->fat, firstCluster, runs, scratch);
+}
+
+long long volumeReadFile(Volume* volume, const DIRENTRY* directoryEntry, unsigned long long offset, void* buf, size_t length) {
+    unsigned long long size = directoryEntry->size;
+    unsigned int firstCluster = fatFirstCluster(directoryEntry, volume->geometry.fatType);
+    if(offset >= size || firstCluster < 2) {
+        return 0;
+    }
+    if(length > size - offset) {
+        length = (size_t)(size - offset);
+    }
+
+    ExtentList scratch = {0, 0, 0};
+    const Extent* runs;
+    unsigned int runCount = volumeChain(volume, firstCluster, &runs, &scratch);
+
+    // a chain that is too short for the size ends the file early
+    unsigned long long runStart = 0;
+    size_t done = 0;
+    unsigned int run;
+    for(run = 0; run < runCount && done < length; run++) {
+        unsigned long long runSize = (unsigned long long)runs[run].length * volume->geometry.clusterSize;
+        if(offset + done < runStart + runSize) {
+            unsigned long long within = offset + done - runStart;
+            size_t chunk = runSize - within < length - done ? (size_t)(runSize - within) : length - done;
+            if(imageRead(&volume->image, (char*)buf + done, chunk, volumeClusterOffset(volume, runs[run].start) + within) != 0) {
+                int error = errno;
+                extentListFree(&scratch);
+                errno = error;
+                return -1;
+            }
+            done += chunk;
+        }
+        runStart += runSize;
+    }
+    extentListFree(&scratch);
+    return (long long)done;
+}
+
+/**
+ * @brief Rewinds an iterator to the first run of a directory
+ */
+static void volumeDirReset(Volume* volume, VolumeDir* dir) {
+    dir->volume = volume;
+    dir->run = 0;
+    dir->view = 0;
+    dir->viewCount = 0;
+    dir->index = 0;
+    dir->entryIndex = 0;
+    dir->consumed = 0;
+    dir->error = 0;
+    dir->group = ~0u;
+    dir->name[0] = '\0';
+    dir->nameLength = 0;
+    dir->longNameLength = 0;
+    lfnReset(&dir->lfn);
+}
+
+void volumeDirOpen(Volume* volume, VolumeDir* dir, unsigned int firstCluster) {
+    volumeDirReset(volume, dir);
+
+    // the FAT12/16 root directory is a fixed region, everything else is read run by run
+    if(firstCluster == 0 && volume->geometry.fatType != 32) {
+        dir->rootRun.start = 0;
+        dir->rootRun.length = 1;
+        dir->runs = &dir->rootRun;
+        dir->runCount = 1;
+    }else{
+        dir->runCount = volumeChain(volume, firstCluster, &dir->runs, &dir->chain);
+    }
+
+    // the first run is needed right away, the others while it is decoded
+    if(dir->readAhead) {
+        unsigned int run;
+        for(run = 1; run < dir->runCount; run++) {
+            readAheadStart(dir->readAhead, volumeClusterOffset(volume, dir->runs[run].start), dir->runs[run].length * volume->geometry.clusterSize);
+        }
+    }
+}
+
+void volumeDirOpenRuns(Volume* volume, VolumeDir* dir, const Extent* runs, unsigned int runCount) {
+    volumeDirReset(volume, dir);
+    dir->runs = runs;
+    dir->runCount = runCount;
+}
+
+void volumeDirPrefetch(Volume* volume, ReadAhead* readAhead, unsigned int firstCluster) {
+    if(firstCluster == 0 && volume->geometry.fatType != 32) {
+        readAheadStart(readAhead, volume->geometry.rootOffset, volume->geometry.rootSize);
+        return;
+    }
+    ExtentList scratch = {0, 0, 0};
+    const Extent* runs;
+    unsigned int runCount = volumeChain(volume, firstCluster, &runs, &scratch);
+    unsigned int run;
+    for(run = 0; run < runCount; run++) {
+        readAheadStart(readAhead, volumeClusterOffset(volume, runs[run].start), runs[run].length * volume->geometry.clusterSize);
+    }
+    extentListFree(&scratch);
+}
+
+/**
+ * @brief Makes the next run of the directory the current one
+ * @return 1 on success, 0 if there is none or it could not be read
+ */
+static int volumeDirNextRun(VolumeDir* dir) {
+    if(dir->run >= dir->runCount) {
+        return 0;
+    }
+    const Volume* volume = dir->volume;
+    const Extent* run = &dir->runs[dir->run++];
+    unsigned int length = dir->runs == &dir->rootRun ? volume->geometry.rootSize : run->length * volume->geometry.clusterSize;
+    unsigned long long offset = volumeClusterOffset(volume, run->start);
+
+    // a run read ahead comes in a buffer of its own, swapped for the scratch buffer
+    dir->view = dir->readAhead ? (const DIRENTRY*)readAheadTake(dir->readAhead, offset, length, &dir->scratch, &dir->scratchSize) : 0;
+    if(!dir->view) {
+        if(!volume->image.map && length > dir->scratchSize) {
+            char* scratch = (char*)realloc(dir->scratch, length);
+            if(!scratch) {
+                dir->error = 1;
+                errno = ENOMEM;
+                return 0;
+            }
+            dir->scratch = scratch;
+            dir->scratchSize = length;
+        }
+
+        // one view on the whole run, do not read past its last cluster
+        dir->view = (const DIRENTRY*)imageView(&dir->volume->image, offset, length, dir->scratch);
+        if(!dir->view) {
+            dir->error = 1;
+            return 0;
+        }
+    }
+    COUNT(COUNTER_DIRECTORY_RUNS, 1);
+    dir->viewCount = length / sizeof(DIRENTRY);
+    dir->index = 0;
+    dir->group = ~0u;
+    return 1;
+}
+
+/**
+ * @brief Classifies entries first to count-1 one by one, for the tails of the SIMD kernel
+ */
+static void volumeDirClassifyScalar(const DIRENTRY* entries, unsigned int first, unsigned int count, VolumeDirClasses* classes) {
+    unsigned int i;
+    for(i = first; i < count; i++) {
+        const DIRENTRY* directoryEntry = &entries[i];
+        unsigned long long bit = 1ull << i;
+        unsigned char attr = directoryEntry->attr;
+        if(directoryEntry->name[0] == '\0') {
+            classes->end |= bit;
+        }
+        if(directoryEntry->name[0] == DIRENTRY_EMPTY) {
+            classes->deleted |= bit;
+        }
+        if(attr == DIRENTRY_ATTR_VFAT) {
+            classes->vfat |= bit;
+            continue;
+        }
+        if(attr & DIRENTRY_ATTR_DIR) {
+            classes->directory |= bit;
+        }
+        if(attr & DIRENTRY_ATTR_VOLUME) {
+            classes->label |= bit;
+        }
+        if(memcmp(directoryEntry->name, ".       ", 8) == 0 || memcmp(directoryEntry->name, "..      ", 8) == 0) {
+            classes->dots |= bit;
+        }
+    }
+}
+
+#ifdef VOLUME_X86_SIMD
+
+/**
+ * @brief Classifies 64 entries, 8 per step: the first 12 bytes of each entry are
+ * gathered as three dwords, the first byte of the name and the attributes compared in place
+ */
+__attribute__((target("avx2")))
+static void volumeDirClassifyAVX2(const DIRENTRY* entries, unsigned int count, VolumeDirClasses* classes) {
+    const __m256i stride = _mm256_setr_epi32(0, 32, 64, 96, 128, 160, 192, 224);
+    const __m256i byte = _mm256_set1_epi32(0xFF);
+    const __m256i zero = _mm256_setzero_si256();
+    const __m256i empty = _mm256_set1_epi32(DIRENTRY_EMPTY);
+    const __m256i vfat = _mm256_set1_epi32(DIRENTRY_ATTR_VFAT);
+    const __m256i dirBit = _mm256_set1_epi32(DIRENTRY_ATTR_DIR);
+    const __m256i volumeBit = _mm256_set1_epi32(DIRENTRY_ATTR_VOLUME);
+    const __m256i dot = _mm256_set1_epi32(0x2020202E);         // ".   " little endian
+    const __m256i dotdot = _mm256_set1_epi32(0x20202E2E);      // "..  "
+    const __m256i spaces = _mm256_set1_epi32(0x20202020);
+
+    unsigned int i;
+    for(i = 0; i + 8 <= count; i += 8) {
+        const int* base = (const int*)&entries[i];
+        __m256i name0 = _mm256_i32gather_epi32(base, stride, 1);
+        __m256i name4 = _mm256_i32gather_epi32(base + 1, stride, 1);
+        __m256i attr = _mm256_srli_epi32(_mm256_i32gather_epi32(base + 2, stride, 1), 24);
+
+        __m256i first = _mm256_and_si256(name0, byte);
+        __m256i isVfat = _mm256_cmpeq_epi32(attr, vfat);
+        __m256i isDir = _mm256_andnot_si256(isVfat, _mm256_cmpeq_epi32(_mm256_and_si256(attr, dirBit), dirBit));
+        __m256i isLabel = _mm256_andnot_si256(isVfat, _mm256_cmpeq_epi32(_mm256_and_si256(attr, volumeBit), volumeBit));
+        __m256i isDots = _mm256_andnot_si256(isVfat, _mm256_and_si256(_mm256_cmpeq_epi32(name4, spaces),
+                                                                       _mm256_or_si256(_mm256_cmpeq_epi32(name0, dot), _mm256_cmpeq_epi32(name0, dotdot))));
+
+        classes->end |= (unsigned long long)_mm256_movemask_ps(_mm256_castsi256_ps(_mm256_cmpeq_epi32(first, zero))) << i;
+        classes->deleted |= (unsigned long long)_mm256_movemask_ps(_mm256_castsi256_ps(_mm256_cmpeq_epi32(first, empty))) << i;
+        classes->vfat |= (unsigned long long)_mm256_movemask_ps(_mm256_castsi256_ps(isVfat)) << i;
+        classes->directory |= (unsigned long long)_mm256_movemask_ps(_mm256_castsi256_ps(isDir)) << i;
+        classes->label |= (unsigned long long)_mm256_movemask_ps(_mm256_castsi256_ps(isLabel)) << i;
+        classes->dots |= (unsigned long long)_mm256_movemask_ps(_mm256_castsi256_ps(isDots)) << i;
+    }
+    volumeDirClassifyScalar(entries, i, count, classes);
+}
+
+#endif
+
+void volumeDirClassify(const DIRENTRY* entries, unsigned int count, VolumeDirClasses* classes) {
+    memset(classes, 0, sizeof(VolumeDirClasses));
+#ifdef VOLUME_X86_SIMD
+    if(__builtin_cpu_supports("avx2")) {
+        volumeDirClassifyAVX2(entries, count, classes);
+        return;
+    }
+#endif
+    volumeDirClassifyScalar(entries, 0, count, classes);
+}
+
+/**
+ * @brief Classifies the group of 64 entries holding the next entry and works out which ones are wanted:
+ * those not skipped, the end marker, and the LFN entries right in front of a wanted one
+ */
+static void volumeDirClassifyGroup(VolumeDir* dir) {
+    unsigned int group = dir->index & ~63u;
+    unsigned int count = dir->viewCount - group < 64 ? dir->viewCount - group : 64;
+    VolumeDirClasses* classes = &dir->classes;
+    volumeDirClassify(&dir->view[group], count, classes);
+    dir->group = group;
+
+    unsigned long long skipped = classes->vfat;
+    if(dir->skip & VOLUME_SKIP_DELETED) {
+        skipped |= classes->deleted;
+    }
+    if(dir->skip & VOLUME_SKIP_DOTS) {
+        skipped |= classes->dots;
+    }
+    if(dir->skip & VOLUME_SKIP_LABELS) {
+        skipped |= classes->label;
+    }
+    if(dir->skip & VOLUME_SKIP_FILES) {
+        skipped |= ~(classes->directory | classes->label);
+    }
+    if(dir->skip & VOLUME_SKIP_DIRECTORIES) {
+        skipped |= classes->directory & ~classes->label;
+    }
+    unsigned long long valid = count == 64 ? ~0ull : (1ull << count) - 1;
+    unsigned long long wanted = ~skipped & valid;
+
+    // the long name of a wanted entry goes backwards from it; one at the top may belong to the next group
+    unsigned long long names = ((wanted >> 1) | (1ull << (count - 1))) & classes->vfat;
+    unsigned long long frontier = names;
+    while(frontier) {
+        frontier = (frontier >> 1) & classes->vfat & ~names;
+        names |= frontier;
+    }
+    dir->wanted = wanted | names | classes->end;
+}
+
+const DIRENTRY* volumeDirRead(VolumeDir* dir) {
+    for(;;) {
+        if(dir->index >= dir->viewCount && !volumeDirNextRun(dir)) {
+            return 0;
+        }
+        if(dir->skip) {
+            // go straight to the next entry that matters
+            if((dir->index & ~63u) != dir->group) {
+                volumeDirClassifyGroup(dir);
+            }
+            unsigned long long rest = dir->wanted & (~0ull << (dir->index & 63));
+            unsigned int next = rest ? dir->group + __builtin_ctzll(rest) : dir->group + 64;
+            if(next > dir->viewCount) {
+                next = dir->viewCount;
+            }
+            if(next != dir->index) {
+                // a long name doesn't carry over entries that were passed over
+                lfnReset(&dir->lfn);
+                dir->consumed += next - dir->index;
+                dir->index = next;
+                continue;
+            }
+        }
+        const DIRENTRY* directoryEntry = &dir->view[dir->index++];
+        if(directoryEntry->name[0] == '\0') {
+            // end of directory marker, nothing after it counts
+            dir->run = dir->runCount;
+            dir->viewCount = 0;
+            return 0;
+        }
+        COUNT(COUNTER_ENTRIES, 1);
+        dir->entryIndex = dir->consumed++;
+
+        if(directoryEntry->attr == DIRENTRY_ATTR_VFAT) {
+            // a part of the long name of an 8.3 entry further down, it may continue into the next run
+            lfnFeed(&dir->lfn, (const DIRENTRY_V*)directoryEntry);
+            continue;
+        }
+        dir->longNameLength = lfnFinish(&dir->lfn, directoryEntry, dir->name);
+        dir->nameLength = dir->longNameLength ? dir->longNameLength : volumeShortNameUtf8(directoryEntry, dir->name);
+        return directoryEntry;
+    }
+}
+
+void volumeDirClose(VolumeDir* dir) {
+    extentListFree(&dir->chain);
+    free(dir->scratch);
+    dir->scratch = 0;
+    dir->scratchSize = 0;
+}
+
+int volumeFind(Volume* volume, unsigned int directoryCluster, int (*match)(const DIRENTRY*, const char*, const void*), const void* arg, DIRENTRY* found, char* name) {
+    // own iterator, the caller may be in the middle of reading the same directory
+    VolumeDir dir;
+    memset(&dir, 0, sizeof(dir));
+    volumeDirOpen(volume, &dir, directoryCluster);
+
+    int ret = 0;
+    const DIRENTRY* directoryEntry;
+    while((directoryEntry = volumeDirRead(&dir))) {
+        if(match(directoryEntry, dir.name, arg)) {
+            *found = *directoryEntry;
+            if(name) {
+                memcpy(name, dir.name, dir.nameLength + 1);
+            }
+            ret = 1;
+            break;
+        }
+    }
+    volumeDirClose(&dir);
+    return ret;
+}
+
+/**
+ * @brief Matches a file or directory by its long or 8.3 name, ignoring the case of ASCII letters
+ * @param arg the name like 'file.ext'
+ */
+static int matchName(const DIRENTRY* directoryEntry, const char* name, const void* arg) {
+    if((directoryEntry->attr & DIRENTRY_ATTR_VOLUME) || directoryEntry->name[0] == 0xE5) {
+        return 0;
+    }
+    if(strcasecmp(name, (const char*)arg) == 0) {
+        return 1;
+    }
+    char shortName[14];
+    volumeShortName(directoryEntry, shortName);
+    return strcasecmp(shortName, (const char*)arg) == 0;
+}
+
+int volumeLookup(Volume* volume, const char* path, DIRENTRY* found, char* name) {
+    memset(found, 0, sizeof(DIRENTRY));
+    found->attr = DIRENTRY_ATTR_DIR;
+    name[0] = '\0';
+
+    while(*path) {
+        while(*path == '\\' || *path == '/') {
+            path++;
+        }
+        size_t length = strcspn(path, "\\/");
+        if(length == 0) {
+            break;
+        }
+        if(length >= LFN_UTF8_MAX || !IS_DIR(found->attr)) {
+            return 0;
+        }
+
+        char component[LFN_UTF8_MAX];
+        memcpy(component, path, length);
+        component[length] = '\0';
+        path += length;
+
+        // cluster 0 is the root directory
+        if(!volumeFind(volume, fatFirstCluster(found, volume->geometry.fatType), matchName, component, found, name)) {
+            return 0;
+        }
+    }
+    return 1;
+}
+
+void volumeShortName(const DIRENTRY* directoryEntry, char* buf) {
+    strncpy(buf, (const char*)directoryEntry->name, 8);
+
+    if(directoryEntry->ext[0] != ' '){
+
+        // find end of file name
+        unsigned short i = 7;
+        while(i > 0 && buf[i] == 0x20) { --i; }
+
+        // append '.' and file extension
+        buf[i+1] = '.';
+        strncpy(&buf[i+2], (const char*)directoryEntry->ext, 3);
+        buf[i+5] = '\0';
+    }else{
+        // terminate as early as possible
+        unsigned short i;
+        for(i = 1; i < 8 && buf[i] != 0x20; i++) ;
+        buf[i] = '\0';
+    }
+}
+
+size_t volumeShortNameUtf8(const DIRENTRY* directoryEntry, char* buf) {
+    char name[14];
+    volumeShortName(directoryEntry, name);
+    // 0x05 stands for a name starting with 0xE5, which marks deleted entries
+    if(name[0] == 0x05) {
+        name[0] = (char)0xE5;
+    }
+    return oemToUtf8(name, strlen(name), buf);
+}
@@ -0,0 +1,222 @@
+/*
+ * volume.h
+ *
+ * A FAT volume as a library: everything that belongs to one image lives in
+ * a Volume, so several volumes can be open at once and used from several
+ * threads. Nothing here prints or exits; errors come back as return values
+ * with errno set where the system gave one.
+ *
+ * Directories are read with an iterator that hands out views on the
+ * directory entries in place (in the mapping, or in the iterator's own
+ * buffer if the image is not mapped), together with the decoded long name.
+ */
+
+#ifndef __VOLUME_H
+#define __VOLUME_H
+
+#include <stddef.h>
+
+#include "data.h"
+#include "extent.h"
+#include "fat.h"
+#include "image.h"
+#include "lfn.h"
+#include "readahead.h"
+
+#define VOLUME_ERROR_OPEN   -1  // the image can't be opened
+#define VOLUME_ERROR_READ   -2  // the boot sector or the FAT can't be read
+#define VOLUME_ERROR_FORMAT -3  // the boot sector doesn't describe a FAT volume
+#define VOLUME_ERROR_MEMORY -4
+
+// kinds of entries the directory iterator passes over (VolumeDir.skip)
+#define VOLUME_SKIP_DELETED     0x01
+#define VOLUME_SKIP_DOTS        0x02    // '.' and '..'
+#define VOLUME_SKIP_LABELS      0x04    // volume labels
+#define VOLUME_SKIP_FILES       0x08    // everything but directories and volume labels
+#define VOLUME_SKIP_DIRECTORIES 0x10
+
+typedef struct Volume_t {
+    Image image;
+    BOOTSECTOR bootsector;
+    FSINFO fsinfo;
+    int hasFsinfo;              // FAT32 with a valid FSInfo sector
+    FatGeometry geometry;
+    FatTable fat;               // filled by volumeLoad, or from a snapshot
+    ExtentIndex extents;
+} Volume;
+
+/**
+ * @brief Kinds of up to 64 consecutive directory entries, one bit per entry
+ */
+typedef struct VolumeDirClasses_t {
+    unsigned long long end;         // end of directory marker (name starts with 0)
+    unsigned long long deleted;     // name starts with 0xE5
+    unsigned long long vfat;        // part of a long name
+    unsigned long long directory;   // directory bit, not VFAT
+    unsigned long long label;       // volume bit, not VFAT
+    unsigned long long dots;        // '.' and '..'
+} VolumeDirClasses;
+
+/**
+ * @brief Iterator over the entries of a directory
+ */
+typedef struct VolumeDir_t {
+    Volume* volume;
+    const Extent* runs;         // of the directory's chain
+    unsigned int runCount;
+    unsigned int run;           // being read
+    Extent rootRun;             // FAT12/16 root directory region
+    ExtentList chain;           // for chains that are not in the extent index
+    const DIRENTRY* view;       // entries of the current run
+    unsigned int viewCount;
+    char* scratch;              // unmapped images: the current run is read here
+    unsigned int scratchSize;
+    LfnState lfn;
+    ReadAhead* readAhead;       // set by the caller to take runs read ahead, 0 for none
+    unsigned int skip;          // set by the caller, VOLUME_SKIP_* of entries not to return
+    VolumeDirClasses classes;   // of the group of 64 entries of the current run being read
+    unsigned long long wanted;  // entries of the group to be looked at
+    unsigned int group;         // index of the group's first entry, ~0 if none is classified yet
+
+    unsigned int index;         // of the next entry in the current run
+    unsigned int consumed;      // entries of the directory read so far, LFN entries included
+    unsigned int entryIndex;    // of the entry last returned, counted from the start of the directory
+    int error;                  // a run could not be read, errno is set
+    char name[LFN_UTF8_MAX];    // long name of the entry last returned, 8.3 name if there is none (UTF-8)
+    size_t nameLength;
+    size_t longNameLength;      // 0 if the entry has no long name
+} VolumeDir;
+
+/**
+ * @brief Opens an image, reads the boot sector (and FSInfo) and derives the geometry
+ * @return 0 on success, VOLUME_ERROR_* otherwise; nothing is left open on error
+ */
+int volumeOpen(Volume* volume, const char* filename);
+
+/**
+ * @brief Opens an image for reading and writing, like volumeOpen; see writer.h for the changes
+ * @return 0 on success, VOLUME_ERROR_* otherwise (VOLUME_ERROR_OPEN with errno EROFS for a compressed image)
+ */
+int volumeOpenWritable(Volume* volume, const char* filename);
+
+/**
+ * @brief Opens the volume in a partition of a disk image, like volumeOpen; offsets are relative to the partition from then on
+ * @param offset of the partition in the image, see partition.h
+ * @param length of the partition, 0 for the rest of the image
+ * @param writable opens it like volumeOpenWritable
+ * @return 0 on success, VOLUME_ERROR_* otherwise (VOLUME_ERROR_READ with errno EINVAL if the partition is outside the image)
+ */
+int volumeOpenPartition(Volume* volume, const char* filename, unsigned long long offset, unsigned long long length, int writable);
+
+/**
+ * @brief Decodes the FAT and builds the extent index
+ * @return 0 on success, VOLUME_ERROR_READ or VOLUME_ERROR_MEMORY
+ */
+int volumeLoad(Volume* volume);
+
+void volumeClose(Volume* volume);
+
+/**
+ * @brief Follows a chain by one hop
+ * @return next cluster, FAT_CLUSTER_LAST if cluster is outside the table
+ */
+static inline unsigned int volumeNext(const Volume* volume, unsigned int cluster) {
+    return fatNext(&volume->fat, cluster);
+}
+
+/**
+ * @return image offset of a data cluster, cluster 0 is the root directory
+ */
+static inline unsigned long long volumeClusterOffset(const Volume* volume, unsigned int cluster) {
+    return fatClusterOffset(&volume->geometry, cluster);
+}
+
+/**
+ * @brief Returns the runs of contiguous clusters of a chain
+ * @param firstCluster 0 for the root directory chain (FAT32)
+ * @param runs receives a pointer to the first run, valid until scratch changes
+ * @param scratch for chains that are not in the extent index
+ * @return number of runs, 0 if firstCluster is not a data cluster
+ */
+unsigned int volumeChain(const Volume* volume, unsigned int firstCluster, const Extent** runs, ExtentList* scratch);
+
+/**
+ * @brief Reads from a file
+ * @param offset into the file
+ * @return number of bytes read, less than length at the end of the file; -1 on error (errno is set)
+ */
+long long volumeReadFile(Volume* volume, const DIRENTRY* directoryEntry, unsigned long long offset, void* buf, size_t length);
+
+/**
+ * @brief Starts reading a directory, its runs after the first one are read ahead if dir->readAhead is set
+ * @param dir zeroed before its first use; buffers are kept across opens until volumeDirClose
+ * @param firstCluster of the directory, 0 for the root directory
+ */
+void volumeDirOpen(Volume* volume, VolumeDir* dir, unsigned int firstCluster);
+
+/**
+ * @brief Starts reading a directory that is not where its chain says, e.g. a deleted one
+ * @param runs clusters of the directory, they have to stay valid while it is read
+ */
+void volumeDirOpenRuns(Volume* volume, VolumeDir* dir, const Extent* runs, unsigned int runCount);
+
+/**
+ * @brief Starts reading the runs of a directory that will be listed soon
+ * @param firstCluster of the directory, 0 for the root directory
+ */
+void volumeDirPrefetch(Volume* volume, ReadAhead* readAhead, unsigned int firstCluster);
+
+/**
+ * @brief Returns the next entry of the directory. LFN entries are not returned,
+ * their name is in dir->name; deleted entries, '.', '..' and volume labels are
+ * unless dir->skip says otherwise. With skip set the entries are classified
+ * 64 at a time and the skipped ones are not looked at one by one.
+ * @return view on the entry, valid until the next call; 0 at the end of the
+ * directory or on a read error (dir->error)
+ */
+const DIRENTRY* volumeDirRead(VolumeDir* dir);
+
+/**
+ * @brief Classifies consecutive directory entries
+ * @param count number of entries, at most 64; the bits above count are 0
+ */
+void volumeDirClassify(const DIRENTRY* entries, unsigned int count, VolumeDirClasses* classes);
+
+/**
+ * @brief Releases the buffers of an iterator
+ */
+void volumeDirClose(VolumeDir* dir);
+
+/**
+ * @brief Finds an entry in a directory
+ * @param directoryCluster first cluster of the directory, 0 for the root directory
+ * @param match returns 1 for the wanted entry, gets its long name (8.3 name if there is none)
+ * @param found receives a copy of the matching entry
+ * @param name receives the name of the matching entry, a buffer >= LFN_UTF8_MAX bytes or 0
+ * @return 1 if an entry was found, 0 otherwise
+ */
+int volumeFind(Volume* volume, unsigned int directoryCluster, int (*match)(const DIRENTRY*, const char*, const void*), const void* arg, DIRENTRY* found, char* name);
+
+/**
+ * @brief Looks up an absolute path like '\DIR\FILE.TXT', '/' separates as well.
+ * Components match long or 8.3 names, ignoring the case of ASCII letters.
+ * @param found receives the entry, for the root directory a directory entry with first cluster 0
+ * @param name receives the name of the last component, a buffer >= LFN_UTF8_MAX bytes
+ * @return 1 if the path exists, 0 otherwise
+ */
+int volumeLookup(Volume* volume, const char* path, DIRENTRY* found, char* name);
+
+/**
+ * @brief Formats the 8.3 name of an entry like 'file.ext', in the OEM code page
+ * @param buf is a buffer >= 13 bytes
+ */
+void volumeShortName(const DIRENTRY* directoryEntry, char* buf);
+
+/**
+ * @brief Formats the 8.3 name of an entry like 'file.ext' in UTF-8
+ * @param buf is a buffer >= 37 bytes
+ * @return length of the name
+ */
+size_t volumeShortNameUtf8(const DIRENTRY* directoryEntry, char* buf);
+
+#endif
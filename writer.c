@@ -0,0 +1,817 @@
+#define _FILE_OFFSET_BITS 64
+
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <unistd.h>
+
+#include "writer.h"
+
+/**
+ * @brief A directory read into memory in one piece
+ */
+typedef struct WriterDir_t {
+    unsigned int cluster;       // first cluster, 0 for the root directory
+    ExtentList runs;            // its clusters, none for the FAT12/16 root directory region
+    DIRENTRY* entries;
+    unsigned int count;
+} WriterDir;
+
+/**
+ * @brief Converts a time to the DOS date and time of directory entries (local time, 1980 to 2107)
+ */
+static void writerDosTime(time_t modified, unsigned short* date, unsigned short* time) {
+    struct tm local;
+    if(!localtime_r(&modified, &local) || local.tm_year < 80) {
+        *date = (1 << 5) | 1;
+        *time = 0;
+        return;
+    }
+    if(local.tm_year > 207) {
+        *date = (127 << 9) | (12 << 5) | 31;
+        *time = (23 << 11) | (59 << 5) | 29;
+        return;
+    }
+    *date = ((local.tm_year - 80) << 9) | ((local.tm_mon + 1) << 5) | local.tm_mday;
+    *time = (local.tm_hour << 11) | (local.tm_min << 5) | (local.tm_sec / 2);
+}
+
+static void writerSetFirstCluster(DIRENTRY* directoryEntry, unsigned int cluster, unsigned char fatType) {
+    directoryEntry->firstcluser = cluster & 0xFFFF;
+    directoryEntry->EAindex = fatType == 32 ? cluster >> 16 : 0;
+}
+
+/**
+ * @brief Chains the clusters of runs in the FAT, in their order, the last one ends the chain
+ */
+static void writerLink(FatTable* fat, const ExtentList* runs) {
+    unsigned int run;
+    for(run = 0; run < runs->count; run++) {
+        const Extent* extent = &runs->extents[run];
+        unsigned int cluster;
+        for(cluster = extent->start; cluster + 1 < extent->start + extent->length; cluster++) {
+            fatSet(fat, cluster, cluster + 1);
+        }
+        fatSet(fat, cluster, run + 1 < runs->count ? runs->extents[run + 1].start : FAT_CLUSTER_LAST);
+    }
+}
+
+/**
+ * @brief Takes count clusters and chains them
+ * @param runs receives the clusters, empty on error
+ * @return 0 on success, -1 otherwise (errno is set)
+ */
+static int writerAllocate(Writer* writer, unsigned int count, unsigned int goal, ExtentList* runs) {
+    if(allocatorTake(&writer->allocator, count, goal, runs) != 0) {
+        int error = errno;
+        unsigned int run;
+        for(run = 0; run < runs->count; run++) {
+            allocatorRelease(&writer->allocator, &runs->extents[run]);
+        }
+        runs->count = 0;
+        errno = error;
+        return -1;
+    }
+    writerLink(&writer->volume->fat, runs);
+    return 0;
+}
+
+/**
+ * @brief Frees the clusters of runs in the FAT and hands them back to the allocator;
+ * clusters that are free already (a chain running into itself) are passed over
+ * @return 0 on success, -1 if out of memory
+ */
+static int writerReleaseRuns(Writer* writer, const ExtentList* runs) {
+    FatTable* fat = &writer->volume->fat;
+    int ret = 0;
+    unsigned int run;
+    for(run = 0; run < runs->count; run++) {
+        const Extent* extent = &runs->extents[run];
+        Extent freed = {0, 0};
+        unsigned int cluster;
+        for(cluster = extent->start; cluster <= extent->start + extent->length; cluster++) {
+            if(cluster < extent->start + extent->length && fatEntry(fat, cluster) != CLUSTER_FREE) {
+                fatSet(fat, cluster, CLUSTER_FREE);
+                if(freed.length == 0) {
+                    freed.start = cluster;
+                }
+                freed.length++;
+            }else if(freed.length > 0) {
+                if(allocatorRelease(&writer->allocator, &freed) != 0) {
+                    ret = -1;
+                }
+                freed.length = 0;
+            }
+        }
+    }
+    return ret;
+}
+
+/**
+ * @brief Frees a chain
+ * @return 0 on success, -1 if out of memory
+ */
+static int writerRelease(Writer* writer, unsigned int firstCluster) {
+    if(firstCluster < 2) {
+        return 0;
+    }
+    ExtentList runs = {0, 0, 0};
+    int ret = extentFollow(&writer->volume->fat, firstCluster, &runs) < 0 ? -1 : writerReleaseRuns(writer, &runs);
+    extentListFree(&runs);
+    if(ret != 0) {
+        errno = ENOMEM;
+    }
+    return ret;
+}
+
+/**
+ * @brief Writes zeros over the clusters of runs
+ * @return 0 on success, -1 otherwise (errno is set)
+ */
+static int writerZero(Writer* writer, const ExtentList* runs) {
+    Volume* volume = writer->volume;
+    memset(writer->buffer, 0, WRITER_BUFFER);
+    unsigned int run;
+    for(run = 0; run < runs->count; run++) {
+        unsigned long long offset = volumeClusterOffset(volume, runs->extents[run].start);
+        unsigned long long remaining = (unsigned long long)runs->extents[run].length * volume->geometry.clusterSize;
+        while(remaining > 0) {
+            size_t length = remaining < WRITER_BUFFER ? (size_t)remaining : WRITER_BUFFER;
+            if(imageWrite(&volume->image, writer->buffer, length, offset) != 0) {
+                return -1;
+            }
+            offset += length;
+            remaining -= length;
+        }
+    }
+    return 0;
+}
+
+/**
+ * @brief Copies size bytes of a file into the clusters of runs, one request per run and buffer
+ * @return 0 on success, -1 otherwise (errno is set, EIO if the file ends early)
+ */
+static int writerFill(Writer* writer, const ExtentList* runs, int fd, unsigned long long size) {
+    Volume* volume = writer->volume;
+    unsigned int run;
+    for(run = 0; run < runs->count && size > 0; run++) {
+        unsigned long long offset = volumeClusterOffset(volume, runs->extents[run].start);
+        unsigned long long runSize = (unsigned long long)runs->extents[run].length * volume->geometry.clusterSize;
+        unsigned long long remaining = runSize < size ? runSize : size;
+        size -= remaining;
+        while(remaining > 0) {
+            size_t length = remaining < WRITER_BUFFER ? (size_t)remaining : WRITER_BUFFER;
+            size_t done = 0;
+            while(done < length) {
+                ssize_t bytesRead = read(fd, writer->buffer + done, length - done);
+                if(bytesRead < 0 && errno == EINTR) {
+                    continue;
+                }
+                if(bytesRead <= 0) {
+                    if(bytesRead == 0) {
+                        errno = EIO;
+                    }
+                    return -1;
+                }
+                done += bytesRead;
+            }
+            if(imageWrite(&volume->image, writer->buffer, length, offset) != 0) {
+                return -1;
+            }
+            offset += length;
+            remaining -= length;
+        }
+    }
+    return 0;
+}
+
+/**
+ * @brief Reads a whole directory
+ * @param cluster first cluster, 0 for the root directory
+ * @return 0 on success, -1 otherwise (errno is set)
+ */
+static int writerDirLoad(Writer* writer, unsigned int cluster, WriterDir* dir) {
+    Volume* volume = writer->volume;
+    memset(dir, 0, sizeof(WriterDir));
+    dir->cluster = cluster;
+
+    size_t size;
+    if(cluster == 0 && volume->geometry.fatType != 32) {
+        size = volume->geometry.rootSize;
+    }else{
+        if(extentFollow(&volume->fat, cluster ? cluster : volume->geometry.rootCluster, &dir->runs) < 0) {
+            errno = ENOMEM;
+            return -1;
+        }
+        size = 0;
+        unsigned int run;
+        for(run = 0; run < dir->runs.count; run++) {
+            size += (size_t)dir->runs.extents[run].length * volume->geometry.clusterSize;
+        }
+        if(size == 0) {
+            extentListFree(&dir->runs);
+            errno = EIO;
+            return -1;
+        }
+    }
+
+    dir->entries = (DIRENTRY*)malloc(size);
+    if(!dir->entries) {
+        extentListFree(&dir->runs);
+        errno = ENOMEM;
+        return -1;
+    }
+    dir->count = size / sizeof(DIRENTRY);
+
+    int ret = 0;
+    if(dir->runs.count == 0) {
+        ret = imageRead(&volume->image, dir->entries, size, volume->geometry.rootOffset);
+    }else{
+        char* dst = (char*)dir->entries;
+        unsigned int run;
+        for(run = 0; run < dir->runs.count && ret == 0; run++) {
+            size_t length = (size_t)dir->runs.extents[run].length * volume->geometry.clusterSize;
+            ret = imageRead(&volume->image, dst, length, volumeClusterOffset(volume, dir->runs.extents[run].start));
+            dst += length;
+        }
+    }
+    if(ret != 0) {
+        int error = errno;
+        free(dir->entries);
+        extentListFree(&dir->runs);
+        errno = error;
+    }
+    return ret;
+}
+
+static void writerDirFree(WriterDir* dir) {
+    free(dir->entries);
+    extentListFree(&dir->runs);
+    dir->entries = 0;
+    dir->count = 0;
+}
+
+/**
+ * @brief Writes entries first to end - 1 of a directory back, one request per run
+ * @return 0 on success, -1 otherwise (errno is set)
+ */
+static int writerDirStore(Writer* writer, const WriterDir* dir, unsigned int first, unsigned int end) {
+    Volume* volume = writer->volume;
+    unsigned int perCluster = volume->geometry.clusterSize / sizeof(DIRENTRY);
+    unsigned int before = 0;    // entries in the runs so far
+    unsigned int run = 0;
+    while(first < end) {
+        unsigned long long offset;
+        unsigned int contiguous;
+        if(dir->runs.count == 0) {
+            offset = volume->geometry.rootOffset + (unsigned long long)first * sizeof(DIRENTRY);
+            contiguous = end - first;
+        }else{
+            while(first >= before + dir->runs.extents[run].length * perCluster) {
+                before += dir->runs.extents[run++].length * perCluster;
+            }
+            offset = volumeClusterOffset(volume, dir->runs.extents[run].start) + (unsigned long long)(first - before) * sizeof(DIRENTRY);
+            contiguous = before + dir->runs.extents[run].length * perCluster - first;
+        }
+        unsigned int count = end - first < contiguous ? end - first : contiguous;
+        if(imageWrite(&volume->image, &dir->entries[first], count * sizeof(DIRENTRY), offset) != 0) {
+            return -1;
+        }
+        first += count;
+    }
+    return 0;
+}
+
+/**
+ * @brief Finds an entry by its long or 8.3 name, ignoring the case of ASCII letters
+ * @param slot receives the index of the 8.3 entry
+ * @param first receives the index of its first long name entry, slot if it has none
+ * @return 1 if it was found, 0 otherwise
+ */
+static int writerDirFind(const WriterDir* dir, const char* name, unsigned int* slot, unsigned int* first) {
+    LfnState lfn;
+    lfnReset(&lfn);
+    char longName[LFN_UTF8_MAX];
+    unsigned int sequenceStart = 0;
+    unsigned int i;
+    for(i = 0; i < dir->count && dir->entries[i].name[0] != '\0'; i++) {
+        const DIRENTRY* directoryEntry = &dir->entries[i];
+        if(directoryEntry->attr == DIRENTRY_ATTR_VFAT) {
+            if(VFAT_SEQUENCE_END(directoryEntry->name[0]) && directoryEntry->name[0] != DIRENTRY_EMPTY) {
+                sequenceStart = i;
+            }
+            lfnFeed(&lfn, (const DIRENTRY_V*)directoryEntry);
+            continue;
+        }
+        size_t length = lfnFinish(&lfn, directoryEntry, longName);
+        if(directoryEntry->name[0] == DIRENTRY_EMPTY || (directoryEntry->attr & DIRENTRY_ATTR_VOLUME) || directoryEntry->name[0] == '.') {
+            continue;
+        }
+        char shortName[LFN_UTF8_MAX];
+        volumeShortNameUtf8(directoryEntry, shortName);
+        if((length > 0 && strcasecmp(longName, name) == 0) || strcasecmp(shortName, name) == 0) {
+            *slot = i;
+            *first = length > 0 ? sequenceStart : i;
+            return 1;
+        }
+    }
+    return 0;
+}
+
+/**
+ * @return 1 if an entry of the directory has the 8.3 name (11 bytes)
+ */
+static int writerShortNameTaken(const WriterDir* dir, const unsigned char* shortName) {
+    unsigned int i;
+    for(i = 0; i < dir->count && dir->entries[i].name[0] != '\0'; i++) {
+        const DIRENTRY* directoryEntry = &dir->entries[i];
+        if(directoryEntry->attr != DIRENTRY_ATTR_VFAT && directoryEntry->name[0] != DIRENTRY_EMPTY && memcmp(directoryEntry->name, shortName, 11) == 0) {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+/**
+ * @brief Makes the 8.3 name of a new entry unique with a numeric tail ('NAME~1', 'NAM~12', ...)
+ * @return 0 on success, -1 if all tails are taken
+ */
+static int writerUniqueShortName(const WriterDir* dir, unsigned char* shortName) {
+    unsigned int length = 8;
+    while(length > 1 && shortName[length - 1] == ' ') {
+        length--;
+    }
+    unsigned char candidate[11];
+    unsigned int number;
+    for(number = 1; number < 1000000; number++) {
+        char tail[8];
+        unsigned int tailLength = (unsigned int)snprintf(tail, sizeof(tail), "~%u", number);
+        unsigned int keep = length < 8 - tailLength ? length : 8 - tailLength;
+        memcpy(candidate, shortName, 11);
+        memset(&candidate[keep], ' ', 8 - keep);
+        memcpy(&candidate[keep], tail, tailLength);
+        if(!writerShortNameTaken(dir, candidate)) {
+            memcpy(shortName, candidate, 11);
+            return 0;
+        }
+    }
+    return -1;
+}
+
+/**
+ * @brief Appends clusters to a directory: zeroed on disk, chained behind its last cluster
+ * @return 0 on success, -1 otherwise (errno is set)
+ */
+static int writerDirGrow(Writer* writer, WriterDir* dir, unsigned int clusters) {
+    Volume* volume = writer->volume;
+    unsigned int perCluster = volume->geometry.clusterSize / sizeof(DIRENTRY);
+    const Extent* last = &dir->runs.extents[dir->runs.count - 1];
+    unsigned int lastCluster = last->start + last->length - 1;
+    DIRENTRY* entries = (DIRENTRY*)realloc(dir->entries, sizeof(DIRENTRY) * (dir->count + clusters * perCluster));
+    if(!entries) {
+        errno = ENOMEM;
+        return -1;
+    }
+    dir->entries = entries;
+
+    ExtentList runs = {0, 0, 0};
+    if(writerAllocate(writer, clusters, lastCluster + 1, &runs) != 0) {
+        extentListFree(&runs);
+        return -1;
+    }
+    // an empty directory cluster is all end markers
+    if(writerZero(writer, &runs) != 0) {
+        int error = errno;
+        writerReleaseRuns(writer, &runs);
+        extentListFree(&runs);
+        errno = error;
+        return -1;
+    }
+    fatSet(&volume->fat, lastCluster, runs.extents[0].start);
+
+    unsigned int run;
+    for(run = 0; run < runs.count; run++) {
+        unsigned int cluster;
+        for(cluster = runs.extents[run].start; cluster < runs.extents[run].start + runs.extents[run].length; cluster++) {
+            if(extentListAdd(&dir->runs, cluster) != 0) {
+                extentListFree(&runs);
+                errno = ENOMEM;
+                return -1;
+            }
+        }
+    }
+    extentListFree(&runs);
+    memset(&dir->entries[dir->count], 0, sizeof(DIRENTRY) * clusters * perCluster);
+    dir->count += clusters * perCluster;
+    return 0;
+}
+
+/**
+ * @brief Adds an entry to a directory under a name: an 8.3 name is derived and
+ * long name entries go in front of it unless the 8.3 name says it all. The
+ * directory grows by as many clusters as it needs.
+ * @param directoryEntry all but the name
+ * @return 0 on success, -1 otherwise (errno is set)
+ */
+static int writerDirAdd(Writer* writer, WriterDir* dir, const char* name, DIRENTRY* directoryEntry) {
+    unsigned short chars[LFN_MAX_CHARS];
+    int count = utf8ToUcs2(name, strlen(name), chars, LFN_MAX_CHARS);
+    if(count <= 0 || count > 255) {
+        errno = count > 255 || (count < 0 && strlen(name) > LFN_MAX_CHARS) ? ENAMETOOLONG : EINVAL;
+        return -1;
+    }
+    int i;
+    for(i = 0; i < count; i++) {
+        if(chars[i] < 0x20 || (chars[i] < 0x80 && strchr("\"*/:<>?\\|", chars[i]))) {
+            errno = EINVAL;
+            return -1;
+        }
+    }
+
+    unsigned char shortName[11];
+    if((lfnShortName(chars, count, shortName) || writerShortNameTaken(dir, shortName)) && writerUniqueShortName(dir, shortName) != 0) {
+        errno = EEXIST;
+        return -1;
+    }
+    memcpy(directoryEntry->name, shortName, 8);
+    memcpy(directoryEntry->ext, &shortName[8], 3);
+    char formatted[LFN_UTF8_MAX];
+    volumeShortNameUtf8(directoryEntry, formatted);
+    unsigned int lfnEntries = strcmp(formatted, name) != 0 ? (count + LFN_CHARS_PER_ENTRY - 1) / LFN_CHARS_PER_ENTRY : 0;
+    unsigned int needed = lfnEntries + 1;
+
+    // consecutive free entries: deleted ones, and all from the end marker on
+    unsigned int end = dir->count;
+    unsigned int start = 0;
+    unsigned int free = 0;
+    unsigned int slot;
+    for(slot = 0; slot < dir->count && free < needed; slot++) {
+        if(dir->entries[slot].name[0] == '\0' && end == dir->count) {
+            end = slot;
+        }
+        if(slot < end && dir->entries[slot].name[0] != DIRENTRY_EMPTY) {
+            free = 0;
+            continue;
+        }
+        if(free++ == 0) {
+            start = slot;
+        }
+    }
+    if(free < needed) {
+        // the free entries at the end go on into new clusters; the FAT12/16 root directory can't grow
+        unsigned int perCluster = writer->volume->geometry.clusterSize / sizeof(DIRENTRY);
+        unsigned int clusters = (needed - free + perCluster - 1) / perCluster;
+        if(dir->runs.count == 0 || dir->count + clusters * perCluster > WRITER_MAX_ENTRIES) {
+            errno = ENOSPC;
+            return -1;
+        }
+        if(free == 0) {
+            start = dir->count;
+        }
+        if(writerDirGrow(writer, dir, clusters) != 0) {
+            return -1;
+        }
+    }
+
+    // last part of the long name first, terminated by 0x0000 unless it fills the entry, padded with 0xFFFF
+    unsigned char checksum = lfnChecksum(shortName);
+    unsigned int part;
+    for(part = lfnEntries; part > 0; part--) {
+        DIRENTRY_V* lfnEntry = (DIRENTRY_V*)&dir->entries[start + lfnEntries - part];
+        memset(lfnEntry, 0, sizeof(DIRENTRY_V));
+        lfnEntry->sequence_number = part | (part == lfnEntries ? 0x40 : 0);
+        lfnEntry->attr = DIRENTRY_ATTR_VFAT;
+        lfnEntry->checksum = checksum;
+        unsigned short partChars[LFN_CHARS_PER_ENTRY];
+        unsigned int k;
+        for(k = 0; k < LFN_CHARS_PER_ENTRY; k++) {
+            int c = (part - 1) * LFN_CHARS_PER_ENTRY + k;
+            partChars[k] = c < count ? chars[c] : (c == count ? VFAT_END : 0xFFFF);
+        }
+        memcpy(lfnEntry->name_0, &partChars[0], sizeof(lfnEntry->name_0));
+        memcpy(lfnEntry->name_1, &partChars[5], sizeof(lfnEntry->name_1));
+        memcpy(lfnEntry->name_2, &partChars[11], sizeof(lfnEntry->name_2));
+    }
+    dir->entries[start + lfnEntries] = *directoryEntry;
+
+    // behind the end marker, the entry after the new ones has to end the directory
+    unsigned int storeEnd = start + needed;
+    if(start + needed > end && storeEnd < dir->count && dir->entries[storeEnd].name[0] != '\0') {
+        dir->entries[storeEnd].name[0] = '\0';
+        storeEnd++;
+    }
+    return writerDirStore(writer, dir, start, storeEnd);
+}
+
+/**
+ * @brief Splits a path into its directory, read into dir, and the last component
+ * @param name receives the last component, a buffer >= LFN_UTF8_MAX bytes
+ * @return 0 on success, -1 otherwise (errno is set)
+ */
+static int writerParent(Writer* writer, const char* path, WriterDir* dir, char* name) {
+    size_t length = strlen(path);
+    while(length > 0 && (path[length - 1] == '\\' || path[length - 1] == '/')) {
+        length--;
+    }
+    size_t start = length;
+    while(start > 0 && path[start - 1] != '\\' && path[start - 1] != '/') {
+        start--;
+    }
+    if(length - start >= LFN_UTF8_MAX) {
+        errno = ENAMETOOLONG;
+        return -1;
+    }
+    memcpy(name, &path[start], length - start);
+    name[length - start] = '\0';
+    if(name[0] == '\0' || strcmp(name, ".") == 0 || strcmp(name, "..") == 0) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    char parent[start + 1];
+    memcpy(parent, path, start);
+    parent[start] = '\0';
+    DIRENTRY found;
+    char parentName[LFN_UTF8_MAX];
+    if(!volumeLookup(writer->volume, parent, &found, parentName)) {
+        errno = ENOENT;
+        return -1;
+    }
+    if(!IS_DIR(found.attr)) {
+        errno = ENOTDIR;
+        return -1;
+    }
+    return writerDirLoad(writer, fatFirstCluster(&found, writer->volume->geometry.fatType), dir);
+}
+
+int writerOpen(Writer* writer, Volume* volume) {
+    memset(writer, 0, sizeof(Writer));
+    writer->volume = volume;
+    if(!volume->image.writable) {
+        errno = EBADF;
+        return -1;
+    }
+    if(!volume->fat.next && fatLoad(&volume->fat, &volume->image, &volume->geometry) != 0) {
+        return -1;
+    }
+    writer->buffer = (char*)malloc(WRITER_BUFFER);
+    if(!writer->buffer || fatWritable(&volume->fat) != 0 || allocatorInit(&writer->allocator, &volume->fat) != 0) {
+        free(writer->buffer);
+        writer->buffer = 0;
+        errno = ENOMEM;
+        return -1;
+    }
+    // chains change from now on, they are followed through the FAT
+    extentIndexFree(&volume->extents);
+    return 0;
+}
+
+int writerPut(Writer* writer, const char* path, int fd, unsigned long long size, time_t modified) {
+    if(size > WRITER_MAX_SIZE) {
+        errno = EFBIG;
+        return -1;
+    }
+    Volume* volume = writer->volume;
+    WriterDir dir;
+    char name[LFN_UTF8_MAX];
+    if(writerParent(writer, path, &dir, name) != 0) {
+        return -1;
+    }
+    unsigned int slot, first;
+    int exists = writerDirFind(&dir, name, &slot, &first);
+    if(exists && IS_DIR(dir.entries[slot].attr)) {
+        writerDirFree(&dir);
+        errno = EISDIR;
+        return -1;
+    }
+
+    // the new content goes to new clusters, the old one stays until it is written
+    unsigned int clusters = (unsigned int)((size + volume->geometry.clusterSize - 1) / volume->geometry.clusterSize);
+    ExtentList runs = {0, 0, 0};
+    if(clusters > 0 && (writerAllocate(writer, clusters, 0, &runs) != 0 || writerFill(writer, &runs, fd, size) != 0)) {
+        int error = errno;
+        writerReleaseRuns(writer, &runs);
+        extentListFree(&runs);
+        writerDirFree(&dir);
+        errno = error;
+        return -1;
+    }
+
+    DIRENTRY directoryEntry;
+    unsigned short date, time;
+    writerDosTime(modified, &date, &time);
+    if(exists) {
+        directoryEntry = dir.entries[slot];
+    }else{
+        memset(&directoryEntry, 0, sizeof(DIRENTRY));
+        directoryEntry.attr = DIRENTRY_ATTR_ARCHIVE;
+        directoryEntry.createdate = date;
+        directoryEntry.createtime = time;
+    }
+    unsigned int oldCluster = exists ? fatFirstCluster(&directoryEntry, volume->geometry.fatType) : 0;
+    writerSetFirstCluster(&directoryEntry, clusters > 0 ? runs.extents[0].start : 0, volume->geometry.fatType);
+    directoryEntry.size = (unsigned int)size;
+    directoryEntry.changedate = date;
+    directoryEntry.changetime = time;
+    directoryEntry.lastaccessdate = date;
+
+    int ret;
+    if(exists) {
+        dir.entries[slot] = directoryEntry;
+        ret = writerDirStore(writer, &dir, slot, slot + 1);
+    }else{
+        ret = writerDirAdd(writer, &dir, name, &directoryEntry);
+    }
+    int error = errno;
+    if(ret != 0) {
+        writerReleaseRuns(writer, &runs);
+    }else if(writerRelease(writer, oldCluster) != 0) {
+        ret = -1;
+        error = errno;
+    }
+    extentListFree(&runs);
+    writerDirFree(&dir);
+    errno = error;
+    return ret;
+}
+
+int writerMkdir(Writer* writer, const char* path, time_t modified) {
+    Volume* volume = writer->volume;
+    WriterDir dir;
+    char name[LFN_UTF8_MAX];
+    if(writerParent(writer, path, &dir, name) != 0) {
+        return -1;
+    }
+    unsigned int slot, first;
+    if(writerDirFind(&dir, name, &slot, &first)) {
+        writerDirFree(&dir);
+        errno = EEXIST;
+        return -1;
+    }
+
+    ExtentList runs = {0, 0, 0};
+    if(writerAllocate(writer, 1, 0, &runs) != 0) {
+        int error = errno;
+        extentListFree(&runs);
+        writerDirFree(&dir);
+        errno = error;
+        return -1;
+    }
+    unsigned int cluster = runs.extents[0].start;
+
+    DIRENTRY directoryEntry;
+    memset(&directoryEntry, 0, sizeof(DIRENTRY));
+    directoryEntry.attr = DIRENTRY_ATTR_DIR;
+    writerDosTime(modified, &directoryEntry.changedate, &directoryEntry.changetime);
+    directoryEntry.createdate = directoryEntry.changedate;
+    directoryEntry.createtime = directoryEntry.changetime;
+    directoryEntry.lastaccessdate = directoryEntry.changedate;
+
+    // '.' is the directory itself, '..' its parent (0 for the root directory, FAT32 too)
+    DIRENTRY* dots = (DIRENTRY*)writer->buffer;
+    memset(writer->buffer, 0, volume->geometry.clusterSize);
+    dots[0] = directoryEntry;
+    memcpy(dots[0].name, ".          ", 11);
+    writerSetFirstCluster(&dots[0], cluster, volume->geometry.fatType);
+    dots[1] = directoryEntry;
+    memcpy(dots[1].name, "..         ", 11);
+    writerSetFirstCluster(&dots[1], dir.cluster, volume->geometry.fatType);
+
+    int ret = imageWrite(&volume->image, writer->buffer, volume->geometry.clusterSize, volumeClusterOffset(volume, cluster));
+    if(ret == 0) {
+        writerSetFirstCluster(&directoryEntry, cluster, volume->geometry.fatType);
+        ret = writerDirAdd(writer, &dir, name, &directoryEntry);
+    }
+    int error = errno;
+    if(ret != 0) {
+        writerReleaseRuns(writer, &runs);
+    }
+    extentListFree(&runs);
+    writerDirFree(&dir);
+    errno = error;
+    return ret;
+}
+
+/**
+ * @return 1 for the '.' and '..' entries of a directory
+ */
+static int writerDots(const DIRENTRY* directoryEntry) {
+    return IS_DIR(directoryEntry->attr) &&
+           (memcmp(directoryEntry->name, ".          ", 11) == 0 || memcmp(directoryEntry->name, "..         ", 11) == 0);
+}
+
+/**
+ * @brief Marks all entries of a directory deleted, frees its chain and does the same for its subdirectories.
+ * A directory whose chain is free already is one that was reached before (a loop), it is passed over.
+ * @return 0 on success, -1 otherwise (errno is set)
+ */
+static int writerRemoveTree(Writer* writer, unsigned int cluster) {
+    Volume* volume = writer->volume;
+    if(cluster < 2 || cluster >= volume->fat.count || fatEntry(&volume->fat, cluster) == CLUSTER_FREE) {
+        return 0;
+    }
+    WriterDir dir;
+    if(writerDirLoad(writer, cluster, &dir) != 0) {
+        return -1;
+    }
+
+    // subdirectories go after this directory is written back, by then '.' and '..' look like one letter names
+    unsigned int* subdirectories = (unsigned int*)malloc(sizeof(unsigned int) * (dir.count ? dir.count : 1));
+    if(!subdirectories) {
+        writerDirFree(&dir);
+        errno = ENOMEM;
+        return -1;
+    }
+    unsigned int subdirectoryCount = 0;
+
+    int ret = 0;
+    unsigned int i;
+    for(i = 0; i < dir.count && dir.entries[i].name[0] != '\0'; i++) {
+        DIRENTRY* directoryEntry = &dir.entries[i];
+        if(directoryEntry->name[0] == DIRENTRY_EMPTY) {
+            continue;
+        }
+        int skip = directoryEntry->attr == DIRENTRY_ATTR_VFAT || (directoryEntry->attr & DIRENTRY_ATTR_VOLUME) || writerDots(directoryEntry);
+        directoryEntry->name[0] = DIRENTRY_EMPTY;
+        if(skip) {
+            continue;
+        }
+        if(IS_DIR(directoryEntry->attr)) {
+            // its own chain is freed with its entries
+            subdirectories[subdirectoryCount++] = fatFirstCluster(directoryEntry, volume->geometry.fatType);
+            continue;
+        }
+        if(writerRelease(writer, fatFirstCluster(directoryEntry, volume->geometry.fatType)) != 0) {
+            ret = -1;
+        }
+    }
+    if(ret == 0 && writerDirStore(writer, &dir, 0, i) != 0) {
+        ret = -1;
+    }
+    // freed before the subdirectories are, a '..' or a loop back finds it free
+    if(ret == 0 && writerReleaseRuns(writer, &dir.runs) != 0) {
+        errno = ENOMEM;
+        ret = -1;
+    }
+    unsigned int j;
+    for(j = 0; j < subdirectoryCount && ret == 0; j++) {
+        ret = writerRemoveTree(writer, subdirectories[j]);
+    }
+    int error = errno;
+    free(subdirectories);
+    writerDirFree(&dir);
+    errno = error;
+    return ret;
+}
+
+int writerRemove(Writer* writer, const char* path) {
+    Volume* volume = writer->volume;
+    WriterDir dir;
+    char name[LFN_UTF8_MAX];
+    if(writerParent(writer, path, &dir, name) != 0) {
+        return -1;
+    }
+    unsigned int slot, first;
+    if(!writerDirFind(&dir, name, &slot, &first)) {
+        writerDirFree(&dir);
+        errno = ENOENT;
+        return -1;
+    }
+
+    DIRENTRY directoryEntry = dir.entries[slot];
+    unsigned int i;
+    for(i = first; i <= slot; i++) {
+        dir.entries[i].name[0] = DIRENTRY_EMPTY;
+    }
+    int ret = writerDirStore(writer, &dir, first, slot + 1);
+    if(ret == 0) {
+        unsigned int cluster = fatFirstCluster(&directoryEntry, volume->geometry.fatType);
+        ret = IS_DIR(directoryEntry.attr) ? writerRemoveTree(writer, cluster) : writerRelease(writer, cluster);
+    }
+    int error = errno;
+    writerDirFree(&dir);
+    errno = error;
+    return ret;
+}
+
+int writerFlush(Writer* writer) {
+    Volume* volume = writer->volume;
+    if(fatFlush(&volume->fat, &volume->image, &volume->geometry) != 0) {
+        return -1;
+    }
+    if(!volume->hasFsinfo) {
+        return 0;
+    }
+    volume->fsinfo.freecount = writer->allocator.freeCount;
+    volume->fsinfo.nextfree = writer->allocator.next;
+    return imageWrite(&volume->image, &volume->fsinfo, sizeof(FSINFO), (unsigned long long)volume->bootsector.EBPB32.fsinfosector * volume->geometry.sectorSize);
+}
+
+int writerClose(Writer* writer) {
+    free(writer->buffer);
+    writer->buffer = 0;
+    allocatorFree(&writer->allocator);
+    return extentIndexBuild(&writer->volume->extents, &writer->volume->fat);
+}
@@ -0,0 +1,78 @@
+/*
+ * writer.h
+ *
+ * Changes to a volume: files are added or overwritten, directories made and
+ * files and directory trees removed, without mounting the image. Clusters
+ * come from the free extents of a ClusterAllocator, so a new file is one
+ * run if the free space has one that large. The FAT is only changed in
+ * memory and written back by writerFlush, once for all changes and to all
+ * FAT copies; file contents and directory entries are written right away.
+ *
+ * While a writer is open the volume has no extent index, chains are
+ * followed through the FAT. Chains are freed as the FAT says, a cross-linked
+ * chain (see check.h) takes the clusters of the other file with it.
+ */
+
+#ifndef __WRITER_H
+#define __WRITER_H
+
+#include <time.h>
+
+#include "allocator.h"
+#include "volume.h"
+
+#define WRITER_BUFFER   (1u << 20)  // bytes of a file read at once
+#define WRITER_MAX_SIZE 0xFFFFFFFFull
+#define WRITER_MAX_ENTRIES 65536    // directory entries a directory can have
+
+typedef struct Writer_t {
+    Volume* volume;
+    ClusterAllocator allocator;
+    char* buffer;                   // WRITER_BUFFER bytes
+} Writer;
+
+/**
+ * @brief Gets a volume ready for changes: the FAT is loaded if it isn't and
+ * made writable, the free extents are collected and the extent index dropped
+ * @param volume opened with volumeOpenWritable
+ * @return 0 on success, -1 otherwise (errno is set, EBADF if the volume is read only)
+ */
+int writerOpen(Writer* writer, Volume* volume);
+
+/**
+ * @brief Writes a file, a new one or over the content of an existing one
+ * @param path absolute path of the file, its directory has to exist
+ * @param fd the content is read from its current position on
+ * @param size bytes to read from fd
+ * @param modified time of the entry (local time)
+ * @return 0 on success, -1 otherwise (errno is set: ENOENT or ENOTDIR for the directory,
+ * EISDIR if the path is a directory, ENOSPC, EFBIG beyond 4 GiB, EINVAL for a bad name, EIO if fd ends early)
+ */
+int writerPut(Writer* writer, const char* path, int fd, unsigned long long size, time_t modified);
+
+/**
+ * @brief Makes a directory with its '.' and '..' entries
+ * @return 0 on success, -1 otherwise (errno is set, EEXIST if the path exists)
+ */
+int writerMkdir(Writer* writer, const char* path, time_t modified);
+
+/**
+ * @brief Removes a file, or a directory with everything in it: the entries are
+ * marked deleted and the chains freed
+ * @return 0 on success, -1 otherwise (errno is set, EINVAL for the root directory)
+ */
+int writerRemove(Writer* writer, const char* path);
+
+/**
+ * @brief Writes the changed parts of the FAT to all copies and updates the FSInfo sector
+ * @return 0 on success, -1 otherwise (errno is set)
+ */
+int writerFlush(Writer* writer);
+
+/**
+ * @brief Releases the writer and rebuilds the extent index of the volume; changes not flushed stay in memory only
+ * @return 0 on success, -1 if the index can't be rebuilt (out of memory)
+ */
+int writerClose(Writer* writer);
+
+#endif